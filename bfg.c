@@ -1,10 +1,43 @@
 #include "bfg.h"
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+/* SSE4.2 crc32 and PCLMUL for checksums, SSE4.1 and AVX2 for the
+ * encoder's row pass, all selected at run time */
+#define BFG_CRC_HW
+#define BFG_ROW_SIMD
+#include <immintrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 /* ---- helpers ---- */
 
-static inline bfg_pixel_t bfg_read_pixel(const uint8_t *px, uint8_t ch) {
+static void write_u32_le(uint8_t *buf, uint32_t v) {
+  buf[0] = (uint8_t)(v);
+  buf[1] = (uint8_t)(v >> 8);
+  buf[2] = (uint8_t)(v >> 16);
+  buf[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t read_u32_le(const uint8_t *buf) {
+  return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+         ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/* Force inlining of the codec loop bodies and the per-pixel helpers they
+ * use, so that each cache configuration gets its own specialized loop with
+ * the hash and mask folded in. */
+#if defined(__GNUC__) || defined(__clang__)
+#define BFG_INLINE static inline __attribute__((always_inline))
+#else
+#define BFG_INLINE static inline
+#endif
+
+BFG_INLINE bfg_pixel_t bfg_read_pixel(const uint8_t *px, uint8_t ch) {
   bfg_pixel_t p;
   p.r = px[0];
   p.g = px[1];
@@ -13,22 +46,41 @@ static inline bfg_pixel_t bfg_read_pixel(const uint8_t *px, uint8_t ch) {
   return p;
 }
 
-static inline void bfg_write_pixel(uint8_t *px, bfg_pixel_t p, uint8_t ch) {
+BFG_INLINE void bfg_write_pixel(uint8_t *px, bfg_pixel_t p, uint8_t ch) {
+  if (ch >= 4) {
+    memcpy(px, &p, 4); /* one 32-bit store, alpha included */
+    return;
+  }
   px[0] = p.r;
   px[1] = p.g;
   px[2] = p.b;
-  if (ch >= 4) px[3] = p.a;
 }
 
-static inline int bfg_pixel_eq(bfg_pixel_t a, bfg_pixel_t b) {
+BFG_INLINE int bfg_pixel_eq(bfg_pixel_t a, bfg_pixel_t b) {
   return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
 }
 
-static inline uint32_t bfg_hash(bfg_pixel_t p) {
-  return (p.r * 3u ^ p.g * 5u ^ p.b * 11u ^ p.a * 7u) & (BFG_CACHE_SIZE - 1);
+BFG_INLINE uint32_t bfg_hash(bfg_pixel_t p, const int bits, const int hash) {
+  if (hash == BFG_HASH_MUL) {
+    uint32_t v = (uint32_t)p.r | ((uint32_t)p.g << 8) |
+                 ((uint32_t)p.b << 16) | ((uint32_t)p.a << 24);
+    return (v * 0x9E3779B1u) >> (32 - bits);
+  }
+  return (p.r * 3u ^ p.g * 5u ^ p.b * 11u ^ p.a * 7u) & ((1u << bits) - 1);
+}
+
+/* Number of index bits for a header cache config byte. */
+static inline int bfg_cache_bits(uint8_t cache_cfg) {
+  return 4 + 2 * (cache_cfg & BFG_CACHE_SIZE_MASK);
+}
+
+uint32_t bfg_cache_index(bfg_pixel_t p, uint8_t cache_cfg) {
+  return bfg_hash(p, bfg_cache_bits(cache_cfg),
+                  (cache_cfg & BFG_CACHE_HASH_MASK) >> 2);
 }
 
-static inline bfg_pixel_t bfg_predict(bfg_pixel_t left, bfg_pixel_t above) {
+
+BFG_INLINE bfg_pixel_t bfg_predict(bfg_pixel_t left, bfg_pixel_t above) {
   bfg_pixel_t p;
   p.r = ((uint16_t)left.r + above.r) >> 1;
   p.g = ((uint16_t)left.g + above.g) >> 1;
@@ -37,128 +89,1093 @@ static inline bfg_pixel_t bfg_predict(bfg_pixel_t left, bfg_pixel_t above) {
   return p;
 }
 
-/* ---- encoder ---- */
+/* YCoCg-R lifting in mod 256 arithmetic. Co and Cg are stored biased by
+ * 128, so (slot >> 1) - 64 is the floor of the signed value halved. */
+BFG_INLINE bfg_pixel_t bfg_ycocg_fwd(bfg_pixel_t p) {
+  bfg_pixel_t q;
+  uint8_t t;
+  q.r = (uint8_t)(p.r - p.b + 128);             /* Co + 128 */
+  t = (uint8_t)(p.b + (q.r >> 1) - 64);
+  q.b = (uint8_t)(p.g - t + 128);               /* Cg + 128 */
+  q.g = (uint8_t)(t + (q.b >> 1) - 64);         /* Y */
+  q.a = p.a;
+  return q;
+}
 
-bfg_img_t bfg_encode(bfg_raw_t raw, bfg_header_t *header, uint32_t *out_len) {
-  if (!raw || !header || !out_len) return NULL;
-  if (!raw->width || !raw->height || !raw->n_channels) return NULL;
-  if (raw->n_channels < 3 || raw->n_channels > 4) return NULL;
+BFG_INLINE bfg_pixel_t bfg_ycocg_inv(bfg_pixel_t q) {
+  bfg_pixel_t p;
+  uint8_t t = (uint8_t)(q.g - (q.b >> 1) + 64);
+  p.g = (uint8_t)(q.b - 128 + t);
+  p.b = (uint8_t)(t - (q.r >> 1) + 64);
+  p.r = (uint8_t)(p.b + q.r - 128);
+  p.a = q.a;
+  return p;
+}
+
+/* Origin pixel (black with the stream's base alpha) in the working color
+ * space. */
+static inline bfg_pixel_t bfg_origin(int xform, uint8_t alpha) {
+  bfg_pixel_t o = {0, 0, 0, 255};
+  if (xform) { o.r = 128; o.b = 128; }
+  o.a = alpha;
+  return o;
+}
+
+/* Per-stream coding parameters shared by the encode and decode loops. */
+typedef struct {
+  int xform;          /* YCoCg-R working space */
+  bfg_pixel_t origin; /* predictor origin in the working space */
+  int code_a;         /* alpha is coded by the color ops */
+  int psz;            /* channels per STORED pixel */
+  int tol;            /* near-lossless max error per channel (encoder) */
+  const uint8_t *ref; /* reference frame, packed like the image, or NULL */
+} bfg_stream_t;
+
+/* Co-located reference pixel i, in the working space. */
+BFG_INLINE bfg_pixel_t bfg_ref_pixel(const bfg_stream_t *st, uint64_t i,
+                                     uint8_t ch) {
+  bfg_pixel_t p = bfg_read_pixel(&st->ref[i * ch], ch);
+  if (st->psz == 3) p.a = st->origin.a; /* constant or plane alpha */
+  return st->xform ? bfg_ycocg_fwd(p) : p;
+}
+
+static inline int bfg_clamp(int v, int lo, int hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/* Whether working-space pixel rec decodes to within tol of RGB source src,
+ * with alpha exact. */
+static inline int bfg_near(bfg_pixel_t rec, bfg_pixel_t src, int xform,
+                           int tol) {
+  if (xform) rec = bfg_ycocg_inv(rec);
+  return abs(rec.r - src.r) <= tol && abs(rec.g - src.g) <= tol &&
+         abs(rec.b - src.b) <= tol && rec.a == src.a;
+}
+
+/* Per-channel residuals of px from pred, wrapped to the signed byte range. */
+BFG_INLINE void bfg_residuals(bfg_pixel_t px, bfg_pixel_t pred, int *dg,
+                              int *dr, int *db) {
+  *dg = (((int)px.g - (int)pred.g + 128) & 0xFF) - 128;
+  *dr = (((int)px.r - (int)pred.r + 128) & 0xFF) - 128;
+  *db = (((int)px.b - (int)pred.b + 128) & 0xFF) - 128;
+}
+
+/* Pixel reconstructed from prediction and luma-correlated residuals. */
+BFG_INLINE bfg_pixel_t bfg_apply_delta(bfg_pixel_t pred, int dg, int dr_dg,
+                                      int db_dg, int corr, uint8_t a) {
+  bfg_pixel_t px;
+  px.r = (uint8_t)((int)pred.r + dg * corr + dr_dg);
+  px.g = (uint8_t)((int)pred.g + dg);
+  px.b = (uint8_t)((int)pred.b + dg * corr + db_dg);
+  px.a = a;
+  return px;
+}
+
+/* ---- memory accounting ---- */
+
+#ifdef BFG_MEMSTATS
+static bfg_mem_stats_t bfg_mem;
+
+/* size prefix in front of each block, a multiple of malloc's alignment */
+#define BFG_MEM_PREFIX 16
+
+void *bfg_mem_alloc(size_t size) {
+  uint8_t *p = (uint8_t *)malloc(size + BFG_MEM_PREFIX);
+  if (!p) return NULL;
+  memcpy(p, &size, sizeof(size));
+  bfg_mem.allocs++;
+  bfg_mem.bytes += size;
+  bfg_mem.live += size;
+  if (bfg_mem.live > bfg_mem.peak) bfg_mem.peak = bfg_mem.live;
+  return p + BFG_MEM_PREFIX;
+}
+
+void bfg_mem_free(void *ptr) {
+  if (!ptr) return;
+  uint8_t *p = (uint8_t *)ptr - BFG_MEM_PREFIX;
+  size_t size;
+  memcpy(&size, p, sizeof(size));
+  bfg_mem.live -= size;
+  free(p);
+}
+
+void bfg_mem_get(bfg_mem_stats_t *stats) {
+  if (stats) *stats = bfg_mem;
+}
+
+void bfg_mem_reset(void) {
+  bfg_mem.allocs = 0;
+  bfg_mem.bytes = 0;
+  bfg_mem.peak = bfg_mem.live;
+}
+#endif
+
+/* ---- statistics ---- */
+
+#ifdef BFG_STATS
+static bfg_stats_t bfg_stats;
+/* color ops of the open STORED candidate block, held back until the encoder
+ * knows whether the block replaces them */
+static bfg_op_stat_t bfg_stats_blk[BFG_STAT_OPS];
+
+#define BFG_STAT(...) do { __VA_ARGS__; } while (0)
+
+static void bfg_stat_op(bfg_op_stat_t *s, int op, uint32_t bytes,
+                        uint32_t n) {
+  s[op].count++;
+  s[op].bytes += bytes;
+  s[op].pixels += n;
+}
+
+static int bfg_stat_log2(uint32_t v) {
+  int b = 0;
+  while (v >>= 1) b++;
+  return b;
+}
+
+static void bfg_stat_run(uint32_t run) {
+  if (run <= 32) {
+    bfg_stat_op(bfg_stats.op, BFG_STAT_RUN, 1, run);
+  } else {
+    bfg_stat_op(bfg_stats.op, BFG_STAT_RUN, 1, 32);
+    bfg_stat_op(bfg_stats.op, BFG_STAT_RUN2, 2, run - 32);
+  }
+  int b = bfg_stat_log2(run);
+  bfg_stats.run_hist[b < BFG_STAT_RUN_BINS ? b : BFG_STAT_RUN_BINS - 1]++;
+}
+
+static void bfg_stat_pixel(int hit, bfg_pixel_t px, bfg_pixel_t pred,
+                           int corr) {
+  int dg, dr, db;
+  bfg_residuals(px, pred, &dg, &dr, &db);
+  const int d[3] = {dg, dr - dg * corr, db - dg * corr};
+  if (hit) bfg_stats.cache_hits++;
+  else bfg_stats.cache_misses++;
+  for (int c = 0; c < 3; c++) {
+    uint32_t m = (uint32_t)abs(d[c]);
+    int b = m ? bfg_stat_log2(m) + 1 : 0;
+    bfg_stats.resid_hist[c][b < BFG_STAT_RESID_BINS ? b
+                                                    : BFG_STAT_RESID_BINS - 1]++;
+  }
+}
 
+/* Settle the held-back block: either one STORED op or the ops themselves. */
+static void bfg_stat_block(int stored, uint32_t bytes, uint32_t n) {
+  if (stored) {
+    bfg_stat_op(bfg_stats.op, BFG_STAT_STORED, bytes, n);
+  } else {
+    for (int op = 0; op < BFG_STAT_OPS; op++) {
+      bfg_stats.op[op].count += bfg_stats_blk[op].count;
+      bfg_stats.op[op].bytes += bfg_stats_blk[op].bytes;
+      bfg_stats.op[op].pixels += bfg_stats_blk[op].pixels;
+    }
+  }
+  memset(bfg_stats_blk, 0, sizeof(bfg_stats_blk));
+}
+
+void bfg_stats_get(bfg_stats_t *stats) {
+  if (stats) *stats = bfg_stats;
+}
+
+void bfg_stats_reset(void) {
+  memset(&bfg_stats, 0, sizeof(bfg_stats));
+  memset(bfg_stats_blk, 0, sizeof(bfg_stats_blk));
+}
+
+const char *bfg_stats_op_name(int op) {
+  static const char *const names[BFG_STAT_OPS] = {
+      "DELTA1", "DELTA2",  "RUN",   "RUN2", "CACHE",   "CACHE2",
+      "RGB",    "RGBA",    "STORED", "SAME", "TDELTA", "TDELTA2",
+      "A_RUN",  "A_UP",    "A_DELTA", "A_LIT"};
+  return op >= 0 && op < BFG_STAT_OPS ? names[op] : "?";
+}
+#else
+#define BFG_STAT(...) do { } while (0)
+#endif
+
+/* Whether the header's size and flags describe a decodable stream. Returns
+ * 0 if so. */
+static int bfg_check_header(const bfg_header_t *header) {
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  uint8_t ch = header->channels;
+  if (!w || !h || ch < 3 || ch > 4) return 1;
+  if ((uint64_t)w * h > BFG_MAX_PIXELS) return 1;
+  if (header->flags & ~BFG_FLAGS_KNOWN) return 1;
+  if (header->cache & ~(BFG_CACHE_SIZE_MASK | BFG_CACHE_HASH_MASK)) return 1;
+
+  const int fill = (header->flags & BFG_FLAG_ALPHA_CONST) != 0;
+  const int plane = (header->flags & BFG_FLAG_ALPHA_PLANE) != 0;
+  if ((fill || plane) && ch != 4) return 1;
+  if (fill && plane) return 1;
+  if ((header->flags & BFG_FLAG_LAYERED) && (header->flags & BFG_FLAG_INTER))
+    return 1;
+  return 0;
+}
+
+/* Rows per stripe and number of stripes of a striped stream. Returns 0 if
+ * the stripe table at data is well formed. */
+static int bfg_stripes(const uint8_t *data, uint32_t data_len, uint32_t h,
+                       uint32_t *rows, uint32_t *n) {
+  if (data_len < 4) return 1;
+  *rows = read_u32_le(data);
+  if (*rows == 0) return 1;
+  *n = (h - 1) / *rows + 1;
+  if ((uint64_t)*n * 4 > data_len - 4) return 1;
+  /* stripe ends must be in order and within the data */
+  uint32_t table = 4 + *n * 4, end = 0;
+  for (uint32_t k = 0; k < *n; k++) {
+    uint32_t e = read_u32_le(&data[4 + k * 4]);
+    if (e < end || e > data_len - table) return 1;
+    end = e;
+  }
+  return 0;
+}
+
+/* Bytes and rows of stripe k of a checked striped stream. */
+static const uint8_t *bfg_stripe(const uint8_t *data, uint32_t rows,
+                                 uint32_t n, uint32_t h, uint32_t k,
+                                 uint32_t *len, uint32_t *k_rows) {
+  const uint8_t *body = data + 4 + n * 4;
+  uint32_t start = k ? read_u32_le(&data[4 + (k - 1) * 4]) : 0;
+  *len = read_u32_le(&data[4 + k * 4]) - start;
+  *k_rows = h - k * rows < rows ? h - k * rows : rows;
+  return body + start;
+}
+
+/* Steps data past the preview layer of layered data; other data is left
+ * alone. Returns 0 if the layer's length fits in data_len. */
+static int bfg_skip_preview(const bfg_header_t *header, const uint8_t **data,
+                            uint32_t *data_len) {
+  if (!(header->flags & BFG_FLAG_LAYERED)) return 0;
+  if (*data_len < 4) return 1;
+  uint32_t len = read_u32_le(*data);
+  if (len > *data_len - 4) return 1;
+  *data += 4 + len;
+  *data_len -= 4 + len;
+  return 0;
+}
+
+/* Bytes of checksum trailer after the ops, per the header flags. */
+static uint32_t bfg_trailer_len(const bfg_header_t *header) {
+  return ((header->flags & BFG_FLAG_CRC) ? 4 : 0) +
+         ((header->flags & BFG_FLAG_PIXEL_CRC) ? 4 : 0);
+}
+
+/* ---- checksums ---- */
+
+/* CRC-32C (Castagnoli), bit-reflected polynomial 0x82F63B78. The helpers
+ * work on the raw register; bfg_crc32c adds the usual inversions. */
+static const uint32_t bfg_crc_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint32_t bfg_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len--) crc = bfg_crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef BFG_CRC_HW
+/* A crc32 instruction has a latency of three cycles but a throughput of
+ * one, so the data is cut into three lanes coded side by side, and the
+ * lane CRCs are merged by shifting the first two over the bytes that
+ * follow them. bfg_crc_shift[i] holds x^(8n - 33) mod P for the lane
+ * lengths n = LONG, 2 LONG, SHORT, 2 SHORT: a CRC carry-less multiplied by
+ * it and folded back with one crc32 is that CRC moved past n zero bytes. */
+#define BFG_CRC_LONG 4096
+#define BFG_CRC_SHORT 256
+static const uint32_t bfg_crc_shift[4] = {0x82f89c77, 0x54a86326,
+                                          0xb9e02b86, 0xdd7e3b0c};
+
+__attribute__((target("sse4.2,pclmul")))
+static uint64_t bfg_crc_move(uint64_t crc, uint32_t k) {
+  __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+                                      _mm_cvtsi32_si128((int)k), 0);
+  return _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t bfg_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+  uint64_t c0 = crc, v0, v1, v2;
+  for (; len && ((uintptr_t)p & 7); len--)
+    c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+  for (int s = 0; s < 2; s++) {
+    const size_t lane = s ? BFG_CRC_SHORT : BFG_CRC_LONG;
+    for (; len >= 3 * lane; len -= 3 * lane) {
+      uint64_t c1 = 0, c2 = 0;
+      for (const uint8_t *end = p + lane; p < end; p += 8) {
+        memcpy(&v0, p, 8);
+        memcpy(&v1, p + lane, 8);
+        memcpy(&v2, p + 2 * lane, 8);
+        c0 = _mm_crc32_u64(c0, v0);
+        c1 = _mm_crc32_u64(c1, v1);
+        c2 = _mm_crc32_u64(c2, v2);
+      }
+      c0 = bfg_crc_move(c0, bfg_crc_shift[2 * s + 1]) ^
+           bfg_crc_move(c1, bfg_crc_shift[2 * s]) ^ c2;
+      p += 2 * lane;
+    }
+  }
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&v0, p, 8);
+    c0 = _mm_crc32_u64(c0, v0);
+  }
+  while (len--) c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+  return (uint32_t)c0;
+}
+#endif
+
+uint32_t bfg_crc32c(uint32_t crc, const void *data, size_t len) {
+  if (!data) return crc;
+#ifdef BFG_CRC_HW
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+    return ~bfg_crc32c_hw(~crc, (const uint8_t *)data, len);
+#endif
+  return ~bfg_crc32c_sw(~crc, (const uint8_t *)data, len);
+}
+
+/* Appends the checksum trailer the header flags call for to the p bytes of
+ * ops at out, and returns the new length, or 0 on failure. pixels are the
+ * image as it decodes, or NULL to decode out for them (near-lossless). */
+static uint32_t bfg_put_trailer(const bfg_header_t *header, uint8_t *out,
+                                uint32_t p, const uint8_t *pixels) {
+  if (header->flags & BFG_FLAG_PIXEL_CRC) {
+    size_t len = (size_t)header->width * header->height * header->channels;
+    uint8_t *scratch = NULL;
+    if (!pixels) {
+      bfg_header_t bare = *header;
+      bfg_format_t fmt = {header->channels == 4 ? BFG_FMT_RGBA : BFG_FMT_RGB,
+                          0};
+      bare.flags &= (uint8_t)~(BFG_FLAG_CRC | BFG_FLAG_PIXEL_CRC);
+      scratch = (uint8_t *)BFG_MALLOC(len);
+      if (!scratch || bfg_decode_into(&bare, out, p, &fmt, scratch, len)) {
+        BFG_FREE(scratch);
+        return 0;
+      }
+      pixels = scratch;
+    }
+    write_u32_le(&out[p], bfg_crc32c(0, pixels, len));
+    p += 4;
+    BFG_FREE(scratch);
+  }
+  if (header->flags & BFG_FLAG_CRC) {
+    uint8_t hdr[BFG_HEADER_SIZE];
+    bfg_header_pack(header, hdr);
+    write_u32_le(&out[p], bfg_crc32c(bfg_crc32c(0, hdr, sizeof(hdr)), out, p));
+    p += 4;
+  }
+  return p;
+}
+
+/* ---- alpha plane ---- */
+
+/* Code the alpha channel of a 4-channel image on its own, predicting each
+ * value from the previous one in raster order, or copying runs from the row
+ * above. Returns bytes written. */
+static uint32_t bfg_encode_alpha(bfg_raw_t raw, uint8_t *out) {
   uint32_t w = raw->width;
-  uint32_t h = raw->height;
-  uint8_t ch = raw->n_channels;
-  uint64_t n_px = (uint64_t)w * h;
-  if (n_px > BFG_MAX_PIXELS) return NULL;
+  uint64_t n_px = (uint64_t)w * raw->height;
+  const uint8_t *src = raw->pixels + 3;
+  uint8_t prev = 255;
+  uint32_t lit_n = 0, lit_tag = 0;
+  uint32_t p = 0;
 
-  /* fill header */
-  header->magic = BFG_MAGIC;
-  header->width = w;
-  header->height = h;
-  header->channels = ch;
-  memset(header->reserved, 0, 3);
+  uint64_t i = 0;
+  while (i < n_px) {
+    uint64_t left = n_px - i;
+    uint32_t max = left < BFG_A_RUN_MAX ? (uint32_t)left : BFG_A_RUN_MAX;
 
-  /* worst case: every pixel is RGBA literal (5 bytes each) + padding */
-  uint64_t max_size = n_px * 5 + 16;
-  if (max_size > UINT32_MAX) return NULL;
-  uint8_t *out = (uint8_t *)BFG_MALLOC((size_t)max_size);
-  if (!out) return NULL;
+    /* longest run of the previous value and longest copy from above */
+    uint32_t run = 0, up = 0;
+    while (run < max && src[(i + run) * 4] == prev) run++;
+    if (i >= w) {
+      while (up < max && src[(i + up) * 4] == src[(i + up - w) * 4]) up++;
+    }
 
-  bfg_pixel_t cache[BFG_CACHE_SIZE];
-  memset(cache, 0, sizeof(cache));
+    if (run > 0 || up > 0) {
+      uint32_t n = run >= up ? run : up;
+      uint8_t op = run >= up ? BFG_OP_A_RUN : BFG_OP_A_UP;
+      if (n < 64) {
+        out[p++] = op | (uint8_t)(n - 1);
+      } else {
+        out[p++] = op | 63;
+        out[p++] = (uint8_t)(n - 64);
+        out[p++] = (uint8_t)((n - 64) >> 8);
+      }
+      BFG_STAT(bfg_stat_op(bfg_stats.op, op == BFG_OP_A_RUN ? BFG_STAT_A_RUN
+                                                           : BFG_STAT_A_UP,
+                           n < 64 ? 1 : 3, n));
+      i += n;
+      prev = src[(i - 1) * 4];
+      lit_n = 0;
+      continue;
+    }
 
-  /* prev_row stores the previous row's pixels for 2D prediction */
-  bfg_pixel_t *prev_row = (bfg_pixel_t *)BFG_MALLOC(w * sizeof(bfg_pixel_t));
-  if (!prev_row) { BFG_FREE(out); return NULL; }
+    /* wrapped delta, so 0 <-> 255 edges of binary alpha are -1 / +1;
+     * an open literal block absorbs values at the same 1 byte cost */
+    uint8_t a = src[i * 4];
+    int d = ((a - prev + 128) & 0xFF) - 128;
+    if (d >= -32 && d <= 31 && (lit_n == 0 || lit_n == 64)) {
+      lit_n = 0;
+      out[p++] = BFG_OP_A_DELTA | (uint8_t)(d + 32);
+      BFG_STAT(bfg_stat_op(bfg_stats.op, BFG_STAT_A_DELTA, 1, 1));
+    } else {
+      if (lit_n == 0 || lit_n == 64) {
+        lit_tag = p++;
+        lit_n = 0;
+        BFG_STAT(bfg_stat_op(bfg_stats.op, BFG_STAT_A_LIT, 1, 0));
+      }
+      out[p++] = a;
+      BFG_STAT(bfg_stats.op[BFG_STAT_A_LIT].bytes++;
+               bfg_stats.op[BFG_STAT_A_LIT].pixels++);
+      out[lit_tag] = BFG_OP_A_LIT | (uint8_t)lit_n++;
+    }
+    prev = a;
+    i++;
+  }
 
-  /* initialize prev_row to default prediction origin */
+  return p;
+}
+
+/* Decode an alpha plane into the alpha bytes at dst, which are 4 bytes
+ * apart within a row and stride bytes apart between rows.
+ * Returns 0 on success, nonzero on a corrupt op. */
+static int bfg_decode_alpha(const uint8_t *data, uint32_t data_len,
+                            uint8_t *dst, uint32_t w, uint32_t h,
+                            size_t stride) {
+  uint8_t a = 255;
+  uint32_t x = 0, y = 0;
+  uint32_t dp = 0;
+
+  while (y < h && dp < data_len) {
+    uint8_t b0 = data[dp++];
+    uint8_t op = b0 & BFG_MASK2;
+    uint32_t n = (uint32_t)(b0 & 0x3F) + 1;
+    if (n == 64 && op <= BFG_OP_A_UP) {
+      /* long run: 16-bit extension */
+      if (data_len - dp < 2) return 1;
+      n = 64 + ((uint32_t)data[dp] | ((uint32_t)data[dp + 1] << 8));
+      dp += 2;
+    }
+    if (op == BFG_OP_A_DELTA) {
+      a = (uint8_t)(a + (b0 & 0x3F) - 32);
+      n = 1;
+    } else if (op == BFG_OP_A_UP && y == 0) {
+      return 1;
+    } else if (op == BFG_OP_A_LIT) {
+      if (n > data_len - dp) return 1;
+    }
+
+    /* one row segment at a time */
+    while (n > 0 && y < h) {
+      uint32_t m = w - x < n ? w - x : n;
+      uint8_t *d = &dst[x * 4];
+      switch (op) {
+      case BFG_OP_A_UP:
+        for (uint32_t k = 0; k < m; k++) d[k * 4] = d[k * 4 - stride];
+        a = d[(m - 1) * 4];
+        break;
+      case BFG_OP_A_LIT:
+        for (uint32_t k = 0; k < m; k++) d[k * 4] = data[dp + k];
+        a = data[dp + m - 1];
+        dp += m;
+        break;
+      default: /* A_RUN, A_DELTA */
+        for (uint32_t k = 0; k < m; k++) d[k * 4] = a;
+        break;
+      }
+      x += m;
+      n -= m;
+      if (x == w) {
+        x = 0;
+        y++;
+        dst += stride;
+      }
+    }
+    if (op == BFG_OP_A_LIT) dp += n; /* literals past the last row */
+  }
+  return 0;
+}
+
+/* ---- encoder ---- */
+
+/* Replace the ops written since out[start] for the n non-run pixels at src
+ * with a STORED block when that is smaller. psz is the number of channels
+ * coded per pixel. Returns the new write position. */
+BFG_INLINE uint32_t bfg_store_block(uint8_t *out, uint32_t start, uint32_t p,
+                                    const uint8_t *src, uint32_t n,
+                                    const uint8_t ch, const int psz) {
+  if (p - start <= 2 + n * psz) {
+    BFG_STAT(bfg_stat_block(0, 0, n));
+    return p;
+  }
+  BFG_STAT(bfg_stat_block(1, 2 + n * psz, n));
+  out[start++] = BFG_OP_STORED;
+  out[start++] = (uint8_t)(n - 1);
+  if (psz == ch) {
+    memcpy(&out[start], src, (size_t)n * ch);
+    return start + n * ch;
+  }
+  for (uint32_t k = 0; k < n; k++, start += 3) {
+    memcpy(&out[start], &src[k * ch], 3);
+  }
+  return start;
+}
+
+/* Write a RUN of 1..32 or RUN + RUN2 of 33..288 pixels. Returns the new
+ * write position. */
+BFG_INLINE uint32_t bfg_put_run(uint8_t *out, uint32_t p, uint32_t run) {
+  if (run <= 32) {
+    out[p++] = BFG_OP_RUN | (uint8_t)(run - 1);
+  } else {
+    out[p++] = BFG_OP_RUN | 31;           /* first 32 */
+    out[p++] = BFG_OP_RUN2;
+    out[p++] = (uint8_t)(run - 33);        /* remaining 1..256 */
+  }
+  BFG_STAT(bfg_stat_run(run));
+  return p;
+}
+
+/* Number of pixels from px on, at most max, whose first cmp channels equal
+ * those at ref. */
+static uint32_t bfg_match_len(const uint8_t *px, const uint8_t *ref,
+                              uint32_t max, int ch, int cmp) {
+  uint32_t n = 0;
+  while (n < max && memcmp(&px[n * ch], &ref[n * ch], (size_t)cmp) == 0) n++;
+  return n;
+}
+
+/* Write a TDELTA or TDELTA2 op for px against reference pixel rp if the
+ * residuals fit. Returns the bytes written, 0 if they don't fit. */
+static uint32_t bfg_put_tdelta(uint8_t *out, bfg_pixel_t px, bfg_pixel_t rp,
+                               int corr) {
+  if (px.a != rp.a) return 0;
+  int dg, dr, db;
+  bfg_residuals(px, rp, &dg, &dr, &db);
+  int dr_dg = dr - dg * corr;
+  int db_dg = db - dg * corr;
+
+  if (dg >= -8 && dg <= 7 &&
+      dr_dg >= -2 && dr_dg <= 1 &&
+      db_dg >= -2 && db_dg <= 1) {
+    out[0] = BFG_OP_TDELTA;
+    out[1] = (uint8_t)(((dg + 8) << 4) | ((dr_dg + 2) << 2) | (db_dg + 2));
+    BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_TDELTA, 2, 1));
+    return 2;
+  }
+  if (dg >= -32 && dg <= 31 &&
+      dr_dg >= -16 && dr_dg <= 15 &&
+      db_dg >= -16 && db_dg <= 15) {
+    uint32_t v = (uint32_t)(((dg + 32) << 10) | ((dr_dg + 16) << 5) |
+                            (db_dg + 16));
+    out[0] = BFG_OP_TDELTA2;
+    out[1] = (uint8_t)(v >> 8);
+    out[2] = (uint8_t)v;
+    BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_TDELTA2, 3, 1));
+    return 3;
+  }
+  return 0;
+}
+
+/* In lossless coding every pixel is predicted from source pixels only (the
+ * reconstruction is the source), so a whole row's residuals and the ops
+ * they qualify for are known before any op is written. The row pass
+ * computes them into one code per pixel and leaves the op loop to emit
+ * bytes and track the cache, runs and blocks:
+ *   byte 0  dr - dg (or dCo under YCoCg-R), saturated to a signed byte
+ *   byte 1  dg
+ *   byte 2  db - dg (or dCg), saturated
+ *   byte 3  BFG_ROW_* candidates
+ * The residual bytes are exact whenever DELTA1 or DELTA2 applies. */
+#define BFG_ROW_REPEAT 0x01 /* equals the previous pixel */
+#define BFG_ROW_DELTA1 0x02 /* alpha unchanged, residuals in DELTA1 range */
+#define BFG_ROW_DELTA2 0x04 /* alpha unchanged, residuals in DELTA2 range */
+
+/* Row pass instruction sets, best first. */
+#define BFG_ROW_SCALAR 0
+#define BFG_ROW_SSE41 1
+#define BFG_ROW_AVX2 2
+
+/* Prediction of pixel (x, y) of a body from its left and above neighbors. */
+BFG_INLINE bfg_pixel_t bfg_pred_at(uint32_t x, uint32_t y, bfg_pixel_t left,
+                                   bfg_pixel_t above) {
+  if (y == 0) return left; /* first row: predict from left */
+  if (x == 0) return above; /* first col: predict from above */
+  return bfg_predict(left, above);
+}
+
+static inline int bfg_sat8(int v) { return bfg_clamp(v, -128, 127); }
+
+/* Row code of px given its prediction and the previous pixel. */
+BFG_INLINE uint32_t bfg_row_code(bfg_pixel_t px, bfg_pixel_t pred,
+                                 bfg_pixel_t prev, int corr) {
+  int dg, dr, db;
+  bfg_residuals(px, pred, &dg, &dr, &db);
+  int dr_dg = dr - dg * corr;
+  int db_dg = db - dg * corr;
+  uint32_t cls = bfg_pixel_eq(px, prev) ? BFG_ROW_REPEAT : 0;
+  if (px.a == prev.a) {
+    if (dg >= -4 && dg <= 3 && dr_dg >= -2 && dr_dg <= 1 &&
+        db_dg >= -2 && db_dg <= 1) {
+      cls |= BFG_ROW_DELTA1;
+    }
+    if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+        db_dg >= -8 && db_dg <= 7) {
+      cls |= BFG_ROW_DELTA2;
+    }
+  }
+  return (uint32_t)(uint8_t)bfg_sat8(dr_dg) | (uint32_t)(uint8_t)dg << 8 |
+         (uint32_t)(uint8_t)bfg_sat8(db_dg) << 16 | cls << 24;
+}
+
+/* Codes for pixels x0..w-1 (x0 >= 1) of a row, predicted from cur[x - 1]
+ * and above[x]. */
+static void bfg_row_codes_sw(const bfg_pixel_t *cur, const bfg_pixel_t *above,
+                             uint32_t x0, uint32_t w, int corr,
+                             uint32_t *codes) {
+  for (uint32_t x = x0; x < w; x++) {
+    codes[x] = bfg_row_code(cur[x], bfg_predict(cur[x - 1], above[x]),
+                            cur[x - 1], corr);
+  }
+}
+
+#ifdef BFG_ROW_SIMD
+/* The vector passes take pixels 4 or 8 at a time:
+ *   pred  floor average of left and above, per byte
+ *   d     px - pred, wrapping: the residuals as signed bytes
+ * then widen to 16 bits, so that dr - dg and db - dg don't wrap, and
+ * replace the alpha lane by 0 if alpha equals the previous pixel's, -1 if
+ * not. A lane is in range when lane + bias <= limit unsigned, and a pixel
+ * qualifies when all four of its lanes are, a 64-bit compare. Signed
+ * saturating packs give back the byte layout of the scalar codes. */
+#define BFG_ROW_G_TO_RB \
+  2, 3, -128, -128, 2, 3, -128, -128, 10, 11, -128, -128, 10, 11, -128, -128
+
+__attribute__((target("sse4.1"))) static inline __m128i
+bfg_row_lanes_sse41(__m128i d, __m128i eq, __m128i rep, int corr) {
+  const __m128i ones = _mm_set1_epi32(-1);
+  __m128i v = _mm_cvtepi8_epi16(d);
+  if (corr) {
+    v = _mm_sub_epi16(
+        v, _mm_shuffle_epi8(v, _mm_setr_epi8(BFG_ROW_G_TO_RB)));
+  }
+  v = _mm_blend_epi16(v, _mm_xor_si128(_mm_cvtepi8_epi16(eq), ones), 0x88);
+  __m128i b1 = _mm_add_epi16(v, _mm_setr_epi16(2, 4, 2, 0, 2, 4, 2, 0));
+  __m128i b2 = _mm_add_epi16(v, _mm_setr_epi16(8, 32, 8, 0, 8, 32, 8, 0));
+  __m128i in1 = _mm_cmpeq_epi16(
+      _mm_min_epu16(b1, _mm_setr_epi16(3, 7, 3, 0, 3, 7, 3, 0)), b1);
+  __m128i in2 = _mm_cmpeq_epi16(
+      _mm_min_epu16(b2, _mm_setr_epi16(15, 63, 15, 0, 15, 63, 15, 0)), b2);
+  __m128i cls = _mm_or_si128(
+      _mm_and_si128(_mm_cmpeq_epi64(in1, ones),
+                    _mm_set1_epi64x((int64_t)BFG_ROW_DELTA1 << 48)),
+      _mm_and_si128(_mm_cmpeq_epi64(in2, ones),
+                    _mm_set1_epi64x((int64_t)BFG_ROW_DELTA2 << 48)));
+  cls = _mm_or_si128(cls, _mm_and_si128(_mm_cvtepi32_epi64(rep),
+                                        _mm_set1_epi64x((int64_t)BFG_ROW_REPEAT
+                                                        << 48)));
+  return _mm_blend_epi16(v, cls, 0x88);
+}
+
+__attribute__((target("sse4.1"))) static uint32_t
+bfg_row_codes_sse41(const bfg_pixel_t *cur, const bfg_pixel_t *above,
+                    uint32_t x, uint32_t w, int corr, uint32_t *codes) {
+  const __m128i low7 = _mm_set1_epi8(0x7F);
+  for (; x + 4 <= w; x += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i *)&cur[x]);
+    __m128i lf = _mm_loadu_si128((const __m128i *)&cur[x - 1]);
+    __m128i ab = _mm_loadu_si128((const __m128i *)&above[x]);
+    __m128i pred = _mm_add_epi8(
+        _mm_and_si128(lf, ab),
+        _mm_and_si128(_mm_srli_epi16(_mm_xor_si128(lf, ab), 1), low7));
+    __m128i d = _mm_sub_epi8(px, pred);
+    __m128i eq = _mm_cmpeq_epi8(px, lf);
+    __m128i rep = _mm_cmpeq_epi32(px, lf);
+    __m128i lo = bfg_row_lanes_sse41(d, eq, rep, corr);
+    __m128i hi = bfg_row_lanes_sse41(_mm_srli_si128(d, 8),
+                                     _mm_srli_si128(eq, 8),
+                                     _mm_srli_si128(rep, 8), corr);
+    _mm_storeu_si128((__m128i *)&codes[x], _mm_packs_epi16(lo, hi));
+  }
+  return x;
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+bfg_row_lanes_avx2(__m128i d, __m128i eq, __m128i rep, int corr) {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  __m256i v = _mm256_cvtepi8_epi16(d);
+  if (corr) {
+    v = _mm256_sub_epi16(
+        v, _mm256_shuffle_epi8(v, _mm256_setr_epi8(BFG_ROW_G_TO_RB,
+                                                   BFG_ROW_G_TO_RB)));
+  }
+  v = _mm256_blend_epi16(v, _mm256_xor_si256(_mm256_cvtepi8_epi16(eq), ones),
+                         0x88);
+  __m256i b1 = _mm256_add_epi16(
+      v, _mm256_setr_epi16(2, 4, 2, 0, 2, 4, 2, 0, 2, 4, 2, 0, 2, 4, 2, 0));
+  __m256i b2 = _mm256_add_epi16(v, _mm256_setr_epi16(8, 32, 8, 0, 8, 32, 8, 0,
+                                                     8, 32, 8, 0, 8, 32, 8, 0));
+  __m256i in1 = _mm256_cmpeq_epi16(
+      _mm256_min_epu16(b1, _mm256_setr_epi16(3, 7, 3, 0, 3, 7, 3, 0, 3, 7, 3,
+                                             0, 3, 7, 3, 0)),
+      b1);
+  __m256i in2 = _mm256_cmpeq_epi16(
+      _mm256_min_epu16(b2, _mm256_setr_epi16(15, 63, 15, 0, 15, 63, 15, 0, 15,
+                                             63, 15, 0, 15, 63, 15, 0)),
+      b2);
+  __m256i cls = _mm256_or_si256(
+      _mm256_and_si256(_mm256_cmpeq_epi64(in1, ones),
+                       _mm256_set1_epi64x((int64_t)BFG_ROW_DELTA1 << 48)),
+      _mm256_and_si256(_mm256_cmpeq_epi64(in2, ones),
+                       _mm256_set1_epi64x((int64_t)BFG_ROW_DELTA2 << 48)));
+  cls = _mm256_or_si256(
+      cls, _mm256_and_si256(_mm256_cvtepi32_epi64(rep),
+                            _mm256_set1_epi64x((int64_t)BFG_ROW_REPEAT << 48)));
+  return _mm256_blend_epi16(v, cls, 0x88);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+bfg_row_codes_avx2(const bfg_pixel_t *cur, const bfg_pixel_t *above,
+                   uint32_t x, uint32_t w, int corr, uint32_t *codes) {
+  const __m256i low7 = _mm256_set1_epi8(0x7F);
+  for (; x + 8 <= w; x += 8) {
+    __m256i px = _mm256_loadu_si256((const __m256i *)&cur[x]);
+    __m256i lf = _mm256_loadu_si256((const __m256i *)&cur[x - 1]);
+    __m256i ab = _mm256_loadu_si256((const __m256i *)&above[x]);
+    __m256i pred = _mm256_add_epi8(
+        _mm256_and_si256(lf, ab),
+        _mm256_and_si256(_mm256_srli_epi16(_mm256_xor_si256(lf, ab), 1),
+                         low7));
+    __m256i d = _mm256_sub_epi8(px, pred);
+    __m256i eq = _mm256_cmpeq_epi8(px, lf);
+    __m256i rep = _mm256_cmpeq_epi32(px, lf);
+    __m256i lo = bfg_row_lanes_avx2(_mm256_castsi256_si128(d),
+                                    _mm256_castsi256_si128(eq),
+                                    _mm256_castsi256_si128(rep), corr);
+    __m256i hi = bfg_row_lanes_avx2(_mm256_extracti128_si256(d, 1),
+                                    _mm256_extracti128_si256(eq, 1),
+                                    _mm256_extracti128_si256(rep, 1), corr);
+    /* the pack interleaves 128-bit lanes: put pixels back in order */
+    __m256i packed = _mm256_packs_epi16(lo, hi);
+    _mm256_storeu_si256((__m256i *)&codes[x],
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  return x;
+}
+#endif
+
+/* Best row pass this machine runs, at most max (BFG_ROW_*). */
+static int bfg_row_isa(int max) {
+#ifdef BFG_ROW_SIMD
+  if (max >= BFG_ROW_AVX2 && __builtin_cpu_supports("avx2")) {
+    return BFG_ROW_AVX2;
+  }
+  if (max >= BFG_ROW_SSE41 && __builtin_cpu_supports("sse4.1")) {
+    return BFG_ROW_SSE41;
+  }
+#endif
+  (void)max;
+  return BFG_ROW_SCALAR;
+}
+
+/* Codes for row y of a body. cur holds its working-space pixels, above
+ * the row before (unused for y == 0) and prev the last pixel before the
+ * row in coding order. */
+static void bfg_row_codes(const bfg_pixel_t *cur, const bfg_pixel_t *above,
+                          uint32_t w, uint32_t y, int corr,
+                          bfg_pixel_t origin, bfg_pixel_t prev, int isa,
+                          uint32_t *codes) {
+  bfg_pixel_t pred0 = y ? above[0] : origin;
+  codes[0] = bfg_row_code(cur[0], pred0, prev, corr);
+  /* the first row predicts from the left: averaging it with itself */
+  if (y == 0) above = cur - 1;
+  uint32_t x = 1;
+#ifdef BFG_ROW_SIMD
+  if (isa == BFG_ROW_AVX2) {
+    x = bfg_row_codes_avx2(cur, above, x, w, corr, codes);
+  }
+  if (isa >= BFG_ROW_SSE41) {
+    x = bfg_row_codes_sse41(cur, above, x, w, corr, codes);
+  }
+#endif
+  (void)isa;
+  bfg_row_codes_sw(cur, above, x, w, corr, codes);
+}
+
+/* Working-space pixels of one source row: alpha set to the origin's when
+ * the color ops don't code it, YCoCg-R applied when enabled. */
+static void bfg_load_row(const uint8_t *src, uint32_t w, uint8_t ch,
+                         const bfg_stream_t *st, bfg_pixel_t *cur) {
+  if (ch == 4 && st->code_a && !st->xform) {
+    memcpy(cur, src, (size_t)w * 4);
+    return;
+  }
   for (uint32_t x = 0; x < w; x++) {
-    prev_row[x].r = 0; prev_row[x].g = 0;
-    prev_row[x].b = 0; prev_row[x].a = 255;
+    bfg_pixel_t p = bfg_read_pixel(&src[x * ch], ch);
+    if (!st->code_a) p.a = st->origin.a;
+    cur[x] = st->xform ? bfg_ycocg_fwd(p) : p;
   }
+}
+
+/* Encoder row buffers for rows of w pixels: the previous row, then the
+ * current row and its codes for the row pass. */
+static size_t bfg_enc_rows_size(uint32_t w) {
+  return (size_t)w * (2 * sizeof(bfg_pixel_t) + sizeof(uint32_t));
+}
+
+/* Encode all pixels into out for one cache configuration. Returns the number
+ * of bytes written. prev_row must hold w origin pixels and be followed by
+ * the rest of the row buffers (bfg_enc_rows_size). When st->code_a is zero
+ * the alpha channel is replaced by the origin alpha and left to the alpha
+ * plane. inter enables the reference frame ops against st->ref. */
+BFG_INLINE uint32_t bfg_encode_px(bfg_raw_t raw, uint8_t *out,
+                                  bfg_pixel_t *prev_row,
+                                  const bfg_stream_t *st, const int inter,
+                                  const int bits, const int hash) {
+  uint32_t w = raw->width;
+  uint32_t h = raw->height;
+  uint8_t ch = raw->n_channels;
+  const int xform = st->xform;
+  const bfg_pixel_t origin = st->origin;
+  const int code_a = st->code_a;
+  const int psz = st->psz;
+  const int tol = st->tol;
+  const int corr = !xform; /* code dr, db relative to dg */
+  const uint8_t *ref = inter ? st->ref : NULL;
+  const uint64_t n_px = (uint64_t)w * h;
+  /* near-lossless predicts from reconstructions, known only as it goes */
+  const int isa = tol ? BFG_ROW_SCALAR : bfg_row_isa(BFG_ROW_AVX2);
+  bfg_pixel_t *cur = prev_row + w;
+  uint32_t *codes = (uint32_t *)(void *)(cur + w);
+
+  bfg_pixel_t cache[BFG_CACHE_MAX];
+  memset(cache, 0, sizeof(cache));
 
-  bfg_pixel_t prev = {0, 0, 0, 255};
+  bfg_pixel_t prev = origin;
   uint32_t run = 0;
+  uint32_t same = 0; /* pixels left in the current SAME op */
   uint32_t p = 0; /* write position in output */
 
+  /* candidate STORED block: every non-run op updates the same state as a
+   * stored pixel would, so any stretch of them can be swapped for one */
+  uint32_t blk_p = 0, blk_idx = 0, blk_n = 0;
+  /* near-lossless blocks store the reconstruction, not the source */
+  uint8_t blk_buf[256 * 4];
+  const uint8_t *blk_src = blk_buf;
+
   for (uint32_t y = 0; y < h; y++) {
-    bfg_pixel_t left = {0, 0, 0, 255};
+    bfg_pixel_t left = origin;
+    if (!tol) {
+      bfg_load_row(&raw->pixels[(uint64_t)y * w * ch], w, ch, st, cur);
+      bfg_row_codes(cur, prev_row, w, y, corr, origin, prev, isa, codes);
+    }
     for (uint32_t x = 0; x < w; x++) {
       uint32_t idx = (y * w + x) * ch;
-      bfg_pixel_t px = bfg_read_pixel(&raw->pixels[idx], ch);
-
-      /* compute 2D prediction */
-      bfg_pixel_t above = prev_row[x];
-      bfg_pixel_t pred;
-      if (y == 0) {
-        pred = left; /* first row: predict from left */
-      } else if (x == 0) {
-        pred = above; /* first col: predict from above */
+      bfg_pixel_t src, px;
+      uint32_t code = 0;
+      if (!tol) {
+        px = src = cur[x];
+        code = codes[x];
       } else {
-        pred = bfg_predict(left, above);
+        src = bfg_read_pixel(&raw->pixels[idx], ch);
+        if (!code_a) src.a = origin.a;
+        px = xform ? bfg_ycocg_fwd(src) : src;
+      }
+
+      if (same) {
+        same--;
+        prev_row[x] = px;
+        left = px;
+        prev = px;
+        continue;
+      }
+
+      int repeat = tol ? bfg_pixel_eq(px, prev) ||
+                             bfg_near(prev, src, xform, tol)
+                       : (code >> 24) & BFG_ROW_REPEAT;
+
+      /* inter frames: at the start of an op, take the stretch matching the
+       * reference when it reaches further than a run would */
+      if (ref && !(repeat && run)) {
+        uint64_t i = (uint64_t)y * w + x;
+        uint32_t max = n_px - i < 65536 ? (uint32_t)(n_px - i) : 65536;
+        uint32_t ns = bfg_match_len(&raw->pixels[idx], &ref[idx], max, ch,
+                                    psz);
+        if (ns >= 2 &&
+            (!repeat || bfg_match_len(&raw->pixels[idx + ch],
+                                      &raw->pixels[idx], ns - 1, ch,
+                                      psz) < ns - 1)) {
+          if (run > 0) {
+            p = bfg_put_run(out, p, run);
+            run = 0;
+          }
+          if (blk_n) {
+            p = bfg_store_block(out, blk_p, p, &raw->pixels[blk_idx], blk_n,
+                                ch, psz);
+            blk_n = 0;
+          }
+          if (ns <= 256) {
+            out[p++] = BFG_OP_SAME;
+            out[p++] = (uint8_t)(ns - 1);
+          } else {
+            out[p++] = BFG_OP_SAME2;
+            out[p++] = (uint8_t)(ns - 1);
+            out[p++] = (uint8_t)((ns - 1) >> 8);
+          }
+          BFG_STAT(bfg_stat_op(bfg_stats.op, BFG_STAT_SAME, ns <= 256 ? 2 : 3,
+                               ns));
+          same = ns - 1;
+          prev_row[x] = px;
+          left = px;
+          prev = px;
+          continue;
+        }
       }
 
       /* RUN check */
-      if (bfg_pixel_eq(px, prev)) {
+      if (repeat) {
+        if (blk_n) {
+          if (!tol) blk_src = &raw->pixels[blk_idx];
+          p = bfg_store_block(out, blk_p, p, blk_src, blk_n, ch, psz);
+          blk_n = 0;
+        }
         run++;
         if (run == 288) {
           /* flush max extended run: 32 (RUN) + 256 (RUN2) */
           out[p++] = BFG_OP_RUN | 31;  /* run of 32 */
           out[p++] = BFG_OP_RUN2;
           out[p++] = 255;               /* run of 256 */
+          BFG_STAT(bfg_stat_run(run));
           run = 0;
         }
-        prev_row[x] = px;
-        left = px;
+        prev_row[x] = prev;
+        left = prev;
         continue;
       }
 
       /* flush pending run before encoding a different pixel */
       if (run > 0) {
-        if (run <= 32) {
-          out[p++] = BFG_OP_RUN | (run - 1);
-        } else {
-          out[p++] = BFG_OP_RUN | 31;           /* first 32 */
-          out[p++] = BFG_OP_RUN2;
-          out[p++] = (uint8_t)(run - 33);        /* remaining 1..256 */
-        }
+        p = bfg_put_run(out, p, run);
         run = 0;
       }
 
-      /* compute luma-correlated residuals from prediction */
-      int dg = (int)px.g - (int)pred.g;
-      int dr = (int)px.r - (int)pred.r;
-      int db = (int)px.b - (int)pred.b;
+      if (blk_n == 0) {
+        blk_p = p;
+        blk_idx = idx;
+      }
+
+      /* near-lossless: pull the residuals into the DELTA1, then DELTA2
+       * range if the result stays within tol, and continue from the
+       * reconstruction so errors don't build up through prediction.
+       * Either way the code is found as the row pass would have. */
+      if (tol) {
+        bfg_pixel_t pred = bfg_pred_at(x, y, left, prev_row[x]);
+        if (px.a == prev.a) {
+          int dg, dr, db;
+          bfg_residuals(px, pred, &dg, &dr, &db);
+          int qg = bfg_clamp(dg, -4, 3);
+          int qr = bfg_clamp(dr - qg * corr, -2, 1);
+          int qb = bfg_clamp(db - qg * corr, -2, 1);
+          bfg_pixel_t rec = bfg_apply_delta(pred, qg, qr, qb, corr, px.a);
+          bfg_pixel_t hit = cache[bfg_hash(px, bits, hash)];
+          if (!bfg_near(rec, src, xform, tol)) {
+            if (bfg_pixel_eq(hit, px) || bfg_near(hit, src, xform, tol)) {
+              rec = hit; /* stored at its own hash, so CACHE finds it */
+            } else {
+              qg = bfg_clamp(dg, -32, 31);
+              qr = bfg_clamp(dr - qg * corr, -8, 7);
+              qb = bfg_clamp(db - qg * corr, -8, 7);
+              rec = bfg_apply_delta(pred, qg, qr, qb, corr, px.a);
+              if (!bfg_near(rec, src, xform, tol)) rec = px;
+            }
+          }
+          px = rec;
+        }
+        code = bfg_row_code(px, pred, prev, corr);
+      }
 
-      /* wrap to signed byte range */
-      if (dg > 127) dg -= 256;
-      if (dg < -128) dg += 256;
-      if (dr > 127) dr -= 256;
-      if (dr < -128) dr += 256;
-      if (db > 127) db -= 256;
-      if (db < -128) db += 256;
+      /* luma-correlated residuals: r and b as offsets from the green delta
+       * (YCoCg-R: chroma deltas are coded directly) */
+      int dg = (int8_t)(code >> 8);
+      int dr_dg = (int8_t)code;
+      int db_dg = (int8_t)(code >> 16);
+      const uint32_t cls = code >> 24;
 
-      /* luma-correlated: encode r and b as offsets from green delta */
-      int dr_dg = dr - dg;
-      int db_dg = db - dg;
+      uint32_t hi = bfg_hash(px, bits, hash);
+      uint32_t tp;
+      BFG_STAT(bfg_stat_pixel(bfg_pixel_eq(cache[hi], px), px,
+                              bfg_pred_at(x, y, left, prev_row[x]), corr));
 
       /* DELTA1: dg in [-4..3], (dr-dg) in [-2..1], (db-dg) in [-2..1] */
-      if (px.a == prev.a &&
-          dg >= -4 && dg <= 3 &&
-          dr_dg >= -2 && dr_dg <= 1 &&
-          db_dg >= -2 && db_dg <= 1) {
+      if (cls & BFG_ROW_DELTA1) {
         out[p++] = (uint8_t)(((dg + 4) << 4) | ((dr_dg + 2) << 2) | (db_dg + 2));
+        BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_DELTA1, 1, 1));
       }
-      /* CACHE */
-      else if (bfg_pixel_eq(cache[bfg_hash(px)], px)) {
-        out[p++] = BFG_OP_CACHE | (bfg_hash(px) & 0x0F);
+      /* CACHE: short op for the first 16 slots, CACHE2 for the rest */
+      else if (bfg_pixel_eq(cache[hi], px)) {
+        if (hi < 16) {
+          out[p++] = BFG_OP_CACHE | (uint8_t)hi;
+          BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_CACHE, 1, 1));
+        } else {
+          out[p++] = BFG_OP_CACHE2;
+          out[p++] = (uint8_t)hi;
+          BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_CACHE2, 2, 1));
+        }
       }
       /* DELTA2: dg in [-32..31], (dr-dg) in [-8..7], (db-dg) in [-8..7] */
-      else if (px.a == prev.a &&
-               dg >= -32 && dg <= 31 &&
-               dr_dg >= -8 && dr_dg <= 7 &&
-               db_dg >= -8 && db_dg <= 7) {
+      else if (cls & BFG_ROW_DELTA2) {
         out[p++] = BFG_OP_DELTA2 | (uint8_t)((dg + 32) & 0x3F);
         out[p++] = (uint8_t)(((dr_dg + 8) << 4) | ((db_dg + 8) & 0x0F));
+        BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_DELTA2, 2, 1));
+      }
+      /* TDELTA, TDELTA2: residual from the co-located reference pixel */
+      else if (ref && (tp = bfg_put_tdelta(
+                           &out[p], px,
+                           bfg_ref_pixel(st, (uint64_t)y * w + x, ch),
+                           corr)) != 0) {
+        p += tp;
       }
       /* RGB literal */
       else if (px.a == prev.a) {
@@ -166,6 +1183,7 @@ bfg_img_t bfg_encode(bfg_raw_t raw, bfg_header_t *header, uint32_t *out_len) {
         out[p++] = px.r;
         out[p++] = px.g;
         out[p++] = px.b;
+        BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_RGB, 4, 1));
       }
       /* RGBA literal */
       else {
@@ -174,75 +1192,1239 @@ bfg_img_t bfg_encode(bfg_raw_t raw, bfg_header_t *header, uint32_t *out_len) {
         out[p++] = px.g;
         out[p++] = px.b;
         out[p++] = px.a;
+        BFG_STAT(bfg_stat_op(bfg_stats_blk, BFG_STAT_RGBA, 5, 1));
       }
 
-      cache[bfg_hash(px)] = px;
+      cache[hi] = px;
       prev_row[x] = px;
       left = px;
       prev = px;
+
+      if (tol) {
+        bfg_write_pixel(&blk_buf[blk_n * ch], xform ? bfg_ycocg_inv(px) : px,
+                        ch);
+      }
+      if (++blk_n == 256) {
+        if (!tol) blk_src = &raw->pixels[blk_idx];
+        p = bfg_store_block(out, blk_p, p, blk_src, blk_n, ch, psz);
+        blk_n = 0;
+      }
     }
   }
 
-  /* flush final run */
-  if (run > 0) {
-    if (run <= 32) {
-      out[p++] = BFG_OP_RUN | (run - 1);
-    } else {
-      out[p++] = BFG_OP_RUN | 31;
-      out[p++] = BFG_OP_RUN2;
-      out[p++] = (uint8_t)(run - 33);
-    }
+  if (blk_n) {
+    if (!tol) blk_src = &raw->pixels[blk_idx];
+    p = bfg_store_block(out, blk_p, p, blk_src, blk_n, ch, psz);
   }
 
-  BFG_FREE(prev_row);
-  *out_len = p;
-  return out;
+  /* flush final run */
+  if (run > 0) p = bfg_put_run(out, p, run);
+
+  return p;
+}
+
+/* Inter frames share one instance across cache configurations, keeping
+ * the reference checks out of the keyframe loops. */
+static uint32_t bfg_encode_inter(bfg_raw_t raw, uint8_t *out,
+                                 bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                                 int bits, int hash) {
+  return bfg_encode_px(raw, out, prev_row, st, 1, bits, hash);
+}
+
+/* Encode raw (a whole image or one stripe) into out: the color ops, then
+ * for an alpha plane its length prefix and the alpha ops. st->ref points at
+ * the reference pixels for raw. Returns bytes written. */
+static uint32_t bfg_encode_body(bfg_raw_t raw, uint8_t *out,
+                                bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                                uint8_t cache_cfg) {
+  const int plane = !st->code_a;
+  const int hash = (cache_cfg & BFG_CACHE_HASH_MASK) >> 2;
+
+  /* initialize prev_row to default prediction origin */
+  for (uint32_t x = 0; x < raw->width; x++) prev_row[x] = st->origin;
+
+  /* an alpha plane is preceded by the color stream length */
+  uint8_t *color = plane ? out + 4 : out;
+
+  uint32_t p = 0;
+  switch (st->ref ? 0xFF : cache_cfg) {
+  case 0xFF:
+    p = bfg_encode_inter(raw, color, prev_row, st, bfg_cache_bits(cache_cfg),
+                         hash);
+    break;
+  case BFG_CACHE_16 | (BFG_HASH_XOR << 2):
+    p = bfg_encode_px(raw, color, prev_row, st, 0, 4, BFG_HASH_XOR);
+    break;
+  case BFG_CACHE_64 | (BFG_HASH_XOR << 2):
+    p = bfg_encode_px(raw, color, prev_row, st, 0, 6, BFG_HASH_XOR);
+    break;
+  case BFG_CACHE_256 | (BFG_HASH_XOR << 2):
+    p = bfg_encode_px(raw, color, prev_row, st, 0, 8, BFG_HASH_XOR);
+    break;
+  case BFG_CACHE_16 | (BFG_HASH_MUL << 2):
+    p = bfg_encode_px(raw, color, prev_row, st, 0, 4, BFG_HASH_MUL);
+    break;
+  case BFG_CACHE_64 | (BFG_HASH_MUL << 2):
+    p = bfg_encode_px(raw, color, prev_row, st, 0, 6, BFG_HASH_MUL);
+    break;
+  case BFG_CACHE_256 | (BFG_HASH_MUL << 2):
+    p = bfg_encode_px(raw, color, prev_row, st, 0, 8, BFG_HASH_MUL);
+    break;
+  }
+
+  if (plane) {
+    write_u32_le(out, p);
+    p += 4;
+    p += bfg_encode_alpha(raw, out + p);
+  }
+  return p;
+}
+
+/* Largest encoded size of n pixels coded as one body: every pixel an RGBA
+ * literal (5 bytes each) + padding, or with an alpha plane an RGB literal
+ * plus a 2-byte alpha literal. */
+static uint64_t bfg_body_max(uint64_t n_px, int plane) {
+  return plane ? 4 + n_px * 6 + 16 : n_px * 5 + 16;
+}
+
+/* Largest encoded size of the preview layer of a w x h image. */
+static uint64_t bfg_preview_max(uint32_t w, uint32_t h, int plane) {
+  return 4 + bfg_body_max((uint64_t)((w + 7) / 8) * ((h + 7) / 8), plane);
+}
+
+/* Largest encoded size of n pixels at 16 bits per channel: every pixel an
+ * RGBA literal (9 bytes each). */
+static uint64_t bfg_body16_max(uint64_t n_px) { return n_px * 9; }
+
+uint64_t bfg_max_size(const bfg_header_t *header) {
+  uint64_t n_px = (uint64_t)header->width * header->height;
+  if (header->channels & BFG_DEPTH_16) return bfg_body16_max(n_px);
+  const int plane = (header->flags & BFG_FLAG_ALPHA_PLANE) != 0;
+  /* as bfg_encode_frame sizes its output, with one stripe per row at
+   * worst */
+  const int striped = (header->flags & BFG_FLAG_STRIPES) != 0;
+  uint64_t n_stripes = striped ? header->height : 1;
+  uint64_t max = bfg_body_max(n_px, plane) + n_stripes * 20 + 8 +
+                 bfg_trailer_len(header);
+  if (striped) max += 4 + n_stripes * 4;
+  if (header->flags & BFG_FLAG_LAYERED) {
+    max += bfg_preview_max(header->width, header->height, plane);
+  }
+  return max;
+}
+
+/* Code the preview layer of raw at out: its length, then the image of
+ * rounded 8x8 block means coded as a body. prev_row must hold a row of raw.
+ * Returns bytes written, or 0 on failure. */
+static uint32_t bfg_encode_preview(bfg_raw_t raw, uint8_t *out,
+                                   bfg_pixel_t *prev_row,
+                                   const bfg_stream_t *st, uint8_t cache_cfg) {
+  uint32_t w = raw->width;
+  uint32_t h = raw->height;
+  uint8_t ch = raw->n_channels;
+  struct bfg_raw base = {(w + 7) / 8, (h + 7) / 8, ch, NULL};
+  size_t row_len = (size_t)w * ch;
+  base.pixels = (uint8_t *)BFG_MALLOC((size_t)base.width * ch * base.height);
+  uint16_t *cols = (uint16_t *)BFG_MALLOC(row_len * sizeof(uint16_t));
+  if (!base.pixels || !cols) {
+    BFG_FREE(base.pixels);
+    BFG_FREE(cols);
+    return 0;
+  }
+
+  /* add up each column over eight rows (a plain loop the compiler
+   * vectorizes), then each block's eight columns */
+  uint8_t *dst = base.pixels;
+  for (uint32_t y0 = 0; y0 < h; y0 += 8) {
+    uint32_t rows = h - y0 < 8 ? h - y0 : 8;
+    memset(cols, 0, row_len * sizeof(uint16_t));
+    for (uint32_t y = y0; y < y0 + rows; y++) {
+      const uint8_t *src = raw->pixels + (uint64_t)y * row_len;
+      for (size_t i = 0; i < row_len; i++) cols[i] += src[i];
+    }
+    for (uint32_t x0 = 0; x0 < w; x0 += 8) {
+      uint32_t n = w - x0 < 8 ? w - x0 : 8;
+      uint32_t area = n * rows;
+      for (uint8_t c = 0; c < ch; c++) {
+        uint32_t sum = 0;
+        for (uint32_t x = x0; x < x0 + n; x++) sum += cols[x * ch + c];
+        *dst++ = (uint8_t)((sum + area / 2) / area);
+      }
+    }
+  }
+  BFG_FREE(cols);
+
+  uint32_t p = 4 + bfg_encode_body(&base, out + 4, prev_row, st, cache_cfg);
+  write_u32_le(out, p - 4);
+  BFG_FREE(base.pixels);
+  return p;
+}
+
+/* Header fields and stream parameters for raw with the given options.
+ * Returns 0 on success. */
+static int bfg_encode_setup(bfg_raw_t raw, const bfg_opts_t *opts,
+                            const uint8_t *ref, bfg_header_t *header,
+                            bfg_stream_t *st) {
+  if (!raw->width || !raw->height || !raw->n_channels) return 1;
+  if (raw->n_channels < 3 || raw->n_channels > 4) return 1;
+
+  uint32_t w = raw->width;
+  uint32_t h = raw->height;
+  uint8_t ch = raw->n_channels;
+  uint64_t n_px = (uint64_t)w * h;
+  if (n_px > BFG_MAX_PIXELS) return 1;
+
+  uint8_t transform = opts ? opts->transform : BFG_TRANSFORM_NONE;
+  if (transform > BFG_TRANSFORM_YCOCG) return 1;
+  const int xform = (transform == BFG_TRANSFORM_YCOCG);
+
+  uint8_t cache_cfg;
+  switch (opts ? opts->cache_size : 0) {
+  case 0:
+  case 16: cache_cfg = BFG_CACHE_16; break;
+  case 64: cache_cfg = BFG_CACHE_64; break;
+  case 256: cache_cfg = BFG_CACHE_256; break;
+  default: return 1;
+  }
+  uint8_t hash = opts ? opts->hash : BFG_HASH_XOR;
+  if (hash > BFG_HASH_MUL) return 1;
+  cache_cfg |= (uint8_t)(hash << 2);
+
+  uint8_t alpha_mode = opts ? opts->alpha : BFG_ALPHA_AUTO;
+  if (alpha_mode > BFG_ALPHA_INTERLEAVED) return 1;
+  if (ref && opts && opts->max_error) return 1;
+  uint8_t flags = xform ? BFG_FLAG_YCOCG : 0;
+  if (ref) flags |= BFG_FLAG_INTER;
+  if (opts && opts->stripe_rows) flags |= BFG_FLAG_STRIPES;
+  if (opts && (opts->checksum & ~(BFG_CHECKSUM_DATA | BFG_CHECKSUM_PIXELS)))
+    return 1;
+  if (opts && (opts->checksum & BFG_CHECKSUM_DATA)) flags |= BFG_FLAG_CRC;
+  if (opts && (opts->checksum & BFG_CHECKSUM_PIXELS))
+    flags |= BFG_FLAG_PIXEL_CRC;
+  if (opts && opts->preview) {
+    if (ref) return 1;
+    flags |= BFG_FLAG_LAYERED;
+  }
+  uint8_t fill = 255;
+  if (ch == 4 && alpha_mode == BFG_ALPHA_AUTO) {
+    /* pre-scan: constant alpha goes in the header. Alpha that mostly
+     * changes by small steps gets its own plane so it doesn't break the
+     * color deltas; noisy alpha stays interleaved with the RGBA ops. */
+    uint8_t prev_a = raw->pixels[3];
+    uint64_t changes = 0, rough = 0;
+    for (uint64_t i = 1; i < n_px; i++) {
+      uint8_t a = raw->pixels[i * 4 + 3];
+      int d = ((a - prev_a + 128) & 0xFF) - 128;
+      changes += (d != 0);
+      rough += (d < -32 || d > 31);
+      prev_a = a;
+    }
+    if (changes == 0) {
+      flags |= BFG_FLAG_ALPHA_CONST;
+      fill = raw->pixels[3];
+    } else if (rough <= n_px / 8) {
+      flags |= BFG_FLAG_ALPHA_PLANE;
+    }
+  }
+
+  /* fill header */
+  header->magic = BFG_MAGIC;
+  header->width = w;
+  header->height = h;
+  header->channels = ch;
+  header->flags = flags;
+  header->cache = cache_cfg;
+  header->alpha = (flags & BFG_FLAG_ALPHA_CONST) ? fill : 0;
+
+  st->xform = xform;
+  st->origin = bfg_origin(xform, fill);
+  st->code_a = !(flags & BFG_FLAG_ALPHA_PLANE);
+  st->psz = (flags & (BFG_FLAG_ALPHA_CONST | BFG_FLAG_ALPHA_PLANE)) ? 3 : ch;
+  st->tol = opts ? opts->max_error : 0;
+  st->ref = ref;
+  return 0;
+}
+
+/* Encode raw, as an inter frame when ref holds the previous frame (same
+ * size and channels, lossless only). */
+static bfg_img_t bfg_encode_frame(bfg_raw_t raw, const bfg_opts_t *opts,
+                                  const uint8_t *ref, bfg_header_t *header,
+                                  uint32_t *out_len) {
+  if (!raw || !header || !out_len) return NULL;
+  bfg_stream_t st;
+  if (bfg_encode_setup(raw, opts, ref, header, &st)) return NULL;
+
+  uint32_t w = raw->width;
+  uint32_t h = raw->height;
+  uint8_t ch = raw->n_channels;
+  uint64_t n_px = (uint64_t)w * h;
+  const int plane = !st.code_a;
+
+  /* a striped stream starts with the rows per stripe and the end offset of
+   * each stripe */
+  uint32_t rows = (opts && opts->stripe_rows) ? opts->stripe_rows : h;
+  uint32_t n_stripes = (h - 1) / rows + 1;
+  uint32_t table = (header->flags & BFG_FLAG_STRIPES) ? 4 + n_stripes * 4 : 0;
+
+  const int layered = (header->flags & BFG_FLAG_LAYERED) != 0;
+
+  uint64_t max_size = table + bfg_body_max(n_px, plane) + n_stripes * 20 + 8;
+  if (layered) max_size += bfg_preview_max(w, h, plane);
+  if (max_size > UINT32_MAX) return NULL;
+  uint8_t *out = (uint8_t *)BFG_MALLOC((size_t)max_size);
+  if (!out) return NULL;
+
+  /* prev_row stores the previous row's pixels for 2D prediction, followed
+   * by the row pass's scratch */
+  bfg_pixel_t *prev_row = (bfg_pixel_t *)BFG_MALLOC(bfg_enc_rows_size(w));
+  if (!prev_row) { BFG_FREE(out); return NULL; }
+
+  /* the preview layer goes first, and the full image after it */
+  uint32_t lead = 0;
+  if (layered) {
+    lead = bfg_encode_preview(raw, out, prev_row, &st, header->cache);
+    if (!lead) {
+      BFG_FREE(prev_row);
+      BFG_FREE(out);
+      return NULL;
+    }
+  }
+
+  uint32_t p = lead + table;
+  if (table) write_u32_le(out + lead, rows);
+  for (uint32_t k = 0; k < n_stripes; k++) {
+    uint64_t offset = (uint64_t)k * rows * w * ch;
+    struct bfg_raw stripe = {w, h - k * rows < rows ? h - k * rows : rows, ch,
+                             raw->pixels + offset};
+    bfg_stream_t sst = st;
+    if (ref) sst.ref = ref + offset;
+    p += bfg_encode_body(&stripe, out + p, prev_row, &sst, header->cache);
+    if (table) write_u32_le(&out[lead + 4 + k * 4], p - lead - table);
+  }
+  BFG_FREE(prev_row);
+  /* checksums over the data while it is still in cache */
+  p = bfg_put_trailer(header, out, p, st.tol ? NULL : raw->pixels);
+  if (!p) {
+    BFG_FREE(out);
+    return NULL;
+  }
+
+  BFG_STAT(bfg_stats.images++; bfg_stats.pixels += n_px);
+  *out_len = p;
+  return out;
+}
+
+bfg_img_t bfg_encode(bfg_raw_t raw, bfg_header_t *header, uint32_t *out_len) {
+  return bfg_encode_opts(raw, NULL, header, out_len);
+}
+
+bfg_img_t bfg_encode_opts(bfg_raw_t raw, const bfg_opts_t *opts,
+                          bfg_header_t *header, uint32_t *out_len) {
+  return bfg_encode_frame(raw, opts, NULL, header, out_len);
+}
+
+bfg_img_t bfg_encode_update(bfg_header_t *header, const uint8_t *data,
+                            uint32_t data_len, bfg_raw_t raw,
+                            const bfg_rect_t *rects, uint32_t n_rects,
+                            uint32_t *out_len) {
+  if (!header || !data || !raw || !raw->pixels || !out_len) return NULL;
+  if (!rects && n_rects) return NULL;
+  if (bfg_check_header(header)) return NULL;
+  if (!(header->flags & BFG_FLAG_STRIPES)) return NULL;
+  if (header->flags & BFG_FLAG_INTER) return NULL;
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  uint8_t ch = header->channels;
+  if (raw->width != w || raw->height != h || raw->n_channels != ch) {
+    return NULL;
+  }
+  /* the old trailer is dropped and a new one computed */
+  if (data_len < bfg_trailer_len(header)) return NULL;
+  data_len -= bfg_trailer_len(header);
+  /* as is the old preview: it is made again from raw */
+  const int layered = (header->flags & BFG_FLAG_LAYERED) != 0;
+  if (bfg_skip_preview(header, &data, &data_len)) return NULL;
+
+  uint32_t rows, n;
+  if (bfg_stripes(data, data_len, h, &rows, &n)) return NULL;
+  uint8_t *dirty = (uint8_t *)BFG_MALLOC(n);
+  if (!dirty) return NULL;
+  memset(dirty, 0, n);
+  for (uint32_t r = 0; r < n_rects; r++) {
+    const bfg_rect_t *rc = &rects[r];
+    if (!rc->w || !rc->h || rc->x >= w || rc->y >= h) continue;
+    uint32_t y1 = h - rc->y < rc->h ? h - 1 : rc->y + rc->h - 1;
+    for (uint32_t k = rc->y / rows; k <= y1 / rows; k++) dirty[k] = 1;
+  }
+
+  const int xform = (header->flags & BFG_FLAG_YCOCG) != 0;
+  const int fill = (header->flags & BFG_FLAG_ALPHA_CONST) != 0;
+  const int plane = (header->flags & BFG_FLAG_ALPHA_PLANE) != 0;
+  bfg_stream_t st;
+  st.xform = xform;
+  st.origin = bfg_origin(xform, fill ? header->alpha : 255);
+  st.code_a = !plane;
+  st.psz = (fill || plane) ? 3 : ch;
+  st.tol = 0;
+  st.ref = NULL;
+
+  /* size the output, and check a constant alpha still holds */
+  uint32_t table = 4 + n * 4;
+  uint64_t max_size = table + 8;
+  if (layered) max_size += bfg_preview_max(w, h, plane);
+  int refit = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t len, k_rows;
+    bfg_stripe(data, rows, n, h, k, &len, &k_rows);
+    if (!dirty[k]) {
+      max_size += len;
+      continue;
+    }
+    uint64_t k_px = (uint64_t)k_rows * w;
+    max_size += bfg_body_max(k_px, plane) + 4;
+    const uint8_t *a = raw->pixels + (uint64_t)k * rows * w * ch + 3;
+    for (uint64_t i = 0; fill && i < k_px && !refit; i++) {
+      refit = a[i * 4] != header->alpha;
+    }
+  }
+
+  if (refit) {
+    /* the header no longer fits the image: start over */
+    BFG_FREE(dirty);
+    if (rows > UINT16_MAX) return NULL;
+    bfg_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.transform = xform ? BFG_TRANSFORM_YCOCG : BFG_TRANSFORM_NONE;
+    opts.cache_size = (uint16_t)(1u << bfg_cache_bits(header->cache));
+    opts.hash = (header->cache & BFG_CACHE_HASH_MASK) >> 2;
+    opts.stripe_rows = (uint16_t)rows;
+    if (header->flags & BFG_FLAG_CRC) opts.checksum |= BFG_CHECKSUM_DATA;
+    if (header->flags & BFG_FLAG_PIXEL_CRC)
+      opts.checksum |= BFG_CHECKSUM_PIXELS;
+    opts.preview = (uint8_t)layered;
+    return bfg_encode_frame(raw, &opts, NULL, header, out_len);
+  }
+
+  uint8_t *out = NULL;
+  bfg_pixel_t *prev_row = NULL;
+  if (max_size <= UINT32_MAX) {
+    out = (uint8_t *)BFG_MALLOC((size_t)max_size);
+    prev_row = (bfg_pixel_t *)BFG_MALLOC(bfg_enc_rows_size(w));
+  }
+  if (!out || !prev_row) {
+    BFG_FREE(out);
+    BFG_FREE(prev_row);
+    BFG_FREE(dirty);
+    return NULL;
+  }
+
+  uint32_t lead = 0;
+  if (layered) {
+    lead = bfg_encode_preview(raw, out, prev_row, &st, header->cache);
+    if (!lead) {
+      BFG_FREE(out);
+      BFG_FREE(prev_row);
+      BFG_FREE(dirty);
+      return NULL;
+    }
+  }
+
+  /* clean stripes are copied, dirty ones coded again */
+  write_u32_le(out + lead, rows);
+  uint32_t p = lead + table;
+  int copied = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t len, k_rows;
+    const uint8_t *sd = bfg_stripe(data, rows, n, h, k, &len, &k_rows);
+    copied |= !dirty[k];
+    if (dirty[k]) {
+      struct bfg_raw stripe = {w, k_rows, ch,
+                               raw->pixels + (uint64_t)k * rows * w * ch};
+      p += bfg_encode_body(&stripe, out + p, prev_row, &st, header->cache);
+      BFG_STAT(bfg_stats.pixels += (uint64_t)k_rows * w);
+    } else {
+      memcpy(out + p, sd, len);
+      p += len;
+    }
+    write_u32_le(&out[lead + 4 + k * 4], p - lead - table);
+  }
+  BFG_FREE(prev_row);
+  BFG_FREE(dirty);
+  /* coded stripes are lossless, but copied ones may come from a
+   * max_error encode and decode to something else than raw */
+  p = bfg_put_trailer(header, out, p, copied ? NULL : raw->pixels);
+  if (!p) {
+    BFG_FREE(out);
+    return NULL;
+  }
+
+  BFG_STAT(bfg_stats.images++);
+  *out_len = p;
+  return out;
+}
+
+/* ---- decoder ---- */
+
+/* Decoded output: caller's buffer, row stride and pixel layout. keep_a
+ * means alpha was already decoded into the buffer from an alpha plane. */
+typedef struct {
+  uint8_t *pixels;
+  size_t stride;
+  int layout; /* BFG_FMT_* */
+  int bpp;    /* bytes per output pixel */
+  int keep_a;
+} bfg_dst_t;
+
+/* Store RGB(A) pixel p at dst in the output layout, in one 32-bit store for
+ * the 4-byte layouts. */
+BFG_INLINE void bfg_put_pixel(uint8_t *dst, bfg_pixel_t p, const int layout,
+                              const int keep_a) {
+  if (layout == BFG_FMT_RGB) {
+    dst[0] = p.r;
+    dst[1] = p.g;
+    dst[2] = p.b;
+    return;
+  }
+  if (keep_a) p.a = dst[3];
+  switch (layout) {
+  case BFG_FMT_RGBX:
+    p.a = 255;
+    break;
+  case BFG_FMT_BGRA_PREMUL: {
+    /* exact round(c * a / 255) */
+    uint32_t t;
+    t = p.r * p.a + 128u; p.r = (uint8_t)((t + (t >> 8)) >> 8);
+    t = p.g * p.a + 128u; p.g = (uint8_t)((t + (t >> 8)) >> 8);
+    t = p.b * p.a + 128u; p.b = (uint8_t)((t + (t >> 8)) >> 8);
+  } /* fall through */
+  case BFG_FMT_BGRA: {
+    uint8_t r = p.r;
+    p.r = p.b;
+    p.b = r;
+    break;
+  }
+  default:
+    break;
+  }
+  memcpy(dst, &p, 4);
+}
+
+/* Fill n output pixels at dst with p. */
+BFG_INLINE void bfg_fill_pixels(uint8_t *dst, bfg_pixel_t p, uint32_t n,
+                                const int layout, const int keep_a) {
+  uint32_t k = 0;
+  if (keep_a || layout == BFG_FMT_RGB) {
+    const int bpp = layout == BFG_FMT_RGB ? 3 : 4;
+    for (; k < n; k++) bfg_put_pixel(&dst[k * bpp], p, layout, keep_a);
+    return;
+  }
+
+  uint8_t v[4];
+  uint32_t u;
+  bfg_put_pixel(v, p, layout, 0);
+  memcpy(&u, v, 4);
+#ifdef __SSE2__
+  __m128i x4 = _mm_set1_epi32((int)u);
+  for (; k + 4 <= n; k += 4) _mm_storeu_si128((__m128i *)&dst[k * 4], x4);
+#endif
+  for (; k < n; k++) memcpy(&dst[k * 4], &u, 4);
+}
+
+/* Convert n STORED pixels (psz channels, RGB order) into the output. */
+BFG_INLINE void bfg_put_block(uint8_t *dst, const uint8_t *src, uint32_t n,
+                              const int psz, uint8_t fill_a,
+                              const int layout, const int keep_a) {
+  const int bpp = layout == BFG_FMT_RGB ? 3 : 4;
+  uint32_t k = 0;
+  if (psz == bpp && !keep_a &&
+      (layout == BFG_FMT_RGB || layout == BFG_FMT_RGBA)) {
+    memcpy(dst, src, (size_t)n * psz);
+    return;
+  }
+#ifdef __SSE2__
+  if (psz == 4 && !keep_a &&
+      (layout == BFG_FMT_BGRA || layout == BFG_FMT_RGBX)) {
+    const __m128i ga = _mm_set1_epi32((int)0xFF00FF00u);
+    const __m128i lo = _mm_set1_epi32(0xFF);
+    const __m128i a = _mm_set1_epi32((int)0xFF000000u);
+    for (; k + 4 <= n; k += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)&src[k * 4]);
+      if (layout == BFG_FMT_BGRA) {
+        /* swap the r and b bytes of each little-endian RGBA word */
+        v = _mm_or_si128(_mm_and_si128(v, ga),
+                         _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lo),
+                                      _mm_slli_epi32(_mm_and_si128(v, lo), 16)));
+      } else {
+        v = _mm_or_si128(v, a);
+      }
+      _mm_storeu_si128((__m128i *)&dst[k * 4], v);
+    }
+  }
+#endif
+  for (; k < n; k++) {
+    bfg_pixel_t p = bfg_read_pixel(&src[k * psz], (uint8_t)psz);
+    if (psz == 3) p.a = fill_a;
+    bfg_put_pixel(&dst[k * bpp], p, layout, keep_a);
+  }
+}
+
+/* Decode the op stream for one cache configuration and output layout into
+ * out. prev_row must hold w origin pixels. Returns 0 on success, nonzero on
+ * a corrupt op. */
+BFG_INLINE int bfg_decode_px(const uint8_t *data, uint32_t data_len,
+                             uint32_t w, uint32_t h, const bfg_dst_t *out,
+                             bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                             const int layout, const int keep_a,
+                             const int bits, const int hash) {
+  const int xform = st->xform;
+  const bfg_pixel_t origin = st->origin;
+  const int psz = st->psz;
+  const int corr = !xform;
+  const uint32_t mask = (1u << bits) - 1;
+  const int bpp = layout == BFG_FMT_RGB ? 3 : 4;
+
+  bfg_pixel_t cache[BFG_CACHE_MAX];
+  memset(cache, 0, sizeof(cache));
+
+  bfg_pixel_t prev = origin;
+  uint32_t dp = 0; /* data pointer */
+  uint32_t px_x = 0, px_y = 0; /* current pixel coords */
+  uint8_t *row = out->pixels; /* current output row */
+  bfg_pixel_t left = origin;
+
+  while (px_y < h && dp < data_len) {
+    uint8_t b0 = data[dp];
+
+    /* decode op */
+    bfg_pixel_t px;
+
+    if ((b0 & BFG_MASK1) == BFG_OP_DELTA1) {
+      /* 0 | dg+4(3) | (dr-dg)+2(2) | (db-dg)+2(2) */
+      bfg_pixel_t above = prev_row[px_x];
+      bfg_pixel_t pred;
+      if (px_y == 0) pred = left;
+      else if (px_x == 0) pred = above;
+      else pred = bfg_predict(left, above);
+
+      int dg = ((b0 >> 4) & 0x07) - 4;
+      int dr_dg = ((b0 >> 2) & 0x03) - 2;
+      int db_dg = (b0 & 0x03) - 2;
+      px = bfg_apply_delta(pred, dg, dr_dg, db_dg, corr, prev.a);
+      dp += 1;
+    }
+    else if ((b0 & BFG_MASK2) == BFG_OP_DELTA2) {
+      if (dp + 1 >= data_len) break;
+      bfg_pixel_t above = prev_row[px_x];
+      bfg_pixel_t pred;
+      if (px_y == 0) pred = left;
+      else if (px_x == 0) pred = above;
+      else pred = bfg_predict(left, above);
+
+      uint8_t b1 = data[dp + 1];
+      int dg = (b0 & 0x3F) - 32;
+      int dr_dg = ((b1 >> 4) & 0x0F) - 8;
+      int db_dg = (b1 & 0x0F) - 8;
+      px = bfg_apply_delta(pred, dg, dr_dg, db_dg, corr, prev.a);
+      dp += 2;
+    }
+    else if ((b0 & BFG_MASK3) == BFG_OP_RUN) {
+      uint32_t run_len = (b0 & 0x1F) + 1;
+      /* check for extended RUN2 following a full RUN of 32 */
+      if (run_len == 32 && dp + 1 < data_len && data[dp + 1] == BFG_OP_RUN2) {
+        if (dp + 2 >= data_len) break;
+        run_len += (uint32_t)data[dp + 2] + 1;
+        dp += 3;
+      } else {
+        dp += 1;
+      }
+      /* fill the run a row segment at a time */
+      bfg_pixel_t out_px = xform ? bfg_ycocg_inv(prev) : prev;
+      while (run_len > 0 && px_y < h) {
+        uint32_t n = w - px_x < run_len ? w - px_x : run_len;
+        bfg_fill_pixels(&row[px_x * bpp], out_px, n, layout, keep_a);
+        for (uint32_t i = 0; i < n; i++) prev_row[px_x + i] = prev;
+        left = prev;
+        px_x += n;
+        run_len -= n;
+        if (px_x == w) {
+          px_x = 0;
+          px_y++;
+          row += out->stride;
+          left = origin;
+        }
+      }
+      continue; /* skip the single-pixel write below */
+    }
+    else if ((b0 & BFG_MASK4) == BFG_OP_CACHE) {
+      uint32_t ci = b0 & 0x0F;
+      px = cache[ci];
+      dp += 1;
+    }
+    else if (b0 == BFG_OP_RGB) {
+      if (dp + 3 >= data_len) break;
+      px.r = data[dp + 1];
+      px.g = data[dp + 2];
+      px.b = data[dp + 3];
+      px.a = prev.a;
+      dp += 4;
+    }
+    else if (b0 == BFG_OP_RGBA) {
+      if (dp + 4 >= data_len) break;
+      px.r = data[dp + 1];
+      px.g = data[dp + 2];
+      px.b = data[dp + 3];
+      px.a = data[dp + 4];
+      dp += 5;
+    }
+    else if (b0 == BFG_OP_CACHE2) {
+      if (dp + 1 >= data_len) break;
+      px = cache[data[dp + 1] & mask];
+      dp += 2;
+    }
+    else if (b0 == BFG_OP_TDELTA || b0 == BFG_OP_TDELTA2) {
+      if (!st->ref) return 1;
+      int dg, dr_dg, db_dg;
+      if (b0 == BFG_OP_TDELTA) {
+        if (dp + 1 >= data_len) break;
+        uint8_t b1 = data[dp + 1];
+        dg = (b1 >> 4) - 8;
+        dr_dg = ((b1 >> 2) & 0x03) - 2;
+        db_dg = (b1 & 0x03) - 2;
+        dp += 2;
+      } else {
+        if (dp + 2 >= data_len) break;
+        uint32_t v = ((uint32_t)data[dp + 1] << 8) | data[dp + 2];
+        dg = (int)(v >> 10) - 32;
+        dr_dg = (int)((v >> 5) & 0x1F) - 16;
+        db_dg = (int)(v & 0x1F) - 16;
+        dp += 3;
+      }
+      bfg_pixel_t rp = bfg_ref_pixel(st, (uint64_t)px_y * w + px_x,
+                                     (uint8_t)bpp);
+      px = bfg_apply_delta(rp, dg, dr_dg, db_dg, corr, rp.a);
+    }
+    else if (b0 == BFG_OP_SAME || b0 == BFG_OP_SAME2) {
+      if (!st->ref) return 1;
+      uint32_t n;
+      if (b0 == BFG_OP_SAME) {
+        if (dp + 1 >= data_len) break;
+        n = (uint32_t)data[dp + 1] + 1;
+        dp += 2;
+      } else {
+        if (dp + 2 >= data_len) break;
+        n = ((uint32_t)data[dp + 1] | ((uint32_t)data[dp + 2] << 8)) + 1;
+        dp += 3;
+      }
+      if ((uint64_t)(h - px_y) * w - px_x < n) return 1;
+
+      /* the output already holds the reference, so only the predictor
+       * state moves, plus the fill value of a constant-alpha frame */
+      const int fill_a = psz == 3 && bpp == 4 && !keep_a;
+      while (n > 0) {
+        uint32_t m = w - px_x < n ? w - px_x : n;
+        uint64_t i = (uint64_t)px_y * w + px_x;
+        for (uint32_t k = 0; k < m; k++) {
+          prev_row[px_x + k] = bfg_ref_pixel(st, i + k, (uint8_t)bpp);
+        }
+        if (fill_a) {
+          for (uint32_t k = 0; k < m; k++) row[(px_x + k) * 4 + 3] = origin.a;
+        }
+        prev = prev_row[px_x + m - 1];
+        left = prev;
+        px_x += m;
+        n -= m;
+        if (px_x == w) {
+          px_x = 0;
+          px_y++;
+          row += out->stride;
+          left = origin;
+        }
+      }
+      continue;
+    }
+    else if (b0 == BFG_OP_STORED) {
+      if (dp + 1 >= data_len) break;
+      uint32_t n = (uint32_t)data[dp + 1] + 1;
+      if ((uint64_t)n * psz > data_len - dp - 2) break;
+      if ((uint64_t)(h - px_y) * w - px_x < n) return 1;
+      const uint8_t *src = &data[dp + 2];
+      dp += 2 + n * psz;
+
+      /* pixels are stored in output order: convert them a row segment at
+       * a time, then replay them through the predictor state */
+      while (n > 0) {
+        uint32_t m = w - px_x < n ? w - px_x : n;
+        bfg_put_block(&row[px_x * bpp], src, m, psz, origin.a, layout,
+                      keep_a);
+        for (uint32_t k = 0; k < m; k++) {
+          px = bfg_read_pixel(&src[k * psz], (uint8_t)psz);
+          px.a = psz == 4 ? px.a : origin.a;
+          if (xform) px = bfg_ycocg_fwd(px);
+          cache[bfg_hash(px, bits, hash)] = px;
+          prev_row[px_x + k] = px;
+        }
+        left = px;
+        prev = px;
+        src += m * psz;
+        px_x += m;
+        n -= m;
+        if (px_x == w) {
+          px_x = 0;
+          px_y++;
+          row += out->stride;
+          left = origin;
+        }
+      }
+      continue;
+    }
+    else {
+      /* unknown op — data corruption */
+      return 1;
+    }
+
+    /* write pixel and advance */
+    bfg_put_pixel(&row[px_x * bpp], xform ? bfg_ycocg_inv(px) : px, layout,
+                  keep_a);
+    cache[bfg_hash(px, bits, hash)] = px;
+    prev_row[px_x] = px;
+    left = px;
+    prev = px;
+
+    px_x++;
+    if (px_x == w) {
+      px_x = 0;
+      px_y++;
+      row += out->stride;
+      left = origin;
+    }
+  }
+
+  return 0;
+}
+
+/* Conversions to the other layouts share one runtime-layout instance. */
+static int bfg_decode_any(const uint8_t *data, uint32_t data_len, uint32_t w,
+                          uint32_t h, const bfg_dst_t *out,
+                          bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                          int bits, int hash) {
+  return bfg_decode_px(data, data_len, w, h, out, prev_row, st, out->layout,
+                       out->keep_a, bits, hash);
+}
+
+/* The native layouts get their own instances per cache configuration. */
+BFG_INLINE int bfg_decode_cfg(const uint8_t *data, uint32_t data_len,
+                              uint32_t w, uint32_t h, const bfg_dst_t *out,
+                              bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                              const int bits, const int hash) {
+  if (out->layout == BFG_FMT_RGB) {
+    return bfg_decode_px(data, data_len, w, h, out, prev_row, st,
+                         BFG_FMT_RGB, 0, bits, hash);
+  }
+  if (out->layout == BFG_FMT_RGBA && !out->keep_a) {
+    return bfg_decode_px(data, data_len, w, h, out, prev_row, st,
+                         BFG_FMT_RGBA, 0, bits, hash);
+  }
+  return bfg_decode_any(data, data_len, w, h, out, prev_row, st, bits, hash);
+}
+
+/* Decode one body (a whole image or one stripe) into out. prev_row is w
+ * pixels of scratch. Returns 0 on success. */
+static int bfg_decode_body(const uint8_t *data, uint32_t data_len, uint32_t w,
+                           uint32_t h, const bfg_dst_t *out_desc,
+                           bfg_pixel_t *prev_row, const bfg_stream_t *stream,
+                           uint8_t cache_cfg) {
+  /* local copies the compiler can tell apart from the pixel stores */
+  const bfg_dst_t dst = *out_desc;
+  const bfg_stream_t sst = *stream;
+  const bfg_dst_t *out = &dst;
+  const bfg_stream_t *st = &sst;
+
+  /* split off the alpha plane */
+  const uint8_t *alpha = NULL;
+  uint32_t alpha_len = 0;
+  if (!st->code_a) {
+    if (data_len < 4) return 1;
+    uint32_t color_len = read_u32_le(data);
+    if (color_len > data_len - 4) return 1;
+    alpha = data + 4 + color_len;
+    alpha_len = data_len - 4 - color_len;
+    data += 4;
+    data_len = color_len;
+  }
+
+  /* alpha goes first, so premultiplication sees it */
+  if (out->keep_a &&
+      bfg_decode_alpha(alpha, alpha_len, out->pixels + 3, w, h, out->stride)) {
+    return 1;
+  }
+
+  for (uint32_t x = 0; x < w; x++) prev_row[x] = st->origin;
+
+  switch (cache_cfg) {
+  case BFG_CACHE_16 | (BFG_HASH_XOR << 2):
+    return bfg_decode_cfg(data, data_len, w, h, out, prev_row, st, 4,
+                          BFG_HASH_XOR);
+  case BFG_CACHE_64 | (BFG_HASH_XOR << 2):
+    return bfg_decode_cfg(data, data_len, w, h, out, prev_row, st, 6,
+                          BFG_HASH_XOR);
+  case BFG_CACHE_256 | (BFG_HASH_XOR << 2):
+    return bfg_decode_cfg(data, data_len, w, h, out, prev_row, st, 8,
+                          BFG_HASH_XOR);
+  case BFG_CACHE_16 | (BFG_HASH_MUL << 2):
+    return bfg_decode_cfg(data, data_len, w, h, out, prev_row, st, 4,
+                          BFG_HASH_MUL);
+  case BFG_CACHE_64 | (BFG_HASH_MUL << 2):
+    return bfg_decode_cfg(data, data_len, w, h, out, prev_row, st, 6,
+                          BFG_HASH_MUL);
+  case BFG_CACHE_256 | (BFG_HASH_MUL << 2):
+    return bfg_decode_cfg(data, data_len, w, h, out, prev_row, st, 8,
+                          BFG_HASH_MUL);
+  default:
+    return 1; /* unknown cache size or hash */
+  }
+}
+
+/* Decode into pixels. With ref_in_place, pixels holds the previous frame,
+ * packed in the native layout, and inter frames decode over it. scratch
+ * holds a row of the image, or is NULL to have one allocated here. */
+static int bfg_decode_frame(const bfg_header_t *header, const uint8_t *data,
+                            uint32_t data_len, const bfg_format_t *fmt,
+                            uint8_t *pixels, size_t pixels_len,
+                            int ref_in_place, bfg_pixel_t *scratch) {
+  if (!header || !data || !fmt || !pixels) return 1;
+  if (bfg_check_header(header)) return 1;
+  if (data_len < bfg_trailer_len(header)) return 1;
+  data_len -= bfg_trailer_len(header);
+  if (bfg_skip_preview(header, &data, &data_len)) return 1;
+
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  const int xform = (header->flags & BFG_FLAG_YCOCG) != 0;
+  const int fill = (header->flags & BFG_FLAG_ALPHA_CONST) != 0;
+  const int plane = (header->flags & BFG_FLAG_ALPHA_PLANE) != 0;
+  const int inter = (header->flags & BFG_FLAG_INTER) != 0;
+  if (inter && !ref_in_place) return 1;
+  bfg_stream_t st;
+  st.xform = xform;
+  st.origin = bfg_origin(xform, fill ? header->alpha : 255);
+  st.code_a = !plane;
+  st.psz = (fill || plane) ? 3 : header->channels;
+  st.tol = 0;
+  st.ref = inter ? pixels : NULL;
+
+  bfg_dst_t out;
+  if (fmt->layout > BFG_FMT_BGRA_PREMUL) return 1;
+  out.pixels = pixels;
+  out.layout = fmt->layout;
+  out.bpp = fmt->layout == BFG_FMT_RGB ? 3 : 4;
+  out.stride = fmt->stride ? fmt->stride : (size_t)w * out.bpp;
+  if (out.stride < (size_t)w * out.bpp) return 1;
+  if (pixels_len < out.stride * (h - 1) + (size_t)w * out.bpp) return 1;
+  /* layouts without alpha skip the alpha plane entirely */
+  out.keep_a = plane && out.layout != BFG_FMT_RGB &&
+               out.layout != BFG_FMT_RGBX;
+
+  bfg_pixel_t *prev_row =
+      scratch ? scratch : (bfg_pixel_t *)BFG_MALLOC(w * sizeof(bfg_pixel_t));
+  if (!prev_row) return 1;
+
+  int err;
+  if (header->flags & BFG_FLAG_STRIPES) {
+    uint32_t rows, n;
+    err = bfg_stripes(data, data_len, h, &rows, &n);
+    for (uint32_t k = 0; k < n && !err; k++) {
+      uint32_t len, k_rows;
+      const uint8_t *sd = bfg_stripe(data, rows, n, h, k, &len, &k_rows);
+      bfg_dst_t sout = out;
+      bfg_stream_t sst = st;
+      sout.pixels += (size_t)k * rows * out.stride;
+      if (inter) sst.ref = sout.pixels;
+      err = bfg_decode_body(sd, len, w, k_rows, &sout, prev_row, &sst,
+                            header->cache);
+    }
+  } else {
+    err = bfg_decode_body(data, data_len, w, h, &out, prev_row, &st,
+                          header->cache);
+  }
+
+  if (!scratch) BFG_FREE(prev_row);
+  return err;
+}
+
+int bfg_decode_into(const bfg_header_t *header, const uint8_t *data,
+                    uint32_t data_len, const bfg_format_t *fmt,
+                    uint8_t *pixels, size_t pixels_len) {
+  return bfg_decode_frame(header, data, data_len, fmt, pixels, pixels_len, 0,
+                          NULL);
+}
+
+uint32_t bfg_decode_batch(bfg_batch_item_t *items, uint32_t n) {
+  if (!items) return n;
+
+  /* one row of scratch, as wide as the widest image, serves them all */
+  uint32_t max_w = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    const bfg_header_t *header = items[i].header;
+    if (header && !bfg_check_header(header) && header->width > max_w) {
+      max_w = header->width;
+    }
+  }
+  bfg_pixel_t *scratch = NULL;
+  if (max_w) {
+    scratch = (bfg_pixel_t *)BFG_MALLOC(max_w * sizeof(bfg_pixel_t));
+  }
+
+  uint32_t failed = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    bfg_batch_item_t *it = &items[i];
+    it->status = !scratch || bfg_decode_frame(it->header, it->data,
+                                              it->data_len, &it->fmt,
+                                              it->pixels, it->pixels_len, 0,
+                                              scratch);
+    failed += it->status != 0;
+  }
+  BFG_FREE(scratch);
+  return failed;
+}
+
+int bfg_decode(const bfg_header_t *header, const uint8_t *data,
+               uint32_t data_len, bfg_raw_t raw) {
+  if (!header || !data || !raw) return 1;
+
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  uint8_t ch = header->channels;
+  if (!w || !h || ch < 3 || ch > 4) return 1;
+
+  uint64_t n_px = (uint64_t)w * h;
+  if (n_px > BFG_MAX_PIXELS) return 1;
+
+  raw->width = w;
+  raw->height = h;
+  raw->n_channels = ch;
+  raw->pixels = (uint8_t *)BFG_MALLOC((size_t)(n_px * ch));
+  if (!raw->pixels) return 1;
+
+  bfg_format_t fmt;
+  fmt.layout = ch == 3 ? BFG_FMT_RGB : BFG_FMT_RGBA;
+  fmt.stride = 0;
+  if (bfg_decode_into(header, data, data_len, &fmt, raw->pixels,
+                      (size_t)(n_px * ch))) {
+    BFG_FREE(raw->pixels);
+    raw->pixels = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+uint32_t bfg_preview_len(const bfg_header_t *header, const uint8_t *data,
+                         uint32_t data_len) {
+  if (!header || !data || data_len < 4) return 0;
+  if (!(header->flags & BFG_FLAG_LAYERED)) return 0;
+  uint32_t len = read_u32_le(data);
+  return len > UINT32_MAX - 4 ? 0 : 4 + len;
+}
+
+int bfg_decode_preview(const bfg_header_t *header, const uint8_t *data,
+                       uint32_t data_len, bfg_raw_t raw) {
+  if (!header || !data || !raw) return 1;
+  if (bfg_check_header(header)) return 1;
+  uint32_t len = bfg_preview_len(header, data, data_len);
+  if (!len || len > data_len) return 1;
+
+  /* the layer reads as a small unstriped image with no trailer */
+  bfg_header_t base = *header;
+  base.width = (header->width + 7) / 8;
+  base.height = (header->height + 7) / 8;
+  base.flags &= BFG_FLAG_YCOCG | BFG_FLAG_ALPHA_CONST | BFG_FLAG_ALPHA_PLANE;
+  return bfg_decode(&base, data + 4, len - 4, raw);
+}
+
+int bfg_verify(const bfg_header_t *header, const uint8_t *data,
+               uint32_t data_len, int flags) {
+  if (!header || !data) return 1;
+  if (bfg_check_header(header)) return 1;
+  const int crc = (header->flags & BFG_FLAG_CRC) != 0;
+  const int pixel_crc = (header->flags & BFG_FLAG_PIXEL_CRC) != 0;
+  const int decode = pixel_crc && (flags & BFG_VERIFY_PIXELS) &&
+                     !(header->flags & BFG_FLAG_INTER);
+  if (!crc && !decode) return 1;
+  if (data_len < bfg_trailer_len(header)) return 1;
+
+  if (crc) {
+    uint8_t hdr[BFG_HEADER_SIZE];
+    bfg_header_pack(header, hdr);
+    uint32_t body = data_len - 4;
+    if (bfg_crc32c(bfg_crc32c(0, hdr, sizeof(hdr)), data, body) !=
+        read_u32_le(&data[body])) {
+      return 1;
+    }
+  }
+  if (decode) {
+    struct bfg_raw raw;
+    if (bfg_decode(header, data, data_len, &raw)) return 1;
+    size_t len = (size_t)raw.width * raw.height * raw.n_channels;
+    uint32_t sum = bfg_crc32c(0, raw.pixels, len);
+    BFG_FREE(raw.pixels);
+    if (sum != read_u32_le(&data[data_len - bfg_trailer_len(header)]))
+      return 1;
+  }
+  return 0;
+}
+
+/* ---- analysis ---- */
+
+/* Count n pixels of RGB color p in the histograms, and alpha with tally_a. */
+BFG_INLINE void bfg_tally(bfg_analysis_t *an, bfg_pixel_t p, uint32_t n,
+                          const int tally_a) {
+  an->hist[0][p.r] += n;
+  an->hist[1][p.g] += n;
+  an->hist[2][p.b] += n;
+  if (tally_a) an->hist[3][p.a] += n;
 }
 
-/* ---- decoder ---- */
+/* Grow the box over the n visible pixels from raster index i. */
+static void bfg_box_span(bfg_analysis_t *an, uint64_t i, uint64_t n,
+                         uint32_t w) {
+  uint64_t j = i + n - 1;
+  uint32_t x0 = (uint32_t)(i % w), y0 = (uint32_t)(i / w);
+  uint32_t x1 = (uint32_t)(j % w), y1 = (uint32_t)(j / w);
+  if (y0 != y1) {
+    x0 = 0;
+    x1 = w - 1;
+  }
+  if (x0 < an->box_x0) an->box_x0 = x0;
+  if (y0 < an->box_y0) an->box_y0 = y0;
+  if (x1 > an->box_x1) an->box_x1 = x1;
+  if (y1 > an->box_y1) an->box_y1 = y1;
+  an->visible += n;
+}
 
-int bfg_decode(const bfg_header_t *header, const uint8_t *data,
-               uint32_t data_len, bfg_raw_t raw) {
-  if (!header || !data || !raw) return 1;
+BFG_INLINE void bfg_box_pixel(bfg_analysis_t *an, uint32_t x, uint32_t y) {
+  if (x < an->box_x0) an->box_x0 = x;
+  if (x > an->box_x1) an->box_x1 = x;
+  if (y < an->box_y0) an->box_y0 = y;
+  if (y > an->box_y1) an->box_y1 = y;
+  an->visible++;
+}
 
-  uint32_t w = header->width;
-  uint32_t h = header->height;
-  uint8_t ch = header->channels;
-  if (!w || !h || ch < 3 || ch > 4) return 1;
+/* Set n entries of a row from x on, wrapping at w. The row only remembers
+ * the last pixel of each column, so a run of any length touches at most w
+ * of them. */
+static void bfg_fill_row(bfg_pixel_t *row, uint32_t w, uint32_t x, uint64_t n,
+                         bfg_pixel_t p) {
+  if (n >= w) {
+    x = 0;
+    n = w;
+  }
+  for (uint32_t k = 0; k < n; k++) {
+    row[x] = p;
+    if (++x == w) x = 0;
+  }
+}
 
+/* Statistics of an alpha plane whose first row is image row y0. Only A_UP
+ * and A_LIT look at single values; row holds the last value of each column
+ * and starts out all 255. */
+static int bfg_analyze_alpha(const uint8_t *data, uint32_t data_len,
+                             uint32_t w, uint32_t h, uint32_t y0,
+                             uint8_t *row, bfg_analysis_t *an) {
+  const uint64_t base = (uint64_t)y0 * w;
   uint64_t n_px = (uint64_t)w * h;
-  if (n_px > BFG_MAX_PIXELS) return 1;
+  uint64_t i = 0;
+  uint32_t x = 0;
+  uint32_t dp = 0;
+  uint8_t a = 255;
 
-  raw->width = w;
-  raw->height = h;
-  raw->n_channels = ch;
-  raw->pixels = (uint8_t *)BFG_MALLOC((size_t)(n_px * ch));
-  if (!raw->pixels) return 1;
+  while (i < n_px && dp < data_len) {
+    uint8_t b0 = data[dp++];
+    uint8_t op = b0 & BFG_MASK2;
+    uint64_t n = (uint32_t)(b0 & 0x3F) + 1;
+    if (n == 64 && op <= BFG_OP_A_UP) {
+      if (data_len - dp < 2) return 1;
+      n = 64 + ((uint32_t)data[dp] | ((uint32_t)data[dp + 1] << 8));
+      dp += 2;
+    }
+    if (op == BFG_OP_A_DELTA) {
+      a = (uint8_t)(a + (b0 & 0x3F) - 32);
+      n = 1;
+    } else if (op == BFG_OP_A_UP && i < w) {
+      return 1;
+    } else if (op == BFG_OP_A_LIT) {
+      if (n > data_len - dp) return 1;
+    }
+    if (n > n_px - i) n = n_px - i; /* spills past the last row */
 
-  bfg_pixel_t cache[BFG_CACHE_SIZE];
-  memset(cache, 0, sizeof(cache));
+    if (op == BFG_OP_A_RUN || op == BFG_OP_A_DELTA) {
+      an->hist[3][a] += (uint32_t)n;
+      if (a) bfg_box_span(an, base + i, n, w);
+      if (n >= w) {
+        memset(row, a, w);
+      } else if (x + n <= w) {
+        memset(&row[x], a, (size_t)n);
+      } else {
+        memset(&row[x], a, w - x);
+        memset(row, a, (size_t)(n - (w - x)));
+      }
+    } else {
+      /* A_UP leaves the row as it is, literals replace it; either way,
+       * equal neighbors are counted together */
+      const uint8_t *src = op == BFG_OP_A_UP ? row : &data[dp];
+      uint64_t k = 0;
+      while (k < n) {
+        uint32_t m = w - x < n - k ? w - x : (uint32_t)(n - k);
+        const uint8_t *v = op == BFG_OP_A_UP ? &src[x] : &src[k];
+        if (op == BFG_OP_A_LIT) memcpy(&row[x], v, m);
+        for (uint32_t j = 0; j < m;) {
+          uint32_t e = j + 1;
+          while (e < m && v[e] == v[j]) e++;
+          an->hist[3][v[j]] += e - j;
+          if (v[j]) bfg_box_span(an, base + i + k + j, e - j, w);
+          j = e;
+        }
+        a = v[m - 1];
+        k += m;
+        x = (uint32_t)((x + m) % w);
+      }
+      if (op == BFG_OP_A_LIT) dp += (uint32_t)n;
+    }
+    i += n;
+    x = (uint32_t)(i % w);
+  }
+  return i < n_px;
+}
 
-  bfg_pixel_t *prev_row = (bfg_pixel_t *)BFG_MALLOC(w * sizeof(bfg_pixel_t));
-  if (!prev_row) { BFG_FREE(raw->pixels); raw->pixels = NULL; return 1; }
+/* Statistics of the color ops for one cache configuration, for an image
+ * or stripe whose first row is image row y0. prev_row must hold w origin
+ * pixels. Mirrors bfg_decode_px, minus the output. */
+BFG_INLINE int bfg_analyze_px(const uint8_t *data, uint32_t data_len,
+                              uint32_t w, uint32_t h, uint32_t y0,
+                              bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                              bfg_analysis_t *an, const int bits,
+                              const int hash) {
+  const int xform = st->xform;
+  const bfg_pixel_t origin = st->origin;
+  const int psz = st->psz;
+  const int tally_a = psz == 4; /* alpha comes with the color ops */
+  const int corr = !xform;
+  const uint32_t mask = (1u << bits) - 1;
+  const uint64_t n_px = (uint64_t)w * h;
+  const uint64_t base = (uint64_t)y0 * w;
 
-  for (uint32_t x = 0; x < w; x++) {
-    prev_row[x].r = 0; prev_row[x].g = 0;
-    prev_row[x].b = 0; prev_row[x].a = 255;
-  }
+  bfg_pixel_t cache[BFG_CACHE_MAX];
+  memset(cache, 0, sizeof(cache));
 
-  bfg_pixel_t prev = {0, 0, 0, 255};
-  uint32_t dp = 0; /* data pointer */
-  uint32_t px_x = 0, px_y = 0; /* current pixel coords */
-  bfg_pixel_t left = {0, 0, 0, 255};
+  bfg_pixel_t prev = origin;
+  bfg_pixel_t left = origin;
+  uint32_t dp = 0;
+  uint64_t i = 0; /* raster index of the current pixel */
+  uint32_t px_x = 0, px_y = 0;
 
-  while (px_y < h && dp < data_len) {
+  while (i < n_px && dp < data_len) {
     uint8_t b0 = data[dp];
-
-    /* decode op */
     bfg_pixel_t px;
 
     if ((b0 & BFG_MASK1) == BFG_OP_DELTA1) {
-      /* 0 | dg+4(3) | (dr-dg)+2(2) | (db-dg)+2(2) */
       bfg_pixel_t above = prev_row[px_x];
       bfg_pixel_t pred;
       if (px_y == 0) pred = left;
@@ -252,14 +2434,11 @@ int bfg_decode(const bfg_header_t *header, const uint8_t *data,
       int dg = ((b0 >> 4) & 0x07) - 4;
       int dr_dg = ((b0 >> 2) & 0x03) - 2;
       int db_dg = (b0 & 0x03) - 2;
-      px.r = (uint8_t)((int)pred.r + dg + dr_dg);
-      px.g = (uint8_t)((int)pred.g + dg);
-      px.b = (uint8_t)((int)pred.b + dg + db_dg);
-      px.a = prev.a;
+      px = bfg_apply_delta(pred, dg, dr_dg, db_dg, corr, prev.a);
       dp += 1;
     }
     else if ((b0 & BFG_MASK2) == BFG_OP_DELTA2) {
-      if (dp + 1 >= data_len) break;
+      if (dp + 1 >= data_len) return 1;
       bfg_pixel_t above = prev_row[px_x];
       bfg_pixel_t pred;
       if (px_y == 0) pred = left;
@@ -270,42 +2449,37 @@ int bfg_decode(const bfg_header_t *header, const uint8_t *data,
       int dg = (b0 & 0x3F) - 32;
       int dr_dg = ((b1 >> 4) & 0x0F) - 8;
       int db_dg = (b1 & 0x0F) - 8;
-      px.r = (uint8_t)((int)pred.r + dg + dr_dg);
-      px.g = (uint8_t)((int)pred.g + dg);
-      px.b = (uint8_t)((int)pred.b + dg + db_dg);
-      px.a = prev.a;
+      px = bfg_apply_delta(pred, dg, dr_dg, db_dg, corr, prev.a);
       dp += 2;
     }
     else if ((b0 & BFG_MASK3) == BFG_OP_RUN) {
-      uint32_t run_len = (b0 & 0x1F) + 1;
-      /* check for extended RUN2 following a full RUN of 32 */
+      uint64_t run_len = (b0 & 0x1F) + 1;
       if (run_len == 32 && dp + 1 < data_len && data[dp + 1] == BFG_OP_RUN2) {
-        if (dp + 2 >= data_len) break;
+        if (dp + 2 >= data_len) return 1;
         run_len += (uint32_t)data[dp + 2] + 1;
         dp += 3;
       } else {
         dp += 1;
       }
-      for (uint32_t i = 0; i < run_len && px_y < h; i++) {
-        bfg_write_pixel(&raw->pixels[(px_y * w + px_x) * ch], prev, ch);
-        prev_row[px_x] = prev;
-        left = prev;
-        px_x++;
-        if (px_x == w) {
-          px_x = 0;
-          px_y++;
-          left.r = 0; left.g = 0; left.b = 0; left.a = 255;
-        }
-      }
-      continue; /* skip the single-pixel write below */
+      if (run_len > n_px - i) run_len = n_px - i;
+
+      /* the whole run at once */
+      bfg_pixel_t rgb = xform ? bfg_ycocg_inv(prev) : prev;
+      bfg_tally(an, rgb, (uint32_t)run_len, tally_a);
+      if (tally_a && rgb.a) bfg_box_span(an, base + i, run_len, w);
+      bfg_fill_row(prev_row, w, px_x, run_len, prev);
+      i += run_len;
+      px_x = (uint32_t)(i % w);
+      px_y = (uint32_t)(i / w);
+      left = px_x ? prev : origin;
+      continue;
     }
     else if ((b0 & BFG_MASK4) == BFG_OP_CACHE) {
-      uint32_t ci = b0 & 0x0F;
-      px = cache[ci];
+      px = cache[b0 & 0x0F];
       dp += 1;
     }
     else if (b0 == BFG_OP_RGB) {
-      if (dp + 3 >= data_len) break;
+      if (dp + 3 >= data_len) return 1;
       px.r = data[dp + 1];
       px.g = data[dp + 2];
       px.b = data[dp + 3];
@@ -313,24 +2487,474 @@ int bfg_decode(const bfg_header_t *header, const uint8_t *data,
       dp += 4;
     }
     else if (b0 == BFG_OP_RGBA) {
-      if (dp + 4 >= data_len) break;
+      if (dp + 4 >= data_len) return 1;
       px.r = data[dp + 1];
       px.g = data[dp + 2];
       px.b = data[dp + 3];
       px.a = data[dp + 4];
       dp += 5;
     }
+    else if (b0 == BFG_OP_CACHE2) {
+      if (dp + 1 >= data_len) return 1;
+      px = cache[data[dp + 1] & mask];
+      dp += 2;
+    }
+    else if (b0 == BFG_OP_STORED) {
+      if (dp + 1 >= data_len) return 1;
+      uint32_t n = (uint32_t)data[dp + 1] + 1;
+      if ((uint64_t)n * psz > data_len - dp - 2) return 1;
+      if (n_px - i < n) return 1;
+      const uint8_t *src = &data[dp + 2];
+      dp += 2 + n * psz;
+
+      /* stored pixels are already RGB */
+      for (uint32_t k = 0; k < n; k++) {
+        px = bfg_read_pixel(&src[k * psz], (uint8_t)psz);
+        px.a = psz == 4 ? px.a : origin.a;
+        bfg_tally(an, px, 1, tally_a);
+        if (tally_a && px.a) bfg_box_pixel(an, px_x, y0 + px_y);
+        if (xform) px = bfg_ycocg_fwd(px);
+        cache[bfg_hash(px, bits, hash)] = px;
+        prev_row[px_x] = px;
+        if (++px_x == w) {
+          px_x = 0;
+          px_y++;
+        }
+      }
+      i += n;
+      prev = px;
+      left = px_x ? prev : origin;
+      continue;
+    }
+    else {
+      /* unknown op, or an inter op without a reference */
+      return 1;
+    }
+
+    bfg_pixel_t rgb = xform ? bfg_ycocg_inv(px) : px;
+    bfg_tally(an, rgb, 1, tally_a);
+    if (tally_a && rgb.a) bfg_box_pixel(an, px_x, y0 + px_y);
+    cache[bfg_hash(px, bits, hash)] = px;
+    prev_row[px_x] = px;
+    left = px;
+    prev = px;
+
+    i++;
+    if (++px_x == w) {
+      px_x = 0;
+      px_y++;
+      left = origin;
+    }
+  }
+
+  return i < n_px;
+}
+
+/* Statistics of one body (a whole image or one stripe) starting at image
+ * row y0. prev_row is w pixels of scratch. */
+static int bfg_analyze_body(const uint8_t *data, uint32_t data_len,
+                            uint32_t w, uint32_t h, uint32_t y0,
+                            bfg_pixel_t *prev_row, const bfg_stream_t *st,
+                            bfg_analysis_t *an, uint8_t cache_cfg) {
+  if (!st->code_a) {
+    if (data_len < 4) return 1;
+    uint32_t color_len = read_u32_le(data);
+    if (color_len > data_len - 4) return 1;
+    /* the row buffer serves the alpha plane first, as bytes */
+    uint8_t *alpha_row = (uint8_t *)prev_row;
+    memset(alpha_row, 255, w);
+    if (bfg_analyze_alpha(data + 4 + color_len, data_len - 4 - color_len, w,
+                          h, y0, alpha_row, an))
+      return 1;
+    data += 4;
+    data_len = color_len;
+  }
+
+  for (uint32_t x = 0; x < w; x++) prev_row[x] = st->origin;
+
+  switch (cache_cfg) {
+  case BFG_CACHE_16 | (BFG_HASH_XOR << 2):
+    return bfg_analyze_px(data, data_len, w, h, y0, prev_row, st, an, 4,
+                          BFG_HASH_XOR);
+  case BFG_CACHE_64 | (BFG_HASH_XOR << 2):
+    return bfg_analyze_px(data, data_len, w, h, y0, prev_row, st, an, 6,
+                          BFG_HASH_XOR);
+  case BFG_CACHE_256 | (BFG_HASH_XOR << 2):
+    return bfg_analyze_px(data, data_len, w, h, y0, prev_row, st, an, 8,
+                          BFG_HASH_XOR);
+  case BFG_CACHE_16 | (BFG_HASH_MUL << 2):
+    return bfg_analyze_px(data, data_len, w, h, y0, prev_row, st, an, 4,
+                          BFG_HASH_MUL);
+  case BFG_CACHE_64 | (BFG_HASH_MUL << 2):
+    return bfg_analyze_px(data, data_len, w, h, y0, prev_row, st, an, 6,
+                          BFG_HASH_MUL);
+  case BFG_CACHE_256 | (BFG_HASH_MUL << 2):
+    return bfg_analyze_px(data, data_len, w, h, y0, prev_row, st, an, 8,
+                          BFG_HASH_MUL);
+  default:
+    return 1;
+  }
+}
+
+int bfg_analyze(const bfg_header_t *header, const uint8_t *data,
+                uint32_t data_len, bfg_analysis_t *an) {
+  if (!header || !data || !an) return 1;
+  if (bfg_check_header(header)) return 1;
+  if (header->flags & BFG_FLAG_INTER) return 1;
+  if (data_len < bfg_trailer_len(header)) return 1;
+  data_len -= bfg_trailer_len(header);
+  if (bfg_skip_preview(header, &data, &data_len)) return 1;
+
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  uint64_t n_px = (uint64_t)w * h;
+  const int xform = (header->flags & BFG_FLAG_YCOCG) != 0;
+  const int fill = (header->flags & BFG_FLAG_ALPHA_CONST) != 0;
+  const int plane = (header->flags & BFG_FLAG_ALPHA_PLANE) != 0;
+  bfg_stream_t st;
+  st.xform = xform;
+  st.origin = bfg_origin(xform, fill ? header->alpha : 255);
+  st.code_a = !plane;
+  st.psz = (fill || plane) ? 3 : header->channels;
+  st.tol = 0;
+  st.ref = NULL;
+
+  memset(an, 0, sizeof(*an));
+  an->pixels = n_px;
+  an->box_x0 = w;
+  an->box_y0 = h;
+  if (!plane && st.psz == 3) {
+    /* constant alpha: 255 without an alpha channel */
+    an->hist[3][st.origin.a] = (uint32_t)n_px;
+    if (st.origin.a) bfg_box_span(an, 0, n_px, w);
+  }
+
+  bfg_pixel_t *prev_row = (bfg_pixel_t *)BFG_MALLOC(w * sizeof(bfg_pixel_t));
+  if (!prev_row) return 1;
+
+  int err;
+  if (header->flags & BFG_FLAG_STRIPES) {
+    uint32_t rows, n;
+    err = bfg_stripes(data, data_len, h, &rows, &n);
+    for (uint32_t k = 0; k < n && !err; k++) {
+      uint32_t len, k_rows;
+      const uint8_t *sd = bfg_stripe(data, rows, n, h, k, &len, &k_rows);
+      err = bfg_analyze_body(sd, len, w, k_rows, k * rows, prev_row, &st, an,
+                             header->cache);
+    }
+  } else {
+    err = bfg_analyze_body(data, data_len, w, h, 0, prev_row, &st, an,
+                           header->cache);
+  }
+  BFG_FREE(prev_row);
+  if (err) return 1;
+
+  /* means and the solid check come out of the histograms: an image is one
+   * color exactly when every channel has a single value */
+  uint8_t color[4] = {0, 0, 0, 0};
+  an->solid = 1;
+  for (int c = 0; c < 4; c++) {
+    uint64_t sum = 0;
+    int values = 0;
+    for (int v = 0; v < 256; v++) {
+      if (!an->hist[c][v]) continue;
+      sum += (uint64_t)v * an->hist[c][v];
+      values++;
+      color[c] = (uint8_t)v;
+    }
+    an->mean[c] = (double)sum / n_px;
+    if (values != 1) an->solid = 0;
+  }
+  if (an->solid) {
+    an->color.r = color[0];
+    an->color.g = color[1];
+    an->color.b = color[2];
+    an->color.a = color[3];
+  }
+  if (!an->visible) an->box_x0 = an->box_y0 = 0;
+  return 0;
+}
+
+/* ---- 16 bits per channel ---- */
+
+/* RGBA pixel with 16-bit channels. */
+typedef struct {
+  uint16_t r, g, b, a;
+} bfg_pixel16_t;
+
+/* Whether a 16-bit header describes a decodable stream. Returns 0 if so. */
+static int bfg_check_header16(const bfg_header_t *header) {
+  uint8_t ch = header->channels & BFG_CHANNELS_MASK;
+  if (header->channels != (BFG_DEPTH_16 | ch)) return 1;
+  if (!header->width || !header->height || ch < 3 || ch > 4) return 1;
+  if ((uint64_t)header->width * header->height > BFG_MAX_PIXELS) return 1;
+  return header->flags || header->cache || header->alpha;
+}
+
+BFG_INLINE bfg_pixel16_t bfg_predict16(bfg_pixel16_t left,
+                                       bfg_pixel16_t above) {
+  bfg_pixel16_t p;
+  p.r = (uint16_t)(((uint32_t)left.r + above.r) >> 1);
+  p.g = (uint16_t)(((uint32_t)left.g + above.g) >> 1);
+  p.b = (uint16_t)(((uint32_t)left.b + above.b) >> 1);
+  p.a = (uint16_t)(((uint32_t)left.a + above.a) >> 1);
+  return p;
+}
+
+BFG_INLINE int bfg_eq16(bfg_pixel16_t p, bfg_pixel16_t q) {
+  return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+}
+
+/* A difference of 16-bit samples wrapped to -32768..32767. */
+BFG_INLINE int bfg_wrap16(int d) { return ((d + 32768) & 0xFFFF) - 32768; }
+
+static uint32_t bfg_put_run16(uint8_t *out, uint32_t run) {
+  if (run <= 256) {
+    out[0] = BFG_OP16_RUN;
+    out[1] = (uint8_t)(run - 1);
+    return 2;
+  }
+  out[0] = BFG_OP16_RUN2;
+  out[1] = (uint8_t)((run - 257) & 0xFF);
+  out[2] = (uint8_t)((run - 257) >> 8);
+  return 3;
+}
+
+BFG_INLINE void bfg_put_u16(uint8_t *out, uint16_t v) {
+  out[0] = (uint8_t)(v & 0xFF);
+  out[1] = (uint8_t)(v >> 8);
+}
+
+BFG_INLINE uint16_t bfg_get_u16(const uint8_t *in) {
+  return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+/* Encode raw with ch channels into out. prev_row holds a row of pixels.
+ * Returns bytes written. */
+BFG_INLINE uint32_t bfg_encode16_px(bfg_raw16_t raw, uint8_t *out,
+                                    bfg_pixel16_t *prev_row, const int ch) {
+  const uint32_t w = raw->width;
+  const uint32_t h = raw->height;
+  const bfg_pixel16_t origin = {0, 0, 0, 65535};
+  for (uint32_t x = 0; x < w; x++) prev_row[x] = origin;
+
+  const uint16_t *src = raw->pixels;
+  bfg_pixel16_t prev = origin;
+  uint32_t p = 0, run = 0;
+  for (uint32_t y = 0; y < h; y++) {
+    bfg_pixel16_t left = origin;
+    for (uint32_t x = 0; x < w; x++, src += ch) {
+      bfg_pixel16_t px = {src[0], src[1], src[2], ch == 4 ? src[3] : 65535};
+      bfg_pixel16_t above = prev_row[x];
+      bfg_pixel16_t pred;
+      if (y == 0) pred = left;
+      else if (x == 0) pred = above;
+      else pred = bfg_predict16(left, above);
+      prev_row[x] = px;
+      left = px;
+
+      if (bfg_eq16(px, prev)) {
+        if (++run == BFG_RUN16_MAX) {
+          p += bfg_put_run16(out + p, run);
+          run = 0;
+        }
+        continue;
+      }
+      if (run) {
+        p += bfg_put_run16(out + p, run);
+        run = 0;
+      }
+
+      uint8_t *o = out + p;
+      int dg = bfg_wrap16(px.g - pred.g);
+      int dr_dg = bfg_wrap16(px.r - pred.r) - dg;
+      int db_dg = bfg_wrap16(px.b - pred.b) - dg;
+      if (px.a != prev.a) {
+        o[0] = BFG_OP16_RGBA;
+        bfg_put_u16(o + 1, px.r);
+        bfg_put_u16(o + 3, px.g);
+        bfg_put_u16(o + 5, px.b);
+        bfg_put_u16(o + 7, px.a);
+        p += 9;
+      } else if (dg >= -4 && dg <= 3 && dr_dg >= -2 && dr_dg <= 1 &&
+                 db_dg >= -2 && db_dg <= 1) {
+        o[0] = (uint8_t)(BFG_OP_DELTA1 | (dg + 4) << 4 | (dr_dg + 2) << 2 |
+                         (db_dg + 2));
+        p += 1;
+      } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                 db_dg >= -8 && db_dg <= 7) {
+        o[0] = (uint8_t)(BFG_OP_DELTA2 | (dg + 32));
+        o[1] = (uint8_t)((dr_dg + 8) << 4 | (db_dg + 8));
+        p += 2;
+      } else if (dg >= -64 && dg <= 63 && dr_dg >= -64 && dr_dg <= 63 &&
+                 db_dg >= -64 && db_dg <= 63) {
+        uint32_t v = (uint32_t)(dg + 64) << 14 |
+                     (uint32_t)(dr_dg + 64) << 7 | (uint32_t)(db_dg + 64);
+        o[0] = (uint8_t)(BFG_OP16_DELTA3 | v >> 16);
+        o[1] = (uint8_t)(v >> 8);
+        o[2] = (uint8_t)v;
+        p += 3;
+      } else if (dg >= -512 && dg <= 511 && dr_dg >= -256 && dr_dg <= 255 &&
+                 db_dg >= -256 && db_dg <= 255) {
+        uint32_t v = (uint32_t)(dg + 512) << 18 |
+                     (uint32_t)(dr_dg + 256) << 9 | (uint32_t)(db_dg + 256);
+        o[0] = (uint8_t)(BFG_OP16_DELTA4 | v >> 24);
+        o[1] = (uint8_t)(v >> 16);
+        o[2] = (uint8_t)(v >> 8);
+        o[3] = (uint8_t)v;
+        p += 4;
+      } else if (dg >= -4096 && dg <= 4095 && dr_dg >= -1024 &&
+                 dr_dg <= 1023 && db_dg >= -1024 && db_dg <= 1023) {
+        uint64_t v = (uint64_t)(dg + 4096) << 22 |
+                     (uint64_t)(dr_dg + 1024) << 11 | (uint64_t)(db_dg + 1024);
+        o[0] = (uint8_t)(BFG_OP16_DELTA5 | v >> 32);
+        o[1] = (uint8_t)(v >> 24);
+        o[2] = (uint8_t)(v >> 16);
+        o[3] = (uint8_t)(v >> 8);
+        o[4] = (uint8_t)v;
+        p += 5;
+      } else {
+        o[0] = BFG_OP16_RGB;
+        bfg_put_u16(o + 1, px.r);
+        bfg_put_u16(o + 3, px.g);
+        bfg_put_u16(o + 5, px.b);
+        p += 7;
+      }
+      prev = px;
+    }
+  }
+  if (run) p += bfg_put_run16(out + p, run);
+  return p;
+}
+
+/* Decode data into raw's packed ch-channel pixels. Returns 0 if every
+ * pixel was decoded. */
+BFG_INLINE int bfg_decode16_px(const uint8_t *data, uint32_t data_len,
+                               bfg_raw16_t raw, bfg_pixel16_t *prev_row,
+                               const int ch) {
+  const uint32_t w = raw->width;
+  const uint32_t h = raw->height;
+  const bfg_pixel16_t origin = {0, 0, 0, 65535};
+  for (uint32_t x = 0; x < w; x++) prev_row[x] = origin;
+
+  uint16_t *dst = raw->pixels;
+  bfg_pixel16_t prev = origin;
+  bfg_pixel16_t left = origin;
+  uint32_t dp = 0;
+  uint32_t px_x = 0, px_y = 0;
+  while (px_y < h && dp < data_len) {
+    uint8_t b0 = data[dp];
+    bfg_pixel16_t px;
+
+    if (b0 < BFG_OP16_RUN) {
+      int dg, dr_dg, db_dg;
+      if ((b0 & BFG_MASK1) == BFG_OP_DELTA1) {
+        dg = ((b0 >> 4) & 0x07) - 4;
+        dr_dg = ((b0 >> 2) & 0x03) - 2;
+        db_dg = (b0 & 0x03) - 2;
+        dp += 1;
+      } else if ((b0 & BFG_MASK2) == BFG_OP_DELTA2) {
+        if (dp + 1 >= data_len) break;
+        uint8_t b1 = data[dp + 1];
+        dg = (b0 & 0x3F) - 32;
+        dr_dg = (b1 >> 4) - 8;
+        db_dg = (b1 & 0x0F) - 8;
+        dp += 2;
+      } else if ((b0 & BFG_MASK3) == BFG_OP16_DELTA3) {
+        if (dp + 2 >= data_len) break;
+        uint32_t v = (uint32_t)(b0 & 0x1F) << 16 |
+                     (uint32_t)data[dp + 1] << 8 | data[dp + 2];
+        dg = (int)(v >> 14) - 64;
+        dr_dg = (int)((v >> 7) & 0x7F) - 64;
+        db_dg = (int)(v & 0x7F) - 64;
+        dp += 3;
+      } else if ((b0 & BFG_MASK4) == BFG_OP16_DELTA4) {
+        if (dp + 3 >= data_len) break;
+        uint32_t v = (uint32_t)(b0 & 0x0F) << 24 |
+                     (uint32_t)data[dp + 1] << 16 |
+                     (uint32_t)data[dp + 2] << 8 | data[dp + 3];
+        dg = (int)(v >> 18) - 512;
+        dr_dg = (int)((v >> 9) & 0x1FF) - 256;
+        db_dg = (int)(v & 0x1FF) - 256;
+        dp += 4;
+      } else {
+        if (dp + 4 >= data_len) break;
+        uint64_t v = (uint64_t)(b0 & 0x07) << 32 |
+                     (uint64_t)data[dp + 1] << 24 |
+                     (uint64_t)data[dp + 2] << 16 |
+                     (uint64_t)data[dp + 3] << 8 | data[dp + 4];
+        dg = (int)(v >> 22) - 4096;
+        dr_dg = (int)((v >> 11) & 0x7FF) - 1024;
+        db_dg = (int)(v & 0x7FF) - 1024;
+        dp += 5;
+      }
+      bfg_pixel16_t above = prev_row[px_x];
+      bfg_pixel16_t pred;
+      if (px_y == 0) pred = left;
+      else if (px_x == 0) pred = above;
+      else pred = bfg_predict16(left, above);
+      px.r = (uint16_t)(pred.r + dg + dr_dg);
+      px.g = (uint16_t)(pred.g + dg);
+      px.b = (uint16_t)(pred.b + dg + db_dg);
+      px.a = prev.a;
+    }
+    else if (b0 <= BFG_OP16_RUN2) {
+      uint32_t run_len;
+      if (b0 == BFG_OP16_RUN) {
+        if (dp + 1 >= data_len) break;
+        run_len = (uint32_t)data[dp + 1] + 1;
+        dp += 2;
+      } else {
+        if (dp + 2 >= data_len) break;
+        run_len = (uint32_t)bfg_get_u16(&data[dp + 1]) + 257;
+        dp += 3;
+      }
+      while (run_len > 0 && px_y < h) {
+        uint32_t n = w - px_x < run_len ? w - px_x : run_len;
+        for (uint32_t i = 0; i < n; i++, dst += ch) {
+          dst[0] = prev.r;
+          dst[1] = prev.g;
+          dst[2] = prev.b;
+          if (ch == 4) dst[3] = prev.a;
+          prev_row[px_x + i] = prev;
+        }
+        left = prev;
+        px_x += n;
+        run_len -= n;
+        if (px_x == w) {
+          px_x = 0;
+          px_y++;
+          left = origin;
+        }
+      }
+      continue; /* skip the single-pixel write below */
+    }
+    else if (b0 == BFG_OP16_RGB) {
+      if (dp + 6 >= data_len) break;
+      px.r = bfg_get_u16(&data[dp + 1]);
+      px.g = bfg_get_u16(&data[dp + 3]);
+      px.b = bfg_get_u16(&data[dp + 5]);
+      px.a = prev.a;
+      dp += 7;
+    }
+    else if (b0 == BFG_OP16_RGBA) {
+      if (dp + 8 >= data_len) break;
+      px.r = bfg_get_u16(&data[dp + 1]);
+      px.g = bfg_get_u16(&data[dp + 3]);
+      px.b = bfg_get_u16(&data[dp + 5]);
+      px.a = bfg_get_u16(&data[dp + 7]);
+      dp += 9;
+    }
     else {
       /* unknown op — data corruption */
-      BFG_FREE(prev_row);
-      BFG_FREE(raw->pixels);
-      raw->pixels = NULL;
       return 1;
     }
 
-    /* write pixel and advance */
-    bfg_write_pixel(&raw->pixels[(px_y * w + px_x) * ch], px, ch);
-    cache[bfg_hash(px)] = px;
+    dst[0] = px.r;
+    dst[1] = px.g;
+    dst[2] = px.b;
+    if (ch == 4) dst[3] = px.a;
+    dst += ch;
     prev_row[px_x] = px;
     left = px;
     prev = px;
@@ -339,26 +2963,213 @@ int bfg_decode(const bfg_header_t *header, const uint8_t *data,
     if (px_x == w) {
       px_x = 0;
       px_y++;
-      left.r = 0; left.g = 0; left.b = 0; left.a = 255;
+      left = origin;
     }
   }
+  return px_y < h;
+}
+
+bfg_img_t bfg_encode16(bfg_raw16_t raw, bfg_header_t *header,
+                       uint32_t *out_len) {
+  if (!raw || !raw->pixels || !header || !out_len) return NULL;
+  uint32_t w = raw->width;
+  uint32_t h = raw->height;
+  uint8_t ch = raw->n_channels;
+  if (!w || !h || ch < 3 || ch > 4) return NULL;
+  uint64_t n_px = (uint64_t)w * h;
+  if (n_px > BFG_MAX_PIXELS) return NULL;
+
+  uint64_t max_size = bfg_body16_max(n_px);
+  if (max_size > UINT32_MAX) return NULL;
+  uint8_t *out = (uint8_t *)BFG_MALLOC((size_t)max_size);
+  if (!out) return NULL;
+  bfg_pixel16_t *prev_row =
+      (bfg_pixel16_t *)BFG_MALLOC(w * sizeof(bfg_pixel16_t));
+  if (!prev_row) { BFG_FREE(out); return NULL; }
 
+  uint32_t p = ch == 4 ? bfg_encode16_px(raw, out, prev_row, 4)
+                       : bfg_encode16_px(raw, out, prev_row, 3);
   BFG_FREE(prev_row);
-  return 0;
+
+  header->magic = BFG_MAGIC;
+  header->width = w;
+  header->height = h;
+  header->channels = (uint8_t)(ch | BFG_DEPTH_16);
+  header->flags = 0;
+  header->cache = 0;
+  header->alpha = 0;
+  *out_len = p;
+  return out;
+}
+
+int bfg_decode16(const bfg_header_t *header, const uint8_t *data,
+                 uint32_t data_len, bfg_raw16_t raw) {
+  if (!header || !data || !raw) return 1;
+  if (bfg_check_header16(header)) return 1;
+
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  uint8_t ch = header->channels & BFG_CHANNELS_MASK;
+  raw->width = w;
+  raw->height = h;
+  raw->n_channels = ch;
+  raw->pixels =
+      (uint16_t *)BFG_MALLOC((size_t)w * h * ch * sizeof(uint16_t));
+  bfg_pixel16_t *prev_row =
+      (bfg_pixel16_t *)BFG_MALLOC(w * sizeof(bfg_pixel16_t));
+  int err = !raw->pixels || !prev_row;
+  if (!err) {
+    err = ch == 4 ? bfg_decode16_px(data, data_len, raw, prev_row, 4)
+                  : bfg_decode16_px(data, data_len, raw, prev_row, 3);
+  }
+  BFG_FREE(prev_row);
+  if (err) bfg_free_raw16(raw);
+  return err;
+}
+
+/* ---- sequences ---- */
+
+struct bfg_seq {
+  bfg_opts_t opts;      /* encoder options */
+  uint32_t keyint;      /* keyframe interval, 0 = only when needed */
+  uint32_t since_key;   /* frames since the last keyframe */
+  struct bfg_raw ref;   /* previous frame; no pixels until the first */
+};
+
+bfg_seq_t bfg_seq_new(uint32_t keyint, const bfg_opts_t *opts) {
+  if (opts && (opts->max_error || opts->preview)) return NULL;
+  bfg_seq_t seq = (bfg_seq_t)BFG_MALLOC(sizeof(struct bfg_seq));
+  if (!seq) return NULL;
+  memset(seq, 0, sizeof(*seq));
+  if (opts) seq->opts = *opts;
+  seq->keyint = keyint;
+  return seq;
+}
+
+void bfg_seq_free(bfg_seq_t seq) {
+  if (!seq) return;
+  bfg_free_raw(&seq->ref);
+  BFG_FREE(seq);
+}
+
+/* Make ref hold a w x h x ch frame. Returns 0 if it already matched, 1 if
+ * it was (re)allocated, -1 on failure. */
+static int bfg_seq_fit(bfg_seq_t seq, uint32_t w, uint32_t h, uint8_t ch) {
+  struct bfg_raw *ref = &seq->ref;
+  if (ref->pixels && ref->width == w && ref->height == h &&
+      ref->n_channels == ch) {
+    return 0;
+  }
+  bfg_free_raw(ref);
+  ref->pixels = (uint8_t *)BFG_MALLOC((size_t)w * h * ch);
+  if (!ref->pixels) return -1;
+  ref->width = w;
+  ref->height = h;
+  ref->n_channels = ch;
+  return 1;
+}
+
+bfg_img_t bfg_seq_encode(bfg_seq_t seq, bfg_raw_t frame, bfg_header_t *header,
+                         uint32_t *out_len) {
+  if (!seq || !frame || !frame->pixels) return NULL;
+  uint64_t n_px = (uint64_t)frame->width * frame->height;
+  if (!n_px || n_px > BFG_MAX_PIXELS) return NULL;
+  if (frame->n_channels < 3 || frame->n_channels > 4) return NULL;
+
+  int fit = bfg_seq_fit(seq, frame->width, frame->height, frame->n_channels);
+  if (fit < 0) return NULL;
+  int key = fit || (seq->keyint && seq->since_key >= seq->keyint);
+
+  bfg_img_t img = bfg_encode_frame(frame, &seq->opts,
+                                   key ? NULL : seq->ref.pixels, header,
+                                   out_len);
+  if (!img) {
+    bfg_free_raw(&seq->ref); /* start over with a keyframe */
+    return NULL;
+  }
+  seq->since_key = key ? 1 : seq->since_key + 1;
+  memcpy(seq->ref.pixels, frame->pixels, (size_t)(n_px * frame->n_channels));
+  return img;
+}
+
+const uint8_t *bfg_seq_decode(bfg_seq_t seq, const bfg_header_t *header,
+                              const uint8_t *data, uint32_t data_len) {
+  if (!seq || !header) return NULL;
+  uint32_t w = header->width;
+  uint32_t h = header->height;
+  uint8_t ch = header->channels;
+  if (!w || !h || ch < 3 || ch > 4) return NULL;
+  if ((uint64_t)w * h > BFG_MAX_PIXELS) return NULL;
+
+  if (header->flags & BFG_FLAG_INTER) {
+    /* needs the previous frame, at the same size */
+    if (!seq->ref.pixels || seq->ref.width != w || seq->ref.height != h ||
+        seq->ref.n_channels != ch) {
+      return NULL;
+    }
+  } else if (bfg_seq_fit(seq, w, h, ch) < 0) {
+    return NULL;
+  }
+
+  bfg_format_t fmt;
+  fmt.layout = ch == 3 ? BFG_FMT_RGB : BFG_FMT_RGBA;
+  fmt.stride = 0;
+  if (bfg_decode_frame(header, data, data_len, &fmt, seq->ref.pixels,
+                       (size_t)w * h * ch, 1, NULL)) {
+    bfg_free_raw(&seq->ref); /* the reference is gone */
+    return NULL;
+  }
+  return seq->ref.pixels;
 }
 
 /* ---- file I/O ---- */
 
-static void write_u32_le(uint8_t *buf, uint32_t v) {
-  buf[0] = (uint8_t)(v);
-  buf[1] = (uint8_t)(v >> 8);
-  buf[2] = (uint8_t)(v >> 16);
-  buf[3] = (uint8_t)(v >> 24);
+void bfg_header_pack(const bfg_header_t *header, uint8_t *buf) {
+  write_u32_le(&buf[0], header->magic);
+  write_u32_le(&buf[4], header->width);
+  write_u32_le(&buf[8], header->height);
+  buf[12] = header->channels;
+  buf[13] = header->flags;
+  buf[14] = header->cache;
+  buf[15] = header->alpha;
 }
 
-static uint32_t read_u32_le(const uint8_t *buf) {
-  return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
-         ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+int bfg_header_unpack(const uint8_t *buf, bfg_header_t *header) {
+  header->magic = read_u32_le(&buf[0]);
+  header->width = read_u32_le(&buf[4]);
+  header->height = read_u32_le(&buf[8]);
+  header->channels = buf[12];
+  header->flags = buf[13];
+  header->cache = buf[14];
+  header->alpha = buf[15];
+  return header->magic != BFG_MAGIC;
+}
+
+int bfg_probe_buffer(const uint8_t *buf, size_t len, bfg_header_t *header) {
+  if (!buf || !header || len < BFG_HEADER_SIZE) return 1;
+  if (bfg_header_unpack(buf, header)) return 1;
+  if (header->channels & BFG_DEPTH_16) return bfg_check_header16(header);
+  return bfg_check_header(header);
+}
+
+size_t bfg_serialize(const bfg_header_t *header, const uint8_t *data,
+                     uint32_t data_len, uint8_t *buf, size_t buf_len) {
+  if (!header || (!data && data_len) || !buf) return 0;
+  if (buf_len < BFG_HEADER_SIZE || buf_len - BFG_HEADER_SIZE < data_len)
+    return 0;
+  bfg_header_pack(header, buf);
+  if (data_len) memcpy(buf + BFG_HEADER_SIZE, data, data_len);
+  return BFG_HEADER_SIZE + (size_t)data_len;
+}
+
+int bfg_deserialize(const uint8_t *buf, size_t len, bfg_header_t *header,
+                    const uint8_t **data, uint32_t *data_len) {
+  if (!data || !data_len) return 1;
+  if (bfg_probe_buffer(buf, len, header)) return 1;
+  if (len - BFG_HEADER_SIZE > UINT32_MAX) return 1;
+  *data = buf + BFG_HEADER_SIZE;
+  *data_len = (uint32_t)(len - BFG_HEADER_SIZE);
+  return 0;
 }
 
 int bfg_write(const char *fpath, const bfg_header_t *header,
@@ -368,11 +3179,7 @@ int bfg_write(const char *fpath, const bfg_header_t *header,
   if (!fp) return 1;
 
   uint8_t hdr[BFG_HEADER_SIZE];
-  write_u32_le(&hdr[0], header->magic);
-  write_u32_le(&hdr[4], header->width);
-  write_u32_le(&hdr[8], header->height);
-  hdr[12] = header->channels;
-  hdr[13] = 0; hdr[14] = 0; hdr[15] = 0;
+  bfg_header_pack(header, hdr);
 
   if (fwrite(hdr, 1, BFG_HEADER_SIZE, fp) != BFG_HEADER_SIZE) {
     fclose(fp); return 1;
@@ -394,13 +3201,7 @@ uint8_t *bfg_read(const char *fpath, bfg_header_t *header, uint32_t *out_len) {
     fclose(fp); return NULL;
   }
 
-  header->magic = read_u32_le(&hdr[0]);
-  header->width = read_u32_le(&hdr[4]);
-  header->height = read_u32_le(&hdr[8]);
-  header->channels = hdr[12];
-  memset(header->reserved, 0, 3);
-
-  if (header->magic != BFG_MAGIC) {
+  if (bfg_header_unpack(hdr, header)) {
     fprintf(stderr, "Not a valid BFG2 file\n");
     fclose(fp); return NULL;
   }
@@ -432,6 +3233,13 @@ void bfg_free_raw(bfg_raw_t raw) {
   }
 }
 
+void bfg_free_raw16(bfg_raw16_t raw) {
+  if (raw && raw->pixels) {
+    BFG_FREE(raw->pixels);
+    raw->pixels = NULL;
+  }
+}
+
 void bfg_free_img(bfg_img_t img) {
   if (img) BFG_FREE(img);
 }
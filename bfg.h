@@ -14,8 +14,21 @@ Header (16 bytes, little-endian):
   Bytes 0-3:   Magic "BFG2" (0x42, 0x46, 0x47, 0x32)
   Bytes 4-7:   Width  (uint32)
   Bytes 8-11:  Height (uint32)
-  Byte  12:    Channels (3 = RGB, 4 = RGBA)
-  Bytes 13-15: Reserved (zero)
+  Byte  12:    Channels (3 = RGB, 4 = RGBA), plus 0x10 for 16 bits per
+               channel (see below)
+  Byte  13:    Flags
+                 bit 0: YCoCg-R color transform
+                 bit 1: constant alpha (RGBA only, value in byte 15)
+                 bit 2: separate alpha plane (RGBA only)
+                 bit 3: inter frame, predicted from the previous frame
+                 bit 4: striped
+                 bit 5: CRC32C trailer
+                 bit 6: pixel CRC32C in the trailer
+                 bit 7: 1/8 scale preview layer first
+  Byte  14:    Cache config
+                 bits 0-1: size (0 = 16, 1 = 64, 2 = 256 entries)
+                 bits 2-3: hash (0 = XOR-multiply, 1 = multiplicative)
+  Byte  15:    Alpha fill value (constant alpha), otherwise zero
 
 Pixel data is a sequence of byte-aligned ops:
 
@@ -28,6 +41,20 @@ Pixel data is a sequence of byte-aligned ops:
   11110000 + r + g + b      RGB     (4 bytes) literal RGB, alpha unchanged
   11110001 + r + g + b + a  RGBA    (5 bytes) literal RGBA
   11110010 + 1 byte         RUN2    (2 bytes) extended run length 33..288
+  11110011 + 1 byte         CACHE2  (2 bytes) cache index 16..255
+  11110100 + n + pixels     STORED  (2 + n*c) n+1 = 1..256 raw pixels
+
+Inter frames (flag bit 3) may also use:
+
+  11110101 + 1 byte         SAME    (2 bytes) n+1 = 1..256 pixels equal
+                                      to the reference
+  11110110 + uint16         SAME2   (3 bytes) n+1 = 1..65536 pixels equal
+                                      to the reference
+  11110111 + 1 byte         TDELTA  (2 bytes) delta from the reference:
+                                      dg[-8..7], (dr-dg)[-2..1], (db-dg)[-2..1]
+  11111000 + 2 bytes        TDELTA2 (3 bytes) delta from the reference:
+                                      dg[-32..31], (dr-dg)[-16..15],
+                                      (db-dg)[-16..15]
 
 Prediction: average of left and above pixels per channel.
   - First pixel: predict {0, 0, 0, 255}
@@ -38,7 +65,100 @@ Prediction: average of left and above pixels per channel.
 Delta ops encode luma-correlated residuals: green delta directly,
 red and blue as offsets from green delta. This leverages the
 correlation between color channels in natural images.
-A 16-entry hash cache stores recently seen pixel values.
+A hash cache of 16 (default), 64 or 256 entries stores recently seen
+pixel values. Indices 0..15 use the 1-byte CACHE op and larger indices
+the 2-byte CACHE2 op. The hash is either the XOR-multiply
+  (r*3 ^ g*5 ^ b*11 ^ a*7) & (size - 1)
+or the multiplicative hash of the little-endian packed RGBA word
+  (rgba * 0x9E3779B1) >> (32 - log2(size))
+
+STORED carries raw pixels in output channel order (RGB, or RGBA when
+alpha is interleaved; c is 3 or 4), bypassing the color transform. Each
+stored pixel updates the cache and predictor state exactly like a
+literal. The encoder swaps a stretch of up to 256 non-run ops for a
+STORED block whenever the raw pixels are smaller.
+
+Alpha: RGBA images whose alpha never changes (flag bit 1) are coded as
+3-channel, with every pixel carrying the header fill value as its
+alpha, so no op ever codes alpha. With varying alpha (flag bit 2) the
+color ops are likewise coded as 3-channel with alpha 255, and the data
+becomes:
+  uint32 color stream length, color ops, alpha ops
+The alpha ops code the alpha channel alone, in raster order, relative
+to the previous alpha value (initially 255) or the row above:
+  00xxxxxx                  A_RUN   (1 byte)  repeat previous, 1..63
+  01xxxxxx                  A_UP    (1 byte)  copy from above, 1..63
+  10xxxxxx                  A_DELTA (1 byte)  delta -32..31 (mod 256)
+  11xxxxxx + n bytes        A_LIT   (n+1)     n = 1..64 literal values
+A_RUN or A_UP with all six length bits set is followed by a uint16
+extension, for a length of 64 + ext (up to 65599).
+
+Color transform (flag bit 0): pixels are mapped through a reversible
+YCoCg-R lifting transform (mod 256) before prediction:
+  Co = R - B,  t = B + (Co >> 1),  Cg = G - t,  Y = t + (Cg >> 1)
+Y takes the green slot, Co + 128 the red slot and Cg + 128 the blue
+slot. Prediction, runs and the cache all operate in the transformed
+space, and delta ops code dCo and dCg directly instead of relative
+to dY, since the transform has already removed the inter-channel
+correlation. The origin pixel is transformed black {128, 0, 128, 255}.
+
+Sequences: an inter frame is coded against a reference, the previous
+decoded frame of the same size and channel count, and cannot be decoded
+on its own. SAME and TDELTA take the co-located reference pixel, with
+alpha replaced as for every other op when alpha is constant or in a
+plane, and TDELTA deltas are coded like DELTA2 (dCo, dCg directly with
+YCoCg-R). Reference pixels update the predictor state like literals,
+except that SAME does not touch the cache. Frames without flag bit 3
+are keyframes, where decoding can start.
+
+Stripes (flag bit 4): the image is cut into horizontal stripes of a
+fixed number of rows (the last may be shorter), each coded as if it were
+an image of its own, with fresh cache and predictor state and, with an
+alpha plane, its own length prefix and alpha ops. The data becomes:
+  uint32 rows per stripe, uint32 end offset of each stripe, stripes
+with the end offsets counted from the first stripe's first byte. A
+stripe can be decoded, or re-encoded and spliced in, without touching
+the others.
+
+Preview layer (flag bit 7): the data starts with a small version of the
+image, (width + 7) / 8 by (height + 7) / 8 pixels, each the rounded mean
+of every channel over one 8x8 block (clipped at the right and bottom
+edges). It is coded as an unstriped image of that size with the same
+flags and cache, and goes first with its length:
+  uint32 preview length, preview ops, the data as without bit 7
+The full image that follows is coded as usual, without reference to the
+preview, so a viewer can show the preview from the start of a download
+and replace it once the rest arrives. Not combined with flag bit 3.
+
+16 bits per channel (0x10 in byte 12): samples are 0..65535, no flags
+are set and bytes 14 and 15 are zero. Prediction is as above, from the
+first pixel's {0, 0, 0, 65535}, with residuals taken mod 65536, and the
+pixel data is its own op set, sized for the wider residuals:
+  0xxxxxxx                  DELTA1  (1 byte)  dg[-4..3], (dr-dg)[-2..1],
+                                      (db-dg)[-2..1]
+  10xxxxxx + 1 byte         DELTA2  (2 bytes) dg[-32..31], (dr-dg)[-8..7],
+                                      (db-dg)[-8..7]
+  110xxxxx + 2 bytes        DELTA3  (3 bytes) dg[-64..63],
+                                      (dr-dg)[-64..63], (db-dg)[-64..63]
+  1110xxxx + 3 bytes        DELTA4  (4 bytes) dg[-512..511],
+                                      (dr-dg)[-256..255], (db-dg)[-256..255]
+  11110xxx + 4 bytes        DELTA5  (5 bytes) dg[-4096..4095],
+                                      (dr-dg)[-1024..1023],
+                                      (db-dg)[-1024..1023]
+  11111000 + 1 byte         RUN     (2 bytes) n+1 = 1..256 repeats
+  11111001 + uint16         RUN2    (3 bytes) n+257 = 257..65792 repeats
+  11111010 + 3 x uint16     RGB     (7 bytes) literal RGB, alpha unchanged
+  11111011 + 4 x uint16     RGBA    (9 bytes) literal RGBA
+Delta fields are packed most significant first after the tag bits, as
+in DELTA2, and keep the previous pixel's alpha. Runs repeat the previous
+pixel and literals are little-endian.
+
+Checksums (flag bits 5 and 6): the data ends with a trailer,
+  [uint32 pixel CRC (bit 6)] [uint32 data CRC (bit 5)]
+Both are CRC-32C (Castagnoli). The pixel CRC covers the image as
+bfg_decode returns it: packed rows of RGB or RGBA, channels bytes per
+pixel. The data CRC covers the 16 header bytes followed by every data
+byte before it, so a file can be checked without decoding.
 
 */
 
@@ -52,7 +172,43 @@ A 16-entry hash cache stores recently seen pixel values.
 #define BFG_MAGIC (0x32474642u) /* little-endian for "BFG2" */
 #define BFG_HEADER_SIZE 16
 #define BFG_MAX_PIXELS ((uint32_t)400000000) /* ~400 megapixels */
-#define BFG_CACHE_SIZE 16
+#define BFG_CACHE_SIZE 16  /* default cache entries */
+#define BFG_DEPTH_16 0x10  /* channels byte: 16 bits per channel */
+#define BFG_CHANNELS_MASK 0x0F /* channels byte: the channel count */
+#define BFG_CACHE_MAX  256 /* largest selectable cache */
+
+/* Header flags */
+#define BFG_FLAG_YCOCG 0x01 /* reversible YCoCg-R color transform */
+#define BFG_FLAG_ALPHA_CONST 0x02 /* alpha is header->alpha everywhere */
+#define BFG_FLAG_ALPHA_PLANE 0x04 /* alpha coded as a separate plane */
+#define BFG_FLAG_INTER 0x08 /* predicted from the previous frame */
+#define BFG_FLAG_STRIPES 0x10 /* independently coded horizontal stripes */
+#define BFG_FLAG_CRC 0x20 /* CRC32C of the header and data at the end */
+#define BFG_FLAG_PIXEL_CRC 0x40 /* CRC32C of the decoded pixels too */
+#define BFG_FLAG_LAYERED 0x80 /* led by a 1/8 scale preview layer */
+#define BFG_FLAGS_KNOWN                                                  \
+  (BFG_FLAG_YCOCG | BFG_FLAG_ALPHA_CONST | BFG_FLAG_ALPHA_PLANE |        \
+   BFG_FLAG_INTER | BFG_FLAG_STRIPES | BFG_FLAG_CRC | BFG_FLAG_PIXEL_CRC | \
+   BFG_FLAG_LAYERED)
+
+/* Color transforms selectable at encode time */
+#define BFG_TRANSFORM_NONE  0 /* luma-correlated RGB deltas */
+#define BFG_TRANSFORM_YCOCG 1 /* YCoCg-R, see BFG_FLAG_YCOCG */
+
+/* Alpha handling selectable at encode time */
+#define BFG_ALPHA_AUTO        0 /* pre-scan: constant fill or alpha plane */
+#define BFG_ALPHA_INTERLEAVED 1 /* code alpha inline with RGBA ops */
+
+/* Cache config byte */
+#define BFG_CACHE_16  0x00
+#define BFG_CACHE_64  0x01
+#define BFG_CACHE_256 0x02
+#define BFG_CACHE_SIZE_MASK 0x03
+#define BFG_CACHE_HASH_MASK 0x0C
+
+/* Cache hash functions */
+#define BFG_HASH_XOR 0 /* XOR-multiply of the channels */
+#define BFG_HASH_MUL 1 /* multiplicative hash of the packed pixel */
 
 /* Op tag masks */
 #define BFG_OP_DELTA1 0x00 /* 0xxxxxxx */
@@ -62,17 +218,47 @@ A 16-entry hash cache stores recently seen pixel values.
 #define BFG_OP_RGB    0xF0 /* 11110000 */
 #define BFG_OP_RGBA   0xF1 /* 11110001 */
 #define BFG_OP_RUN2   0xF2 /* 11110010 + 1 byte: extended run 33..288 */
+#define BFG_OP_CACHE2 0xF3 /* 11110011 + 1 byte: cache index 16..255 */
+#define BFG_OP_STORED 0xF4 /* 11110100 + count-1 + raw pixels */
+#define BFG_OP_SAME   0xF5 /* 11110101 + count-1: copy reference pixels */
+#define BFG_OP_SAME2  0xF6 /* 11110110 + uint16 count-1 */
+#define BFG_OP_TDELTA 0xF7 /* 11110111 + 1 byte: small temporal delta */
+#define BFG_OP_TDELTA2 0xF8 /* 11111000 + 2 bytes: temporal delta */
+
+/* Alpha plane op tags */
+#define BFG_OP_A_RUN   0x00 /* 00xxxxxx */
+#define BFG_OP_A_UP    0x40 /* 01xxxxxx */
+#define BFG_OP_A_DELTA 0x80 /* 10xxxxxx */
+#define BFG_OP_A_LIT   0xC0 /* 11xxxxxx + 1..64 bytes */
+#define BFG_A_RUN_MAX  65599 /* longest A_RUN / A_UP (64 + uint16) */
+
+/* 16-bit op tags (BFG_DEPTH_16), after DELTA1 and DELTA2 as above */
+#define BFG_OP16_DELTA3 0xC0 /* 110xxxxx + 2 bytes */
+#define BFG_OP16_DELTA4 0xE0 /* 1110xxxx + 3 bytes */
+#define BFG_OP16_DELTA5 0xF0 /* 11110xxx + 4 bytes */
+#define BFG_OP16_RUN    0xF8 /* 11111000 + 1 byte: run 1..256 */
+#define BFG_OP16_RUN2   0xF9 /* 11111001 + uint16: run 257..65792 */
+#define BFG_OP16_RGB    0xFA /* 11111010 + 3 x uint16 */
+#define BFG_OP16_RGBA   0xFB /* 11111011 + 4 x uint16 */
+#define BFG_RUN16_MAX   65792
 
 #define BFG_MASK1     0x80 /* 1-bit prefix mask */
 #define BFG_MASK2     0xC0 /* 2-bit prefix mask */
 #define BFG_MASK3     0xE0 /* 3-bit prefix mask */
 #define BFG_MASK4     0xF0 /* 4-bit prefix mask */
 
-/* Optionally provide custom malloc and free. */
+/* Optionally provide custom malloc and free. Building with -DBFG_MEMSTATS
+ * (and no custom allocator) routes them through a counting allocator, see
+ * bfg_mem_get. */
 #ifndef BFG_MALLOC
+#ifdef BFG_MEMSTATS
+#define BFG_MALLOC(sz) bfg_mem_alloc(sz)
+#define BFG_FREE(ptr) bfg_mem_free(ptr)
+#else
 #define BFG_MALLOC(sz) malloc(sz)
 #define BFG_FREE(ptr) free(ptr)
 #endif
+#endif
 
 /* RGBA pixel for internal processing. */
 typedef struct {
@@ -87,15 +273,56 @@ typedef struct bfg_raw {
   uint8_t *pixels;
 } * bfg_raw_t;
 
+/* Raw image with 16 bits per channel, see bfg_encode16. */
+typedef struct bfg_raw16 {
+  uint32_t width;
+  uint32_t height;
+  uint8_t n_channels;
+  uint16_t *pixels; /* packed rows of n_channels samples each */
+} * bfg_raw16_t;
+
 /* File header (16 bytes). */
 typedef struct bfg_header {
   uint32_t magic;
   uint32_t width;
   uint32_t height;
-  uint8_t channels;
-  uint8_t reserved[3];
+  uint8_t channels; /* 3 or 4, | BFG_DEPTH_16 for 16-bit images */
+  uint8_t flags;
+  uint8_t cache; /* BFG_CACHE_* size | hash << 2 */
+  uint8_t alpha; /* fill value with BFG_FLAG_ALPHA_CONST */
 } bfg_header_t;
 
+/* Encoder options. Zero-initialize for the default behavior. */
+typedef struct bfg_opts {
+  uint8_t transform;   /* BFG_TRANSFORM_* */
+  uint16_t cache_size; /* 16 (default), 64 or 256 entries */
+  uint8_t hash;        /* BFG_HASH_* */
+  uint8_t alpha;       /* BFG_ALPHA_* */
+  uint8_t max_error;   /* near-lossless R, G, B error bound (0 = lossless) */
+  uint16_t stripe_rows; /* rows per stripe (0 = unstriped), see
+                           bfg_encode_update */
+  uint8_t checksum;    /* BFG_CHECKSUM_* bits, see bfg_verify */
+  uint8_t preview;     /* nonzero: lead with a preview layer, see
+                          bfg_decode_preview (not for inter frames) */
+} bfg_opts_t;
+
+/* Checksums to append (bfg_opts_t.checksum). */
+#define BFG_CHECKSUM_DATA 0x01   /* header and data, see BFG_FLAG_CRC */
+#define BFG_CHECKSUM_PIXELS 0x02 /* decoded pixels, see BFG_FLAG_PIXEL_CRC */
+
+/* Output pixel layouts for bfg_decode_into. */
+#define BFG_FMT_RGB         0 /* r, g, b */
+#define BFG_FMT_RGBA        1 /* r, g, b, a */
+#define BFG_FMT_BGRA        2 /* b, g, r, a */
+#define BFG_FMT_RGBX        3 /* r, g, b, 255 */
+#define BFG_FMT_BGRA_PREMUL 4 /* b, g, r, a with color premultiplied by a */
+
+/* Target format for bfg_decode_into. */
+typedef struct bfg_format {
+  uint8_t layout; /* BFG_FMT_* */
+  size_t stride;  /* bytes per row, 0 = tightly packed */
+} bfg_format_t;
+
 /* Encoded image data. */
 typedef uint8_t *bfg_img_t;
 
@@ -103,12 +330,167 @@ typedef uint8_t *bfg_img_t;
  * header is filled with image metadata. Returns NULL on failure. */
 bfg_img_t bfg_encode(bfg_raw_t raw, bfg_header_t *header, uint32_t *out_len);
 
+/* Like bfg_encode, with encoder options. opts may be NULL for defaults. */
+bfg_img_t bfg_encode_opts(bfg_raw_t raw, const bfg_opts_t *opts,
+                          bfg_header_t *header, uint32_t *out_len);
+
+/* A rectangle of changed pixels. */
+typedef struct bfg_rect {
+  uint32_t x, y, w, h;
+} bfg_rect_t;
+
+/* Re-encode a striped image (see bfg_opts_t.stripe_rows) after the pixels
+ * in rects changed. header and data are the previous encoding and raw the
+ * whole new image of the same size; only the stripes a rectangle touches
+ * are coded again, and the others are copied over. If the header's
+ * constant alpha no longer holds, the image is encoded from scratch and
+ * header updated. Returns the new data (caller frees) or NULL on failure. */
+bfg_img_t bfg_encode_update(bfg_header_t *header, const uint8_t *data,
+                            uint32_t data_len, bfg_raw_t raw,
+                            const bfg_rect_t *rects, uint32_t n_rects,
+                            uint32_t *out_len);
+
 /* Decode BFG data into raw pixels. raw->pixels is allocated (caller frees).
- * Returns 0 on success, nonzero on failure. */
+ * Inter frames need bfg_seq_decode. Returns 0 on success, nonzero on
+ * failure. */
 int bfg_decode(const bfg_header_t *header, const uint8_t *data,
                uint32_t data_len, bfg_raw_t raw);
 
-/* Write BFG file (header + data). Returns 0 on success. */
+/* Decode BFG data straight into a caller-owned buffer in the given layout
+ * and row stride, converting while decoding. pixels_len must cover the last
+ * row. Images without alpha decode with alpha 255; layouts without alpha
+ * drop it. Returns 0 on success, nonzero on failure. */
+int bfg_decode_into(const bfg_header_t *header, const uint8_t *data,
+                    uint32_t data_len, const bfg_format_t *fmt,
+                    uint8_t *pixels, size_t pixels_len);
+
+/* One image of a bfg_decode_batch call: the arguments of bfg_decode_into
+ * and its result. */
+typedef struct bfg_batch_item {
+  const bfg_header_t *header;
+  const uint8_t *data;
+  uint32_t data_len;
+  bfg_format_t fmt;
+  uint8_t *pixels;
+  size_t pixels_len;
+  int status; /* set to 0 if the image decoded, nonzero if not */
+} bfg_batch_item_t;
+
+/* Decode n independent images, each as bfg_decode_into would, with one
+ * scratch row shared between them. For sets of small images such as icons.
+ * Returns the number of images that failed. */
+uint32_t bfg_decode_batch(bfg_batch_item_t *items, uint32_t n);
+
+/* Decode the preview layer of an image encoded with bfg_opts_t.preview
+ * (see BFG_FLAG_LAYERED) into raw, at (width + 7) / 8 by (height + 7) / 8
+ * pixels. data may stop anywhere after the layer: the first 4 bytes give
+ * its length n, and 4 + n bytes are enough (see bfg_preview_len).
+ * raw->pixels is allocated (caller frees with bfg_free_raw). Returns 0 on
+ * success, nonzero on failure or if the image has no preview. */
+int bfg_decode_preview(const bfg_header_t *header, const uint8_t *data,
+                       uint32_t data_len, bfg_raw_t raw);
+
+/* Bytes of data bfg_decode_preview needs, read from the first 4 bytes of
+ * data (data_len of them available). Returns 0 if that is not known yet or
+ * the image has no preview. */
+uint32_t bfg_preview_len(const bfg_header_t *header, const uint8_t *data,
+                         uint32_t data_len);
+
+/* Encode raw pixels with 16 bits per channel, losslessly. header->channels
+ * gets BFG_DEPTH_16 set: decode with bfg_decode16, as the 8-bit decoders
+ * reject it. Returns encoded data (caller frees) or NULL on failure. */
+bfg_img_t bfg_encode16(bfg_raw16_t raw, bfg_header_t *header,
+                       uint32_t *out_len);
+
+/* Decode an image encoded by bfg_encode16. raw->pixels is allocated
+ * (caller frees with bfg_free_raw16). Returns 0 on success, nonzero on
+ * failure. */
+int bfg_decode16(const bfg_header_t *header, const uint8_t *data,
+                 uint32_t data_len, bfg_raw16_t raw);
+
+/* Check an encoded image against its checksum trailer. The data CRC is
+ * checked straight over the bytes, without decoding; with
+ * BFG_VERIFY_PIXELS the image is also decoded and checked against the
+ * pixel CRC, except for inter frames, which cannot be decoded alone.
+ * Returns 0 if the checksums present match, nonzero on a mismatch, a bad
+ * header, or a stream without any checksum to check. */
+int bfg_verify(const bfg_header_t *header, const uint8_t *data,
+               uint32_t data_len, int flags);
+#define BFG_VERIFY_PIXELS 0x01
+
+/* CRC-32C of len bytes at data, continuing from crc (0 to start), with
+ * SSE4.2 and PCLMUL when the CPU has them. */
+uint32_t bfg_crc32c(uint32_t crc, const void *data, size_t len);
+
+/* Image statistics gathered from the op stream without decoding. */
+typedef struct bfg_analysis {
+  uint64_t pixels;
+  uint32_t hist[4][256]; /* per-channel value counts, r, g, b, a */
+  double mean[4];        /* per-channel mean, r, g, b, a */
+  /* Bounding box (inclusive) of the pixels that are not fully transparent,
+   * valid if visible > 0. */
+  uint64_t visible;
+  uint32_t box_x0, box_y0, box_x1, box_y1;
+  int solid;         /* every pixel is color */
+  bfg_pixel_t color; /* with solid, the image's only pixel value */
+} bfg_analysis_t;
+
+/* Gather an's statistics by walking the ops: a run counts as all its pixels
+ * at once, and only the predictor state is kept, never the pixels. Inter
+ * frames have no reference here and fail. Returns 0 on success, nonzero on
+ * failure or a truncated stream. */
+int bfg_analyze(const bfg_header_t *header, const uint8_t *data,
+                uint32_t data_len, bfg_analysis_t *an);
+
+/* Image sequence state: the reference frame and keyframe schedule. */
+typedef struct bfg_seq *bfg_seq_t;
+
+/* New sequence encoder or decoder. The encoder makes every keyint-th frame
+ * a keyframe (0 = only the first, or when the size changes); opts are as
+ * for bfg_encode_opts, except that near-lossless and preview layers are not
+ * supported and return NULL. A decoder passes 0 and NULL. Free with bfg_seq_free. */
+bfg_seq_t bfg_seq_new(uint32_t keyint, const bfg_opts_t *opts);
+void bfg_seq_free(bfg_seq_t seq);
+
+/* Encode the next frame, as an inter frame against the previous one where
+ * possible. Returns encoded data (caller frees) or NULL on failure. */
+bfg_img_t bfg_seq_encode(bfg_seq_t seq, bfg_raw_t frame, bfg_header_t *header,
+                         uint32_t *out_len);
+
+/* Decode the next frame in place over the reference. Decoding may start
+ * at any keyframe. Returns the packed pixels (header->channels per pixel),
+ * owned by seq and valid until its next decode, or NULL on failure, after
+ * which a keyframe is needed. */
+const uint8_t *bfg_seq_decode(bfg_seq_t seq, const bfg_header_t *header,
+                              const uint8_t *data, uint32_t data_len);
+
+/* Serialize a header into BFG_HEADER_SIZE bytes at buf, or parse one.
+ * Unpacking returns nonzero if the magic is wrong. */
+void bfg_header_pack(const bfg_header_t *header, uint8_t *buf);
+int bfg_header_unpack(const uint8_t *buf, bfg_header_t *header);
+
+/* Parse and validate the header at the start of buf, without looking at
+ * the data. Returns 0 if buf holds a header (len >= BFG_HEADER_SIZE) that
+ * describes a decodable stream. See bfg_io.h for files. */
+int bfg_probe_buffer(const uint8_t *buf, size_t len, bfg_header_t *header);
+
+/* Upper bound on the data length of any stream the header describes, for
+ * sizing reads before the data is seen. */
+uint64_t bfg_max_size(const bfg_header_t *header);
+
+/* Serialize a file image (header + data, as bfg_write stores it) into buf.
+ * Returns the bytes written, BFG_HEADER_SIZE + data_len, or 0 if buf_len
+ * is too small. */
+size_t bfg_serialize(const bfg_header_t *header, const uint8_t *data,
+                     uint32_t data_len, uint8_t *buf, size_t buf_len);
+
+/* Parse a file image held in memory without copying it: header is filled
+ * and *data points into buf. Returns 0 if the header is valid. */
+int bfg_deserialize(const uint8_t *buf, size_t len, bfg_header_t *header,
+                    const uint8_t **data, uint32_t *data_len);
+
+/* Write BFG file (header + data). Returns 0 on success. See bfg_io.h for
+ * file descriptors. */
 int bfg_write(const char *fpath, const bfg_header_t *header,
               const uint8_t *data, uint32_t data_len);
 
@@ -116,8 +498,89 @@ int bfg_write(const char *fpath, const bfg_header_t *header,
  * are filled. Returns NULL on failure. */
 uint8_t *bfg_read(const char *fpath, bfg_header_t *header, uint32_t *out_len);
 
+/* Cache slot of pixel p under a header cache config byte. Exposed so that
+ * tools can replay the encoder's cache without encoding. */
+uint32_t bfg_cache_index(bfg_pixel_t p, uint8_t cache_cfg);
+
+#ifdef BFG_STATS
+/* Encoder statistics, compiled in with -DBFG_STATS. Each encode adds to one
+ * process-wide bfg_stats_t (not thread-safe); builds without BFG_STATS carry
+ * no instrumentation at all. */
+
+/* Op categories. Bytes include the op's tag and payload. */
+#define BFG_STAT_DELTA1  0
+#define BFG_STAT_DELTA2  1
+#define BFG_STAT_RUN     2
+#define BFG_STAT_RUN2    3
+#define BFG_STAT_CACHE   4
+#define BFG_STAT_CACHE2  5
+#define BFG_STAT_RGB     6
+#define BFG_STAT_RGBA    7
+#define BFG_STAT_STORED  8
+#define BFG_STAT_SAME    9  /* SAME and SAME2 */
+#define BFG_STAT_TDELTA  10
+#define BFG_STAT_TDELTA2 11
+#define BFG_STAT_A_RUN   12
+#define BFG_STAT_A_UP    13
+#define BFG_STAT_A_DELTA 14
+#define BFG_STAT_A_LIT   15
+#define BFG_STAT_OPS     16
+
+/* Run lengths bin by log2: 1, 2-3, 4-7, ..., 256-288. Residuals bin by
+ * magnitude: 0, 1, 2-3, 4-7, ..., 128 and above. */
+#define BFG_STAT_RUN_BINS   9
+#define BFG_STAT_RESID_BINS 9
+
+typedef struct bfg_op_stat {
+  uint64_t count;  /* ops emitted */
+  uint64_t bytes;  /* encoded bytes */
+  uint64_t pixels; /* pixels covered */
+} bfg_op_stat_t;
+
+typedef struct bfg_stats {
+  uint64_t images;
+  uint64_t pixels;
+  bfg_op_stat_t op[BFG_STAT_OPS];
+  uint64_t cache_hits;   /* non-run pixels found in the color cache */
+  uint64_t cache_misses; /* non-run pixels not in the cache */
+  uint64_t run_hist[BFG_STAT_RUN_BINS];
+  /* coded residuals of non-run pixels: dg, dr - dg, db - dg (dCo and dCg
+   * with YCoCg-R) */
+  uint64_t resid_hist[3][BFG_STAT_RESID_BINS];
+} bfg_stats_t;
+
+/* Copy out / clear the accumulated statistics. */
+void bfg_stats_get(bfg_stats_t *stats);
+void bfg_stats_reset(void);
+
+/* Short op name for a BFG_STAT_* category, e.g. "DELTA1". */
+const char *bfg_stats_op_name(int op);
+#endif /* BFG_STATS */
+
+#ifdef BFG_MEMSTATS
+/* Allocation accounting, compiled in with -DBFG_MEMSTATS. Process-wide and
+ * not thread-safe. Memory from BFG_MALLOC (including decoded pixels and
+ * encoded data) must be released with BFG_FREE or bfg_free_*. */
+typedef struct bfg_mem_stats {
+  uint64_t allocs; /* allocations since the last reset */
+  uint64_t bytes;  /* bytes allocated since the last reset */
+  uint64_t live;   /* bytes currently allocated */
+  uint64_t peak;   /* most bytes live at once since the last reset */
+} bfg_mem_stats_t;
+
+void *bfg_mem_alloc(size_t size);
+void bfg_mem_free(void *ptr);
+
+/* Copy out the counters. Resetting zeroes allocs and bytes and restarts
+ * peak from the bytes live now, so peak - live at reset is what a call
+ * needed on top of what it started with. */
+void bfg_mem_get(bfg_mem_stats_t *stats);
+void bfg_mem_reset(void);
+#endif /* BFG_MEMSTATS */
+
 /* Free raw pixels and/or encoded data. Either pointer may be NULL. */
 void bfg_free_raw(bfg_raw_t raw);
+void bfg_free_raw16(bfg_raw16_t raw);
 void bfg_free_img(bfg_img_t img);
 
 #endif /* BFG_H */
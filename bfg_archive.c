@@ -0,0 +1,306 @@
+#define _POSIX_C_SOURCE 200112L
+#include "bfg_archive.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct bfga {
+  const uint8_t *map;
+  size_t map_len;
+  uint32_t n;
+  const uint8_t *index; /* n entries of BFGA_ENTRY_SIZE */
+  const uint8_t *ids;   /* n entries of BFGA_ID_SIZE */
+  const char *names;
+};
+
+/* ---- helpers ---- */
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  put_u32(p, (uint32_t)v);
+  put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* Bytewise order, shorter first on a common prefix. */
+static int name_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+  int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (c) return c;
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+/* ---- writer ---- */
+
+static const bfga_item_t *sort_items;
+
+static int cmp_by_name(const void *a, const void *b) {
+  const bfga_item_t *x = &sort_items[*(const uint32_t *)a];
+  const bfga_item_t *y = &sort_items[*(const uint32_t *)b];
+  return name_cmp(x->name, strlen(x->name), y->name, strlen(y->name));
+}
+
+static int cmp_id(const void *a, const void *b) {
+  uint32_t x = get_u32((const uint8_t *)a), y = get_u32((const uint8_t *)b);
+  return (x > y) - (x < y);
+}
+
+static int write_zeros(FILE *fp, uint64_t n) {
+  static const uint8_t zeros[256];
+  while (n > 0) {
+    size_t k = n < sizeof(zeros) ? (size_t)n : sizeof(zeros);
+    if (fwrite(zeros, 1, k, fp) != k) return 1;
+    n -= k;
+  }
+  return 0;
+}
+
+int bfga_write(const char *fpath, const bfga_item_t *items, uint32_t n,
+               uint32_t align_log2) {
+  if (!fpath || (!items && n > 0)) return 1;
+  if (align_log2 == 0) align_log2 = BFGA_ALIGN_DEFAULT;
+  if (align_log2 > BFGA_ALIGN_MAX) return 1;
+  uint64_t align = (uint64_t)1 << align_log2;
+
+  int ret = 1;
+  FILE *fp = NULL;
+  uint32_t *order = BFG_MALLOC((size_t)n * sizeof(uint32_t) + 1);
+  uint8_t *index = BFG_MALLOC((size_t)n * BFGA_ENTRY_SIZE + 1);
+  uint8_t *ids = BFG_MALLOC((size_t)n * BFGA_ID_SIZE + 1);
+  if (!order || !index || !ids) goto done;
+
+  /* qsort has no context argument; the writer is not reentrant */
+  for (uint32_t i = 0; i < n; i++) order[i] = i;
+  sort_items = items;
+  qsort(order, n, sizeof(uint32_t), cmp_by_name);
+
+  uint64_t names_len = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    const bfga_item_t *it = &items[order[i]];
+    if (!it->name || (!it->data && it->data_len > 0)) goto done;
+    size_t len = strlen(it->name);
+    if (i > 0) {
+      const char *prev = items[order[i - 1]].name;
+      if (name_cmp(prev, strlen(prev), it->name, len) == 0) goto done;
+    }
+    names_len += len + 1;
+  }
+  if (names_len > UINT32_MAX) goto done;
+
+  uint64_t index_off = BFGA_HEADER_SIZE;
+  uint64_t ids_off = index_off + (uint64_t)n * BFGA_ENTRY_SIZE;
+  uint64_t names_off = ids_off + (uint64_t)n * BFGA_ID_SIZE;
+  uint64_t data_off = (names_off + names_len + align - 1) & ~(align - 1);
+
+  uint64_t file_size = names_off + names_len;
+  uint32_t name_off = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    const bfga_item_t *it = &items[order[i]];
+    uint8_t *e = &index[(size_t)i * BFGA_ENTRY_SIZE];
+    uint32_t len = (uint32_t)strlen(it->name);
+    memset(e, 0, BFGA_ENTRY_SIZE);
+    put_u64(&e[0], data_off);
+    put_u32(&e[8], it->data_len);
+    put_u32(&e[12], name_off);
+    put_u32(&e[16], len);
+    put_u32(&e[20], it->id);
+    bfg_header_pack(&it->header, &e[24]);
+    put_u32(&ids[(size_t)i * BFGA_ID_SIZE], it->id);
+    put_u32(&ids[(size_t)i * BFGA_ID_SIZE + 4], i);
+    name_off += len + 1;
+    file_size = data_off + it->data_len;
+    data_off = (data_off + it->data_len + align - 1) & ~(align - 1);
+  }
+  qsort(ids, n, BFGA_ID_SIZE, cmp_id);
+  for (uint32_t i = 1; i < n; i++)
+    if (get_u32(&ids[(size_t)i * BFGA_ID_SIZE]) ==
+        get_u32(&ids[(size_t)(i - 1) * BFGA_ID_SIZE]))
+      goto done;
+
+  uint8_t hdr[BFGA_HEADER_SIZE];
+  memset(hdr, 0, sizeof(hdr));
+  put_u32(&hdr[0], BFGA_MAGIC);
+  put_u32(&hdr[4], BFGA_VERSION);
+  put_u32(&hdr[8], n);
+  put_u32(&hdr[12], align_log2);
+  put_u64(&hdr[16], index_off);
+  put_u64(&hdr[24], ids_off);
+  put_u64(&hdr[32], names_off);
+  put_u64(&hdr[40], names_len);
+  put_u64(&hdr[48], file_size);
+
+  fp = fopen(fpath, "wb");
+  if (!fp) goto done;
+  if (fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) goto done;
+  if (fwrite(index, BFGA_ENTRY_SIZE, n, fp) != n) goto done;
+  if (fwrite(ids, BFGA_ID_SIZE, n, fp) != n) goto done;
+  for (uint32_t i = 0; i < n; i++) {
+    const char *name = items[order[i]].name;
+    size_t len = strlen(name) + 1;
+    if (fwrite(name, 1, len, fp) != len) goto done;
+  }
+
+  uint64_t pos = names_off + names_len;
+  for (uint32_t i = 0; i < n; i++) {
+    const bfga_item_t *it = &items[order[i]];
+    uint64_t off = get_u64(&index[(size_t)i * BFGA_ENTRY_SIZE]);
+    if (write_zeros(fp, off - pos)) goto done;
+    if (fwrite(it->data, 1, it->data_len, fp) != it->data_len) goto done;
+    pos = off + it->data_len;
+  }
+  ret = 0;
+
+done:
+  if (fp && fclose(fp)) ret = 1;
+  BFG_FREE(order);
+  BFG_FREE(index);
+  BFG_FREE(ids);
+  return ret;
+}
+
+/* ---- reader ---- */
+
+static int check(const struct bfga *ar, uint64_t names_len) {
+  for (uint32_t i = 0; i < ar->n; i++) {
+    const uint8_t *e = &ar->index[(size_t)i * BFGA_ENTRY_SIZE];
+    uint64_t off = get_u64(&e[0]);
+    uint32_t len = get_u32(&e[8]);
+    uint64_t name_off = get_u32(&e[12]);
+    uint64_t name_len = get_u32(&e[16]);
+    if (off > ar->map_len || len > ar->map_len - off) return 1;
+    if (name_off + name_len >= names_len || ar->names[name_off + name_len])
+      return 1;
+    if (get_u32(&e[24]) != BFG_MAGIC) return 1;
+
+    const uint8_t *id = &ar->ids[(size_t)i * BFGA_ID_SIZE];
+    if (get_u32(&id[4]) >= ar->n) return 1;
+    if (i > 0 && get_u32(&id[0]) <= get_u32(&id[-BFGA_ID_SIZE])) return 1;
+  }
+  return 0;
+}
+
+bfga_t bfga_open(const char *fpath) {
+  if (!fpath) return NULL;
+  int fd = open(fpath, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= BFGA_HEADER_SIZE)
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  /* the mapping keeps the file open */
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  struct bfga *ar = BFG_MALLOC(sizeof(struct bfga));
+  if (!ar) {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  ar->map = map;
+  ar->map_len = (size_t)st.st_size;
+
+  const uint8_t *hdr = ar->map;
+  uint64_t len = ar->map_len;
+  ar->n = get_u32(&hdr[8]);
+  uint64_t index_off = get_u64(&hdr[16]);
+  uint64_t ids_off = get_u64(&hdr[24]);
+  uint64_t names_off = get_u64(&hdr[32]);
+  uint64_t names_len = get_u64(&hdr[40]);
+  if (get_u32(&hdr[0]) != BFGA_MAGIC || get_u32(&hdr[4]) != BFGA_VERSION ||
+      get_u64(&hdr[48]) != len || index_off > len ||
+      (len - index_off) / BFGA_ENTRY_SIZE < ar->n || ids_off > len ||
+      (len - ids_off) / BFGA_ID_SIZE < ar->n || names_off > len ||
+      names_len > len - names_off) {
+    bfga_close(ar);
+    return NULL;
+  }
+  ar->index = ar->map + index_off;
+  ar->ids = ar->map + ids_off;
+  ar->names = (const char *)ar->map + names_off;
+  if (check(ar, names_len)) {
+    bfga_close(ar);
+    return NULL;
+  }
+
+  /* lookups jump around the index and payloads */
+  posix_madvise(map, ar->map_len, POSIX_MADV_RANDOM);
+  return ar;
+}
+
+void bfga_close(bfga_t ar) {
+  if (!ar) return;
+  munmap((void *)ar->map, ar->map_len);
+  BFG_FREE(ar);
+}
+
+uint32_t bfga_count(bfga_t ar) { return ar ? ar->n : 0; }
+
+int bfga_entry_at(bfga_t ar, uint32_t i, bfga_entry_t *entry) {
+  if (!ar || !entry || i >= ar->n) return 1;
+  const uint8_t *e = &ar->index[(size_t)i * BFGA_ENTRY_SIZE];
+  entry->data = ar->map + get_u64(&e[0]);
+  entry->data_len = get_u32(&e[8]);
+  entry->name = ar->names + get_u32(&e[12]);
+  entry->name_len = get_u32(&e[16]);
+  entry->id = get_u32(&e[20]);
+  bfg_header_unpack(&e[24], &entry->header);
+  return 0;
+}
+
+int bfga_find(bfga_t ar, const char *name, bfga_entry_t *entry) {
+  if (!ar || !name) return 1;
+  size_t len = strlen(name);
+  uint32_t lo = 0, hi = ar->n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const uint8_t *e = &ar->index[(size_t)mid * BFGA_ENTRY_SIZE];
+    int c = name_cmp(ar->names + get_u32(&e[12]), get_u32(&e[16]), name, len);
+    if (c == 0) return bfga_entry_at(ar, mid, entry);
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 1;
+}
+
+int bfga_find_id(bfga_t ar, uint32_t id, bfga_entry_t *entry) {
+  if (!ar) return 1;
+  uint32_t lo = 0, hi = ar->n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const uint8_t *p = &ar->ids[(size_t)mid * BFGA_ID_SIZE];
+    uint32_t v = get_u32(p);
+    if (v == id) return bfga_entry_at(ar, get_u32(&p[4]), entry);
+    if (v < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 1;
+}
+
+int bfga_decode(const bfga_entry_t *entry, const bfg_format_t *fmt,
+                uint8_t *pixels, size_t pixels_len) {
+  if (!entry) return 1;
+  return bfg_decode_into(&entry->header, entry->data, entry->data_len, fmt,
+                         pixels, pixels_len);
+}
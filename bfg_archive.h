@@ -0,0 +1,104 @@
+#ifndef BFG_ARCHIVE_H
+#define BFG_ARCHIVE_H
+
+#include "bfg.h"
+
+/* --------------------- */
+/* Multi-image archives  */
+/* --------------------- */
+
+/*
+A BFG archive packs many encoded images into one file so that a collection
+of millions of small images costs one open and one mmap instead of a few
+syscalls and an inode lookup per image. All integers are little-endian.
+
+  header (64 bytes)
+    0  u32 magic "BFGA"
+    4  u32 version (1)
+    8  u32 entry count n
+   12  u32 payload alignment as log2 (12 = 4096, the page size)
+   16  u64 offset of the name index
+   24  u64 offset of the id index
+   32  u64 offset of the name table
+   40  u64 size of the name table
+   48  u64 file size
+   56  8 reserved bytes (zero)
+
+  name index: n entries of 48 bytes, sorted by name (bytewise)
+    0  u64 payload offset
+    8  u32 payload size
+   12  u32 name offset in the name table
+   16  u32 name length (without the terminating NUL)
+   20  u32 id
+   24  16-byte BFG header (as in a .bfg file)
+   40  8 reserved bytes (zero)
+
+  id index: n entries of 8 bytes, sorted by id
+    0  u32 id
+    4  u32 position in the name index
+
+  name table: the names, each followed by a NUL
+
+  payloads: each starts at a multiple of the alignment
+
+Names and ids are both unique within an archive. Every offset and size is
+checked once when the archive is opened, so lookups need no bounds checks.
+*/
+
+#define BFGA_MAGIC (0x41474642u) /* little-endian for "BFGA" */
+#define BFGA_VERSION 1
+#define BFGA_HEADER_SIZE 64
+#define BFGA_ENTRY_SIZE 48
+#define BFGA_ID_SIZE 8
+#define BFGA_ALIGN_DEFAULT 12 /* 4096-byte payloads */
+#define BFGA_ALIGN_MAX 16
+
+typedef struct bfga *bfga_t;
+
+/* An image in an open archive. The name and data point into the mapping and
+ * stay valid until bfga_close. */
+typedef struct bfga_entry {
+  const char *name; /* NUL-terminated */
+  uint32_t name_len;
+  uint32_t id;
+  bfg_header_t header;
+  const uint8_t *data;
+  uint32_t data_len;
+} bfga_entry_t;
+
+/* An image to add to a new archive. */
+typedef struct bfga_item {
+  const char *name;
+  uint32_t id;
+  bfg_header_t header;
+  const uint8_t *data;
+  uint32_t data_len;
+} bfga_item_t;
+
+/* Writes the n items to a new archive at fpath, with payloads aligned to
+ * 1 << align_log2 bytes (0 for BFGA_ALIGN_DEFAULT). The items need not be
+ * sorted. Returns 0 on success, nonzero on failure or a duplicate name or
+ * id. */
+int bfga_write(const char *fpath, const bfga_item_t *items, uint32_t n,
+               uint32_t align_log2);
+
+/* Maps the archive at fpath read-only and checks its index. Returns NULL on
+ * failure. */
+bfga_t bfga_open(const char *fpath);
+void bfga_close(bfga_t ar);
+
+uint32_t bfga_count(bfga_t ar);
+
+/* Fills entry with the i-th image in name order. Returns 0 on success. */
+int bfga_entry_at(bfga_t ar, uint32_t i, bfga_entry_t *entry);
+
+/* Looks an image up by name or id with a binary search over the mapped
+ * index. Returns 0 if found, nonzero otherwise. */
+int bfga_find(bfga_t ar, const char *name, bfga_entry_t *entry);
+int bfga_find_id(bfga_t ar, uint32_t id, bfga_entry_t *entry);
+
+/* Decodes an entry straight from the mapping, see bfg_decode_into. */
+int bfga_decode(const bfga_entry_t *entry, const bfg_format_t *fmt,
+                uint8_t *pixels, size_t pixels_len);
+
+#endif /* BFG_ARCHIVE_H */
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bfg_io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define CHUNK 64 /* files a thread claims at a time */
+#define STREAM_START 65536 /* first buffer for a stream of unknown size */
+
+int bfg_probe_fd(int fd, bfg_header_t *header) {
+  if (fd < 0 || !header) return 1;
+  uint8_t buf[BFG_HEADER_SIZE];
+  ssize_t n;
+  do {
+    n = pread(fd, buf, BFG_HEADER_SIZE, 0);
+  } while (n < 0 && errno == EINTR);
+  return bfg_probe_buffer(buf, n < 0 ? 0 : (size_t)n, header);
+}
+
+int bfg_probe(const char *fpath, bfg_header_t *header) {
+  if (!fpath || !header) return 1;
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 1;
+  int err = bfg_probe_fd(fd, header);
+  close(fd);
+  return err;
+}
+
+struct batch {
+  const char *const *paths;
+  bfg_header_t *headers;
+  int *status;
+  uint32_t n;
+  uint32_t next; /* first file not yet claimed */
+  uint32_t failed;
+  pthread_mutex_t lock;
+};
+
+static void *probe_worker(void *arg) {
+  struct batch *b = arg;
+  uint32_t failed = 0;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    uint32_t start = b->next;
+    b->next = b->n - start > CHUNK ? start + CHUNK : b->n;
+    uint32_t end = b->next;
+    pthread_mutex_unlock(&b->lock);
+    if (start == end) break;
+    for (uint32_t i = start; i < end; i++) {
+      int err = bfg_probe(b->paths[i], &b->headers[i]);
+      if (b->status) b->status[i] = err;
+      failed += err != 0;
+    }
+  }
+  pthread_mutex_lock(&b->lock);
+  b->failed += failed;
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+uint32_t bfg_probe_batch(const char *const *paths, uint32_t n,
+                         bfg_header_t *headers, int *status,
+                         uint32_t threads) {
+  if (!paths || !headers) return n;
+  struct batch b = {paths, headers, status, n, 0, 0,
+                    PTHREAD_MUTEX_INITIALIZER};
+  /* no more threads than chunks of work */
+  uint32_t chunks = (n + CHUNK - 1) / CHUNK;
+  if (threads > chunks) threads = chunks;
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+  pthread_t tids[MAX_THREADS];
+  uint32_t started = 0;
+  for (; started + 1 < threads; started++)
+    if (pthread_create(&tids[started], NULL, probe_worker, &b)) break;
+  /* the calling thread helps, or does it all */
+  probe_worker(&b);
+  for (uint32_t t = 0; t < started; t++) pthread_join(tids[t], NULL);
+  return b.failed;
+}
+
+/* ---- descriptors ---- */
+
+int bfg_write_fd(int fd, const bfg_header_t *header, const uint8_t *data,
+                 uint32_t data_len) {
+  if (fd < 0 || !header || (!data && data_len)) return 1;
+  uint8_t hdr[BFG_HEADER_SIZE];
+  bfg_header_pack(header, hdr);
+  struct iovec iov[2] = {{hdr, BFG_HEADER_SIZE}, {(void *)data, data_len}};
+  struct iovec *v = iov;
+  int n = data_len ? 2 : 1;
+  while (n) {
+    ssize_t done = writev(fd, v, n);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) return 1;
+    /* a pipe or socket may take part of it: carry on from there */
+    for (; n && (size_t)done >= v->iov_len; v++, n--) done -= v->iov_len;
+    if (n) {
+      v->iov_base = (uint8_t *)v->iov_base + done;
+      v->iov_len -= (size_t)done;
+    }
+  }
+  return 0;
+}
+
+/* Reads up to len bytes, stopping early only at end of file. Returns the
+ * bytes read, or -1 on error. */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) break;
+    got += (size_t)n;
+  }
+  return (ssize_t)got;
+}
+
+uint8_t *bfg_read_fd(int fd, bfg_header_t *header, uint32_t *out_len) {
+  if (fd < 0 || !header || !out_len) return NULL;
+  uint8_t hdr[BFG_HEADER_SIZE];
+  if (read_full(fd, hdr, BFG_HEADER_SIZE) != BFG_HEADER_SIZE ||
+      bfg_probe_buffer(hdr, BFG_HEADER_SIZE, header)) {
+    return NULL;
+  }
+
+  uint64_t max = bfg_max_size(header);
+  if (max > UINT32_MAX) max = UINT32_MAX;
+
+  /* a file knows its size; a stream is read as it comes */
+  struct stat st;
+  off_t pos;
+  size_t cap = STREAM_START;
+  int sized = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+              (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size >= pos;
+  if (sized) cap = (size_t)(st.st_size - pos);
+  if (cap > max) {
+    if (sized) return NULL;
+    cap = (size_t)max;
+  }
+
+  uint8_t *data = (uint8_t *)BFG_MALLOC(cap ? cap : 1);
+  size_t len = 0;
+  while (data) {
+    ssize_t n = read_full(fd, data + len, cap - len);
+    if (n < 0) break;
+    len += (size_t)n;
+    if (len < cap || sized) {
+      *out_len = (uint32_t)len;
+      return data;
+    }
+    /* filled up: grow, unless the header rules out more data */
+    uint8_t probe;
+    if (cap == max) {
+      if (read_full(fd, &probe, 1) == 0) {
+        *out_len = (uint32_t)len;
+        return data;
+      }
+      break;
+    }
+    size_t grown_cap = cap * 2 > max ? (size_t)max : cap * 2;
+    uint8_t *grown = (uint8_t *)BFG_MALLOC(grown_cap);
+    if (grown) memcpy(grown, data, len);
+    BFG_FREE(data);
+    data = grown;
+    cap = grown_cap;
+  }
+  BFG_FREE(data);
+  return NULL;
+}
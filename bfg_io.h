@@ -0,0 +1,50 @@
+#ifndef BFG_IO_H
+#define BFG_IO_H
+
+#include "bfg.h"
+
+/* ------------------------------ */
+/* Probing and descriptor I/O     */
+/* ------------------------------ */
+
+/*
+Everything needed to describe a .bfg file (size, channels, flags) is in its
+first BFG_HEADER_SIZE bytes. These calls read just that with one pread and
+validate it as bfg_probe_buffer does, so scanning a collection for metadata
+costs one small read per file instead of loading every payload as bfg_read
+would.
+
+The descriptor calls read and write whole file images on any fd (files,
+memfds, pipes, sockets) without stdio buffers or temporary files. For
+memory buffers see bfg_serialize and bfg_deserialize in bfg.h.
+*/
+
+/* Probes the file at fpath. Returns 0 if it starts with a valid header. */
+int bfg_probe(const char *fpath, bfg_header_t *header);
+
+/* Probes an open file from offset 0, leaving its position alone. Returns 0
+ * if it starts with a valid header. */
+int bfg_probe_fd(int fd, bfg_header_t *header);
+
+/* Probes n files on up to threads threads (0 or 1 probes on the calling
+ * thread). For each file, headers[i] is filled and status[i] is 0 if it
+ * probed, nonzero otherwise; status may be NULL. Returns the number of
+ * files that failed. */
+uint32_t bfg_probe_batch(const char *const *paths, uint32_t n,
+                         bfg_header_t *headers, int *status,
+                         uint32_t threads);
+
+/* Writes a file image (header + data) to fd from its current position,
+ * with one writev for both unless the descriptor takes less at a time
+ * (pipes, sockets). Returns 0 on success. */
+int bfg_write_fd(int fd, const bfg_header_t *header, const uint8_t *data,
+                 uint32_t data_len);
+
+/* Reads a file image from fd's current position to end of file. A regular
+ * file or memfd is read in one go into a buffer of its remaining size;
+ * a pipe or socket is read as it arrives into a buffer that grows up to the
+ * largest stream the header allows (bfg_max_size). Returns the data (release
+ * with bfg_free_img) with header and out_len filled, or NULL on failure. */
+uint8_t *bfg_read_fd(int fd, bfg_header_t *header, uint32_t *out_len);
+
+#endif /* BFG_IO_H */
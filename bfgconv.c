@@ -0,0 +1,614 @@
+#define _GNU_SOURCE /* syscall */
+#include "convert.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef BFG_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* Bulk PNG <-> BFG converter. Files flow through three stages joined by
+ * bounded queues: a reader that loads whole files, a pool of codec threads,
+ * and a writer. Reads and writes are issued a batch at a time, so with the
+ * io_uring backend (make URING=1, then -u) a batch is one system call and
+ * the storage latency of a batch overlaps; either way coding overlaps with
+ * I/O. The direction follows the input extension: .png becomes .bfg and
+ * .bfg becomes .png. */
+
+#define MAX_THREADS 64
+#define PATH_LEN 4096
+#define MAX_BATCH 64
+
+struct file {
+  char *in_path;
+  char out_path[PATH_LEN];
+  int to_bfg;
+  uint8_t *in; /* whole input file */
+  size_t in_len;
+  uint8_t *out; /* whole output file */
+  size_t out_len;
+  int failed;
+};
+
+/* ---- bounded queue ---- */
+
+struct queue {
+  struct file **items;
+  uint32_t cap, head, n;
+  uint32_t producers; /* closed once all have finished */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+};
+
+static int queue_init(struct queue *q, uint32_t cap, uint32_t producers) {
+  q->items = malloc(cap * sizeof(struct file *));
+  q->cap = cap;
+  q->head = q->n = 0;
+  q->producers = producers;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  return q->items == NULL;
+}
+
+static void queue_push(struct queue *q, struct file *f) {
+  pthread_mutex_lock(&q->lock);
+  while (q->n == q->cap) pthread_cond_wait(&q->not_full, &q->lock);
+  q->items[(q->head + q->n++) % q->cap] = f;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* One producer is done; the last one wakes every consumer. */
+static void queue_done(struct queue *q) {
+  pthread_mutex_lock(&q->lock);
+  if (--q->producers == 0) pthread_cond_broadcast(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Waits for at least one item and takes up to max. Returns 0 once the queue
+ * is empty and every producer is done. */
+static uint32_t queue_pop(struct queue *q, struct file **out, uint32_t max) {
+  pthread_mutex_lock(&q->lock);
+  while (q->n == 0 && q->producers)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  uint32_t n = q->n < max ? q->n : max;
+  for (uint32_t i = 0; i < n; i++) {
+    out[i] = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+  }
+  q->n -= n;
+  pthread_cond_broadcast(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+/* ---- I/O backends ---- */
+
+/* An I/O in a batch: len bytes at buf to or from fd, from offset 0. */
+struct io {
+  int fd;
+  uint8_t *buf;
+  size_t len;
+  int failed;
+};
+
+/* Completes a read or write that came back short, or does all of it. */
+static int io_finish(struct io *io, size_t done, int write) {
+  while (done < io->len) {
+    ssize_t n = write ? pwrite(io->fd, io->buf + done, io->len - done, done)
+                      : pread(io->fd, io->buf + done, io->len - done, done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 1;
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+#ifdef BFG_URING
+/* A minimal io_uring on the raw system calls, so there is no liburing
+ * dependency. One ring per stage thread, never shared. */
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_size, cq_size, sqes_size;
+};
+
+static int uring_init(struct uring *r, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+  r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) return 1;
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+    r->cq_size = r->sq_size;
+  }
+  r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq_ring = r->sq_ring;
+  if (r->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  }
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+      r->sqes == MAP_FAILED) {
+    close(r->fd);
+    return 1;
+  }
+
+  uint8_t *sq = r->sq_ring, *cq = r->cq_ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_free(struct uring *r) {
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+  munmap(r->sq_ring, r->sq_size);
+  close(r->fd);
+}
+
+/* Submits the n I/Os with one system call, waits for all of them and
+ * finishes short ones synchronously. Returns 0 when every I/O is done, 1
+ * if the ring failed before taking any (nothing was submitted), or 2 if
+ * waiting for the ones in flight failed: those are then marked failed and
+ * the ring can no longer be trusted. */
+static int uring_batch(struct uring *r, struct io *ios, uint32_t n,
+                       int write) {
+  unsigned tail = *r->sq_tail;
+  for (uint32_t i = 0; i < n; i++, tail++) {
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = ios[i].fd;
+    sqe->addr = (uint64_t)(uintptr_t)ios[i].buf;
+    sqe->len = (uint32_t)ios[i].len;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    ios[i].failed = 1; /* until its completion says otherwise */
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  /* the kernel takes entries in order, so ios[submitted..n) are ours */
+  uint32_t submitted = 0, reaped = 0;
+  int refused = 0, lost = 0;
+  while (reaped < (refused ? submitted : n)) {
+    uint32_t to_submit = refused ? 0 : n - submitted;
+    long ret = syscall(__NR_io_uring_enter, r->fd, to_submit,
+                       submitted + to_submit - reaped,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      /* retrying cannot help: stop submitting, take back the entries the
+       * kernel did not take, and only wait for the rest */
+      if (refused) {
+        lost = 1;
+        break;
+      }
+      __atomic_store_n(r->sq_tail, tail - (n - submitted), __ATOMIC_RELEASE);
+      if (submitted == 0) return 1;
+      refused = 1;
+      continue;
+    }
+    if (ret > 0) submitted += (uint32_t)ret;
+    unsigned head = *r->cq_head;
+    unsigned cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++, reaped++) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      struct io *io = &ios[cqe->user_data];
+      io->failed = cqe->res < 0 || io_finish(io, (size_t)cqe->res, write);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  for (uint32_t i = submitted; i < n; i++) {
+    ios[i].failed = io_finish(&ios[i], 0, write);
+  }
+  return lost ? 2 : 0;
+}
+#endif
+
+/* Per-thread I/O: the ring when the io_uring backend is on and works. */
+struct io_ctx {
+  int uring;
+#ifdef BFG_URING
+  struct uring ring;
+#endif
+};
+
+static void io_init(struct io_ctx *ctx, int want_uring) {
+  ctx->uring = 0;
+#ifdef BFG_URING
+  if (want_uring) ctx->uring = uring_init(&ctx->ring, MAX_BATCH) == 0;
+#else
+  (void)want_uring;
+#endif
+}
+
+static void io_free(struct io_ctx *ctx) {
+#ifdef BFG_URING
+  if (ctx->uring) uring_free(&ctx->ring);
+#else
+  (void)ctx;
+#endif
+}
+
+static void io_batch(struct io_ctx *ctx, struct io *ios, uint32_t n,
+                     int write) {
+#ifdef BFG_URING
+  int err = ctx->uring ? uring_batch(&ctx->ring, ios, n, write) : 1;
+  if (err == 2) {
+    /* completions may still arrive: the ring is done for */
+    uring_free(&ctx->ring);
+    ctx->uring = 0;
+  }
+  if (err != 1) return;
+#else
+  (void)ctx;
+#endif
+  for (uint32_t i = 0; i < n; i++) ios[i].failed = io_finish(&ios[i], 0, write);
+}
+
+/* ---- stages ---- */
+
+struct conv {
+  struct file *files;
+  uint32_t n;
+  uint32_t batch;
+  int uring;
+  bfg_opts_t opts;
+  struct queue coded, written; /* reader -> codec -> writer */
+};
+
+static void *reader(void *arg) {
+  struct conv *cv = arg;
+  struct io_ctx ctx;
+  io_init(&ctx, cv->uring);
+  struct io ios[MAX_BATCH];
+  struct file *batch[MAX_BATCH];
+  for (uint32_t next = 0; next < cv->n;) {
+    uint32_t n = 0;
+    for (; n < cv->batch && next < cv->n; next++) {
+      struct file *f = &cv->files[next];
+      struct stat st;
+      int fd = open(f->in_path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0 &&
+          (f->in = malloc((size_t)st.st_size))) {
+        f->in_len = (size_t)st.st_size;
+        ios[n] = (struct io){fd, f->in, f->in_len, 0};
+        batch[n++] = f;
+        continue;
+      }
+      if (fd >= 0) close(fd);
+      f->failed = 1;
+      queue_push(&cv->coded, f); /* still counted by the writer */
+    }
+    io_batch(&ctx, ios, n, 0);
+    for (uint32_t i = 0; i < n; i++) {
+      close(ios[i].fd);
+      batch[i]->failed = ios[i].failed;
+      queue_push(&cv->coded, batch[i]);
+    }
+  }
+  io_free(&ctx);
+  queue_done(&cv->coded);
+  return NULL;
+}
+
+static int convert(struct file *f, const bfg_opts_t *opts) {
+  struct bfg_raw raw;
+  if (f->to_bfg) {
+    if (libpng_decode_mem(f->in, f->in_len, &raw)) return 1;
+    bfg_header_t header;
+    uint32_t len;
+    bfg_img_t img = bfg_encode_opts(&raw, opts, &header, &len);
+    bfg_free_raw(&raw);
+    if (!img) return 1;
+    f->out_len = BFG_HEADER_SIZE + (size_t)len;
+    f->out = malloc(f->out_len);
+    if (f->out) {
+      bfg_header_pack(&header, f->out);
+      memcpy(f->out + BFG_HEADER_SIZE, img, len);
+    }
+    bfg_free_img(img);
+    return f->out == NULL;
+  }
+
+  bfg_header_t header;
+  if (f->in_len < BFG_HEADER_SIZE || bfg_header_unpack(f->in, &header))
+    return 1;
+  raw.width = header.width;
+  raw.height = header.height;
+  raw.n_channels = header.channels;
+  size_t len = (size_t)raw.width * raw.height * raw.n_channels;
+  bfg_format_t fmt = {raw.n_channels == 4 ? BFG_FMT_RGBA : BFG_FMT_RGB, 0};
+  raw.pixels = BFG_MALLOC(len + 1);
+  int err = !raw.pixels ||
+            bfg_decode_into(&header, f->in + BFG_HEADER_SIZE,
+                            (uint32_t)(f->in_len - BFG_HEADER_SIZE), &fmt,
+                            raw.pixels, len) ||
+            libpng_encode_mem(&raw, &f->out, &f->out_len);
+  bfg_free_raw(&raw);
+  return err;
+}
+
+static void *codec(void *arg) {
+  struct conv *cv = arg;
+  struct file *f;
+  while (queue_pop(&cv->coded, &f, 1)) {
+    if (!f->failed) f->failed = convert(f, &cv->opts);
+    free(f->in);
+    f->in = NULL;
+    queue_push(&cv->written, f);
+  }
+  queue_done(&cv->written);
+  return NULL;
+}
+
+/* Writes whatever is ready, up to a batch at a time. */
+static void *writer(void *arg) {
+  struct conv *cv = arg;
+  struct io_ctx ctx;
+  io_init(&ctx, cv->uring);
+  struct io ios[MAX_BATCH];
+  struct file *batch[MAX_BATCH];
+  uint32_t got;
+  while ((got = queue_pop(&cv->written, batch, cv->batch))) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < got; i++) {
+      struct file *f = batch[i];
+      int fd = -1;
+      if (!f->failed)
+        fd = open(f->out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd < 0) {
+        f->failed = 1;
+        free(f->out);
+        f->out = NULL;
+        continue;
+      }
+      ios[n] = (struct io){fd, f->out, f->out_len, 0};
+      batch[n++] = f;
+    }
+    io_batch(&ctx, ios, n, 1);
+    for (uint32_t i = 0; i < n; i++) {
+      batch[i]->failed = close(ios[i].fd) || ios[i].failed;
+      free(batch[i]->out);
+      batch[i]->out = NULL;
+    }
+  }
+  io_free(&ctx);
+  return NULL;
+}
+
+/* ---- driver ---- */
+
+static const char *ext_of(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  return dot && (!slash || dot > slash) ? dot : "";
+}
+
+static int is_input(const char *path) {
+  return strcmp(ext_of(path), ".png") == 0 || strcmp(ext_of(path), ".bfg") == 0;
+}
+
+struct list {
+  struct file *files;
+  uint32_t n, cap;
+};
+
+static int add_file(struct list *l, const char *path, const char *out_dir) {
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  size_t stem = strlen(base) - strlen(ext_of(base));
+  if (strlen(out_dir) + stem + 6 > PATH_LEN) return 1;
+  if (l->n == l->cap) {
+    uint32_t cap = l->cap ? l->cap * 2 : 256;
+    struct file *grown = realloc(l->files, cap * sizeof(struct file));
+    if (!grown) return 1;
+    l->files = grown;
+    l->cap = cap;
+  }
+  struct file *f = &l->files[l->n];
+  memset(f, 0, sizeof(*f));
+  f->in_path = strdup(path);
+  if (!f->in_path) return 1;
+  f->to_bfg = strcmp(ext_of(path), ".png") == 0;
+  sprintf(f->out_path, "%s/%.*s%s", out_dir, (int)stem, base,
+          f->to_bfg ? ".bfg" : ".png");
+  l->n++;
+  return 0;
+}
+
+/* Adds a file, or every PNG and BFG file directly in a directory. */
+static int add_path(struct list *l, const char *path, const char *out_dir) {
+  struct stat st;
+  if (stat(path, &st)) {
+    fprintf(stderr, "Could not stat %s\n", path);
+    return 1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (!is_input(path)) {
+      fprintf(stderr, "%s: not a .png or .bfg file\n", path);
+      return 1;
+    }
+    return add_file(l, path, out_dir);
+  }
+  DIR *d = opendir(path);
+  if (!d) return 1;
+  char full[PATH_LEN];
+  struct dirent *de;
+  int err = 0;
+  while (!err && (de = readdir(d))) {
+    if (!is_input(de->d_name)) continue;
+    if (snprintf(full, sizeof(full), "%s/%s", path, de->d_name) >= PATH_LEN)
+      continue;
+    err = add_file(l, full, out_dir);
+  }
+  closedir(d);
+  return err;
+}
+
+/* Adds the paths listed one per line in list_path ("-" for stdin). */
+static int add_list(struct list *l, const char *list_path,
+                    const char *out_dir) {
+  FILE *fp = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s\n", list_path);
+    return 1;
+  }
+  char line[PATH_LEN];
+  int err = 0;
+  while (!err && fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0]) err = add_path(l, line, out_dir);
+  }
+  if (fp != stdin) fclose(fp);
+  return err;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] -o <out dir> <file or dir>...\n", prog);
+  fprintf(stderr, "  -o DIR  output directory (must exist)\n");
+  fprintf(stderr, "  -f FILE also convert the paths listed in FILE (- for "
+                  "stdin)\n");
+  fprintf(stderr, "  -j N    codec threads (default 4)\n");
+  fprintf(stderr, "  -q N    files per read or write batch (default 16)\n");
+  fprintf(stderr, "  -u      io_uring for reads and writes");
+#ifndef BFG_URING
+  fprintf(stderr, " (build with URING=1)");
+#endif
+  fprintf(stderr, "\n  -y      encode with the YCoCg-R color transform\n");
+}
+
+int main(int argc, char **argv) {
+  struct conv cv;
+  memset(&cv, 0, sizeof(cv));
+  cv.batch = 16;
+  int threads = 4;
+  const char *out_dir = NULL, *list_path = NULL;
+  struct list l = {NULL, 0, 0};
+  int argi = 1, err = 0;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    const char *arg = argv[argi];
+    int has_val = argi + 1 < argc;
+    if (strcmp(arg, "-o") == 0 && has_val) {
+      out_dir = argv[++argi];
+    } else if (strcmp(arg, "-f") == 0 && has_val) {
+      list_path = argv[++argi];
+    } else if (strcmp(arg, "-j") == 0 && has_val) {
+      threads = atoi(argv[++argi]);
+      if (threads < 1) threads = 1;
+      if (threads > MAX_THREADS) threads = MAX_THREADS;
+    } else if (strcmp(arg, "-q") == 0 && has_val) {
+      int q = atoi(argv[++argi]);
+      cv.batch = q < 1 ? 1 : q > MAX_BATCH ? MAX_BATCH : (uint32_t)q;
+    } else if (strcmp(arg, "-u") == 0) {
+      cv.uring = 1;
+    } else if (strcmp(arg, "-y") == 0) {
+      cv.opts.transform = BFG_TRANSFORM_YCOCG;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!out_dir) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (list_path) err |= add_list(&l, list_path, out_dir);
+  for (; argi < argc; argi++) err |= add_path(&l, argv[argi], out_dir);
+  if (err || l.n == 0) {
+    if (!err) fprintf(stderr, "Nothing to convert\n");
+    return 1;
+  }
+#ifndef BFG_URING
+  if (cv.uring) fprintf(stderr, "io_uring not built in, using pread/pwrite\n");
+#endif
+
+  cv.files = l.files;
+  cv.n = l.n;
+  /* room for a batch in flight on each side of every codec thread */
+  uint32_t depth = cv.batch * 2 + (uint32_t)threads;
+  if (queue_init(&cv.coded, depth, 1) ||
+      queue_init(&cv.written, depth, (uint32_t)threads)) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  double t0 = now_s();
+  pthread_t read_tid, write_tid, codec_tids[MAX_THREADS];
+  if (pthread_create(&read_tid, NULL, reader, &cv) ||
+      pthread_create(&write_tid, NULL, writer, &cv)) {
+    fprintf(stderr, "Could not start threads\n");
+    return 1;
+  }
+  int started = 0;
+  for (; started < threads; started++)
+    if (pthread_create(&codec_tids[started], NULL, codec, &cv)) break;
+  /* the writer waits on one producer per thread asked for; with none
+   * started at all, code on this one */
+  for (int t = started ? started : 1; t < threads; t++)
+    queue_done(&cv.written);
+  if (started == 0) codec(&cv);
+  pthread_join(read_tid, NULL);
+  for (int t = 0; t < started; t++) pthread_join(codec_tids[t], NULL);
+  pthread_join(write_tid, NULL);
+  double elapsed = now_s() - t0;
+
+  uint32_t failed = 0;
+  uint64_t in_bytes = 0, out_bytes = 0;
+  for (uint32_t i = 0; i < l.n; i++) {
+    struct file *f = &l.files[i];
+    if (f->failed) {
+      fprintf(stderr, "Could not convert %s\n", f->in_path);
+      failed++;
+    } else {
+      in_bytes += f->in_len;
+      out_bytes += f->out_len;
+    }
+    free(f->in_path);
+  }
+  uint32_t done = l.n - failed;
+  printf("%u files in %.3f s: %.1f files/s, %.1f MB/s read, %.1f MB/s "
+         "written\n",
+         done, elapsed, done / elapsed, in_bytes / elapsed / 1e6,
+         out_bytes / elapsed / 1e6);
+  if (failed) printf("%u files failed\n", failed);
+
+  free(l.files);
+  free(cv.coded.items);
+  free(cv.written.items);
+  return failed != 0;
+}
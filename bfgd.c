@@ -0,0 +1,295 @@
+#define _GNU_SOURCE /* memfd_create */
+#include "bfgd.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Conversion daemon: one reader thread per connection queues requests,
+ * and a fixed pool of workers takes them off the queue in batches. */
+
+#define MAX_WORKERS 64
+#define QUEUE_LEN 1024
+#define BATCH 8 /* requests a worker takes per wakeup */
+
+struct conn {
+  int sock;
+  int refs; /* the reader, plus one per queued or running request */
+  pthread_mutex_t lock; /* refs, and one reply at a time on sock */
+};
+
+struct job {
+  struct conn *conn;
+  bfgd_msg_t msg;
+  int fd;
+};
+
+static struct {
+  struct job jobs[QUEUE_LEN];
+  uint32_t head, n;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .not_empty = PTHREAD_COND_INITIALIZER,
+           .not_full = PTHREAD_COND_INITIALIZER};
+
+static const char *sock_path;
+static uint32_t n_workers = 4;
+
+static void conn_put(struct conn *c) {
+  pthread_mutex_lock(&c->lock);
+  int last = --c->refs == 0;
+  pthread_mutex_unlock(&c->lock);
+  if (!last) return;
+  close(c->sock);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+static void push(const struct job *job) {
+  pthread_mutex_lock(&queue.lock);
+  while (queue.n == QUEUE_LEN) pthread_cond_wait(&queue.not_full, &queue.lock);
+  queue.jobs[(queue.head + queue.n++) % QUEUE_LEN] = *job;
+  pthread_cond_signal(&queue.not_empty);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+/* Takes up to max queued jobs, waiting for at least one. A batch is at most
+ * a fair share of the queue, so a short queue still spreads over the
+ * workers instead of waiting behind one of them. */
+static uint32_t pop(struct job *jobs, uint32_t max) {
+  pthread_mutex_lock(&queue.lock);
+  while (queue.n == 0) pthread_cond_wait(&queue.not_empty, &queue.lock);
+  uint32_t n = (queue.n + n_workers - 1) / n_workers;
+  if (n > max) n = max;
+  for (uint32_t i = 0; i < n; i++) {
+    jobs[i] = queue.jobs[queue.head];
+    queue.head = (queue.head + 1) % QUEUE_LEN;
+  }
+  queue.n -= n;
+  if (queue.n) pthread_cond_signal(&queue.not_empty);
+  pthread_cond_broadcast(&queue.not_full);
+  pthread_mutex_unlock(&queue.lock);
+  return n;
+}
+
+/* Maps len bytes of a request memfd. Private and writable, though the
+ * codec only reads it. */
+static uint8_t *map_request(int fd, size_t len) {
+  struct stat st;
+  if (fd < 0 || len == 0 || fstat(fd, &st) || (size_t)st.st_size < len) {
+    return NULL;
+  }
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/* Runs one request; on success *out_fd is the reply memfd and msg the
+ * reply. Returns 0 on success. */
+static int run(bfgd_msg_t *msg, int fd, int *out_fd) {
+  *out_fd = -1;
+  size_t in_len = msg->len;
+  uint8_t *in = map_request(fd, in_len);
+  if (!in) return 1;
+
+  int err = 1;
+  if (msg->op == BFGD_OP_ENCODE) {
+    struct bfg_raw raw = {msg->width, msg->height, msg->channels, in};
+    uint32_t len = 0;
+    bfg_img_t img = NULL;
+    if ((uint64_t)raw.width * raw.height * raw.n_channels == in_len) {
+      img = bfg_encode_opts(&raw, &msg->opts, &msg->header, &len);
+    }
+    if (img) {
+      *out_fd = memfd_create("bfgd", MFD_CLOEXEC);
+      err = *out_fd < 0 || pwrite(*out_fd, img, len, 0) != (ssize_t)len;
+      msg->len = len;
+      bfg_free_img(img);
+    }
+  } else if (msg->op == BFGD_OP_DECODE) {
+    const bfg_header_t *h = &msg->header;
+    uint64_t len = (uint64_t)h->width * h->height * h->channels;
+    bfg_format_t fmt = {h->channels == 4 ? BFG_FMT_RGBA : BFG_FMT_RGB, 0};
+    if (len > 0 && len <= (uint64_t)BFG_MAX_PIXELS * 4) {
+      *out_fd = memfd_create("bfgd", MFD_CLOEXEC);
+    }
+    void *map = MAP_FAILED;
+    if (*out_fd >= 0 && ftruncate(*out_fd, (off_t)len) == 0) {
+      map = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 *out_fd, 0);
+    }
+    if (map != MAP_FAILED) {
+      /* straight into the client's pages */
+      err = bfg_decode_into(h, in, (uint32_t)in_len, &fmt, map, (size_t)len);
+      munmap(map, (size_t)len);
+      msg->len = (uint32_t)len;
+    }
+  }
+
+  munmap(in, in_len);
+  if (err && *out_fd >= 0) {
+    close(*out_fd);
+    *out_fd = -1;
+  }
+  return err;
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  struct job jobs[BATCH];
+  for (;;) {
+    uint32_t n = pop(jobs, BATCH);
+    for (uint32_t i = 0; i < n; i++) {
+      struct job *job = &jobs[i];
+      int out_fd;
+      job->msg.status = run(&job->msg, job->fd, &out_fd);
+      close(job->fd);
+
+      pthread_mutex_lock(&job->conn->lock);
+      bfgd_send(job->conn->sock, &job->msg, out_fd);
+      pthread_mutex_unlock(&job->conn->lock);
+      if (out_fd >= 0) close(out_fd);
+      conn_put(job->conn);
+    }
+  }
+  return NULL;
+}
+
+/* Reads the requests of one connection onto the queue until it closes. */
+static void *reader(void *arg) {
+  struct conn *c = arg;
+  struct job job;
+  job.conn = c;
+  while (bfgd_recv(c->sock, &job.msg, &job.fd) == 0) {
+    if (job.fd < 0) {
+      /* nothing to work on: answer right away */
+      job.msg.status = 1;
+      pthread_mutex_lock(&c->lock);
+      bfgd_send(c->sock, &job.msg, -1);
+      pthread_mutex_unlock(&c->lock);
+      continue;
+    }
+    pthread_mutex_lock(&c->lock);
+    c->refs++;
+    pthread_mutex_unlock(&c->lock);
+    push(&job);
+  }
+  conn_put(c);
+  return NULL;
+}
+
+/* Removes a socket at addr left by a daemon that is gone. Returns nonzero
+ * if a daemon still answers there or something else is in the way. */
+static int clear_stale(const struct sockaddr_un *addr) {
+  struct stat st;
+  if (lstat(addr->sun_path, &st)) return errno != ENOENT;
+  if (!S_ISSOCK(st.st_mode)) return 1;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) return 1;
+  int live = connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+  close(sock);
+  return live || unlink(addr->sun_path) != 0;
+}
+
+static void on_signal(int sig) {
+  (void)sig;
+  unlink(sock_path);
+  _exit(0);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options]\n", prog);
+  fprintf(stderr, "  -s PATH  socket path (default $XDG_RUNTIME_DIR/%s)\n",
+          BFGD_SOCKET);
+  fprintf(stderr, "  -j N     worker threads (default 4)\n");
+}
+
+int main(int argc, char **argv) {
+  for (int argi = 1; argi < argc; argi++) {
+    if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc) {
+      sock_path = argv[++argi];
+    } else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+      int n = atoi(argv[++argi]);
+      n_workers = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : (uint32_t)n;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  static char default_path[BFGD_PATH_LEN];
+  if (!sock_path) {
+    if (bfgd_default_path(default_path)) {
+      fprintf(stderr, "XDG_RUNTIME_DIR is not set: give a socket path with "
+                      "-s\n");
+      return 1;
+    }
+    sock_path = default_path;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", sock_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  if (clear_stale(&addr)) {
+    fprintf(stderr, "%s is in use, or not a socket\n", sock_path);
+    return 1;
+  }
+  /* only our user may connect: the socket is created 0600 */
+  int lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(0177);
+  int err = lsock < 0 || bind(lsock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (err || listen(lsock, 64)) {
+    perror(sock_path);
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_t tid;
+  for (uint32_t i = 0; i < n_workers; i++) {
+    if (pthread_create(&tid, NULL, worker, NULL)) {
+      fprintf(stderr, "Could not start worker %u\n", i);
+      return 1;
+    }
+    pthread_detach(tid);
+  }
+  printf("bfgd: %u workers on %s\n", n_workers, sock_path);
+  fflush(stdout);
+
+  for (;;) {
+    int sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) continue;
+    if (!bfgd_same_user(sock)) {
+      close(sock);
+      continue;
+    }
+    struct conn *c = malloc(sizeof(struct conn));
+    if (!c) {
+      close(sock);
+      continue;
+    }
+    c->sock = sock;
+    c->refs = 1;
+    pthread_mutex_init(&c->lock, NULL);
+    if (pthread_create(&tid, NULL, reader, c)) {
+      conn_put(c);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+}
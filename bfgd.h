@@ -0,0 +1,97 @@
+#ifndef BFG_BFGD_H
+#define BFG_BFGD_H
+
+#include "bfg.h"
+
+/* ----------------------------- */
+/* Conversion daemon and clients */
+/* ----------------------------- */
+
+/*
+bfgd listens on a Unix domain socket (SOCK_SEQPACKET) and encodes or
+decodes on a pool of worker threads. Pixels and encoded data never go
+through the socket: every request and every reply carries one bfgd_msg_t
+plus a memfd, passed with SCM_RIGHTS, holding the payload. The daemon
+maps the request memfd, decodes straight into the reply memfd, and the
+client maps the reply. Both ends run on the same machine, so messages are
+plain structs.
+
+Requests on one connection are answered in any order; the tag is echoed
+back to match them up. The client calls below keep one request in flight
+per connection, so concurrent callers use a connection each.
+
+The payloads are the callers' pixels, so both ends must belong to the same
+user. The socket lives in $XDG_RUNTIME_DIR by default, is created with
+mode 0600, and each end checks the other's uid (SO_PEERCRED) on connect.
+*/
+
+#define BFGD_MAGIC (0x44474642u) /* little-endian for "BFGD" */
+#define BFGD_SOCKET "bfgd.sock"  /* in $XDG_RUNTIME_DIR */
+#define BFGD_PATH_LEN 108        /* sun_path, terminator included */
+
+#define BFGD_OP_ENCODE 1 /* pixels in, encoded data and header out */
+#define BFGD_OP_DECODE 2 /* header and encoded data in, pixels out */
+
+typedef struct bfgd_msg {
+  uint32_t magic;
+  uint32_t op;
+  uint64_t tag;        /* echoed in the reply */
+  int32_t status;      /* reply: 0 on success */
+  uint32_t len;        /* payload bytes in the passed memfd */
+  bfg_header_t header; /* decode request, encode reply */
+  uint32_t width;      /* encode request */
+  uint32_t height;
+  uint8_t channels;
+  bfg_opts_t opts;
+} bfgd_msg_t;
+
+/* A payload in shared memory: a memfd and its mapping. */
+typedef struct bfgd_buf {
+  int fd;
+  uint8_t *data;
+  size_t len;
+} bfgd_buf_t;
+
+typedef struct bfgd_conn *bfgd_t;
+
+/* Creates a shared buffer of len bytes for a request. Returns 0 on
+ * success. */
+int bfgd_buf_alloc(bfgd_buf_t *buf, size_t len);
+void bfgd_buf_free(bfgd_buf_t *buf);
+
+/* Writes the default socket path, $XDG_RUNTIME_DIR/BFGD_SOCKET, to buf
+ * (BFGD_PATH_LEN bytes). Returns 0 on success, nonzero if XDG_RUNTIME_DIR
+ * is unset or relative, or the path does not fit. */
+int bfgd_default_path(char *buf);
+
+/* Connects to the daemon at path (NULL for the default path), which must
+ * run as the same user. Returns NULL on failure. */
+bfgd_t bfgd_connect(const char *path);
+void bfgd_close(bfgd_t conn);
+
+/* Encodes the w x h x ch pixels at the start of in. On success out maps
+ * the encoded data (out->len bytes, release with bfgd_buf_free) and
+ * header is filled. Returns 0 on success; on failure out is left empty. */
+int bfgd_encode(bfgd_t conn, const bfgd_buf_t *in, uint32_t w, uint32_t h,
+                uint8_t ch, const bfg_opts_t *opts, bfg_header_t *header,
+                bfgd_buf_t *out);
+
+/* Decodes data_len bytes at the start of in to packed RGB or RGBA pixels
+ * in out. Returns 0 on success; on failure out is left empty. */
+int bfgd_decode(bfgd_t conn, const bfg_header_t *header,
+                const bfgd_buf_t *in, uint32_t data_len, bfgd_buf_t *out);
+
+/* Sends msg with the memfd fd and waits for the reply, whose memfd comes
+ * back in *reply_fd (-1 if none). Returns 0 on success. */
+int bfgd_call(bfgd_t conn, bfgd_msg_t *msg, int fd, int *reply_fd);
+
+/* Message transport shared by the daemon and the client. Sends msg with fd
+ * attached (none if fd < 0), or receives one with its fd in *fd. Return 0
+ * on success, nonzero on failure or, for receive, a closed socket. */
+int bfgd_send(int sock, const bfgd_msg_t *msg, int fd);
+int bfgd_recv(int sock, bfgd_msg_t *msg, int *fd);
+
+/* Nonzero if the process at the other end of sock runs as our user. */
+int bfgd_same_user(int sock);
+
+#endif /* BFG_BFGD_H */
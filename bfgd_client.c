@@ -0,0 +1,231 @@
+#define _GNU_SOURCE /* memfd_create */
+#include "bfgd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct bfgd_conn {
+  int sock;
+  uint64_t next_tag;
+};
+
+/* ---- transport ---- */
+
+int bfgd_send(int sock, const bfgd_msg_t *msg, int fd) {
+  struct iovec iov = {(void *)msg, sizeof(*msg)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(&ctl, 0, sizeof(ctl));
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &mh, MSG_NOSIGNAL) != (ssize_t)sizeof(*msg);
+}
+
+int bfgd_recv(int sock, bfgd_msg_t *msg, int *fd) {
+  struct iovec iov = {msg, sizeof(*msg)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof(ctl.buf);
+
+  *fd = -1;
+  ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  if (n > 0 && cm && cm->cmsg_level == SOL_SOCKET &&
+      cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(fd, CMSG_DATA(cm), sizeof(int));
+  }
+  if (n != (ssize_t)sizeof(*msg) || msg->magic != BFGD_MAGIC ||
+      (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+    return 1;
+  }
+  return 0;
+}
+
+/* ---- shared buffers ---- */
+
+int bfgd_buf_alloc(bfgd_buf_t *buf, size_t len) {
+  if (!buf) return 1;
+  buf->data = NULL;
+  buf->len = len;
+  buf->fd = memfd_create("bfgd", MFD_CLOEXEC);
+  if (buf->fd < 0) return 1;
+  if (len == 0) return 0;
+  void *map = MAP_FAILED;
+  if (ftruncate(buf->fd, (off_t)len) == 0) {
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, buf->fd, 0);
+  }
+  if (map == MAP_FAILED) {
+    close(buf->fd);
+    buf->fd = -1;
+    return 1;
+  }
+  buf->data = map;
+  return 0;
+}
+
+void bfgd_buf_free(bfgd_buf_t *buf) {
+  if (!buf) return;
+  if (buf->data) munmap(buf->data, buf->len);
+  if (buf->fd >= 0) close(buf->fd);
+  buf->data = NULL;
+  buf->fd = -1;
+  buf->len = 0;
+}
+
+/* Maps a reply memfd holding len payload bytes. */
+static int map_reply(int fd, size_t len, bfgd_buf_t *out) {
+  struct stat st;
+  out->fd = fd;
+  out->data = NULL;
+  out->len = len;
+  if (fstat(fd, &st) || (size_t)st.st_size < len) return 1;
+  if (len == 0) return 0;
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return 1;
+  out->data = map;
+  return 0;
+}
+
+int bfgd_same_user(int sock) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == geteuid();
+}
+
+/* ---- client ---- */
+
+int bfgd_default_path(char *buf) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (!buf || !dir || dir[0] != '/') return 1;
+  int n = snprintf(buf, BFGD_PATH_LEN, "%s/%s", dir, BFGD_SOCKET);
+  return n < 0 || n >= BFGD_PATH_LEN;
+}
+
+bfgd_t bfgd_connect(const char *path) {
+  char default_path[BFGD_PATH_LEN];
+  if (!path) {
+    if (bfgd_default_path(default_path)) return NULL;
+    path = default_path;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) return NULL;
+  /* someone else's listener would get our pixels */
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      !bfgd_same_user(sock)) {
+    close(sock);
+    return NULL;
+  }
+  struct bfgd_conn *conn = malloc(sizeof(struct bfgd_conn));
+  if (!conn) {
+    close(sock);
+    return NULL;
+  }
+  conn->sock = sock;
+  conn->next_tag = 1;
+  return conn;
+}
+
+void bfgd_close(bfgd_t conn) {
+  if (!conn) return;
+  close(conn->sock);
+  free(conn);
+}
+
+int bfgd_call(bfgd_t conn, bfgd_msg_t *msg, int fd, int *reply_fd) {
+  if (!conn || !msg || !reply_fd) return 1;
+  uint64_t tag = conn->next_tag++;
+  msg->magic = BFGD_MAGIC;
+  msg->tag = tag;
+  if (bfgd_send(conn->sock, msg, fd)) return 1;
+  if (bfgd_recv(conn->sock, msg, reply_fd)) return 1;
+  if (msg->tag != tag || msg->status) {
+    if (*reply_fd >= 0) close(*reply_fd);
+    *reply_fd = -1;
+    return 1;
+  }
+  return 0;
+}
+
+int bfgd_encode(bfgd_t conn, const bfgd_buf_t *in, uint32_t w, uint32_t h,
+                uint8_t ch, const bfg_opts_t *opts, bfg_header_t *header,
+                bfgd_buf_t *out) {
+  if (!in || !header || !out) return 1;
+  if ((uint64_t)w * h * ch > in->len) return 1;
+  /* empty until a reply is mapped, so a failure can free it */
+  out->fd = -1;
+  out->data = NULL;
+  out->len = 0;
+  bfgd_msg_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.op = BFGD_OP_ENCODE;
+  msg.len = (uint32_t)((uint64_t)w * h * ch);
+  msg.width = w;
+  msg.height = h;
+  msg.channels = ch;
+  if (opts) msg.opts = *opts;
+
+  int fd;
+  if (bfgd_call(conn, &msg, in->fd, &fd)) return 1;
+  *header = msg.header;
+  if (fd < 0 || map_reply(fd, msg.len, out)) {
+    bfgd_buf_free(out);
+    return 1;
+  }
+  return 0;
+}
+
+int bfgd_decode(bfgd_t conn, const bfg_header_t *header,
+                const bfgd_buf_t *in, uint32_t data_len, bfgd_buf_t *out) {
+  if (!header || !in || !out || data_len > in->len) return 1;
+  /* empty until a reply is mapped, so a failure can free it */
+  out->fd = -1;
+  out->data = NULL;
+  out->len = 0;
+  bfgd_msg_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.op = BFGD_OP_DECODE;
+  msg.len = data_len;
+  msg.header = *header;
+
+  int fd;
+  if (bfgd_call(conn, &msg, in->fd, &fd)) return 1;
+  if (fd < 0 || map_reply(fd, msg.len, out)) {
+    bfgd_buf_free(out);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,220 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bfgd.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Load generator for bfgd: concurrent clients, each on its own connection,
+ * send back-to-back requests for a synthetic image and record the latency
+ * of every one. Reports throughput and latency percentiles. */
+
+#define MAX_CLIENTS 256
+
+struct client {
+  const char *path;
+  int decode;
+  uint32_t n;
+  const bfgd_buf_t *in; /* shared, only read */
+  uint32_t w, h, ch, in_len;
+  bfg_header_t header; /* decode requests */
+  bfg_opts_t opts;
+  double *lat; /* n latencies in microseconds */
+  uint32_t done;
+  int failed;
+};
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Smooth gradients with a little noise, so neither codec path is trivial. */
+static void fill(uint8_t *px, uint32_t w, uint32_t h, uint32_t ch) {
+  uint32_t seed = 12345;
+  for (uint32_t y = 0; y < h; y++) {
+    for (uint32_t x = 0; x < w; x++) {
+      seed = seed * 1103515245u + 12345u;
+      uint32_t noise = (seed >> 16) & 7;
+      uint8_t *p = px + ((size_t)y * w + x) * ch;
+      p[0] = (uint8_t)(x * 255 / w + noise);
+      p[1] = (uint8_t)(y * 255 / h + noise);
+      p[2] = (uint8_t)((x + y) / 4);
+      if (ch == 4) p[3] = (uint8_t)(x < w / 2 ? 255 : 128);
+    }
+  }
+}
+
+static void *run_client(void *arg) {
+  struct client *c = arg;
+  bfgd_t conn = bfgd_connect(c->path);
+  if (!conn) {
+    c->failed = 1;
+    return NULL;
+  }
+  for (; c->done < c->n; c->done++) {
+    bfgd_buf_t out;
+    bfg_header_t header;
+    double t0 = now_us();
+    int err = c->decode
+                  ? bfgd_decode(conn, &c->header, c->in, c->in_len, &out)
+                  : bfgd_encode(conn, c->in, c->w, c->h, (uint8_t)c->ch,
+                                &c->opts, &header, &out);
+    c->lat[c->done] = now_us() - t0;
+    if (err) {
+      c->failed = 1;
+      break;
+    }
+    bfgd_buf_free(&out);
+  }
+  bfgd_close(conn);
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of n sorted values. */
+static double percentile(const double *v, uint32_t n, double p) {
+  uint32_t i = (uint32_t)(p / 100.0 * n + 0.5);
+  if (i > 0) i--;
+  return v[i < n ? i : n - 1];
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options]\n", prog);
+  fprintf(stderr, "  -s PATH  socket path (default $XDG_RUNTIME_DIR/%s)\n",
+          BFGD_SOCKET);
+  fprintf(stderr, "  -c N     concurrent clients (default 4)\n");
+  fprintf(stderr, "  -n N     requests per client (default 1000)\n");
+  fprintf(stderr, "  -W N     image width (default 256)\n");
+  fprintf(stderr, "  -H N     image height (default 256)\n");
+  fprintf(stderr, "  -a       RGBA instead of RGB\n");
+  fprintf(stderr, "  -d       send decode requests instead of encodes\n");
+  fprintf(stderr, "  -y       encode with the YCoCg-R color transform\n");
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL; /* bfgd_connect's default */
+  uint32_t n_clients = 4, n = 1000, w = 256, h = 256, ch = 3;
+  int decode = 0;
+  bfg_opts_t opts = {0};
+  for (int argi = 1; argi < argc; argi++) {
+    const char *arg = argv[argi];
+    int has_val = argi + 1 < argc;
+    if (strcmp(arg, "-s") == 0 && has_val) {
+      path = argv[++argi];
+    } else if (strcmp(arg, "-c") == 0 && has_val) {
+      n_clients = (uint32_t)atoi(argv[++argi]);
+    } else if (strcmp(arg, "-n") == 0 && has_val) {
+      n = (uint32_t)atoi(argv[++argi]);
+    } else if (strcmp(arg, "-W") == 0 && has_val) {
+      w = (uint32_t)atoi(argv[++argi]);
+    } else if (strcmp(arg, "-H") == 0 && has_val) {
+      h = (uint32_t)atoi(argv[++argi]);
+    } else if (strcmp(arg, "-a") == 0) {
+      ch = 4;
+    } else if (strcmp(arg, "-d") == 0) {
+      decode = 1;
+    } else if (strcmp(arg, "-y") == 0) {
+      opts.transform = BFG_TRANSFORM_YCOCG;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (n_clients < 1 || n_clients > MAX_CLIENTS || n < 1 || w < 1 || h < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* the request payload, shared by every client */
+  size_t raw_len = (size_t)w * h * ch;
+  bfgd_buf_t pixels, in;
+  if (bfgd_buf_alloc(&pixels, raw_len)) {
+    fprintf(stderr, "Could not allocate %zu bytes\n", raw_len);
+    return 1;
+  }
+  fill(pixels.data, w, h, ch);
+  in = pixels;
+  uint32_t in_len = (uint32_t)raw_len;
+  bfg_header_t header;
+  memset(&header, 0, sizeof(header));
+  if (decode) {
+    struct bfg_raw raw = {w, h, (uint8_t)ch, pixels.data};
+    uint32_t len;
+    bfg_img_t img = bfg_encode_opts(&raw, &opts, &header, &len);
+    if (!img || bfgd_buf_alloc(&in, len)) {
+      fprintf(stderr, "Could not encode the test image\n");
+      return 1;
+    }
+    memcpy(in.data, img, len);
+    in_len = len;
+    bfg_free_img(img);
+  }
+
+  struct client clients[MAX_CLIENTS];
+  pthread_t tids[MAX_CLIENTS];
+  for (uint32_t i = 0; i < n_clients; i++) {
+    struct client *c = &clients[i];
+    memset(c, 0, sizeof(*c));
+    c->path = path;
+    c->decode = decode;
+    c->n = n;
+    c->in = &in;
+    c->w = w;
+    c->h = h;
+    c->ch = ch;
+    c->in_len = in_len;
+    c->header = header;
+    c->opts = opts;
+    c->lat = malloc(n * sizeof(double));
+    if (!c->lat) {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+    }
+  }
+
+  double t0 = now_us();
+  uint32_t started = 0;
+  for (; started < n_clients; started++)
+    if (pthread_create(&tids[started], NULL, run_client, &clients[started]))
+      break;
+  for (uint32_t i = 0; i < started; i++) pthread_join(tids[i], NULL);
+  double elapsed = now_us() - t0;
+
+  /* merge every client's latencies */
+  uint32_t total = 0;
+  int failed = started < n_clients;
+  double *all = malloc((size_t)n * n_clients * sizeof(double));
+  for (uint32_t i = 0; i < started && all; i++) {
+    memcpy(all + total, clients[i].lat, clients[i].done * sizeof(double));
+    total += clients[i].done;
+    failed |= clients[i].failed;
+  }
+  if (failed) fprintf(stderr, "Some requests failed (is bfgd running?)\n");
+  if (!all || total == 0) return 1;
+  qsort(all, total, sizeof(double), cmp_double);
+
+  double px = (double)w * h * total;
+  printf("%s %ux%ux%u, %u clients, %u requests in %.2f s\n",
+         decode ? "decode" : "encode", w, h, ch, n_clients, total,
+         elapsed / 1e6);
+  printf("throughput: %.1f req/s, %.1f MP/s\n", total / (elapsed / 1e6),
+         px / elapsed);
+  printf("latency us: min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  "
+         "max %.1f\n",
+         all[0], percentile(all, total, 50), percentile(all, total, 90),
+         percentile(all, total, 99), percentile(all, total, 99.9),
+         all[total - 1]);
+
+  free(all);
+  for (uint32_t i = 0; i < n_clients; i++) free(clients[i].lat);
+  if (decode) bfgd_buf_free(&in);
+  bfgd_buf_free(&pixels);
+  return failed;
+}
@@ -0,0 +1,298 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bfg_archive.h"
+#include "convert.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Builds a BFG archive from a directory of PNG files, converting them on a
+ * pool of threads, and lists, extracts or verifies archive entries. */
+
+#define MAX_THREADS 64
+#define PATH_LEN 4096
+
+struct job {
+  char path[PATH_LEN];
+  bfga_item_t item;
+  uint8_t *data; /* encoded image, owned */
+  int failed;
+};
+
+struct pool {
+  struct job *jobs;
+  uint32_t n;
+  uint32_t next; /* first job not yet taken */
+  bfg_opts_t opts;
+  pthread_mutex_t lock;
+};
+
+static int convert(struct job *job, const bfg_opts_t *opts) {
+  struct png_data png;
+  struct bfg_raw raw;
+  if (libpng_read(job->path, &png)) return 1;
+  if (libpng_decode(&png, &raw)) {
+    libpng_free(&png);
+    return 1;
+  }
+  libpng_free(&png);
+  job->data = bfg_encode_opts(&raw, opts, &job->item.header,
+                              &job->item.data_len);
+  bfg_free_raw(&raw);
+  job->item.data = job->data;
+  return job->data == NULL;
+}
+
+static void *worker(void *arg) {
+  struct pool *pool = arg;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    uint32_t i = pool->next < pool->n ? pool->next++ : pool->n;
+    pthread_mutex_unlock(&pool->lock);
+    if (i == pool->n) return NULL;
+    pool->jobs[i].failed = convert(&pool->jobs[i], &pool->opts);
+  }
+}
+
+static int has_png_ext(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && strcmp(name + len - 4, ".png") == 0;
+}
+
+static int cmp_job(const void *a, const void *b) {
+  return strcmp(((const struct job *)a)->item.name,
+                ((const struct job *)b)->item.name);
+}
+
+/* Collects the PNG files in dir as jobs sorted by name; each name is the
+ * file name without the extension. */
+static struct job *scan(const char *dir, uint32_t *n) {
+  DIR *d = opendir(dir);
+  if (!d) return NULL;
+  struct job *jobs = NULL;
+  uint32_t cap = 0;
+  *n = 0;
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    if (!has_png_ext(de->d_name)) continue;
+    if (strlen(dir) + strlen(de->d_name) + 2 > PATH_LEN) continue;
+    if (*n == cap) {
+      cap = cap ? cap * 2 : 256;
+      struct job *grown = realloc(jobs, cap * sizeof(struct job));
+      if (!grown) break;
+      jobs = grown;
+    }
+    struct job *job = &jobs[(*n)++];
+    memset(job, 0, sizeof(*job));
+    sprintf(job->path, "%s/%s", dir, de->d_name);
+    job->item.name = strdup(de->d_name);
+    if (job->item.name)
+      ((char *)job->item.name)[strlen(de->d_name) - 4] = '\0';
+    else
+      (*n)--;
+  }
+  closedir(d);
+  if (jobs) qsort(jobs, *n, sizeof(struct job), cmp_job);
+  return jobs;
+}
+
+static int build(const char *out, const char *dir, int threads, int numeric,
+                 uint32_t align_log2, const bfg_opts_t *opts) {
+  uint32_t n = 0;
+  struct job *jobs = scan(dir, &n);
+  if (!jobs && n == 0) {
+    fprintf(stderr, "Could not read directory %s\n", dir);
+    return 1;
+  }
+
+  int ret = 1;
+  bfga_item_t *items = malloc((size_t)n * sizeof(bfga_item_t) + 1);
+  if (!items) goto done;
+  for (uint32_t i = 0; i < n; i++) {
+    char *end;
+    jobs[i].item.id = i;
+    if (numeric) {
+      unsigned long id = strtoul(jobs[i].item.name, &end, 10);
+      if (*end || end == jobs[i].item.name || id > UINT32_MAX) {
+        fprintf(stderr, "%s: name is not a numeric id\n", jobs[i].path);
+        goto done;
+      }
+      jobs[i].item.id = (uint32_t)id;
+    }
+  }
+
+  struct pool pool = {jobs, n, 0, *opts, PTHREAD_MUTEX_INITIALIZER};
+  pthread_t tids[MAX_THREADS];
+  int started = 0;
+  for (; started < threads; started++)
+    if (pthread_create(&tids[started], NULL, worker, &pool)) break;
+  /* with no threads at all, convert on this one */
+  if (started == 0) worker(&pool);
+  for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+
+  uint64_t raw_bytes = 0, bfg_bytes = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (jobs[i].failed) {
+      fprintf(stderr, "Could not convert %s\n", jobs[i].path);
+      goto done;
+    }
+    items[i] = jobs[i].item;
+    raw_bytes += (uint64_t)items[i].header.width * items[i].header.height *
+                 items[i].header.channels;
+    bfg_bytes += items[i].data_len;
+  }
+
+  if (bfga_write(out, items, n, align_log2)) {
+    fprintf(stderr, "Could not write %s (duplicate id?)\n", out);
+    goto done;
+  }
+  printf("%s: %u images, %.1f KiB raw, %.1f KiB encoded\n", out, n,
+         raw_bytes / 1024.0, bfg_bytes / 1024.0);
+  ret = 0;
+
+done:
+  for (uint32_t i = 0; i < n; i++) {
+    free((char *)jobs[i].item.name);
+    bfg_free_img(jobs[i].data);
+  }
+  free(jobs);
+  free(items);
+  return ret;
+}
+
+static int list(const char *path) {
+  bfga_t ar = bfga_open(path);
+  if (!ar) {
+    fprintf(stderr, "Could not open archive %s\n", path);
+    return 1;
+  }
+  for (uint32_t i = 0; i < bfga_count(ar); i++) {
+    bfga_entry_t e;
+    bfga_entry_at(ar, i, &e);
+    printf("%10u\t%5ux%-5u\t%u\t%8u\t%s\n", e.id, e.header.width,
+           e.header.height, e.header.channels, e.data_len, e.name);
+  }
+  bfga_close(ar);
+  return 0;
+}
+
+/* Checks every entry against its checksum trailer, decoding it too if
+ * pixels is set. */
+static int verify(const char *path, int pixels) {
+  bfga_t ar = bfga_open(path);
+  if (!ar) {
+    fprintf(stderr, "Could not open archive %s\n", path);
+    return 1;
+  }
+  uint32_t bad = 0, unchecked = 0;
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < bfga_count(ar); i++) {
+    bfga_entry_t e;
+    bfga_entry_at(ar, i, &e);
+    if (!(e.header.flags & (BFG_FLAG_CRC | BFG_FLAG_PIXEL_CRC))) {
+      unchecked++;
+    } else if (bfg_verify(&e.header, e.data, e.data_len,
+                          pixels ? BFG_VERIFY_PIXELS : 0)) {
+      printf("%s: checksum mismatch\n", e.name);
+      bad++;
+    }
+    bytes += e.data_len;
+  }
+  printf("%s: %u entries, %.1f KiB, %u bad, %u without checksum\n", path,
+         bfga_count(ar), bytes / 1024.0, bad, unchecked);
+  bfga_close(ar);
+  return bad != 0;
+}
+
+/* Decodes the entry named key (or with id key, if numeric) to a PNG. */
+static int extract(const char *path, const char *key, int numeric,
+                   char *out) {
+  bfga_t ar = bfga_open(path);
+  if (!ar) {
+    fprintf(stderr, "Could not open archive %s\n", path);
+    return 1;
+  }
+  bfga_entry_t e;
+  int missing = numeric ? bfga_find_id(ar, (uint32_t)strtoul(key, NULL, 10), &e)
+                        : bfga_find(ar, key, &e);
+  if (missing) {
+    fprintf(stderr, "%s: no entry %s\n", path, key);
+    bfga_close(ar);
+    return 1;
+  }
+
+  int ret = 1;
+  struct bfg_raw raw = {e.header.width, e.header.height, e.header.channels,
+                        NULL};
+  bfg_format_t fmt = {e.header.channels == 4 ? BFG_FMT_RGBA : BFG_FMT_RGB, 0};
+  size_t len = (size_t)raw.width * raw.height * raw.n_channels;
+  raw.pixels = BFG_MALLOC(len + 1);
+  if (raw.pixels && bfga_decode(&e, &fmt, raw.pixels, len) == 0 &&
+      libpng_write(out, &raw) == 0)
+    ret = 0;
+  else
+    fprintf(stderr, "Could not decode %s to %s\n", key, out);
+  bfg_free_raw(&raw);
+  bfga_close(ar);
+  return ret;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <archive> <png directory>\n", prog);
+  fprintf(stderr, "       %s -l <archive>\n", prog);
+  fprintf(stderr, "       %s -x <archive> <name> <out.png>\n", prog);
+  fprintf(stderr, "       %s -c [-p] <archive>\n", prog);
+  fprintf(stderr, "  -j N  conversion threads (default 4)\n");
+  fprintf(stderr, "  -i    file names are numeric ids (-x: look up by id)\n");
+  fprintf(stderr, "  -a N  align payloads to 2^N bytes (default %d)\n",
+          BFGA_ALIGN_DEFAULT);
+  fprintf(stderr, "  -y    encode with the YCoCg-R color transform\n");
+  fprintf(stderr, "  -k    add CRC32C checksums (-kk: of the pixels too)\n");
+  fprintf(stderr, "  -c    verify entries against their checksums\n");
+  fprintf(stderr, "  -p    with -c, decode and check pixel checksums too\n");
+}
+
+int main(int argc, char **argv) {
+  bfg_opts_t opts = {0};
+  int threads = 4, numeric = 0, pixels = 0, mode = 'b';
+  uint32_t align_log2 = BFGA_ALIGN_DEFAULT;
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+      threads = atoi(argv[++argi]);
+      if (threads > MAX_THREADS) threads = MAX_THREADS;
+    } else if (strcmp(argv[argi], "-a") == 0 && argi + 1 < argc) {
+      align_log2 = (uint32_t)atoi(argv[++argi]);
+    } else if (strcmp(argv[argi], "-i") == 0) {
+      numeric = 1;
+    } else if (strcmp(argv[argi], "-y") == 0) {
+      opts.transform = BFG_TRANSFORM_YCOCG;
+    } else if (strcmp(argv[argi], "-k") == 0) {
+      opts.checksum |= BFG_CHECKSUM_DATA;
+    } else if (strcmp(argv[argi], "-kk") == 0) {
+      opts.checksum |= BFG_CHECKSUM_DATA | BFG_CHECKSUM_PIXELS;
+    } else if (strcmp(argv[argi], "-c") == 0) {
+      mode = 'c';
+    } else if (strcmp(argv[argi], "-p") == 0) {
+      pixels = 1;
+    } else if (strcmp(argv[argi], "-l") == 0) {
+      mode = 'l';
+    } else if (strcmp(argv[argi], "-x") == 0) {
+      mode = 'x';
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  int n_args = argc - argi;
+  if (mode == 'l' && n_args == 1) return list(argv[argi]);
+  if (mode == 'c' && n_args == 1) return verify(argv[argi], pixels);
+  if (mode == 'x' && n_args == 3)
+    return extract(argv[argi], argv[argi + 1], numeric, argv[argi + 2]);
+  if (mode == 'b' && n_args == 2)
+    return build(argv[argi], argv[argi + 1], threads, numeric, align_log2,
+                 &opts);
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,135 @@
+#include "convert.h"
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Replays a PNG corpus through every cache size and hash combination and
+ * reports the cache hit rate (over non-run pixels, as the encoder sees them)
+ * and the resulting encoded size. */
+
+#define N_CFG 6
+
+static const struct {
+  uint16_t size;
+  uint8_t hash;
+} cfgs[N_CFG] = {
+    {16, BFG_HASH_XOR}, {64, BFG_HASH_XOR}, {256, BFG_HASH_XOR},
+    {16, BFG_HASH_MUL}, {64, BFG_HASH_MUL}, {256, BFG_HASH_MUL},
+};
+
+struct cache_stats {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t enc_bytes;
+};
+
+/* Mirror the encoder: every pixel that does not extend a run looks up its
+ * cache slot and then overwrites it. With an alpha plane the color stream
+ * sees every pixel as opaque. */
+static void replay(bfg_raw_t raw, const bfg_header_t *header,
+                   struct cache_stats *cs) {
+  int opaque = (header->flags & BFG_FLAG_ALPHA_PLANE) != 0;
+  bfg_pixel_t cache[BFG_CACHE_MAX];
+  memset(cache, 0, sizeof(cache));
+  bfg_pixel_t prev = {0, 0, 0, 255};
+  uint64_t n_px = (uint64_t)raw->width * raw->height;
+
+  for (uint64_t i = 0; i < n_px; i++) {
+    const uint8_t *src = &raw->pixels[i * raw->n_channels];
+    bfg_pixel_t px = {src[0], src[1], src[2],
+                      raw->n_channels >= 4 && !opaque ? src[3] : 255};
+    if (px.r == prev.r && px.g == prev.g && px.b == prev.b && px.a == prev.a)
+      continue;
+
+    uint32_t ci = bfg_cache_index(px, header->cache);
+    bfg_pixel_t c = cache[ci];
+    cs->lookups++;
+    if (c.r == px.r && c.g == px.g && c.b == px.b && c.a == px.a) cs->hits++;
+    cache[ci] = px;
+    prev = px;
+  }
+}
+
+static void print_header(void) {
+  printf("%-30s", "image");
+  for (int c = 0; c < N_CFG; c++)
+    printf("\t%s%-3u", cfgs[c].hash == BFG_HASH_MUL ? "mul" : "xor",
+           cfgs[c].size);
+  printf("\n");
+}
+
+static void print_row(const char *name, struct cache_stats *cs,
+                      uint64_t raw_bytes) {
+  printf("%-30.30s", name);
+  for (int c = 0; c < N_CFG; c++) {
+    double hit = cs[c].lookups ? 100.0 * cs[c].hits / cs[c].lookups : 0;
+    printf("\t%.1f%%", hit);
+  }
+  printf("\n%-30s", "  ratio");
+  for (int c = 0; c < N_CFG; c++) {
+    double ratio = raw_bytes ? 100.0 * cs[c].enc_bytes / raw_bytes : 0;
+    printf("\t%.1f%%", ratio);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <png files>\n", argv[0]);
+    return 1;
+  }
+
+  struct cache_stats total[N_CFG];
+  memset(total, 0, sizeof(total));
+  uint64_t total_raw = 0;
+
+  print_header();
+  for (int i = 1; i < argc; i++) {
+    struct png_data png;
+    struct bfg_raw raw;
+
+    if (libpng_read(argv[i], &png)) {
+      fprintf(stderr, "Could not open file %s\n", argv[i]);
+      continue;
+    }
+    if (libpng_decode(&png, &raw)) {
+      fprintf(stderr, "Could not decode file %s\n", argv[i]);
+      libpng_free(&png);
+      continue;
+    }
+
+    struct cache_stats cs[N_CFG];
+    memset(cs, 0, sizeof(cs));
+    for (int c = 0; c < N_CFG; c++) {
+      bfg_opts_t opts = {0};
+      opts.cache_size = cfgs[c].size;
+      opts.hash = cfgs[c].hash;
+
+      bfg_header_t header;
+      uint32_t len = 0;
+      bfg_img_t img = bfg_encode_opts(&raw, &opts, &header, &len);
+      if (!img) {
+        fprintf(stderr, "Could not encode file %s\n", argv[i]);
+        continue;
+      }
+      cs[c].enc_bytes = len + BFG_HEADER_SIZE;
+      replay(&raw, &header, &cs[c]);
+      bfg_free_img(img);
+
+      total[c].lookups += cs[c].lookups;
+      total[c].hits += cs[c].hits;
+      total[c].enc_bytes += cs[c].enc_bytes;
+    }
+
+    uint64_t raw_bytes = (uint64_t)raw.width * raw.height * raw.n_channels;
+    total_raw += raw_bytes;
+    print_row(basename(argv[i]), cs, raw_bytes);
+
+    bfg_free_raw(&raw);
+    libpng_free(&png);
+  }
+
+  printf("\n");
+  print_row("TOTAL", total, total_raw);
+  return 0;
+}
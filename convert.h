@@ -19,18 +19,43 @@ typedef struct png_data {
 /* Frees everything allocated within the libpng data struct. */
 void libpng_free(png_data_t png);
 
-/* Reads png file at fpath into png data struct using the libpng API. Caller is
- * responsible for freeing the internals of the png struct with libpng_free.
+/* Reads png file at fpath into png data struct using the libpng API, keeping
+ * 16-bit samples. Caller is responsible for freeing the internals of the png
+ * struct with libpng_free.
  * Returns 0 on success, nonzero on failure. */
 int libpng_read(char *fpath, png_data_t png);
 
 /* Populates raw image data struct with data from libpng data struct.
- * Grayscale images are expanded to RGB(A) so BFG always gets 3 or 4 channels.
+ * Grayscale images are expanded to RGB(A) so BFG always gets 3 or 4 channels,
+ * and 16-bit samples are cut to their high byte.
  * Returns 0 on success, nonzero on failure. */
 int libpng_decode(png_data_t png, bfg_raw_t raw);
 
+/* Like libpng_decode, at 16 bits per channel (for bfg_encode16): 16-bit
+ * samples are kept whole and 8-bit ones scaled by 257.
+ * Returns 0 on success, nonzero on failure. */
+int libpng_decode16(png_data_t png, bfg_raw16_t raw);
+
 /* Writes raw image data to a PNG file at fpath.
  * Returns 0 on success, nonzero on failure. */
 int libpng_write(char *fpath, bfg_raw_t raw);
 
+/* Writes raw image data with 16 bits per channel to a 16-bit PNG file.
+ * Returns 0 on success, nonzero on failure. */
+int libpng_write16(char *fpath, bfg_raw16_t raw);
+
+/* Nonzero if png (from libpng_read) has 16 bits per channel. */
+int libpng_is16(png_data_t png);
+
+/* Decodes a whole PNG file held in memory, with the same expansions as
+ * libpng_read, into raw (pixels released with bfg_free_raw). Unlike the
+ * file path, a corrupt image is reported instead of aborting.
+ * Returns 0 on success, nonzero on failure. */
+int libpng_decode_mem(const uint8_t *data, size_t len, bfg_raw_t raw);
+
+/* Encodes raw image data to a PNG file image in memory, returned in *out
+ * (release with free) with its size in *out_len.
+ * Returns 0 on success, nonzero on failure. */
+int libpng_encode_mem(bfg_raw_t raw, uint8_t **out, size_t *out_len);
+
 #endif /* BFG_CONVERT_H */
@@ -1,4 +1,7 @@
 #include "convert.h"
+#include "perf.h"
+#include "pnm.h"
+#include "trace.h"
 #include "util.h"
 #include <libgen.h>
 #include <stdlib.h>
@@ -7,24 +10,106 @@
 
 #define FILENAME_LEN (30)
 
+/* allocations made by one library call */
+struct mem_use {
+  uint64_t allocs;
+  uint64_t bytes;
+  uint64_t peak; /* most bytes live at once beyond those live before */
+};
+
 struct stats {
   uint32_t raw_bytes;
-  uint32_t png_bytes;
+  uint32_t png_bytes;       /* the input file, PNG or PAM/PPM */
   uint32_t bfg_bytes;
-  double png_enc_millis;
+  double png_read_millis;  /* libpng_read + libpng_decode: read, inflate;
+                              or pnm_read and faulting the pixels in */
+  double png_write_millis; /* libpng_write: deflate, write; or pnm_write */
   double bfg_enc_millis;
-  double png_dec_millis;
   double bfg_dec_millis;
+  double bfg_write_millis;
+  double bfg_read_millis;
+  uint64_t pixels;
+  uint64_t enc_perf[PERF_N_COUNTERS]; /* counters around bfg_encode */
+  uint64_t dec_perf[PERF_N_COUNTERS]; /* counters around bfg_decode */
+  struct mem_use enc_mem;
+  struct mem_use dec_mem;
   int verified; /* 1 = pixel-perfect roundtrip, 0 = mismatch, -1 = skipped */
   char name[FILENAME_LEN + 1];
 };
 
+#ifdef BFG_STATS
+/* encoder op statistics summed over the images of one category (the name of
+ * the directory holding them) */
+struct op_category {
+  char name[FILENAME_LEN + 1];
+  unsigned int n_img;
+  bfg_stats_t stats;
+};
+
+static void add_op_stats(bfg_stats_t *sum, const bfg_stats_t *s) {
+  sum->images += s->images;
+  sum->pixels += s->pixels;
+  for (int op = 0; op < BFG_STAT_OPS; op++) {
+    sum->op[op].count += s->op[op].count;
+    sum->op[op].bytes += s->op[op].bytes;
+    sum->op[op].pixels += s->op[op].pixels;
+  }
+  sum->cache_hits += s->cache_hits;
+  sum->cache_misses += s->cache_misses;
+  for (int b = 0; b < BFG_STAT_RUN_BINS; b++) sum->run_hist[b] += s->run_hist[b];
+  for (int c = 0; c < 3; c++) {
+    for (int b = 0; b < BFG_STAT_RESID_BINS; b++) {
+      sum->resid_hist[c][b] += s->resid_hist[c][b];
+    }
+  }
+}
+
+static void print_op_stats(const struct op_category *cat) {
+  const bfg_stats_t *s = &cat->stats;
+  uint64_t bytes = 0;
+  for (int op = 0; op < BFG_STAT_OPS; op++) bytes += s->op[op].bytes;
+  double px = s->pixels ? (double)s->pixels : 1;
+
+  printf("\n%s: %u images, %llu pixels, %.3f bits/px\n", cat->name, cat->n_img,
+         (unsigned long long)s->pixels, 8.0 * bytes / px);
+  printf("op\tcount\t\t%% px\t%% bytes\tbytes/op\n");
+  for (int op = 0; op < BFG_STAT_OPS; op++) {
+    const bfg_op_stat_t *o = &s->op[op];
+    if (!o->count) continue;
+    printf("%s\t%-12llu\t%.2f\t%.2f\t%.2f\n", bfg_stats_op_name(op),
+           (unsigned long long)o->count, 100.0 * o->pixels / px,
+           bytes ? 100.0 * o->bytes / bytes : 0, (double)o->bytes / o->count);
+  }
+
+  uint64_t lookups = s->cache_hits + s->cache_misses;
+  printf("cache\t%.2f%% hits of %llu lookups\n",
+         lookups ? 100.0 * s->cache_hits / lookups : 0,
+         (unsigned long long)lookups);
+  printf("runs\t");
+  for (int b = 0; b < BFG_STAT_RUN_BINS; b++) {
+    printf(" %u+:%llu", 1u << b, (unsigned long long)s->run_hist[b]);
+  }
+  printf("\n");
+  static const char *const chan[3] = {"|dg|", "|dr-dg|", "|db-dg|"};
+  for (int c = 0; c < 3; c++) {
+    printf("%s\t", chan[c]);
+    for (int b = 0; b < BFG_STAT_RESID_BINS; b++) {
+      printf(" %u+:%llu", b ? 1u << (b - 1) : 0,
+             (unsigned long long)s->resid_hist[c][b]);
+    }
+    printf("\n");
+  }
+}
+#endif
+
 void print_stats(struct stats *stats, unsigned int n_img) {
-  printf("\t\t\t\tpng\t\t\tbfg\n");
-  printf("%-*s\tratio\tenc ms\tdec ms\tratio\tenc ms\tdec ms\tverify\n",
+  printf("\t\t\t\tinput\t\t\t\tbfg\n");
+  printf("%-*s\tratio\tread ms\twrite ms\tratio\tenc ms\tdec ms"
+         "\twrite ms\tread ms\tverify\n",
          FILENAME_LEN, "image");
   for (int i = 0; i < FILENAME_LEN; i++) putchar('-');
-  printf("\t-----\t------\t------\t-----\t------\t------\t------\n");
+  printf("\t-----\t-------\t--------\t-----\t------\t------\t--------"
+         "\t-------\t------\n");
 
   for (unsigned int i = 0; i < n_img; i++) {
     struct stats s = stats[i];
@@ -34,57 +119,366 @@ void print_stats(struct stats *stats, unsigned int n_img) {
         s.raw_bytes ? (100.0 * s.bfg_bytes / s.raw_bytes) : 9999;
     const char *vstr =
         s.verified == 1 ? "PASS" : (s.verified == 0 ? "FAIL" : "SKIP");
-    printf("%-*s\t%.1f%%\t%.2f\t%.2f\t%.1f%%\t%.2f\t%.2f\t%s\n",
-           FILENAME_LEN, s.name, png_ratio, s.png_enc_millis, s.png_dec_millis,
-           bfg_ratio, s.bfg_enc_millis, s.bfg_dec_millis, vstr);
+    printf("%-*s\t%.1f%%\t%.2f\t%.2f\t\t%.1f%%\t%.2f\t%.2f\t%.2f\t\t%.2f"
+           "\t%s\n",
+           FILENAME_LEN, s.name, png_ratio, s.png_read_millis,
+           s.png_write_millis, bfg_ratio, s.bfg_enc_millis, s.bfg_dec_millis,
+           s.bfg_write_millis, s.bfg_read_millis, vstr);
+  }
+}
+
+/* Counter value per unit, or "-" when not measured. */
+static void print_per(uint64_t value, uint64_t units) {
+  if (value == PERF_NA || !units) printf("\t-");
+  else printf("\t%.3f", (double)value / units);
+}
+
+/* Counters per pixel, then per output byte (encoded bytes for encode, raw
+ * bytes for decode). */
+static void print_perf(struct stats *stats, unsigned int n_img) {
+  printf("\n%-*s\tstage", FILENAME_LEN, "counters per pixel | per byte");
+  for (int pass = 0; pass < 2; pass++) {
+    for (int c = 0; c < PERF_N_COUNTERS; c++) printf("\t%s", perf_name(c));
   }
+  printf("\n");
+
+  for (unsigned int i = 0; i < n_img; i++) {
+    struct stats *s = &stats[i];
+    if (!s->pixels) continue;
+    for (int dec = 0; dec < 2; dec++) {
+      const uint64_t *v = dec ? s->dec_perf : s->enc_perf;
+      uint64_t out_bytes = dec ? s->raw_bytes : s->bfg_bytes;
+      printf("%-*s\t%s", FILENAME_LEN, s->name, dec ? "dec" : "enc");
+      for (int c = 0; c < PERF_N_COUNTERS; c++) print_per(v[c], s->pixels);
+      for (int c = 0; c < PERF_N_COUNTERS; c++) print_per(v[c], out_bytes);
+      printf("\n");
+    }
+  }
+}
+
+#ifdef BFG_MEMSTATS
+static uint64_t mem_start(void) {
+  bfg_mem_stats_t m;
+  bfg_mem_reset();
+  bfg_mem_get(&m);
+  return m.live;
+}
+
+static struct mem_use mem_since(uint64_t live_before) {
+  bfg_mem_stats_t m;
+  bfg_mem_get(&m);
+  struct mem_use u = {m.allocs, m.bytes, m.peak - live_before};
+  return u;
+}
+
+static void print_mem(struct stats *stats, unsigned int n_img) {
+  printf("\n%-*s\tenc n\tenc KiB\tpeak/px\tdec n\tdec KiB\tpeak/px\n",
+         FILENAME_LEN, "allocations");
+  struct mem_use max_enc = {0, 0, 0}, max_dec = {0, 0, 0};
+  for (unsigned int i = 0; i < n_img; i++) {
+    struct stats *s = &stats[i];
+    if (!s->pixels) continue;
+    printf("%-*s\t%llu\t%.1f\t%.2f\t%llu\t%.1f\t%.2f\n", FILENAME_LEN,
+           s->name, (unsigned long long)s->enc_mem.allocs,
+           s->enc_mem.bytes / 1024.0, (double)s->enc_mem.peak / s->pixels,
+           (unsigned long long)s->dec_mem.allocs, s->dec_mem.bytes / 1024.0,
+           (double)s->dec_mem.peak / s->pixels);
+    if (s->enc_mem.peak > max_enc.peak) max_enc = s->enc_mem;
+    if (s->dec_mem.peak > max_dec.peak) max_dec = s->dec_mem;
+  }
+  printf("peak: encode %.1f KiB, decode %.1f KiB\n", max_enc.peak / 1024.0,
+         max_dec.peak / 1024.0);
+}
+#endif
+
+/* An input image: a PNG inflated by libpng, or a PAM/PPM mapped in place.
+ * A PNG with 16 bits per channel is kept at full depth in raw16. */
+struct source {
+  int is_pnm;
+  int is16;
+  struct png_data png;
+  pnm_image_t pnm;
+  struct bfg_raw16 raw16;
+};
+
+/* Reads fpath into raw, or into src->raw16 for a 16-bit PNG, timing it
+ * into *millis. Returns 0 on success. */
+static int source_read(const char *fpath, const char *base,
+                       struct source *src, struct bfg_raw *raw,
+                       double *millis) {
+  trace_mark_t begin = trace_begin();
+  src->is_pnm = pnm_path(fpath);
+  src->is16 = 0;
+  src->raw16.pixels = NULL;
+  if (src->is_pnm) {
+    if (pnm_read(fpath, &src->pnm)) {
+      fprintf(stderr, "Could not read file %s\n", fpath);
+      return 1;
+    }
+    /* fault the pages in here, so that encode times do not include them
+     * and compare with those of a PNG, which is in memory once decoded */
+    const volatile uint8_t *map = src->pnm.map;
+    uint8_t sum = 0;
+    for (size_t off = 0; off < src->pnm.map_len; off += 4096) sum += map[off];
+    (void)sum;
+    *raw = src->pnm.raw;
+    *millis = trace_end(begin, "pnm_read", "pnm", base);
+    return 0;
+  }
+
+  /* libpng_read reads and inflates the whole image */
+  if (libpng_read((char *)fpath, &src->png)) {
+    fprintf(stderr, "Could not open file %s\n", fpath);
+    return 1;
+  }
+  *millis = trace_end(begin, "libpng_read", "png", base);
+
+  begin = trace_begin();
+  if (libpng_is16(&src->png)) {
+    src->is16 = 1;
+    raw->pixels = NULL;
+    if (libpng_decode16(&src->png, &src->raw16)) {
+      fprintf(stderr, "Could not decode file %s\n", fpath);
+      bfg_free_raw16(&src->raw16);
+      libpng_free(&src->png);
+      return 1;
+    }
+    *millis += trace_end(begin, "libpng_decode16", "png", base);
+    return 0;
+  }
+  if (libpng_decode(&src->png, raw)) {
+    fprintf(stderr, "Could not decode file %s\n", fpath);
+    libpng_free(&src->png);
+    return 1;
+  }
+  *millis += trace_end(begin, "libpng_decode", "png", base);
+  return 0;
+}
+
+static uint32_t source_bytes(struct source *src) {
+  if (src->is_pnm) return (uint32_t)src->pnm.map_len;
+  fseek(src->png.fp, 0L, SEEK_END);
+  return (uint32_t)ftell(src->png.fp);
+}
+
+/* Releases the source and the pixels read from it. */
+static void source_free(struct source *src, struct bfg_raw *raw) {
+  if (src->is_pnm) {
+    pnm_free(&src->pnm);
+  } else {
+    bfg_free_raw(raw);
+    bfg_free_raw16(&src->raw16);
+    libpng_free(&src->png);
+  }
+}
+
+/* The 16-bit path for a 16-bit PNG: bfg_encode16, write and read back,
+ * bfg_decode16, an exact compare and the decoded image written out as a
+ * 16-bit PNG, timed into stats like the 8-bit path. The color transform
+ * and near-lossless options do not apply. */
+static void evaluate16(struct source *src, const char *base,
+                      perf_counters_t *perf, struct stats *stats) {
+  bfg_raw16_t raw = &src->raw16;
+  bfg_header_t header;
+  uint32_t bfg_len = 0;
+  trace_mark_t begin = trace_begin();
+  if (perf) perf_start(perf);
+  bfg_img_t img = bfg_encode16(raw, &header, &bfg_len);
+  if (perf) perf_stop(perf);
+  stats->bfg_enc_millis = trace_end(begin, "bfg_encode16", "bfg", base);
+  if (perf) memcpy(stats->enc_perf, perf->value, sizeof(perf->value));
+  if (!img) {
+    fprintf(stderr, "Could not encode file %s\n", base);
+    return;
+  }
+
+  char out_path[strlen(base) + 16];
+  strcpy(out_path, "output/");
+  mkdir(out_path, 0777);
+  strcat(out_path, base);
+  strcat(out_path, ".bfg");
+  begin = trace_begin();
+  if (bfg_write(out_path, &header, img, bfg_len)) {
+    fprintf(stderr, "Could not write file %s\n", out_path);
+    bfg_free_img(img);
+    return;
+  }
+  stats->bfg_write_millis = trace_end(begin, "bfg_write", "io", base);
+
+  bfg_header_t header_in;
+  uint32_t data_in_len = 0;
+  begin = trace_begin();
+  uint8_t *data_in = bfg_read(out_path, &header_in, &data_in_len);
+  stats->bfg_read_millis = trace_end(begin, "bfg_read", "io", base);
+
+  struct bfg_raw16 raw_in = {0, 0, 0, NULL};
+  begin = trace_begin();
+  if (perf) perf_start(perf);
+  int dec_err =
+      !data_in || bfg_decode16(&header_in, data_in, data_in_len, &raw_in);
+  if (perf) perf_stop(perf);
+  stats->bfg_dec_millis = trace_end(begin, "bfg_decode16", "bfg", base);
+  if (perf) memcpy(stats->dec_perf, perf->value, sizeof(perf->value));
+  if (dec_err) {
+    fprintf(stderr, "Could not decode BFG %s\n", out_path);
+    bfg_free_img(data_in);
+    bfg_free_img(img);
+    return;
+  }
+
+  /* lossless only: every sample must match */
+  size_t total = (size_t)raw->width * raw->height * raw->n_channels;
+  stats->verified = raw_in.width == raw->width &&
+                    raw_in.height == raw->height &&
+                    raw_in.n_channels == raw->n_channels &&
+                    memcmp(raw_in.pixels, raw->pixels,
+                           total * sizeof(uint16_t)) == 0;
+  if (!stats->verified) fprintf(stderr, "  MISMATCH %s (16-bit)\n", base);
+
+  begin = trace_begin();
+  strcat(out_path, ".png");
+  if (libpng_write16(out_path, &raw_in)) {
+    fprintf(stderr, "Could not write file %s\n", out_path);
+  }
+  stats->png_write_millis = trace_end(begin, "libpng_write16", "png", base);
+
+  stats->raw_bytes = (uint32_t)(total * sizeof(uint16_t));
+  stats->png_bytes = source_bytes(src);
+  stats->bfg_bytes = bfg_len + BFG_HEADER_SIZE;
+  stats->pixels = (uint64_t)raw->width * raw->height;
+
+  bfg_free_raw16(&raw_in);
+  bfg_free_img(data_in);
+  bfg_free_img(img);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <png, ppm or pam files>\n", prog);
+  fprintf(stderr, "16-bit PNGs are coded losslessly at full depth; -y and "
+                  "-e apply to 8-bit images\n");
+  fprintf(stderr, "  -y    encode with the YCoCg-R color transform\n");
+  fprintf(stderr, "  -e N  near-lossless, max error N per color channel\n");
+  fprintf(stderr, "  -s    op statistics per image category (make STATS=1)\n");
+  fprintf(stderr, "  -t F  write a Chrome trace-event JSON of all stages to F\n");
+  fprintf(stderr, "  -p    hardware counters around encode and decode\n");
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <png files>\n", argv[0]);
+  bfg_opts_t opts = {0};
+  int op_stats = 0;
+  int use_perf = 0;
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    if (strcmp(argv[argi], "-y") == 0) {
+      opts.transform = BFG_TRANSFORM_YCOCG;
+    } else if (strcmp(argv[argi], "-e") == 0 && argi + 1 < argc) {
+      opts.max_error = (uint8_t)atoi(argv[++argi]);
+    } else if (strcmp(argv[argi], "-s") == 0) {
+      op_stats = 1;
+    } else if (strcmp(argv[argi], "-p") == 0) {
+      use_perf = 1;
+    } else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+      if (trace_open(argv[++argi])) {
+        fprintf(stderr, "Could not start trace %s\n", argv[argi]);
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argi >= argc) {
+    usage(argv[0]);
     return 1;
   }
+#ifndef BFG_STATS
+  if (op_stats) {
+    fprintf(stderr, "-s needs a statistics build: make clean && make STATS=1\n");
+    return 1;
+  }
+#endif
 
-  const unsigned int n_img = argc - 1;
+  const unsigned int n_img = argc - argi;
   struct stats *stats_arr = malloc(sizeof(struct stats) * n_img);
-  clock_t begin;
+  trace_mark_t begin, img_begin;
+
+  perf_counters_t perf;
+  if (use_perf && perf_open(&perf) == 0) {
+    fprintf(stderr, "Hardware counters unavailable, skipping them\n");
+    use_perf = 0;
+  }
   int any_fail = 0;
+#ifdef BFG_STATS
+  struct op_category *cats = calloc(n_img, sizeof(struct op_category));
+  unsigned int n_cat = 0;
+#endif
 
   for (unsigned int i = 0; i < n_img; i++) {
-    struct png_data png;
+    struct source src;
     struct bfg_raw raw;
     bfg_header_t header;
     uint32_t bfg_len = 0;
 
+    memset(&stats_arr[i], 0, sizeof(stats_arr[i]));
+    for (int c = 0; c < PERF_N_COUNTERS; c++) {
+      stats_arr[i].enc_perf[c] = stats_arr[i].dec_perf[c] = PERF_NA;
+    }
     stats_arr[i].verified = -1; /* default: skipped */
+    img_begin = trace_begin();
 
     /* write file basename to stats struct */
-    char *base = basename(argv[i + 1]);
+    char *base = basename(argv[argi + i]);
     memset(stats_arr[i].name, 0, sizeof(stats_arr[i].name));
     strncpy(stats_arr[i].name, base, FILENAME_LEN);
 
-    if (libpng_read(argv[i + 1], &png)) {
-      fprintf(stderr, "Could not open file %s\n", argv[i + 1]);
+    if (source_read(argv[argi + i], base, &src, &raw,
+                    &stats_arr[i].png_read_millis)) {
       continue;
     }
-
-    begin = clock();
-    if (libpng_decode(&png, &raw)) {
-      fprintf(stderr, "Could not decode file %s\n", argv[i + 1]);
-      libpng_free(&png);
+    if (src.is16) {
+      evaluate16(&src, base, use_perf ? &perf : NULL, &stats_arr[i]);
+      any_fail |= stats_arr[i].verified == 0;
+      source_free(&src, &raw);
+      trace_end(img_begin, "image", "image", base);
       continue;
     }
-    stats_arr[i].png_dec_millis = MILLIS_SINCE(begin);
 
     /* encode to BFG */
-    begin = clock();
-    bfg_img_t img = bfg_encode(&raw, &header, &bfg_len);
-    stats_arr[i].bfg_enc_millis = MILLIS_SINCE(begin);
+#ifdef BFG_STATS
+    bfg_stats_reset();
+#endif
+#ifdef BFG_MEMSTATS
+    uint64_t live = mem_start();
+#endif
+    begin = trace_begin();
+    if (use_perf) perf_start(&perf);
+    bfg_img_t img = bfg_encode_opts(&raw, &opts, &header, &bfg_len);
+    if (use_perf) perf_stop(&perf);
+#ifdef BFG_MEMSTATS
+    stats_arr[i].enc_mem = mem_since(live);
+#endif
+    stats_arr[i].bfg_enc_millis = trace_end(begin, "bfg_encode", "bfg", base);
+    if (use_perf) {
+      memcpy(stats_arr[i].enc_perf, perf.value, sizeof(perf.value));
+    }
+#ifdef BFG_STATS
+    if (img && op_stats) {
+      /* category: the directory the image is in */
+      char dir_path[strlen(argv[argi + i]) + 1];
+      strcpy(dir_path, argv[argi + i]);
+      const char *cat_name = basename(dirname(dir_path));
+      unsigned int c = 0;
+      while (c < n_cat && strncmp(cats[c].name, cat_name, FILENAME_LEN)) c++;
+      if (c == n_cat) strncpy(cats[n_cat++].name, cat_name, FILENAME_LEN);
+      bfg_stats_t s;
+      bfg_stats_get(&s);
+      add_op_stats(&cats[c].stats, &s);
+      cats[c].n_img++;
+    }
+#endif
     if (!img) {
-      fprintf(stderr, "Could not encode file %s\n", argv[i + 1]);
-      bfg_free_raw(&raw);
-      libpng_free(&png);
+      fprintf(stderr, "Could not encode file %s\n", argv[argi + i]);
+      source_free(&src, &raw);
       continue;
     }
 
@@ -94,56 +488,73 @@ int main(int argc, char **argv) {
     mkdir(out_path, 0777);
     strcat(out_path, base);
     strcat(out_path, ".bfg");
+    begin = trace_begin();
     if (bfg_write(out_path, &header, img, bfg_len)) {
       fprintf(stderr, "Could not write file %s\n", out_path);
       bfg_free_img(img);
-      bfg_free_raw(&raw);
-      libpng_free(&png);
+      source_free(&src, &raw);
       continue;
     }
+    stats_arr[i].bfg_write_millis = trace_end(begin, "bfg_write", "io", base);
 
     /* read back and decode */
     bfg_header_t header_in;
     uint32_t data_in_len = 0;
+    begin = trace_begin();
     uint8_t *data_in = bfg_read(out_path, &header_in, &data_in_len);
     if (!data_in) {
       fprintf(stderr, "Could not read file %s\n", out_path);
       bfg_free_img(img);
-      bfg_free_raw(&raw);
-      libpng_free(&png);
+      source_free(&src, &raw);
       continue;
     }
+    stats_arr[i].bfg_read_millis = trace_end(begin, "bfg_read", "io", base);
 
     struct bfg_raw raw_in;
-    begin = clock();
-    if (bfg_decode(&header_in, data_in, data_in_len, &raw_in)) {
+#ifdef BFG_MEMSTATS
+    live = mem_start();
+#endif
+    begin = trace_begin();
+    if (use_perf) perf_start(&perf);
+    int dec_err = bfg_decode(&header_in, data_in, data_in_len, &raw_in);
+    if (use_perf) perf_stop(&perf);
+#ifdef BFG_MEMSTATS
+    stats_arr[i].dec_mem = mem_since(live);
+#endif
+    if (dec_err) {
       fprintf(stderr, "Could not decode BFG %s\n", out_path);
       bfg_free_img(data_in);
       bfg_free_img(img);
-      bfg_free_raw(&raw);
-      libpng_free(&png);
+      source_free(&src, &raw);
       continue;
     }
-    stats_arr[i].bfg_dec_millis = MILLIS_SINCE(begin);
+    stats_arr[i].bfg_dec_millis = trace_end(begin, "bfg_decode", "bfg", base);
+    if (use_perf) {
+      memcpy(stats_arr[i].dec_perf, perf.value, sizeof(perf.value));
+    }
 
-    /* pixel-perfect verification */
+    begin = trace_begin();
+
+    /* pixel-perfect verification, or within the error bound for R, G, B
+     * when near-lossless */
     int verified = 1;
     if (raw.width == raw_in.width && raw.height == raw_in.height &&
         raw.n_channels == raw_in.n_channels) {
       uint64_t total = (uint64_t)raw.width * raw.height * raw.n_channels;
       if (memcmp(raw.pixels, raw_in.pixels, (size_t)total) != 0) {
-        verified = 0;
-        any_fail = 1;
         /* find first mismatch for debugging */
         for (uint64_t j = 0; j < total; j++) {
-          if (raw.pixels[j] != raw_in.pixels[j]) {
+          uint32_t px_c = (uint32_t)(j % raw.n_channels);
+          int bound = px_c == 3 ? 0 : opts.max_error;
+          if (abs((int)raw.pixels[j] - (int)raw_in.pixels[j]) > bound) {
             uint64_t px_idx = j / raw.n_channels;
             uint32_t px_x = (uint32_t)(px_idx % raw.width);
             uint32_t px_y = (uint32_t)(px_idx / raw.width);
-            uint32_t px_c = (uint32_t)(j % raw.n_channels);
             fprintf(stderr,
                     "  MISMATCH %s: pixel (%u,%u) ch%u: expected %u got %u\n",
                     base, px_x, px_y, px_c, raw.pixels[j], raw_in.pixels[j]);
+            verified = 0;
+            any_fail = 1;
             break;
           }
         }
@@ -154,31 +565,52 @@ int main(int argc, char **argv) {
       fprintf(stderr, "  MISMATCH %s: dimensions differ\n", base);
     }
     stats_arr[i].verified = verified;
+    trace_end(begin, "verify", "check", base);
 
-    /* write decoded result as PNG for visual inspection */
-    strcat(out_path, ".png");
-    begin = clock();
-    if (libpng_write(out_path, &raw_in)) {
-      fprintf(stderr, "Could not write file %s\n", out_path);
+    /* write decoded result for visual inspection, in the input's format */
+    begin = trace_begin();
+    if (src.is_pnm) {
+      strcat(out_path, raw_in.n_channels == 4 ? ".pam" : ".ppm");
+      if (pnm_write(out_path, &raw_in)) {
+        fprintf(stderr, "Could not write file %s\n", out_path);
+      }
+      stats_arr[i].png_write_millis =
+          trace_end(begin, "pnm_write", "pnm", base);
+    } else {
+      strcat(out_path, ".png");
+      if (libpng_write(out_path, &raw_in)) {
+        fprintf(stderr, "Could not write file %s\n", out_path);
+      }
+      stats_arr[i].png_write_millis =
+          trace_end(begin, "libpng_write", "png", base);
     }
-    stats_arr[i].png_enc_millis = MILLIS_SINCE(begin);
 
     /* stats */
     stats_arr[i].raw_bytes = raw.width * raw.height * raw.n_channels;
-    fseek(png.fp, 0L, SEEK_END);
-    stats_arr[i].png_bytes = ftell(png.fp);
+    stats_arr[i].png_bytes = source_bytes(&src);
     stats_arr[i].bfg_bytes = bfg_len + BFG_HEADER_SIZE;
+    stats_arr[i].pixels = (uint64_t)raw.width * raw.height;
 
     /* cleanup */
     bfg_free_raw(&raw_in);
     bfg_free_img(data_in);
     bfg_free_img(img);
-    bfg_free_raw(&raw);
-    libpng_free(&png);
+    source_free(&src, &raw);
+    trace_end(img_begin, "image", "image", base);
   }
 
+  if (trace_close()) fprintf(stderr, "Could not write trace\n");
   print_stats(stats_arr, n_img);
+  if (use_perf) print_perf(stats_arr, n_img);
+#ifdef BFG_MEMSTATS
+  print_mem(stats_arr, n_img);
+#endif
+  if (use_perf) perf_close(&perf);
   free(stats_arr);
+#ifdef BFG_STATS
+  for (unsigned int c = 0; c < n_cat; c++) print_op_stats(&cats[c]);
+  free(cats);
+#endif
 
   if (any_fail) {
     fprintf(stderr, "\nSome images FAILED pixel-perfect verification!\n");
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "perf.h"
+#include <string.h>
+
+static const char *const names[PERF_N_COUNTERS] = {
+    "cycles", "instr", "br-miss", "L1d-miss", "LLC-miss"};
+
+const char *perf_name(int counter) {
+  return counter >= 0 && counter < PERF_N_COUNTERS ? names[counter] : "?";
+}
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} events[PERF_N_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+int perf_open(perf_counters_t *pc) {
+  int n = 0;
+  for (int i = 0; i < PERF_N_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    pc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    pc->value[i] = PERF_NA;
+    if (pc->fd[i] >= 0) n++;
+  }
+  return n;
+}
+
+void perf_start(perf_counters_t *pc) {
+  for (int i = 0; i < PERF_N_COUNTERS; i++) {
+    if (pc->fd[i] < 0) continue;
+    ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void perf_stop(perf_counters_t *pc) {
+  for (int i = 0; i < PERF_N_COUNTERS; i++) {
+    if (pc->fd[i] >= 0) ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (int i = 0; i < PERF_N_COUNTERS; i++) {
+    uint64_t v[3]; /* value, time enabled, time running */
+    pc->value[i] = PERF_NA;
+    if (pc->fd[i] < 0 || read(pc->fd[i], v, sizeof(v)) != sizeof(v)) continue;
+    if (v[2] == 0) continue; /* never got scheduled on the PMU */
+    pc->value[i] = v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+  }
+}
+
+void perf_close(perf_counters_t *pc) {
+  for (int i = 0; i < PERF_N_COUNTERS; i++) {
+    if (pc->fd[i] >= 0) close(pc->fd[i]);
+    pc->fd[i] = -1;
+  }
+}
+#else
+int perf_open(perf_counters_t *pc) {
+  for (int i = 0; i < PERF_N_COUNTERS; i++) {
+    pc->fd[i] = -1;
+    pc->value[i] = PERF_NA;
+  }
+  return 0;
+}
+
+void perf_start(perf_counters_t *pc) { (void)pc; }
+void perf_stop(perf_counters_t *pc) { (void)pc; }
+void perf_close(perf_counters_t *pc) { (void)pc; }
+#endif
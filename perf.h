@@ -0,0 +1,45 @@
+#ifndef BFG_PERF_H
+#define BFG_PERF_H
+
+#include <stdint.h>
+
+/* ----------------------------- */
+/* Hardware performance counters */
+/* ----------------------------- */
+
+#define PERF_CYCLES       0
+#define PERF_INSTRUCTIONS 1
+#define PERF_BRANCH_MISS  2
+#define PERF_L1D_MISS     3 /* L1 data cache read misses */
+#define PERF_LLC_MISS     4 /* last level cache misses */
+#define PERF_N_COUNTERS   5
+
+/* Counter value that could not be measured. */
+#define PERF_NA UINT64_MAX
+
+/* User-space counters of the calling thread, via perf_event_open on Linux.
+ * Each counter is opened on its own so that the ones the machine lacks
+ * (common in VMs) don't take down the rest. */
+typedef struct perf_counters {
+  int fd[PERF_N_COUNTERS];          /* -1 when unavailable */
+  uint64_t value[PERF_N_COUNTERS];  /* last measurement, or PERF_NA */
+} perf_counters_t;
+
+/* Opens the counters. Returns the number available; with 0 (no kernel
+ * support, no permission, not Linux) start and stop are no-ops and every
+ * value is PERF_NA. */
+int perf_open(perf_counters_t *pc);
+
+/* Resets and starts the counters. */
+void perf_start(perf_counters_t *pc);
+
+/* Stops the counters and reads them into pc->value, scaled up if the
+ * kernel had to multiplex them. */
+void perf_stop(perf_counters_t *pc);
+
+void perf_close(perf_counters_t *pc);
+
+/* Short counter name, e.g. "cycles". */
+const char *perf_name(int counter);
+
+#endif /* BFG_PERF_H */
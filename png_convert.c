@@ -51,10 +51,9 @@ int libpng_read(char *fpath, png_data_t png) {
   png_set_sig_bytes(png->png_ptr, 8);
   png_read_info(png->png_ptr, png->info_ptr);
 
-  /* expand palette and tRNS to full RGBA */
+  /* expand palette and tRNS to full RGBA; 16-bit samples are kept, for
+   * libpng_decode16 */
   png_set_expand(png->png_ptr);
-  /* convert 16-bit to 8-bit */
-  png_set_strip_16(png->png_ptr);
   /* unpack sub-byte depths */
   png_set_packing(png->png_ptr);
 
@@ -93,10 +92,19 @@ int libpng_decode(png_data_t png, bfg_raw_t raw) {
   uint64_t total_bytes = (uint64_t)raw->width * raw->height * raw->n_channels;
   if (total_bytes > UINT32_MAX) return 1;
 
-  raw->pixels = malloc((size_t)total_bytes);
+  /* released with bfg_free_raw */
+  raw->pixels = (uint8_t *)BFG_MALLOC((size_t)total_bytes);
   if (!raw->pixels) return 1;
 
-  png_uint_32 row_bytes = png_get_rowbytes(png->png_ptr, png->info_ptr);
+  size_t row_bytes = (size_t)raw->width * raw->n_channels;
+  if (libpng_is16(png)) {
+    /* the high byte of each big-endian sample, as png_set_strip_16 */
+    for (png_uint_32 y = 0; y < raw->height; y++) {
+      uint8_t *dst = raw->pixels + y * row_bytes;
+      for (size_t i = 0; i < row_bytes; i++) dst[i] = png->row_ptrs[y][i * 2];
+    }
+    return 0;
+  }
   for (png_uint_32 y = 0; y < raw->height; y++) {
     memcpy(raw->pixels + y * row_bytes, png->row_ptrs[y], row_bytes);
   }
@@ -104,9 +112,45 @@ int libpng_decode(png_data_t png, bfg_raw_t raw) {
   return 0;
 }
 
-int libpng_write(char *fpath, bfg_raw_t raw) {
+int libpng_is16(png_data_t png) {
+  return png && png_get_bit_depth(png->png_ptr, png->info_ptr) == 16;
+}
+
+int libpng_decode16(png_data_t png, bfg_raw16_t raw) {
+  if (!png || !raw) return 1;
+
+  raw->width = png_get_image_width(png->png_ptr, png->info_ptr);
+  raw->height = png_get_image_height(png->png_ptr, png->info_ptr);
+  raw->n_channels = png_get_channels(png->png_ptr, png->info_ptr);
+  if (raw->n_channels < 3 || raw->n_channels > 4) return 1;
+
+  uint64_t total = (uint64_t)raw->width * raw->height * raw->n_channels;
+  if (total > UINT32_MAX / 2) return 1;
+
+  /* released with bfg_free_raw16 */
+  raw->pixels = (uint16_t *)BFG_MALLOC((size_t)total * sizeof(uint16_t));
+  if (!raw->pixels) return 1;
+
+  /* 8-bit samples are scaled up by 257, so that 255 becomes 65535 */
+  const int wide = libpng_is16(png);
+  size_t row_len = (size_t)raw->width * raw->n_channels;
+  for (png_uint_32 y = 0; y < raw->height; y++) {
+    const png_byte *src = png->row_ptrs[y];
+    uint16_t *dst = raw->pixels + y * row_len;
+    for (size_t i = 0; i < row_len; i++) {
+      dst[i] = wide ? (uint16_t)(src[i * 2] << 8 | src[i * 2 + 1])
+                    : (uint16_t)(src[i] * 257);
+    }
+  }
+
+  return 0;
+}
+
+/* Writes packed w x h pixels of ch channels, 8 or 16 bits (native byte
+ * order) each, to a PNG file at fpath. */
+static int libpng_write_px(char *fpath, uint32_t w, uint32_t h, uint8_t ch,
+                           int depth, const void *pixels) {
   struct png_data png;
-  if (!fpath || !raw) return 1;
 
   png.row_ptrs = NULL;
   png.file_mode = 'w';
@@ -123,22 +167,28 @@ int libpng_write(char *fpath, bfg_raw_t raw) {
   png_init_io(png.png_ptr, png.fp);
 
   png_byte color_type;
-  switch (raw->n_channels) {
+  switch (ch) {
   case 3: color_type = PNG_COLOR_TYPE_RGB; break;
   case 4: color_type = PNG_COLOR_TYPE_RGB_ALPHA; break;
   default:
-    fprintf(stderr, "Image with %d channels not supported\n", raw->n_channels);
+    fprintf(stderr, "Image with %d channels not supported\n", ch);
     return 1;
   }
 
-  png_set_IHDR(png.png_ptr, png.info_ptr, raw->width, raw->height, 8,
-               color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+  png_set_IHDR(png.png_ptr, png.info_ptr, w, h, depth, color_type,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
                PNG_FILTER_TYPE_DEFAULT);
   png_write_info(png.png_ptr, png.info_ptr);
 
-  png_uint_32 row_bytes = raw->width * raw->n_channels;
-  for (png_uint_32 y = 0; y < raw->height; y++) {
-    png_write_row(png.png_ptr, raw->pixels + FLAT_INDEX(0, y, row_bytes));
+  /* PNG stores 16-bit samples big-endian */
+  const uint16_t one = 1;
+  if (depth == 16 && *(const uint8_t *)&one) png_set_swap(png.png_ptr);
+
+  size_t row_bytes = (size_t)w * ch * (depth / 8);
+  for (png_uint_32 y = 0; y < h; y++) {
+    png_write_row(png.png_ptr,
+                  (png_const_bytep)pixels + FLAT_INDEX(0, (size_t)y,
+                                                       row_bytes));
   }
 
   png_write_end(png.png_ptr, NULL);
@@ -146,3 +196,133 @@ int libpng_write(char *fpath, bfg_raw_t raw) {
 
   return 0;
 }
+
+int libpng_write(char *fpath, bfg_raw_t raw) {
+  if (!fpath || !raw) return 1;
+  return libpng_write_px(fpath, raw->width, raw->height, raw->n_channels, 8,
+                         raw->pixels);
+}
+
+int libpng_write16(char *fpath, bfg_raw16_t raw) {
+  if (!fpath || !raw) return 1;
+  return libpng_write_px(fpath, raw->width, raw->height, raw->n_channels, 16,
+                         raw->pixels);
+}
+
+/* ---- in-memory PNG ---- */
+
+struct png_mem {
+  uint8_t *data;
+  size_t len, pos, cap;
+};
+
+static void png_mem_read(png_structp png_ptr, png_bytep out, png_size_t len) {
+  struct png_mem *mem = png_get_io_ptr(png_ptr);
+  if (len > mem->len - mem->pos) png_error(png_ptr, "truncated png");
+  memcpy(out, mem->data + mem->pos, len);
+  mem->pos += len;
+}
+
+static void png_mem_write(png_structp png_ptr, png_bytep in, png_size_t len) {
+  struct png_mem *mem = png_get_io_ptr(png_ptr);
+  if (len > mem->cap - mem->len) {
+    size_t cap = mem->cap ? mem->cap : 4096;
+    while (len > cap - mem->len) cap *= 2;
+    uint8_t *grown = realloc(mem->data, cap);
+    if (!grown) png_error(png_ptr, "out of memory");
+    mem->data = grown;
+    mem->cap = cap;
+  }
+  memcpy(mem->data + mem->len, in, len);
+  mem->len += len;
+}
+
+static void png_mem_flush(png_structp png_ptr) { (void)png_ptr; }
+
+int libpng_decode_mem(const uint8_t *data, size_t len, bfg_raw_t raw) {
+  if (!data || !raw || len < 8 || png_sig_cmp(data, 0, 8)) return 1;
+  struct png_mem mem = {(uint8_t *)data, len, 8, 0};
+  raw->pixels = NULL;
+
+  png_structp png_ptr =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr) return 1;
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  /* volatile: set before and read after a longjmp */
+  png_bytep *volatile rows = NULL;
+  if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    free(rows);
+    bfg_free_raw(raw);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 1;
+  }
+
+  png_set_read_fn(png_ptr, &mem, png_mem_read);
+  png_set_sig_bytes(png_ptr, 8);
+  png_read_info(png_ptr, info_ptr);
+  png_set_expand(png_ptr);
+  png_set_strip_16(png_ptr);
+  png_set_packing(png_ptr);
+  png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+  if (color_type == PNG_COLOR_TYPE_GRAY ||
+      color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+    png_set_gray_to_rgb(png_ptr);
+  }
+  png_read_update_info(png_ptr, info_ptr);
+
+  raw->width = png_get_image_width(png_ptr, info_ptr);
+  raw->height = png_get_image_height(png_ptr, info_ptr);
+  raw->n_channels = png_get_channels(png_ptr, info_ptr);
+  uint64_t total_bytes = (uint64_t)raw->width * raw->height * raw->n_channels;
+  if (raw->n_channels < 3 || raw->n_channels > 4 || total_bytes > UINT32_MAX)
+    png_error(png_ptr, "unsupported png");
+
+  /* rows point straight into the pixel buffer, no per-row copies */
+  raw->pixels = (uint8_t *)BFG_MALLOC((size_t)total_bytes);
+  rows = malloc(raw->height * sizeof(png_bytep));
+  if (!raw->pixels || !rows) png_error(png_ptr, "out of memory");
+  png_uint_32 row_bytes = raw->width * raw->n_channels;
+  for (png_uint_32 y = 0; y < raw->height; y++) {
+    rows[y] = raw->pixels + FLAT_INDEX(0, (size_t)y, row_bytes);
+  }
+  png_read_image(png_ptr, rows);
+  png_read_end(png_ptr, NULL);
+
+  free(rows);
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  return 0;
+}
+
+int libpng_encode_mem(bfg_raw_t raw, uint8_t **out, size_t *out_len) {
+  if (!raw || !out || !out_len) return 1;
+  if (raw->n_channels != 3 && raw->n_channels != 4) return 1;
+  struct png_mem mem = {NULL, 0, 0, 0};
+
+  png_structp png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr) return 1;
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    free(mem.data);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 1;
+  }
+
+  png_set_write_fn(png_ptr, &mem, png_mem_write, png_mem_flush);
+  png_set_IHDR(png_ptr, info_ptr, raw->width, raw->height, 8,
+               raw->n_channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA
+                                    : PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  png_uint_32 row_bytes = raw->width * raw->n_channels;
+  for (png_uint_32 y = 0; y < raw->height; y++) {
+    png_write_row(png_ptr, raw->pixels + FLAT_INDEX(0, (size_t)y, row_bytes));
+  }
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  *out = mem.data;
+  *out_len = mem.len;
+  return 0;
+}
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pnm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define TOKEN_LEN 16
+
+/* ---- header parsing ---- */
+
+/* Skips whitespace and # comments, which run to the end of the line. */
+static void skip_space(const uint8_t *p, size_t len, size_t *pos) {
+  while (*pos < len) {
+    if (p[*pos] == '#') {
+      while (*pos < len && p[*pos] != '\n') (*pos)++;
+    } else if (p[*pos] == ' ' || (p[*pos] >= '\t' && p[*pos] <= '\r')) {
+      (*pos)++;
+    } else {
+      break;
+    }
+  }
+}
+
+/* Reads the next whitespace-separated token into tok. Returns 0 on
+ * success, nonzero if there is none or it does not fit. */
+static int next_token(const uint8_t *p, size_t len, size_t *pos,
+                      char tok[TOKEN_LEN]) {
+  skip_space(p, len, pos);
+  size_t n = 0;
+  while (*pos < len && p[*pos] > ' ' && p[*pos] != '#') {
+    if (n + 1 == TOKEN_LEN) return 1;
+    tok[n++] = (char)p[(*pos)++];
+  }
+  tok[n] = '\0';
+  return n == 0;
+}
+
+static int next_number(const uint8_t *p, size_t len, size_t *pos,
+                       uint32_t *out) {
+  char tok[TOKEN_LEN];
+  if (next_token(p, len, pos, tok)) return 1;
+  uint64_t v = 0;
+  for (const char *c = tok; *c; c++) {
+    if (*c < '0' || *c > '9') return 1;
+    v = v * 10 + (uint64_t)(*c - '0');
+    if (v > UINT32_MAX) return 1;
+  }
+  *out = (uint32_t)v;
+  return 0;
+}
+
+/* P6: width, height and maxval, then a single whitespace byte. */
+static int parse_ppm(const uint8_t *p, size_t len, size_t *pos,
+                     struct bfg_raw *raw) {
+  uint32_t maxval;
+  if (next_number(p, len, pos, &raw->width) ||
+      next_number(p, len, pos, &raw->height) ||
+      next_number(p, len, pos, &maxval) || maxval != 255 || *pos >= len) {
+    return 1;
+  }
+  (*pos)++;
+  raw->n_channels = 3;
+  return 0;
+}
+
+/* P7: KEY value lines in any order up to ENDHDR and its newline. */
+static int parse_pam(const uint8_t *p, size_t len, size_t *pos,
+                     struct bfg_raw *raw) {
+  uint32_t width = 0, height = 0, depth = 0, maxval = 0;
+  char key[TOKEN_LEN], type[TOKEN_LEN] = "";
+  for (;;) {
+    if (next_token(p, len, pos, key)) return 1;
+    if (strcmp(key, "ENDHDR") == 0) break;
+    uint32_t *num = NULL;
+    if (strcmp(key, "WIDTH") == 0) num = &width;
+    else if (strcmp(key, "HEIGHT") == 0) num = &height;
+    else if (strcmp(key, "DEPTH") == 0) num = &depth;
+    else if (strcmp(key, "MAXVAL") == 0) num = &maxval;
+    else if (strcmp(key, "TUPLTYPE") != 0) return 1;
+    if (num ? next_number(p, len, pos, num) : next_token(p, len, pos, type)) {
+      return 1;
+    }
+  }
+  if (*pos >= len || p[*pos] != '\n') return 1;
+  (*pos)++;
+
+  /* no tuple type is taken to mean what the depth says */
+  int rgb = depth == 3 && (!type[0] || strcmp(type, "RGB") == 0);
+  int rgba = depth == 4 && (!type[0] || strcmp(type, "RGB_ALPHA") == 0);
+  if (maxval != 255 || (!rgb && !rgba)) return 1;
+  raw->width = width;
+  raw->height = height;
+  raw->n_channels = (uint8_t)depth;
+  return 0;
+}
+
+/* ---- files ---- */
+
+int pnm_read(const char *fpath, pnm_image_t *img) {
+  if (!fpath || !img) return 1;
+  memset(img, 0, sizeof(*img));
+  int fd = open(fpath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 1;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 2) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+               fd, 0);
+  }
+  close(fd); /* the mapping keeps the file */
+  if (map == MAP_FAILED) return 1;
+  img->map = map;
+  img->map_len = (size_t)st.st_size;
+
+  const uint8_t *p = map;
+  size_t pos = 2;
+  int err = 1;
+  if (p[0] == 'P' && p[1] == '6') {
+    err = parse_ppm(p, img->map_len, &pos, &img->raw);
+  } else if (p[0] == 'P' && p[1] == '7') {
+    err = parse_pam(p, img->map_len, &pos, &img->raw);
+  }
+
+  uint64_t bytes =
+      (uint64_t)img->raw.width * img->raw.height * img->raw.n_channels;
+  if (err || bytes == 0 || bytes > UINT32_MAX || bytes > img->map_len - pos) {
+    pnm_free(img);
+    return 1;
+  }
+  img->raw.pixels = (uint8_t *)map + pos;
+  /* the encoder reads it front to back, once */
+  posix_madvise(map, img->map_len, POSIX_MADV_SEQUENTIAL);
+  return 0;
+}
+
+void pnm_free(pnm_image_t *img) {
+  if (!img) return;
+  if (img->map) munmap(img->map, img->map_len);
+  memset(img, 0, sizeof(*img));
+}
+
+int pnm_write(const char *fpath, const struct bfg_raw *raw) {
+  if (!fpath || !raw || !raw->pixels) return 1;
+  char hdr[128];
+  int hdr_len;
+  if (raw->n_channels == 3) {
+    hdr_len = snprintf(hdr, sizeof(hdr), "P6\n%u %u\n255\n", raw->width,
+                       raw->height);
+  } else if (raw->n_channels == 4) {
+    hdr_len = snprintf(hdr, sizeof(hdr),
+                       "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+                       "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                       raw->width, raw->height);
+  } else {
+    return 1;
+  }
+
+  int fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) return 1;
+  size_t len = (size_t)raw->width * raw->height * raw->n_channels;
+  struct iovec iov[2] = {{hdr, (size_t)hdr_len}, {raw->pixels, len}};
+  struct iovec *v = iov;
+  int n = 2, err = 0;
+  while (n && !err) {
+    ssize_t done = writev(fd, v, n);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) err = 1;
+    /* a large write may be cut short: carry on from there */
+    for (; !err && n && (size_t)done >= v->iov_len; v++, n--) {
+      done -= v->iov_len;
+    }
+    if (!err && n) {
+      v->iov_base = (uint8_t *)v->iov_base + done;
+      v->iov_len -= (size_t)done;
+    }
+  }
+  if (close(fd)) err = 1;
+  return err;
+}
+
+int pnm_path(const char *fpath) {
+  size_t n = fpath ? strlen(fpath) : 0;
+  return n > 4 && (strcasecmp(fpath + n - 4, ".ppm") == 0 ||
+                   strcasecmp(fpath + n - 4, ".pam") == 0);
+}
@@ -0,0 +1,40 @@
+#ifndef BFG_PNM_H
+#define BFG_PNM_H
+
+#include "bfg.h"
+#include <stddef.h>
+
+/* ------------------ */
+/* PAM/PPM conversion */
+/* ------------------ */
+
+/*
+Raw frames as binary Netpbm files, with no libpng or zlib in the way:
+P6 (PPM, RGB) and P7 (PAM, TUPLTYPE RGB or RGB_ALPHA), 8 bits per sample
+(MAXVAL 255). Reading maps the file and points the raw image at the pixels
+in the mapping, so nothing is copied or inflated before encoding.
+*/
+
+typedef struct pnm_image {
+  struct bfg_raw raw; /* pixels point into map */
+  void *map;
+  size_t map_len; /* the whole file */
+} pnm_image_t;
+
+/* Maps the PPM or PAM file at fpath and fills img. The mapping is private:
+ * writing to img->raw.pixels does not change the file. Release with
+ * pnm_free, not bfg_free_raw.
+ * Returns 0 on success, nonzero on failure. */
+int pnm_read(const char *fpath, pnm_image_t *img);
+
+/* Unmaps an image read with pnm_read. */
+void pnm_free(pnm_image_t *img);
+
+/* Writes raw image data to fpath: PPM for 3 channels, PAM for 4.
+ * Returns 0 on success, nonzero on failure. */
+int pnm_write(const char *fpath, const struct bfg_raw *raw);
+
+/* Nonzero if fpath ends in .ppm or .pam (any case). */
+int pnm_path(const char *fpath);
+
+#endif /* BFG_PNM_H */
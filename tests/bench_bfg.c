@@ -0,0 +1,537 @@
+/*
+ * bench_bfg.c - Microbenchmarks of the encoder and decoder on the synthetic
+ * images of test_bfg.c, with a regression check against a saved baseline.
+ * Compile: gcc -std=c99 -O3 -o bench_bfg bench_bfg.c bfg.c -I.
+ *
+ * Every case is timed over several runs of a fixed number of iterations
+ * and reported as the median in nanoseconds per pixel (per byte for the
+ * checksum), so one slow run from a busy machine does not count. With -c,
+ * each median is compared to the baseline's and any case slower by more
+ * than the threshold fails the run.
+ */
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include "../bfg.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RUNS 101
+#define MIN_RUN_NS 20000000u /* iterations per run are sized to this */
+#define NAME_LEN 31
+#define ICONS 64
+#define ICON_SIZE 32
+
+struct image {
+  const char *name;
+  struct bfg_raw raw;
+  bfg_opts_t opts;
+};
+
+struct result {
+  char name[NAME_LEN + 1];
+  double median; /* ns per pixel, or per byte for crc32c */
+  double spread; /* median absolute deviation, % of the median */
+  double mb_s;   /* raw megabytes per second at the median */
+};
+
+/* Thread CPU time: time spent descheduled does not count. */
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) return 0;
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double *v, int n) {
+  qsort(v, (size_t)n, sizeof(double), cmp_double);
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* ---- inputs: the test images, at sizes that take a while ---- */
+
+static struct bfg_raw make_raw(uint32_t w, uint32_t h, uint8_t ch) {
+  struct bfg_raw raw;
+  raw.width = w;
+  raw.height = h;
+  raw.n_channels = ch;
+  raw.pixels = (uint8_t *)calloc((size_t)w * h * ch, 1);
+  return raw;
+}
+
+static void set_px(struct bfg_raw *r, uint32_t x, uint32_t y, uint8_t rv,
+                   uint8_t gv, uint8_t bv, uint8_t av) {
+  size_t idx = ((size_t)y * r->width + x) * r->n_channels;
+  r->pixels[idx + 0] = rv;
+  r->pixels[idx + 1] = gv;
+  r->pixels[idx + 2] = bv;
+  if (r->n_channels == 4) r->pixels[idx + 3] = av;
+}
+
+/* smooth: mostly DELTA ops off bfg_predict */
+static struct bfg_raw h_gradient(void) {
+  struct bfg_raw r = make_raw(1024, 512, 3);
+  for (uint32_t y = 0; y < 512; y++) {
+    for (uint32_t x = 0; x < 1024; x++) {
+      uint8_t v = (uint8_t)(x / 4 + y);
+      set_px(&r, x, y, v, v, v, 255);
+    }
+  }
+  return r;
+}
+
+static struct bfg_raw v_gradient(void) {
+  struct bfg_raw r = make_raw(512, 1024, 4);
+  for (uint32_t y = 0; y < 1024; y++) {
+    for (uint32_t x = 0; x < 512; x++) {
+      set_px(&r, x, y, (uint8_t)y, (uint8_t)(255 - y), (uint8_t)(y / 2), 255);
+    }
+  }
+  return r;
+}
+
+/* two colors alternating: every pixel a bfg_hash cache hit */
+static struct bfg_raw checkerboard(void) {
+  struct bfg_raw r = make_raw(1024, 512, 3);
+  for (uint32_t y = 0; y < 512; y++) {
+    for (uint32_t x = 0; x < 1024; x++) {
+      uint8_t v = ((x + y) & 1) ? 255 : 0;
+      set_px(&r, x, y, v, v, v, 255);
+    }
+  }
+  return r;
+}
+
+/* incompressible: STORED blocks and the literal path */
+static struct bfg_raw noise(void) {
+  struct bfg_raw r = make_raw(512, 512, 4);
+  srand(12345);
+  for (size_t i = 0; i < (size_t)512 * 512 * 4; i++) {
+    r.pixels[i] = (uint8_t)(rand() & 0xFF);
+  }
+  return r;
+}
+
+/* long runs */
+static struct bfg_raw stripes(void) {
+  struct bfg_raw r = make_raw(1024, 512, 3);
+  for (uint32_t y = 0; y < 512; y++) {
+    for (uint32_t x = 0; x < 1024; x++) {
+      uint8_t v = (y % 8 < 4) ? 200 : 50;
+      set_px(&r, x, y, v, (uint8_t)(255 - v), 128, 255);
+    }
+  }
+  return r;
+}
+
+/* natural-ish: smooth patches with noise, the mix a photo gives */
+static struct bfg_raw patches(void) {
+  struct bfg_raw r = make_raw(1024, 512, 3);
+  srand(99999);
+  for (uint32_t y = 0; y < 512; y++) {
+    for (uint32_t x = 0; x < 1024; x++) {
+      uint8_t base = (uint8_t)((x / 32 + y / 32) * 7);
+      set_px(&r, x, y, (uint8_t)(base + (rand() % 8)),
+             (uint8_t)(base + 30 + (rand() % 8)),
+             (uint8_t)(base + 60 + (rand() % 8)), 255);
+    }
+  }
+  return r;
+}
+
+/* varying alpha: the alpha plane */
+static struct bfg_raw alpha_variation(void) {
+  struct bfg_raw r = make_raw(512, 512, 4);
+  for (uint32_t y = 0; y < 512; y++) {
+    for (uint32_t x = 0; x < 512; x++) {
+      set_px(&r, x, y, (uint8_t)(x * 4), (uint8_t)(y * 4),
+             (uint8_t)((x + y) * 2), (uint8_t)(x * 4));
+    }
+  }
+  return r;
+}
+
+/* an icon set: small RGBA images, shapes on transparent backgrounds with
+ * soft edges, each a little different */
+static struct bfg_raw icon(int i) {
+  struct bfg_raw r = make_raw(ICON_SIZE, ICON_SIZE, 4);
+  srand(1000 + i);
+  const int c = ICON_SIZE / 2, rad = 6 + i % 9;
+  const uint8_t cr = (uint8_t)rand(), cg = (uint8_t)rand(),
+                cb = (uint8_t)rand();
+  for (int y = 0; y < ICON_SIZE; y++) {
+    for (int x = 0; x < ICON_SIZE; x++) {
+      int d2 = (x - c) * (x - c) + (y - c) * (y - c);
+      int edge = rad * rad - d2;
+      uint8_t a = edge > 2 * rad ? 255 : edge > 0 ? (uint8_t)(255 * edge /
+                                                             (2 * rad)) : 0;
+      set_px(&r, (uint32_t)x, (uint32_t)y, (uint8_t)(cr + x + rand() % 4),
+             (uint8_t)(cg + y), (uint8_t)(cb + (x ^ y) % 16), a);
+    }
+  }
+  return r;
+}
+
+/* ---- timing ---- */
+
+/* One iteration of a kernel; returns nonzero on failure. */
+typedef int (*kernel_fn)(void *arg);
+
+struct enc_arg {
+  struct image *img;
+};
+
+struct dec_arg {
+  bfg_header_t header;
+  uint8_t *data;
+  uint32_t len;
+  bfg_format_t fmt;
+  uint8_t *out;
+  size_t out_len;
+};
+
+struct crc_arg {
+  uint8_t *buf;
+  size_t len;
+  uint32_t crc;
+};
+
+static int run_encode(void *arg) {
+  struct image *img = ((struct enc_arg *)arg)->img;
+  bfg_header_t header;
+  uint32_t len = 0;
+  bfg_img_t out = bfg_encode_opts(&img->raw, &img->opts, &header, &len);
+  bfg_free_img(out);
+  return out == NULL;
+}
+
+static int run_decode(void *arg) {
+  struct dec_arg *d = arg;
+  return bfg_decode_into(&d->header, d->data, d->len, &d->fmt, d->out,
+                         d->out_len);
+}
+
+/* A set of small images decoded one call each, or all in one batch. */
+struct icons_arg {
+  bfg_batch_item_t items[ICONS];
+  bfg_header_t headers[ICONS];
+};
+
+static int run_icons(void *arg) {
+  struct icons_arg *a = arg;
+  int err = 0;
+  for (int i = 0; i < ICONS; i++) {
+    bfg_batch_item_t *it = &a->items[i];
+    err |= bfg_decode_into(it->header, it->data, it->data_len, &it->fmt,
+                           it->pixels, it->pixels_len);
+  }
+  return err;
+}
+
+static int run_icons_batch(void *arg) {
+  struct icons_arg *a = arg;
+  return bfg_decode_batch(a->items, ICONS) != 0;
+}
+
+static int run_crc(void *arg) {
+  struct crc_arg *c = arg;
+  c->crc = bfg_crc32c(c->crc, c->buf, c->len);
+  return 0;
+}
+
+/* A kernel on one input, timed as iters iterations per run. units is what
+ * one iteration processes (pixels or bytes) and bytes the raw bytes it
+ * covers. */
+struct bench {
+  char name[NAME_LEN + 1];
+  kernel_fn fn;
+  void *arg;
+  double units, bytes;
+  uint64_t iters;
+  double per[MAX_RUNS]; /* ns per unit, one per run */
+};
+
+static void bench_add(struct bench *b, const char *name, kernel_fn fn,
+                      void *arg, double units, double bytes) {
+  memset(b, 0, sizeof(*b));
+  snprintf(b->name, sizeof(b->name), "%s", name);
+  b->fn = fn;
+  b->arg = arg;
+  b->units = units;
+  b->bytes = bytes;
+}
+
+/* Warms b up and sizes a run to MIN_RUN_NS. Returns nonzero if the kernel
+ * fails. */
+static int calibrate(struct bench *b) {
+  b->iters = 1;
+  for (;;) {
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < b->iters; i++) {
+      if (b->fn(b->arg)) return 1;
+    }
+    uint64_t dt = now_ns() - t0;
+    if (dt >= MIN_RUN_NS) return 0;
+    uint64_t want = dt ? b->iters * MIN_RUN_NS / dt + 1 : b->iters * 2;
+    b->iters = want > b->iters ? want : b->iters + 1;
+  }
+}
+
+static void run_once(struct bench *b, int r) {
+  uint64_t t0 = now_ns();
+  for (uint64_t i = 0; i < b->iters; i++) b->fn(b->arg);
+  b->per[r] = (double)(now_ns() - t0) / ((double)b->iters * b->units);
+}
+
+static void summarize(struct bench *b, int runs, struct result *res) {
+  double dev[MAX_RUNS];
+  memset(res, 0, sizeof(*res));
+  memcpy(res->name, b->name, sizeof(res->name));
+  res->median = median(b->per, runs);
+  for (int r = 0; r < runs; r++) {
+    dev[r] = b->per[r] > res->median ? b->per[r] - res->median
+                                     : res->median - b->per[r];
+  }
+  res->spread = res->median > 0 ? 100 * median(dev, runs) / res->median : 0;
+  res->mb_s =
+      res->median > 0 ? b->bytes / b->units / res->median * 1e3 : 0;
+}
+
+/* ---- baseline ---- */
+
+/* Reads a whole file, NUL-terminated. Returns NULL on failure. */
+static char *read_text(const char *fpath) {
+  FILE *fp = fopen(fpath, "rb");
+  if (!fp) return NULL;
+  char *text = NULL;
+  long len = -1;
+  if (fseek(fp, 0, SEEK_END) == 0) len = ftell(fp);
+  if (len >= 0 && fseek(fp, 0, SEEK_SET) == 0) text = malloc((size_t)len + 1);
+  if (text && fread(text, 1, (size_t)len, fp) != (size_t)len) {
+    free(text);
+    text = NULL;
+  }
+  if (text) text[len] = '\0';
+  fclose(fp);
+  return text;
+}
+
+/* Finds "name": value in a baseline written by write_json. Returns the
+ * value, or a negative number if the case is not there. */
+static double baseline_value(const char *text, const char *name) {
+  char key[NAME_LEN + 4];
+  snprintf(key, sizeof(key), "\"%.*s\"", NAME_LEN, name);
+  const char *p = strstr(text, key);
+  if (!p) return -1;
+  p += strlen(key);
+  while (*p == ' ' || *p == ':') p++;
+  char *end;
+  double v = strtod(p, &end);
+  return end == p ? -1 : v;
+}
+
+static int write_json(const char *fpath, const struct result *res, int n,
+                      int runs) {
+  FILE *fp = fopen(fpath, "w");
+  if (!fp) return 1;
+  fprintf(fp, "{\n  \"unit\": \"ns/px\",\n  \"runs\": %d,\n", runs);
+  fprintf(fp, "  \"results\": {\n");
+  for (int i = 0; i < n; i++) {
+    fprintf(fp, "    \"%s\": %.4f%s\n", res[i].name, res[i].median,
+            i + 1 < n ? "," : "");
+  }
+  fprintf(fp, "  }\n}\n");
+  return fclose(fp) != 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options]\n", prog);
+  fprintf(stderr, "  -r N     runs per case, median taken (default 11)\n");
+  fprintf(stderr, "  -f STR   only cases whose name contains STR\n");
+  fprintf(stderr, "  -o F     write the medians to F as JSON\n");
+  fprintf(stderr, "  -c F     compare against the baseline JSON F\n");
+  fprintf(stderr, "  -t PCT   slowdown that counts as a regression "
+                  "(default 10)\n");
+}
+
+int main(int argc, char **argv) {
+  int runs = 11;
+  double threshold = 10;
+  const char *filter = NULL, *out_path = NULL, *base_path = NULL;
+  for (int argi = 1; argi < argc; argi++) {
+    if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+      runs = atoi(argv[++argi]);
+      runs = runs < 1 ? 1 : runs > MAX_RUNS ? MAX_RUNS : runs;
+    } else if (strcmp(argv[argi], "-f") == 0 && argi + 1 < argc) {
+      filter = argv[++argi];
+    } else if (strcmp(argv[argi], "-o") == 0 && argi + 1 < argc) {
+      out_path = argv[++argi];
+    } else if (strcmp(argv[argi], "-c") == 0 && argi + 1 < argc) {
+      base_path = argv[++argi];
+    } else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+      threshold = atof(argv[++argi]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  char *baseline = NULL;
+  if (base_path && !(baseline = read_text(base_path))) {
+    fprintf(stderr, "Could not read baseline %s\n", base_path);
+    return 1;
+  }
+
+  struct image imgs[] = {
+      {"h_gradient_rgb", h_gradient(), {0}},
+      {"v_gradient_rgba", v_gradient(), {0}},
+      {"checkerboard_rgb", checkerboard(), {0}},
+      {"noise_rgba", noise(), {0}},
+      {"stripes_rgb", stripes(), {0}},
+      {"patches_rgb", patches(), {0}},
+      {"patches_ycocg_rgb", patches(), {0}},
+      {"alpha_variation_rgba", alpha_variation(), {0}},
+  };
+  const int n_img = (int)(sizeof(imgs) / sizeof(imgs[0]));
+  imgs[6].opts.transform = BFG_TRANSFORM_YCOCG;
+
+  enum { N_BENCH = 2 * sizeof(imgs) / sizeof(imgs[0]) + 3 };
+  static struct bench benches[N_BENCH];
+  struct result res[N_BENCH];
+  struct enc_arg enc[sizeof(imgs) / sizeof(imgs[0])];
+  struct dec_arg dec[sizeof(imgs) / sizeof(imgs[0])];
+  int n_res = 0, failed = 0;
+  char name[NAME_LEN + 1];
+  for (int i = 0; i < n_img; i++) {
+    struct image *img = &imgs[i];
+    double px = (double)img->raw.width * img->raw.height;
+    double bytes = px * img->raw.n_channels;
+
+    enc[i].img = img;
+    snprintf(name, sizeof(name), "enc/%s", img->name);
+    if (!filter || strstr(name, filter)) {
+      bench_add(&benches[n_res++], name, run_encode, &enc[i], px, bytes);
+    }
+
+    struct dec_arg *d = &dec[i];
+    d->data = img->raw.pixels ? bfg_encode_opts(&img->raw, &img->opts,
+                                                &d->header, &d->len)
+                              : NULL;
+    d->fmt.layout = img->raw.n_channels == 4 ? BFG_FMT_RGBA : BFG_FMT_RGB;
+    d->fmt.stride = 0;
+    d->out_len = (size_t)bytes;
+    d->out = malloc(d->out_len);
+    failed |= !d->data || !d->out;
+    snprintf(name, sizeof(name), "dec/%s", img->name);
+    if (!filter || strstr(name, filter)) {
+      bench_add(&benches[n_res++], name, run_decode, d, px, bytes);
+    }
+  }
+
+  /* a set of icons, decoded one at a time and as batches */
+  static struct icons_arg icons;
+  struct bfg_raw icon_raw[ICONS];
+  uint8_t *icon_data[ICONS];
+  const double icon_px = (double)ICONS * ICON_SIZE * ICON_SIZE;
+  for (int i = 0; i < ICONS; i++) {
+    bfg_batch_item_t *it = &icons.items[i];
+    icon_raw[i] = icon(i);
+    icon_data[i] = icon_raw[i].pixels
+                       ? bfg_encode(&icon_raw[i], &icons.headers[i],
+                                    &it->data_len)
+                       : NULL;
+    it->header = &icons.headers[i];
+    it->data = icon_data[i];
+    it->fmt.layout = BFG_FMT_RGBA;
+    it->fmt.stride = 0;
+    it->pixels_len = (size_t)ICON_SIZE * ICON_SIZE * 4;
+    it->pixels = malloc(it->pixels_len);
+    failed |= !it->data || !it->pixels;
+  }
+  if (!filter || strstr("dec/icons_rgba", filter)) {
+    bench_add(&benches[n_res++], "dec/icons_rgba", run_icons, &icons,
+              icon_px, icon_px * 4);
+  }
+  if (!filter || strstr("batch/icons_rgba", filter)) {
+    bench_add(&benches[n_res++], "batch/icons_rgba", run_icons_batch,
+              &icons, icon_px, icon_px * 4);
+  }
+
+  /* the checksum trailer, per byte */
+  struct crc_arg crc = {malloc(4 << 20), 4 << 20, 0};
+  failed |= !crc.buf;
+  if (!failed) {
+    for (size_t i = 0; i < crc.len; i++) crc.buf[i] = (uint8_t)(i * 131);
+  }
+  if (!filter || strstr("crc32c", filter)) {
+    bench_add(&benches[n_res++], "crc32c", run_crc, &crc, (double)crc.len,
+              (double)crc.len);
+  }
+
+  /* runs go round all the cases in turn, so a slow spell of the machine
+   * lands on every case alike instead of on whichever ran then */
+  for (int i = 0; i < n_res && !failed; i++) failed |= calibrate(&benches[i]);
+  for (int r = 0; r < runs && !failed; r++) {
+    for (int i = 0; i < n_res; i++) run_once(&benches[i], r);
+  }
+  for (int i = 0; i < n_res && !failed; i++) {
+    summarize(&benches[i], runs, &res[i]);
+  }
+
+  free(crc.buf);
+  for (int i = 0; i < ICONS; i++) {
+    bfg_free_img(icon_data[i]);
+    free(icons.items[i].pixels);
+    free(icon_raw[i].pixels);
+  }
+  for (int i = 0; i < n_img; i++) {
+    bfg_free_img(dec[i].data);
+    free(dec[i].out);
+    free(imgs[i].raw.pixels);
+  }
+  if (failed) {
+    fprintf(stderr, "A benchmark case failed to encode or decode\n");
+    free(baseline);
+    return 1;
+  }
+
+  printf("%-*s\tns/px\tMB/s\t+-%%", NAME_LEN, "case");
+  if (baseline) printf("\tbase\tchange");
+  printf("\n");
+  int regressions = 0;
+  for (int i = 0; i < n_res; i++) {
+    const struct result *r = &res[i];
+    printf("%-*s\t%.3f\t%.0f\t%.1f", NAME_LEN, r->name, r->median, r->mb_s,
+           r->spread);
+    if (baseline) {
+      double base = baseline_value(baseline, r->name);
+      if (base <= 0) {
+        printf("\t-\tnew");
+      } else {
+        double change = 100 * (r->median - base) / base;
+        int slower = change > threshold;
+        regressions += slower;
+        printf("\t%.3f\t%+.1f%%%s", base, change, slower ? "\tSLOWER" : "");
+      }
+    }
+    printf("\n");
+  }
+  free(baseline);
+
+  if (out_path && write_json(out_path, res, n_res, runs)) {
+    fprintf(stderr, "Could not write %s\n", out_path);
+    return 1;
+  }
+  if (regressions) {
+    fprintf(stderr, "\n%d case(s) slower than the baseline by more than "
+                    "%.0f%%\n", regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
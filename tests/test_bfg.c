@@ -1,14 +1,24 @@
 /*
  * test_bfg.c - Synthetic roundtrip tests for BFG2 encoder/decoder.
- * Compile: gcc -std=c99 -O2 -o test_bfg test_bfg.c bfg.c -I.
+ * Compile: gcc -std=c99 -O2 -o test_bfg test_bfg.c bfg.c bfg_archive.c
+ *          bfg_io.c pnm.c -I. -lpthread
  * (no libpng dependency for synthetic tests)
  */
 
+#define _POSIX_C_SOURCE 200809L /* pipes and fds for bfg_io */
+
 #include "../bfg.h"
+#include "../bfg_archive.h"
+#include "../bfg_io.h"
+#include "../pnm.h"
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
 static int tests_run = 0;
 static int tests_passed = 0;
@@ -33,13 +43,14 @@ static void set_px(struct bfg_raw *r, uint32_t x, uint32_t y, uint8_t rv,
   if (r->n_channels >= 4) r->pixels[idx + 3] = av;
 }
 
-/* Roundtrip test: encode then decode, compare pixels. */
-static int roundtrip_test(const char *name, struct bfg_raw *input) {
+/* Roundtrip test with encoder options: encode then decode, compare pixels. */
+static int roundtrip_test_opts(const char *name, struct bfg_raw *input,
+                               const bfg_opts_t *opts) {
   tests_run++;
   bfg_header_t header;
   uint32_t enc_len = 0;
 
-  uint8_t *enc = bfg_encode(input, &header, &enc_len);
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
   if (!enc) {
     printf("  FAIL %s: encode returned NULL\n", name);
     return 0;
@@ -89,6 +100,56 @@ static int roundtrip_test(const char *name, struct bfg_raw *input) {
   return !mismatch;
 }
 
+/* Roundtrip test with default encoder options. */
+static int roundtrip_test(const char *name, struct bfg_raw *input) {
+  return roundtrip_test_opts(name, input, NULL);
+}
+
+/* Near-lossless test: every R, G, B sample must decode within opts->max_error
+ * of the input, alpha exactly. Returns the encoded size, or 0 on failure. */
+static uint32_t near_lossless_test(const char *name, struct bfg_raw *input,
+                                   const bfg_opts_t *opts) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0;
+
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  if (!enc) {
+    printf("  FAIL %s: encode returned NULL\n", name);
+    return 0;
+  }
+
+  struct bfg_raw output;
+  if (bfg_decode(&header, enc, enc_len, &output)) {
+    printf("  FAIL %s: decode failed\n", name);
+    bfg_free_img(enc);
+    return 0;
+  }
+
+  uint64_t total = (uint64_t)input->width * input->height * input->n_channels;
+  int max_err = 0, bad = 0;
+  for (uint64_t i = 0; i < total; i++) {
+    int err = abs((int)input->pixels[i] - (int)output.pixels[i]);
+    if (err > max_err) max_err = err;
+    if ((i % input->n_channels == 3 && err) || err > opts->max_error) {
+      printf("  FAIL %s: sample %llu off by %d (bound %u)\n", name,
+             (unsigned long long)i, err, opts->max_error);
+      bad = 1;
+      break;
+    }
+  }
+
+  if (!bad) {
+    printf("  PASS %s (bound %u, max err %d, %.1f%% ratio, %u bytes)\n", name,
+           opts->max_error, max_err, 100.0 * enc_len / total, enc_len);
+    tests_passed++;
+  }
+
+  bfg_free_raw(&output);
+  bfg_free_img(enc);
+  return bad ? 0 : enc_len;
+}
+
 /* Also test file I/O roundtrip */
 static int file_roundtrip_test(const char *name, struct bfg_raw *input) {
   tests_run++;
@@ -143,6 +204,69 @@ static int file_roundtrip_test(const char *name, struct bfg_raw *input) {
 
 /* ---- test cases ---- */
 
+/* Decode into layout with pad bytes per row; compare against input
+ * converted by hand, and check the padding is untouched. */
+static void decode_into_test(const char *name, struct bfg_raw *input,
+                             const bfg_opts_t *opts, uint8_t layout,
+                             uint32_t pad) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0;
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  if (!enc) {
+    printf("  FAIL %s: encode returned NULL\n", name);
+    return;
+  }
+
+  uint32_t w = input->width, h = input->height, ch = input->n_channels;
+  uint32_t bpp = layout == BFG_FMT_RGB ? 3 : 4;
+  bfg_format_t fmt;
+  fmt.layout = layout;
+  fmt.stride = (size_t)w * bpp + pad;
+  size_t len = fmt.stride * h;
+  uint8_t *out = malloc(len);
+  memset(out, 0xCD, len);
+
+  int bad = 0;
+  if (bfg_decode_into(&header, enc, enc_len, &fmt, out, len)) {
+    printf("  FAIL %s: decode_into failed\n", name);
+    bad = 1;
+  }
+  for (uint32_t y = 0; y < h && !bad; y++) {
+    for (uint32_t x = 0; x < w && !bad; x++) {
+      const uint8_t *s = &input->pixels[(y * w + x) * ch];
+      const uint8_t *d = &out[y * fmt.stride + x * bpp];
+      uint32_t a = ch == 4 ? s[3] : 255;
+      uint8_t e[4] = {s[0], s[1], s[2], (uint8_t)a};
+      if (layout == BFG_FMT_RGBX) e[3] = 255;
+      if (layout == BFG_FMT_BGRA || layout == BFG_FMT_BGRA_PREMUL) {
+        e[0] = s[2];
+        e[2] = s[0];
+      }
+      if (layout == BFG_FMT_BGRA_PREMUL) {
+        for (int c = 0; c < 3; c++) e[c] = (uint8_t)((e[c] * a + 127) / 255);
+      }
+      if (memcmp(d, e, bpp) != 0) {
+        printf("  FAIL %s: pixel (%u,%u) mismatch\n", name, x, y);
+        bad = 1;
+      }
+    }
+    for (uint32_t k = 0; k < pad && !bad; k++) {
+      if (out[y * fmt.stride + w * bpp + k] != 0xCD) {
+        printf("  FAIL %s: row %u padding overwritten\n", name, y);
+        bad = 1;
+      }
+    }
+  }
+
+  if (!bad) {
+    printf("  PASS %s\n", name);
+    tests_passed++;
+  }
+  free(out);
+  bfg_free_img(enc);
+}
+
 static void test_solid_black(void) {
   struct bfg_raw r = make_raw(64, 64, 3);
   /* already all zeros = black */
@@ -218,6 +342,43 @@ static void test_random_noise(void) {
   free(r.pixels);
 }
 
+static void test_stored_blocks(void) {
+  /* noise RGB under constant and binary alpha: STORED carries 3 of 4
+   * channels and the decoder fills in alpha */
+  struct bfg_raw r = make_raw(300, 90, 4);
+  srand(2468);
+  for (uint32_t y = 0; y < 90; y++) {
+    for (uint32_t x = 0; x < 300; x++) {
+      set_px(&r, x, y, (uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(), 200);
+    }
+  }
+  roundtrip_test("stored_const_alpha_rgba", &r);
+  for (uint32_t y = 0; y < 90; y++) {
+    for (uint32_t x = 0; x < 300; x++) {
+      r.pixels[(y * 300 + x) * 4 + 3] = (x / 50 + y / 30) & 1 ? 255 : 0;
+    }
+  }
+  roundtrip_test("stored_alpha_plane_rgba", &r);
+  free(r.pixels);
+
+  /* noise interrupted by short runs, so blocks end at every size */
+  r = make_raw(97, 61, 3);
+  for (uint32_t i = 0; i < 97 * 61; i++) {
+    if (i % 7 == 6 || i % 300 < 5) {
+      memcpy(&r.pixels[i * 3], &r.pixels[(i ? i - 1 : 0) * 3], 3);
+    } else {
+      r.pixels[i * 3 + 0] = (uint8_t)rand();
+      r.pixels[i * 3 + 1] = (uint8_t)rand();
+      r.pixels[i * 3 + 2] = (uint8_t)rand();
+    }
+  }
+  roundtrip_test("stored_broken_runs_rgb", &r);
+  bfg_opts_t opts = {0};
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  roundtrip_test_opts("stored_broken_runs_ycocg_rgb", &r, &opts);
+  free(r.pixels);
+}
+
 static void test_1x1(void) {
   struct bfg_raw r = make_raw(1, 1, 3);
   r.pixels[0] = 42; r.pixels[1] = 100; r.pixels[2] = 200;
@@ -290,6 +451,1067 @@ static void test_large(void) {
   free(r.pixels);
 }
 
+static void test_ycocg(void) {
+  bfg_opts_t opts = {0};
+  opts.transform = BFG_TRANSFORM_YCOCG;
+
+  /* every 8-bit color must survive the mod-256 lifting transform */
+  struct bfg_raw r = make_raw(4096, 4096, 3);
+  for (uint32_t i = 0; i < 4096u * 4096u; i++) {
+    r.pixels[i * 3 + 0] = (uint8_t)(i >> 16);
+    r.pixels[i * 3 + 1] = (uint8_t)(i >> 8);
+    r.pixels[i * 3 + 2] = (uint8_t)i;
+  }
+  roundtrip_test_opts("ycocg_all_colors_rgb", &r, &opts);
+  free(r.pixels);
+
+  r = make_raw(640, 480, 4);
+  srand(4242);
+  for (uint32_t y = 0; y < 480; y++) {
+    for (uint32_t x = 0; x < 640; x++) {
+      uint8_t base = (uint8_t)((x + 2 * y) / 5);
+      set_px(&r, x, y, (uint8_t)(base + rand() % 4),
+             (uint8_t)(base / 2 + 40 + rand() % 4), (uint8_t)(200 - base),
+             (x < 320) ? 255 : (uint8_t)y);
+    }
+  }
+  roundtrip_test_opts("ycocg_smooth_rgba", &r, &opts);
+  free(r.pixels);
+}
+
+static void test_cache_configs(void) {
+  /* palette of 200 scattered colors exercises CACHE2 slots */
+  struct bfg_raw r = make_raw(256, 256, 4);
+  srand(777);
+  uint8_t pal[200][4];
+  for (int i = 0; i < 200; i++) {
+    for (int c = 0; c < 4; c++) pal[i][c] = (uint8_t)(rand() & 0xFF);
+  }
+  for (uint32_t i = 0; i < 256 * 256; i++) {
+    memcpy(&r.pixels[i * 4], pal[rand() % 200], 4);
+  }
+
+  static const uint16_t sizes[3] = {16, 64, 256};
+  char name[64];
+  for (int s = 0; s < 3; s++) {
+    for (uint8_t hash = BFG_HASH_XOR; hash <= BFG_HASH_MUL; hash++) {
+      bfg_opts_t opts = {0};
+      opts.cache_size = sizes[s];
+      opts.hash = hash;
+      snprintf(name, sizeof(name), "cache_%u_%s_rgba", sizes[s],
+               hash == BFG_HASH_MUL ? "mul" : "xor");
+      roundtrip_test_opts(name, &r, &opts);
+    }
+  }
+  free(r.pixels);
+
+  /* unsupported cache size must be rejected */
+  tests_run++;
+  r = make_raw(8, 8, 3);
+  bfg_opts_t bad = {0};
+  bad.cache_size = 32;
+  bfg_header_t header;
+  uint32_t len;
+  if (bfg_encode_opts(&r, &bad, &header, &len) == NULL) {
+    printf("  PASS cache_size_32_rejected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL cache_size_32_rejected\n");
+  }
+  free(r.pixels);
+}
+
+static void test_alpha_modes(void) {
+  /* constant, non-opaque alpha is moved to the header */
+  struct bfg_raw r = make_raw(96, 64, 4);
+  for (uint32_t y = 0; y < 64; y++) {
+    for (uint32_t x = 0; x < 96; x++) {
+      set_px(&r, x, y, (uint8_t)(x * 2), (uint8_t)(y * 3), (uint8_t)(x + y),
+             128);
+    }
+  }
+  tests_run++;
+  bfg_header_t header;
+  uint32_t len;
+  uint8_t *enc = bfg_encode(&r, &header, &len);
+  if (enc && (header.flags & BFG_FLAG_ALPHA_CONST) && header.alpha == 128) {
+    printf("  PASS const_alpha_detected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL const_alpha_detected\n");
+  }
+  bfg_free_img(enc);
+  roundtrip_test("const_alpha_128_rgba", &r);
+  file_roundtrip_test("const_alpha_128_rgba", &r);
+
+  /* binary alpha: disc on a transparent background */
+  for (uint32_t y = 0; y < 64; y++) {
+    for (uint32_t x = 0; x < 96; x++) {
+      int dx = (int)x - 48, dy = (int)y - 32;
+      uint8_t a = (dx * dx + dy * dy < 24 * 24) ? 255 : 0;
+      set_px(&r, x, y, (uint8_t)(x * 2), (uint8_t)(y * 3), (uint8_t)(x + y),
+             a);
+    }
+  }
+  tests_run++;
+  enc = bfg_encode(&r, &header, &len);
+  if (enc && (header.flags & BFG_FLAG_ALPHA_PLANE)) {
+    printf("  PASS alpha_plane_selected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL alpha_plane_selected\n");
+  }
+  bfg_free_img(enc);
+  roundtrip_test("binary_alpha_rgba", &r);
+
+  bfg_opts_t opts = {0};
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  roundtrip_test_opts("binary_alpha_interleaved_rgba", &r, &opts);
+  opts.alpha = BFG_ALPHA_AUTO;
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  opts.cache_size = 64;
+  roundtrip_test_opts("binary_alpha_ycocg_rgba", &r, &opts);
+  free(r.pixels);
+}
+
+static void test_near_lossless(void) {
+  /* smooth content with +-2 noise, the case near-lossless is meant for */
+  struct bfg_raw r = make_raw(320, 240, 3);
+  srand(1357);
+  for (uint32_t y = 0; y < 240; y++) {
+    for (uint32_t x = 0; x < 320; x++) {
+      set_px(&r, x, y, (uint8_t)(x / 2 + rand() % 5),
+             (uint8_t)(y + rand() % 5), (uint8_t)(x + y) / 3 + rand() % 5, 0);
+    }
+  }
+
+  bfg_opts_t opts = {0};
+  bfg_header_t header;
+  uint32_t lossless_len = 0;
+  bfg_free_img(bfg_encode(&r, &header, &lossless_len));
+
+  uint32_t prev_len = lossless_len;
+  char name[64];
+  for (uint8_t e = 1; e <= 2; e++) {
+    opts.max_error = e;
+    snprintf(name, sizeof(name), "near_lossless_e%u_rgb", e);
+    uint32_t len = near_lossless_test(name, &r, &opts);
+    tests_run++;
+    if (len && len < prev_len) {
+      printf("  PASS near_lossless_e%u_smaller (%u < %u bytes)\n", e, len,
+             prev_len);
+      tests_passed++;
+    } else {
+      printf("  FAIL near_lossless_e%u_smaller (%u vs %u bytes)\n", e, len,
+             prev_len);
+    }
+    prev_len = len;
+  }
+
+  opts.max_error = 2;
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  near_lossless_test("near_lossless_e2_ycocg_rgb", &r, &opts);
+  free(r.pixels);
+
+  /* RGBA noise with alpha plane: STORED blocks must hold the
+   * reconstruction, and alpha stays exact */
+  r = make_raw(200, 100, 4);
+  for (uint32_t y = 0; y < 100; y++) {
+    for (uint32_t x = 0; x < 200; x++) {
+      set_px(&r, x, y, (uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(),
+             (x / 20 + y / 10) & 1 ? 255 : 0);
+    }
+  }
+  opts.transform = BFG_TRANSFORM_NONE;
+  opts.max_error = 3;
+  near_lossless_test("near_lossless_e3_noise_rgba", &r, &opts);
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  near_lossless_test("near_lossless_e3_interleaved_rgba", &r, &opts);
+  free(r.pixels);
+}
+
+/* Mixed rows for the row pass: flat runs, noise, ramps, a checkerboard and
+ * noisy ramps, in zones that cut across the vector widths. A local LCG
+ * keeps the pixels, and so the expected streams, the same everywhere. */
+static struct bfg_raw row_pass_image(uint32_t w, uint32_t h, uint8_t ch,
+                                     int alpha, uint32_t seed) {
+  struct bfg_raw r = make_raw(w, h, ch);
+  for (uint32_t y = 0; y < h; y++) {
+    for (uint32_t x = 0; x < w; x++) {
+      uint8_t *p = &r.pixels[((size_t)y * w + x) * ch];
+      uint8_t n[4];
+      for (int i = 0; i < 4; i++) {
+        seed = seed * 1103515245u + 12345u;
+        n[i] = (uint8_t)(seed >> 16);
+      }
+      uint8_t base = (uint8_t)(x + 2 * y);
+      uint8_t v = (x + y) & 1 ? 240 : 16;
+      switch ((x / 23 + y / 11) % 5) {
+      case 0: p[0] = 10; p[1] = 200; p[2] = 30; break;
+      case 1: p[0] = n[0]; p[1] = n[1]; p[2] = n[2]; break;
+      case 2:
+        p[0] = base;
+        p[1] = (uint8_t)(base + n[1] % 3);
+        p[2] = (uint8_t)(base + 1);
+        break;
+      case 3: p[0] = v; p[1] = v; p[2] = (uint8_t)(255 - v); break;
+      default:
+        p[0] = (uint8_t)(base + n[0] % 40);
+        p[1] = (uint8_t)(base + n[1] % 9);
+        p[2] = (uint8_t)(3 * base);
+      }
+      if (ch == 4) {
+        p[3] = alpha == 0 ? 255 : alpha == 1 ? (uint8_t)(x * 3 + y) : n[3];
+      }
+    }
+  }
+  return r;
+}
+
+/* The row pass (whichever vector width this machine runs) has to give the
+ * streams the per-pixel encoder wrote before it: same length, same CRC. */
+static void test_row_pass(void) {
+  static const struct {
+    uint32_t w, h;
+    uint8_t ch;
+    int alpha;
+    uint8_t transform;
+    uint16_t cache_size;
+    uint8_t hash;
+    uint16_t stripe_rows;
+    uint32_t len, crc;
+  } cases[] = {
+      {301, 67, 3, 0, 0, 0, 0, 0, 48781, 0x1b0e66f1},
+      {301, 67, 3, 0, 1, 0, 0, 0, 48766, 0x0e12bbfc},
+      {77, 45, 4, 0, 0, 0, 0, 0, 8501, 0xdca1a259},
+      {77, 45, 4, 1, 0, 0, 0, 0, 11914, 0x6fb962f5},
+      {77, 45, 4, 2, 1, 0, 0, 0, 13884, 0x34920b48},
+      {129, 40, 3, 0, 0, 256, 1, 0, 11086, 0x981d8ced},
+      {130, 41, 4, 2, 0, 64, 0, 7, 21384, 0x3ade85f8},
+      {1, 50, 3, 0, 0, 0, 0, 0, 124, 0x95a2565f},
+      {9, 3, 4, 1, 1, 0, 0, 0, 36, 0x676a3de6},
+  };
+  int ok = 1;
+  for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    struct bfg_raw r = row_pass_image(cases[i].w, cases[i].h, cases[i].ch,
+                                      cases[i].alpha, 100 + i);
+    bfg_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.transform = cases[i].transform;
+    opts.cache_size = cases[i].cache_size;
+    opts.hash = cases[i].hash;
+    opts.stripe_rows = cases[i].stripe_rows;
+    bfg_header_t header;
+    uint32_t len = 0;
+    uint8_t *enc = bfg_encode_opts(&r, &opts, &header, &len);
+    struct bfg_raw dec = {0, 0, 0, NULL};
+    size_t n = (size_t)cases[i].w * cases[i].h * cases[i].ch;
+    if (!enc || len != cases[i].len ||
+        bfg_crc32c(0, enc, len) != cases[i].crc ||
+        bfg_decode(&header, enc, len, &dec) != 0 ||
+        memcmp(dec.pixels, r.pixels, n) != 0) {
+      printf("  FAIL row_pass case %u (len %u)\n", i, len);
+      ok = 0;
+    }
+    bfg_free_raw(&dec);
+    bfg_free_img(enc);
+    free(r.pixels);
+  }
+
+  tests_run++;
+  if (ok) {
+    printf("  PASS row_pass (encoder output unchanged)\n");
+    tests_passed++;
+  }
+}
+
+static void test_decode_into(void) {
+  /* runs, smooth areas and a noise band (STORED blocks), with binary alpha
+   * so the default encode uses the alpha plane */
+  struct bfg_raw r = make_raw(150, 90, 4);
+  srand(4242);
+  for (uint32_t y = 0; y < 90; y++) {
+    for (uint32_t x = 0; x < 150; x++) {
+      int noise = y >= 30 && y < 50;
+      uint8_t a = (x / 16 + y / 8) & 1 ? 255 : (uint8_t)(x < 75 ? 0 : 96);
+      set_px(&r, x, y, noise ? (uint8_t)rand() : (uint8_t)(x / 8 * 8),
+             noise ? (uint8_t)rand() : (uint8_t)y,
+             noise ? (uint8_t)rand() : 40, a);
+    }
+  }
+
+  static const char *names[] = {"rgb", "rgba", "bgra", "rgbx", "bgra_premul"};
+  bfg_opts_t opts = {0};
+  char name[64];
+  for (uint8_t l = BFG_FMT_RGB; l <= BFG_FMT_BGRA_PREMUL; l++) {
+    snprintf(name, sizeof(name), "decode_into_plane_%s", names[l]);
+    decode_into_test(name, &r, &opts, l, 0);
+    snprintf(name, sizeof(name), "decode_into_plane_%s_stride", names[l]);
+    decode_into_test(name, &r, &opts, l, 13);
+  }
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  decode_into_test("decode_into_interleaved_bgra_stride", &r, &opts,
+                   BFG_FMT_BGRA, 4);
+  decode_into_test("decode_into_interleaved_premul", &r, &opts,
+                   BFG_FMT_BGRA_PREMUL, 0);
+  opts.alpha = BFG_ALPHA_AUTO;
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  decode_into_test("decode_into_ycocg_rgbx_stride", &r, &opts, BFG_FMT_RGBX,
+                   7);
+  free(r.pixels);
+
+  /* RGB source into 4-byte layouts */
+  r = make_raw(64, 40, 3);
+  for (uint32_t i = 0; i < 64 * 40 * 3; i++) {
+    r.pixels[i] = (uint8_t)(i % 7 == 0 ? (uint32_t)rand() : i / 192);
+  }
+  opts.transform = BFG_TRANSFORM_NONE;
+  decode_into_test("decode_into_rgb_src_bgra_stride", &r, &opts,
+                   BFG_FMT_BGRA, 8);
+  decode_into_test("decode_into_rgb_src_rgba", &r, &opts, BFG_FMT_RGBA, 0);
+
+  /* a stride shorter than a row, or a buffer short of the last row, is
+   * rejected */
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len;
+  uint8_t *enc = bfg_encode(&r, &header, &enc_len);
+  uint8_t buf[64 * 40 * 4];
+  bfg_format_t fmt = {BFG_FMT_RGBA, 64 * 4 - 1};
+  int short_stride = bfg_decode_into(&header, enc, enc_len, &fmt, buf,
+                                     sizeof(buf));
+  fmt.stride = 0;
+  int short_buf = bfg_decode_into(&header, enc, enc_len, &fmt, buf,
+                                  sizeof(buf) - 1);
+  if (short_stride && short_buf) {
+    printf("  PASS decode_into_bad_buffer_rejected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL decode_into_bad_buffer_rejected\n");
+  }
+  bfg_free_img(enc);
+  free(r.pixels);
+}
+
+#ifdef BFG_STATS
+/* The op statistics must account for every encoded byte and pixel. */
+static void stats_test(const char *name, struct bfg_raw *input,
+                       const bfg_opts_t *opts) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0;
+  bfg_stats_reset();
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  bfg_stats_t st;
+  bfg_stats_get(&st);
+
+  uint64_t n_px = (uint64_t)input->width * input->height;
+  uint64_t bytes = (header.flags & BFG_FLAG_ALPHA_PLANE) ? 4 : 0;
+  uint64_t color_px = 0, alpha_px = 0, runs = 0, runs_hist = 0;
+  for (int op = 0; op < BFG_STAT_OPS; op++) {
+    bytes += st.op[op].bytes;
+    if (op >= BFG_STAT_A_RUN) alpha_px += st.op[op].pixels;
+    else color_px += st.op[op].pixels;
+  }
+  runs = st.op[BFG_STAT_RUN].count;
+  for (int b = 0; b < BFG_STAT_RUN_BINS; b++) runs_hist += st.run_hist[b];
+  uint64_t coded = color_px - st.op[BFG_STAT_RUN].pixels -
+                   st.op[BFG_STAT_RUN2].pixels;
+
+  if (enc && st.images == 1 && st.pixels == n_px && bytes == enc_len &&
+      color_px == n_px && (alpha_px == 0 || alpha_px == n_px) &&
+      runs == runs_hist && st.cache_hits + st.cache_misses == coded) {
+    printf("  PASS %s\n", name);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s: %llu of %u bytes, %llu of %llu pixels\n", name,
+           (unsigned long long)bytes, enc_len, (unsigned long long)color_px,
+           (unsigned long long)n_px);
+  }
+  bfg_free_img(enc);
+}
+
+static void test_stats(void) {
+  struct bfg_raw r = make_raw(300, 120, 4);
+  srand(777);
+  for (uint32_t y = 0; y < 120; y++) {
+    for (uint32_t x = 0; x < 300; x++) {
+      int noise = x >= 200;
+      set_px(&r, x, y, noise ? (uint8_t)rand() : (uint8_t)(x / 40 * 40),
+             noise ? (uint8_t)rand() : (uint8_t)(y / 3),
+             (uint8_t)(x % 5 ? 7 : x), (x / 10 + y / 10) & 1 ? 255 : 0);
+    }
+  }
+  bfg_opts_t opts = {0};
+  stats_test("stats_plane_rgba", &r, &opts);
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  opts.cache_size = 256;
+  stats_test("stats_interleaved_cache256_rgba", &r, &opts);
+  opts.max_error = 2;
+  stats_test("stats_near_lossless_rgba", &r, &opts);
+  free(r.pixels);
+}
+#endif
+
+/* Frame t of a synthetic screen recording: a static background with a
+ * noisy panel, a moving box, and a region slowly fading. */
+static void make_frame(struct bfg_raw *r, uint32_t t) {
+  uint32_t w = r->width, h = r->height;
+  srand(99);
+  for (uint32_t y = 0; y < h; y++) {
+    for (uint32_t x = 0; x < w; x++) {
+      uint8_t v = (uint8_t)rand();
+      uint8_t red = (uint8_t)(x * 3), green = (uint8_t)(y * 2), blue = 90;
+      if (x < w / 4) red = green = blue = v;
+      if (y >= h / 2 && x >= w / 2) {
+        red = (uint8_t)(red + 3 * t);
+        green = (uint8_t)(green + 2 * t);
+      }
+      if (x >= 10 + t * 3 && x < 30 + t * 3 && y >= 8 && y < 24) {
+        red = 255;
+        green = blue = 0;
+      }
+      uint8_t a = (x / 8 + y / 8) & 1 ? 255 : 0;
+      if (y >= h / 2 && x >= w / 2 && a == 0) a = (uint8_t)(t * 10);
+      set_px(r, x, y, red, green, blue, a);
+    }
+  }
+}
+
+/* Encode n frames as a sequence, decode them back (from frame start on)
+ * and compare. Returns total encoded bytes of inter frames, 0 on failure. */
+static uint32_t sequence_test(const char *name, uint8_t ch,
+                              const bfg_opts_t *opts, uint32_t keyint) {
+  enum { N_FRAMES = 12 };
+  tests_run++;
+  struct bfg_raw frames[N_FRAMES];
+  bfg_header_t headers[N_FRAMES];
+  uint8_t *enc[N_FRAMES] = {NULL};
+  memset(frames, 0, sizeof(frames));
+  uint32_t len[N_FRAMES];
+  uint32_t inter_bytes = 0, key_bytes = 0, n_key = 0;
+  int bad = 0;
+
+  bfg_seq_t seq = bfg_seq_new(keyint, opts);
+  for (uint32_t t = 0; t < N_FRAMES; t++) {
+    frames[t] = make_raw(160, 96, ch);
+    make_frame(&frames[t], t);
+    enc[t] = bfg_seq_encode(seq, &frames[t], &headers[t], &len[t]);
+    if (!enc[t]) {
+      printf("  FAIL %s: frame %u encode returned NULL\n", name, t);
+      bad = 1;
+      break;
+    }
+    int key = !(headers[t].flags & BFG_FLAG_INTER);
+    if (key != (keyint ? t % keyint == 0 : t == 0)) {
+      printf("  FAIL %s: frame %u keyframe flag wrong\n", name, t);
+      bad = 1;
+    }
+    if (key) {
+      key_bytes += len[t];
+      n_key++;
+    } else {
+      inter_bytes += len[t];
+    }
+  }
+  bfg_seq_free(seq);
+
+  /* decode from the start and from the last keyframe */
+  uint32_t starts[2] = {0, keyint ? (N_FRAMES - 1) / keyint * keyint : 0};
+  for (int s = 0; s < (starts[1] ? 2 : 1) && !bad; s++) {
+    uint32_t start = starts[s];
+    seq = bfg_seq_new(0, NULL);
+    for (uint32_t t = start; t < N_FRAMES && !bad; t++) {
+      const uint8_t *px = bfg_seq_decode(seq, &headers[t], enc[t], len[t]);
+      if (!px || memcmp(px, frames[t].pixels,
+                        (size_t)160 * 96 * ch) != 0) {
+        printf("  FAIL %s: frame %u decoded %s (from %u)\n", name, t,
+               px ? "wrong" : "nothing", start);
+        bad = 1;
+      }
+    }
+    bfg_seq_free(seq);
+  }
+
+  /* inter frames must be far smaller, and need the reference */
+  struct bfg_raw out;
+  if (!bad && bfg_decode(&headers[1], enc[1], len[1], &out) == 0) {
+    printf("  FAIL %s: inter frame decoded without reference\n", name);
+    bfg_free_raw(&out);
+    bad = 1;
+  }
+  uint32_t n_inter = N_FRAMES - n_key;
+  if (!bad && inter_bytes / n_inter * 3 > key_bytes / n_key) {
+    printf("  FAIL %s: inter frames %u bytes avg vs keyframes %u\n", name,
+           inter_bytes / n_inter, key_bytes / n_key);
+    bad = 1;
+  }
+  if (!bad) {
+    printf("  PASS %s (keyframes %u bytes, inter frames %u bytes avg)\n",
+           name, key_bytes / n_key, inter_bytes / n_inter);
+    tests_passed++;
+  }
+
+  for (uint32_t t = 0; t < N_FRAMES; t++) {
+    free(frames[t].pixels);
+    bfg_free_img(enc[t]);
+  }
+  return bad ? 0 : inter_bytes;
+}
+
+/* A batch of differently shaped images, one of them broken, decodes to
+ * what bfg_decode_into gives each of them alone. */
+static void test_decode_batch(void) {
+  enum { N = 7 };
+  bfg_batch_item_t items[N];
+  bfg_header_t headers[N];
+  struct bfg_raw raws[N];
+  uint8_t *want[N];
+  int ok = 1;
+  srand(31337);
+  for (uint32_t i = 0; i < N; i++) {
+    uint32_t w = 5 + i * 9, h = 3 + i * 5;
+    uint8_t ch = i % 2 ? 4 : 3;
+    raws[i] = make_raw(w, h, ch);
+    for (uint32_t y = 0; y < h; y++) {
+      for (uint32_t x = 0; x < w; x++) {
+        set_px(&raws[i], x, y, (uint8_t)(x * 5 + i), (uint8_t)(y * 3),
+               (uint8_t)(i % 3 ? rand() % 8 : rand()),
+               (uint8_t)(i == 3 ? x * 40 : 255));
+      }
+    }
+    bfg_opts_t opts = {0};
+    opts.transform = i == 2 ? BFG_TRANSFORM_YCOCG : BFG_TRANSFORM_NONE;
+    opts.stripe_rows = i == 4 ? 4 : 0;
+    bfg_batch_item_t *it = &items[i];
+    it->header = &headers[i];
+    it->data = bfg_encode_opts(&raws[i], &opts, &headers[i], &it->data_len);
+    it->fmt.layout = i == 5 ? BFG_FMT_BGRA : ch == 4 ? BFG_FMT_RGBA
+                                                     : BFG_FMT_RGB;
+    it->fmt.stride = i == 1 ? (size_t)w * 4 + 12 : 0;
+    int bpp = it->fmt.layout == BFG_FMT_RGB ? 3 : 4;
+    it->pixels_len = it->fmt.stride ? it->fmt.stride * h : (size_t)w * h * bpp;
+    it->pixels = (uint8_t *)calloc(it->pixels_len, 1);
+    want[i] = (uint8_t *)calloc(it->pixels_len, 1);
+    ok = ok && it->data && it->pixels && want[i];
+  }
+  /* the last one is cut short of its header's claims: it fails alone */
+  if (ok) items[N - 1].pixels_len -= 1;
+
+  uint32_t failed = ok ? bfg_decode_batch(items, N) : N;
+  ok = ok && failed == 1 && items[N - 1].status != 0;
+  for (uint32_t i = 0; ok && i + 1 < N; i++) {
+    bfg_batch_item_t *it = &items[i];
+    ok = it->status == 0 &&
+         bfg_decode_into(it->header, it->data, it->data_len, &it->fmt,
+                         want[i], it->pixels_len) == 0 &&
+         memcmp(it->pixels, want[i], it->pixels_len) == 0;
+  }
+  for (uint32_t i = 0; i < N; i++) {
+    bfg_free_img((bfg_img_t)items[i].data);
+    free(items[i].pixels);
+    free(want[i]);
+    free(raws[i].pixels);
+  }
+
+  tests_run++;
+  if (ok) {
+    printf("  PASS decode_batch (mixed shapes and layouts, one bad)\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL decode_batch\n");
+  }
+}
+
+/* Decodes the preview of data from just its first bfg_preview_len bytes
+ * and checks it against the 8x8 block means of input. */
+static void preview_test(const char *name, struct bfg_raw *input,
+                         const bfg_opts_t *opts) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0;
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  uint32_t need = enc ? bfg_preview_len(&header, enc, 4) : 0;
+  struct bfg_raw prev = {0, 0, 0, NULL};
+  int ok = need && need < enc_len &&
+           bfg_decode_preview(&header, enc, need - 1, &prev) != 0 &&
+           bfg_decode_preview(&header, enc, need, &prev) == 0 &&
+           prev.width == (input->width + 7) / 8 &&
+           prev.height == (input->height + 7) / 8;
+  uint8_t ch = input->n_channels;
+  for (uint32_t by = 0; ok && by < prev.height; by++) {
+    for (uint32_t bx = 0; ok && bx < prev.width; bx++) {
+      for (uint8_t c = 0; ok && c < ch; c++) {
+        uint32_t sum = 0, n = 0;
+        for (uint32_t y = by * 8; y < by * 8 + 8 && y < input->height; y++) {
+          for (uint32_t x = bx * 8; x < bx * 8 + 8 && x < input->width; x++) {
+            sum += input->pixels[((size_t)y * input->width + x) * ch + c];
+            n++;
+          }
+        }
+        ok = prev.pixels[((size_t)by * prev.width + bx) * ch + c] ==
+             (sum + n / 2) / n;
+      }
+    }
+  }
+  if (ok) {
+    printf("  PASS %s (%u of %u bytes)\n", name, need, enc_len);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s\n", name);
+  }
+  bfg_free_raw(&prev);
+  bfg_free_img(enc);
+}
+
+static void test_layered(void) {
+  /* 61x27: partial blocks on the right and bottom edges */
+  struct bfg_raw r = make_raw(61, 27, 4);
+  for (uint32_t y = 0; y < 27; y++) {
+    for (uint32_t x = 0; x < 61; x++) {
+      set_px(&r, x, y, (uint8_t)(x * 4), (uint8_t)(y * 9 + x),
+             (uint8_t)((x ^ y) * 7), (uint8_t)(255 - x - y));
+    }
+  }
+  bfg_opts_t opts = {0};
+  opts.preview = 1;
+  roundtrip_test_opts("layered_plane_rgba", &r, &opts);
+  preview_test("preview_plane_rgba", &r, &opts);
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  opts.stripe_rows = 8;
+  opts.checksum = BFG_CHECKSUM_DATA | BFG_CHECKSUM_PIXELS;
+  roundtrip_test_opts("layered_ycocg_stripes_crc_rgba", &r, &opts);
+  preview_test("preview_ycocg_stripes_crc_rgba", &r, &opts);
+  free(r.pixels);
+
+  struct bfg_raw rgb = make_raw(5, 3, 3); /* a single block */
+  for (uint32_t i = 0; i < 15; i++) {
+    set_px(&rgb, i % 5, i / 5, (uint8_t)(i * 17), (uint8_t)i, 200, 255);
+  }
+  memset(&opts, 0, sizeof(opts));
+  opts.preview = 1;
+  roundtrip_test_opts("layered_tiny_rgb", &rgb, &opts);
+  preview_test("preview_tiny_rgb", &rgb, &opts);
+
+  /* without the layer there is no preview to decode */
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0;
+  uint8_t *enc = bfg_encode(&rgb, &header, &enc_len);
+  struct bfg_raw prev = {0, 0, 0, NULL};
+  if (enc && bfg_preview_len(&header, enc, enc_len) == 0 &&
+      bfg_decode_preview(&header, enc, enc_len, &prev) != 0) {
+    printf("  PASS preview_missing_rejected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL preview_missing_rejected\n");
+  }
+  bfg_free_raw(&prev);
+  bfg_free_img(enc);
+  free(rgb.pixels);
+}
+
+/* 16-bit pixels in bands of noise from none to full range, so every op
+ * gets used, with alpha steady, smooth or random. */
+static struct bfg_raw16 depth16_image(uint32_t w, uint32_t h, uint8_t ch,
+                                      int alpha, uint32_t seed) {
+  static const uint32_t amp[6] = {0, 8, 120, 900, 7000, 65536};
+  struct bfg_raw16 r = {w, h, ch, NULL};
+  r.pixels = (uint16_t *)calloc((size_t)w * h * ch, sizeof(uint16_t));
+  for (uint32_t y = 0; r.pixels && y < h; y++) {
+    for (uint32_t x = 0; x < w; x++) {
+      uint16_t *p = &r.pixels[((size_t)y * w + x) * ch];
+      uint32_t a = amp[(x / 29 + y / 13) % 6];
+      for (uint8_t c = 0; c < ch; c++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t n = a ? (seed >> 8) % a : 0;
+        p[c] = (uint16_t)((x / 4) * 5 + y * 3 + c * 5000 + n);
+      }
+      if (ch == 4 && alpha < 2) {
+        p[3] = alpha == 0 ? 65535 : (uint16_t)(x * 300 + y);
+      }
+    }
+  }
+  return r;
+}
+
+static void depth16_test(const char *name, struct bfg_raw16 *input) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t len = 0;
+  uint8_t *enc = bfg_encode16(input, &header, &len);
+  struct bfg_raw16 out = {0, 0, 0, NULL};
+  struct bfg_raw out8 = {0, 0, 0, NULL};
+  size_t n = (size_t)input->width * input->height * input->n_channels;
+  int ok = enc && header.channels == (input->n_channels | BFG_DEPTH_16) &&
+           bfg_decode16(&header, enc, len, &out) == 0 &&
+           out.width == input->width && out.height == input->height &&
+           out.n_channels == input->n_channels &&
+           memcmp(out.pixels, input->pixels, n * sizeof(uint16_t)) == 0 &&
+           bfg_decode(&header, enc, len, &out8) != 0;
+  if (ok) {
+    printf("  PASS %s (%ux%ux%u, %.1f%% ratio, %u bytes)\n", name,
+           input->width, input->height, input->n_channels,
+           100.0 * len / (n * 2), len);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s\n", name);
+  }
+  bfg_free_raw16(&out);
+  bfg_free_img(enc);
+}
+
+static void test_depth16(void) {
+  struct bfg_raw16 r = depth16_image(181, 67, 3, 0, 7);
+  depth16_test("depth16_rgb", &r);
+  free(r.pixels);
+  for (int alpha = 0; alpha < 3; alpha++) {
+    char name[32];
+    snprintf(name, sizeof(name), "depth16_rgba_alpha%d", alpha);
+    r = depth16_image(97, 45, 4, alpha, 11 + alpha);
+    depth16_test(name, &r);
+    free(r.pixels);
+  }
+
+  /* one flat color: a run longer than RUN2 holds, across rows */
+  struct bfg_raw16 flat = {300, 240, 3, NULL};
+  flat.pixels = (uint16_t *)malloc((size_t)300 * 240 * 3 * sizeof(uint16_t));
+  for (size_t i = 0; flat.pixels && i < (size_t)300 * 240 * 3; i++) {
+    flat.pixels[i] = (uint16_t)(i % 3 == 1 ? 40000 : 1234);
+  }
+  depth16_test("depth16_flat_rgb", &flat);
+  free(flat.pixels);
+
+  /* a 16-bit header probes as valid; cut data and 8-bit data don't decode */
+  tests_run++;
+  r = depth16_image(50, 20, 4, 1, 3);
+  bfg_header_t header, probed;
+  uint32_t len = 0;
+  uint8_t *enc = bfg_encode16(&r, &header, &len);
+  uint8_t buf[BFG_HEADER_SIZE];
+  struct bfg_raw16 out = {0, 0, 0, NULL};
+  int ok = enc != NULL;
+  if (ok) {
+    bfg_header_pack(&header, buf);
+    ok = bfg_probe_buffer(buf, sizeof(buf), &probed) == 0 &&
+         probed.channels == (4 | BFG_DEPTH_16) &&
+         bfg_decode16(&header, enc, len / 2, &out) != 0 && !out.pixels;
+  }
+  bfg_free_img(enc);
+  free(r.pixels);
+  struct bfg_raw r8 = make_raw(8, 8, 3);
+  enc = bfg_encode(&r8, &header, &len);
+  ok = ok && enc && bfg_decode16(&header, enc, len, &out) != 0;
+  bfg_free_img(enc);
+  free(r8.pixels);
+  if (ok) {
+    printf("  PASS depth16_rejects\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL depth16_rejects\n");
+  }
+}
+
+static void test_sequences(void) {
+  bfg_opts_t opts = {0};
+  sequence_test("sequence_rgb", 3, &opts, 5);
+  sequence_test("sequence_plane_rgba", 4, &opts, 0);
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  sequence_test("sequence_interleaved_rgba", 4, &opts, 4);
+  opts.alpha = BFG_ALPHA_AUTO;
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  opts.cache_size = 256;
+  sequence_test("sequence_ycocg_rgb", 3, &opts, 6);
+  opts.transform = BFG_TRANSFORM_NONE;
+  opts.stripe_rows = 16;
+  sequence_test("sequence_striped_rgba", 4, &opts, 5);
+  opts.stripe_rows = 0;
+
+  /* near-lossless has no reference to track */
+  opts.max_error = 1;
+  tests_run++;
+  bfg_seq_t seq = bfg_seq_new(0, &opts);
+  if (!seq) {
+    printf("  PASS sequence_near_lossless_rejected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL sequence_near_lossless_rejected\n");
+    bfg_seq_free(seq);
+  }
+}
+
+/* Analyze the encoded image and compare with statistics scanned from the
+ * decoded pixels. Returns the analysis' solid flag, or -1 on failure. */
+static int analyze_test(const char *name, struct bfg_raw *input,
+                        const bfg_opts_t *opts) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0;
+  struct bfg_raw output = {0, 0, 0, NULL};
+  bfg_analysis_t an;
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  if (!enc || bfg_analyze(&header, enc, enc_len, &an) ||
+      bfg_decode(&header, enc, enc_len, &output)) {
+    printf("  FAIL %s (analyze): encode, analyze or decode failed\n", name);
+    bfg_free_img(enc);
+    bfg_free_raw(&output);
+    return -1;
+  }
+
+  uint32_t w = input->width, h = input->height;
+  uint8_t ch = input->n_channels;
+  static uint32_t hist[4][256];
+  uint64_t sum[4] = {0, 0, 0, 0}, visible = 0;
+  uint32_t x0 = w, y0 = h, x1 = 0, y1 = 0;
+  int solid = 1;
+  memset(hist, 0, sizeof(hist));
+  for (uint32_t y = 0; y < h; y++) {
+    for (uint32_t x = 0; x < w; x++) {
+      const uint8_t *p = &output.pixels[((size_t)y * w + x) * ch];
+      uint8_t v[4] = {p[0], p[1], p[2], ch == 4 ? p[3] : 255};
+      for (int c = 0; c < 4; c++) {
+        hist[c][v[c]]++;
+        sum[c] += v[c];
+      }
+      if (memcmp(p, output.pixels, ch)) solid = 0;
+      if (v[3]) {
+        visible++;
+        if (x < x0) x0 = x;
+        if (y < y0) y0 = y;
+        if (x > x1) x1 = x;
+        if (y > y1) y1 = y;
+      }
+    }
+  }
+  if (!visible) x0 = y0 = 0;
+
+  int ok = an.pixels == (uint64_t)w * h && an.visible == visible &&
+           memcmp(an.hist, hist, sizeof(hist)) == 0 && an.solid == solid;
+  for (int c = 0; c < 4; c++)
+    if (an.mean[c] != (double)sum[c] / an.pixels) ok = 0;
+  if (visible && (an.box_x0 != x0 || an.box_y0 != y0 || an.box_x1 != x1 ||
+                  an.box_y1 != y1))
+    ok = 0;
+  if (solid && (an.color.r != output.pixels[0] ||
+                an.color.g != output.pixels[1] ||
+                an.color.b != output.pixels[2] ||
+                an.color.a != (ch == 4 ? output.pixels[3] : 255)))
+    ok = 0;
+
+  /* a stream cut short is reported, not guessed at */
+  if (enc_len > 1 && bfg_analyze(&header, enc, enc_len / 2, &an) == 0) ok = 0;
+
+  if (ok) {
+    printf("  PASS %s (analyze)\n", name);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s (analyze): statistics differ from decoded pixels\n",
+           name);
+  }
+  bfg_free_raw(&output);
+  bfg_free_img(enc);
+  return ok ? solid : -1;
+}
+
+static void test_analyze(void) {
+  bfg_opts_t opts = {0};
+
+  /* transparent sprite border around a gradient with a hole */
+  struct bfg_raw r = make_raw(97, 61, 4);
+  for (uint32_t y = 0; y < 61; y++) {
+    for (uint32_t x = 0; x < 97; x++) {
+      int inside = x >= 13 && x < 80 && y >= 7 && y < 50;
+      set_px(&r, x, y, (uint8_t)(x * 2), (uint8_t)(y * 3), (uint8_t)(x ^ y),
+             !inside || (x == 40 && y == 20) ? 0 : (uint8_t)(128 + x));
+    }
+  }
+  analyze_test("analyze_sprite_plane_rgba", &r, &opts);
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  analyze_test("analyze_sprite_interleaved_rgba", &r, &opts);
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  opts.cache_size = 256;
+  opts.hash = BFG_HASH_MUL;
+  analyze_test("analyze_sprite_ycocg_rgba", &r, &opts);
+  free(r.pixels);
+
+  /* noise (STORED blocks) with long runs between */
+  memset(&opts, 0, sizeof(opts));
+  r = make_raw(300, 40, 3);
+  srand(4242);
+  for (uint32_t y = 0; y < 40; y++)
+    for (uint32_t x = 0; x < 300; x++)
+      if (y % 10 < 3)
+        set_px(&r, x, y, (uint8_t)rand(), (uint8_t)rand(), (uint8_t)rand(),
+               0);
+      else
+        set_px(&r, x, y, 20, 40, (uint8_t)(y / 10), 0);
+  analyze_test("analyze_stored_runs_rgb", &r, &opts);
+  opts.cache_size = 64;
+  analyze_test("analyze_stored_runs_cache64_rgb", &r, &opts);
+  free(r.pixels);
+
+  /* one color, with constant alpha */
+  memset(&opts, 0, sizeof(opts));
+  r = make_raw(512, 300, 4);
+  for (uint32_t i = 0; i < 512 * 300; i++) {
+    memcpy(&r.pixels[i * 4], "\x11\x22\x33\x80", 4);
+  }
+  tests_run++;
+  if (analyze_test("analyze_solid_rgba", &r, &opts) == 1) {
+    printf("  PASS analyze_solid_detected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL analyze_solid_detected\n");
+  }
+  free(r.pixels);
+
+  /* fully transparent: empty box */
+  r = make_raw(33, 17, 4);
+  for (uint32_t i = 0; i < 33 * 17; i++) r.pixels[i * 4] = (uint8_t)i;
+  analyze_test("analyze_transparent_rgba", &r, &opts);
+  free(r.pixels);
+}
+
+/* Change the pixels in rect, update the striped encoding of input and
+ * check the result is byte for byte a fresh encoding of the new image. */
+static void update_test(const char *name, struct bfg_raw *input,
+                        const bfg_opts_t *opts, bfg_rect_t rect,
+                        uint8_t new_a) {
+  tests_run++;
+  bfg_header_t header, fresh_header;
+  uint32_t enc_len = 0, upd_len = 0, fresh_len = 0;
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  uint8_t ch = input->n_channels;
+  for (uint32_t y = rect.y; y < rect.y + rect.h && y < input->height; y++) {
+    for (uint32_t x = rect.x; x < rect.x + rect.w && x < input->width; x++) {
+      set_px(input, x, y, (uint8_t)(x * y), (uint8_t)(x + 3 * y), 200,
+             new_a);
+    }
+  }
+  uint8_t *upd = enc ? bfg_encode_update(&header, enc, enc_len, input, &rect,
+                                         1, &upd_len)
+                     : NULL;
+  uint8_t *fresh = bfg_encode_opts(input, opts, &fresh_header, &fresh_len);
+  struct bfg_raw output = {0, 0, 0, NULL};
+  int ok = upd && fresh && upd_len == fresh_len &&
+           memcmp(upd, fresh, upd_len) == 0 &&
+           memcmp(&header, &fresh_header, sizeof(header)) == 0 &&
+           bfg_decode(&header, upd, upd_len, &output) == 0 &&
+           memcmp(output.pixels, input->pixels,
+                  (size_t)input->width * input->height * ch) == 0;
+  if (ok) {
+    printf("  PASS %s (%u -> %u bytes)\n", name, enc_len, upd_len);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s: update differs from a fresh encode\n", name);
+  }
+  bfg_free_raw(&output);
+  bfg_free_img(enc);
+  bfg_free_img(upd);
+  bfg_free_img(fresh);
+}
+
+/* Update a near-lossless striped encoding with checksums: the copied
+ * stripes decode to the reconstruction, not to input, and the new pixel
+ * CRC has to cover what they decode to. */
+static void update_lossy_test(const char *name, struct bfg_raw *input,
+                              const bfg_opts_t *opts, bfg_rect_t rect) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t enc_len = 0, upd_len = 0;
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &enc_len);
+  set_px(input, rect.x, rect.y, 1, 2, 3, 255);
+  uint8_t *upd = enc ? bfg_encode_update(&header, enc, enc_len, input, &rect,
+                                         1, &upd_len)
+                     : NULL;
+  struct bfg_raw output = {0, 0, 0, NULL};
+  size_t idx = ((size_t)rect.y * input->width + rect.x) *
+               input->n_channels;
+  int ok = upd && bfg_verify(&header, upd, upd_len, 0) == 0 &&
+           bfg_verify(&header, upd, upd_len, BFG_VERIFY_PIXELS) == 0 &&
+           bfg_decode(&header, upd, upd_len, &output) == 0 &&
+           memcmp(output.pixels + idx, input->pixels + idx, 3) == 0;
+  if (ok) {
+    printf("  PASS %s (%u -> %u bytes)\n", name, enc_len, upd_len);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s: pixel CRC does not match the update\n", name);
+  }
+  bfg_free_raw(&output);
+  bfg_free_img(enc);
+  bfg_free_img(upd);
+}
+
+static void test_striped(void) {
+  /* 101 rows: six stripes of 16 and one of 5 */
+  struct bfg_raw r = make_raw(150, 101, 4);
+  for (uint32_t y = 0; y < 101; y++) {
+    for (uint32_t x = 0; x < 150; x++) {
+      set_px(&r, x, y, (uint8_t)(x + y), (uint8_t)(x / 8 * 8), (uint8_t)y,
+             x < 20 ? 0 : 255);
+    }
+  }
+  bfg_opts_t opts = {0};
+  opts.stripe_rows = 16;
+  roundtrip_test_opts("stripes_plane_rgba", &r, &opts);
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  roundtrip_test_opts("stripes_interleaved_rgba", &r, &opts);
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  opts.cache_size = 64;
+  opts.stripe_rows = 1;
+  roundtrip_test_opts("stripes_ycocg_1row_rgba", &r, &opts);
+  opts.stripe_rows = 200;
+  roundtrip_test_opts("stripes_one_stripe_rgba", &r, &opts);
+
+  bfg_rect_t rect = {30, 10, 12, 9}; /* rows 10..18, stripes 0 and 1 */
+  opts.stripe_rows = 16;
+  update_test("stripes_update_ycocg_rgba", &r, &opts, rect, 255);
+  opts.alpha = BFG_ALPHA_AUTO;
+  opts.transform = BFG_TRANSFORM_NONE;
+  rect.y = 99; /* clipped to the last two rows */
+  update_test("stripes_update_plane_last_rgba", &r, &opts, rect, 128);
+  opts.preview = 1;
+  rect.y = 40;
+  update_test("stripes_update_layered_rgba", &r, &opts, rect, 64);
+  opts.preview = 0;
+  free(r.pixels);
+
+  /* constant alpha broken by the update: the header changes */
+  r = make_raw(64, 64, 4);
+  for (uint32_t i = 0; i < 64 * 64; i++) r.pixels[i * 4 + 3] = 255;
+  rect.y = 20;
+  update_test("stripes_update_alpha_refit_rgba", &r, &opts, rect, 10);
+  rect.y = 40;
+  update_test("stripes_update_alpha_plane_rgba", &r, &opts, rect, 50);
+  free(r.pixels);
+
+  r = make_raw(64, 64, 3);
+  rect.x = 0;
+  rect.w = 64;
+  update_test("stripes_update_full_rows_rgb", &r, &opts, rect, 0);
+
+  /* analysis walks the stripes */
+  opts.stripe_rows = 7;
+  analyze_test("stripes_analyze_rgb", &r, &opts);
+
+  /* unstriped images have no checkpoints to update from */
+  tests_run++;
+  bfg_header_t header;
+  uint32_t len = 0, upd_len = 0;
+  uint8_t *enc = bfg_encode(&r, &header, &len);
+  uint8_t *upd = bfg_encode_update(&header, enc, len, &r, &rect, 1, &upd_len);
+  if (enc && !upd) {
+    printf("  PASS stripes_update_unstriped_rejected\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL stripes_update_unstriped_rejected\n");
+  }
+  bfg_free_img(enc);
+  bfg_free_img(upd);
+  free(r.pixels);
+}
+
 static void test_file_io(void) {
   struct bfg_raw r = make_raw(32, 32, 4);
   for (uint32_t i = 0; i < 32 * 32 * 4; i++) {
@@ -299,6 +1521,419 @@ static void test_file_io(void) {
   free(r.pixels);
 }
 
+/* Pack images of varying size out of name order, then look every one up by
+ * name and by id, check its payload is page aligned and decodes exactly. */
+#define N_ARCHIVED 24
+static void test_archive(void) {
+  const char *tmp_path = "/tmp/bfg_test_archive.bfga";
+  struct bfg_raw raws[N_ARCHIVED];
+  bfga_item_t items[N_ARCHIVED];
+  char names[N_ARCHIVED][16];
+  int bad = 0;
+
+  memset(raws, 0, sizeof(raws));
+  for (uint32_t i = 0; i < N_ARCHIVED; i++) {
+    uint32_t k = (i * 7) % N_ARCHIVED; /* shuffled */
+    raws[i] = make_raw(8 + k, 4 + (k % 5), k % 2 ? 4 : 3);
+    for (uint32_t j = 0; j < raws[i].width * raws[i].height; j++)
+      set_px(&raws[i], j % raws[i].width, j / raws[i].width,
+             (uint8_t)(j * k), (uint8_t)(j / 3), (uint8_t)k,
+             (uint8_t)(255 - (j & 7)));
+    sprintf(names[i], "img%02u", k);
+    items[i].name = names[i];
+    items[i].id = 1000 - 7 * k;
+    items[i].data = bfg_encode(&raws[i], &items[i].header, &items[i].data_len);
+    if (!items[i].data) bad = 1;
+  }
+
+  tests_run++;
+  bfga_t ar = NULL;
+  if (bad || bfga_write(tmp_path, items, N_ARCHIVED, 0) ||
+      !(ar = bfga_open(tmp_path)) || bfga_count(ar) != N_ARCHIVED) {
+    printf("  FAIL archive: write or open failed\n");
+    bad = 1;
+  }
+  for (uint32_t i = 0; i < N_ARCHIVED && !bad; i++) {
+    bfga_entry_t e, by_id, first;
+    uint8_t *px = malloc((size_t)raws[i].width * raws[i].height * 4);
+    size_t len = (size_t)raws[i].width * raws[i].height * raws[i].n_channels;
+    bfg_format_t fmt = {raws[i].n_channels == 4 ? BFG_FMT_RGBA : BFG_FMT_RGB,
+                        0};
+    if (bfga_find(ar, names[i], &e) || bfga_find_id(ar, items[i].id, &by_id) ||
+        by_id.data != e.data || strcmp(e.name, names[i]) ||
+        e.id != items[i].id || e.data_len != items[i].data_len ||
+        ((uintptr_t)e.data & 4095) != 0 || !px ||
+        bfga_decode(&e, &fmt, px, len) ||
+        memcmp(px, raws[i].pixels, len) != 0) {
+      printf("  FAIL archive: entry %s\n", names[i]);
+      bad = 1;
+    }
+    /* the name index is in name order */
+    char expect[16];
+    sprintf(expect, "img%02u", i);
+    if (bfga_entry_at(ar, i, &first) || strcmp(first.name, expect)) {
+      printf("  FAIL archive: entry %u is %s\n", i, first.name);
+      bad = 1;
+    }
+    free(px);
+  }
+  bfga_entry_t e;
+  if (!bad && (bfga_find(ar, "img", &e) == 0 ||
+               bfga_find(ar, "img999", &e) == 0 ||
+               bfga_find_id(ar, 1, &e) == 0)) {
+    printf("  FAIL archive: found a missing entry\n");
+    bad = 1;
+  }
+  bfga_close(ar);
+
+  /* names and ids must be unique */
+  names[1][4] = names[0][4];
+  names[1][3] = names[0][3];
+  if (!bad && bfga_write(tmp_path, items, N_ARCHIVED, 0) == 0) {
+    printf("  FAIL archive: duplicate name accepted\n");
+    bad = 1;
+  }
+  if (!bad) {
+    printf("  PASS archive\n");
+    tests_passed++;
+  }
+
+  for (uint32_t i = 0; i < N_ARCHIVED; i++) {
+    free(raws[i].pixels);
+    bfg_free_img((uint8_t *)items[i].data);
+  }
+  remove(tmp_path);
+}
+
+/* Encode with checksums: the trailer verifies, the image still decodes and
+ * analyzes, and a flipped bit anywhere in the data or header is caught. */
+static void checksum_test(const char *name, struct bfg_raw *input,
+                          const bfg_opts_t *opts) {
+  tests_run++;
+  bfg_header_t header;
+  uint32_t len = 0;
+  uint8_t *enc = bfg_encode_opts(input, opts, &header, &len);
+  struct bfg_raw output = {0, 0, 0, NULL};
+  bfg_analysis_t an;
+  size_t n = (size_t)input->width * input->height * input->n_channels;
+  int ok = enc && bfg_verify(&header, enc, len, BFG_VERIFY_PIXELS) == 0 &&
+           bfg_decode(&header, enc, len, &output) == 0 &&
+           bfg_analyze(&header, enc, len, &an) == 0 &&
+           (opts->max_error || memcmp(output.pixels, input->pixels, n) == 0);
+  for (uint32_t i = 0; ok && i < len; i += 1 + len / 97) {
+    enc[i] ^= 0x10;
+    ok = bfg_verify(&header, enc, len, BFG_VERIFY_PIXELS) != 0;
+    enc[i] ^= 0x10;
+  }
+  header.alpha ^= 1;
+  ok = ok && bfg_verify(&header, enc, len, 0) != 0;
+  if (ok) {
+    printf("  PASS %s (%u bytes)\n", name, len);
+    tests_passed++;
+  } else {
+    printf("  FAIL %s\n", name);
+  }
+  bfg_free_raw(&output);
+  bfg_free_img(enc);
+}
+
+static void test_checksums(void) {
+  /* the CRC-32C check value, and long buffers (three-lane hardware path)
+   * against the same bytes fed in short pieces */
+  uint8_t buf[40000];
+  srand(99);
+  for (size_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)rand();
+  int ok = bfg_crc32c(0, "123456789", 9) == 0xE3069283u;
+  for (size_t len = 1; ok && len <= sizeof(buf); len = len * 3 + 7) {
+    for (size_t off = 0; ok && off < 8; off += 3) {
+      uint32_t whole = bfg_crc32c(0, buf + off, len - (off < len ? off : 0));
+      uint32_t parts = 0;
+      size_t end = len - (off < len ? off : 0), step = 1;
+      for (size_t p = 0; p < end; p += step, step = step * 2 % 251 + 1)
+        parts = bfg_crc32c(parts, buf + off + p,
+                           end - p < step ? end - p : step);
+      ok = whole == parts;
+    }
+  }
+  tests_run++;
+  if (ok) {
+    printf("  PASS crc32c\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL crc32c\n");
+  }
+
+  struct bfg_raw r = make_raw(120, 70, 4);
+  for (uint32_t y = 0; y < 70; y++)
+    for (uint32_t x = 0; x < 120; x++)
+      set_px(&r, x, y, (uint8_t)(x * 2 + (rand() & 3)), (uint8_t)(y * 3),
+             (uint8_t)(x ^ y), x < 30 ? 0 : (uint8_t)(255 - y));
+  bfg_opts_t opts = {0};
+  opts.checksum = BFG_CHECKSUM_DATA | BFG_CHECKSUM_PIXELS;
+  checksum_test("checksum_plane_rgba", &r, &opts);
+  opts.stripe_rows = 16;
+  opts.transform = BFG_TRANSFORM_YCOCG;
+  checksum_test("checksum_striped_ycocg_rgba", &r, &opts);
+  bfg_rect_t rect = {5, 20, 50, 10};
+  update_test("checksum_update_rgba", &r, &opts, rect, 255);
+  opts.stripe_rows = 0;
+  opts.transform = BFG_TRANSFORM_NONE;
+  opts.max_error = 3; /* pixel CRC of the reconstruction */
+  opts.alpha = BFG_ALPHA_INTERLEAVED;
+  checksum_test("checksum_near_lossless_rgba", &r, &opts);
+  free(r.pixels);
+
+  r = make_raw(64, 64, 3);
+  for (uint32_t i = 0; i < 64 * 64 * 3; i++)
+    r.pixels[i] = (uint8_t)(i / 3 % 64 * 4 + (rand() & 15));
+  opts.alpha = BFG_ALPHA_AUTO;
+  opts.stripe_rows = 8;
+  rect = (bfg_rect_t){10, 20, 1, 1};
+  update_lossy_test("checksum_update_near_lossless_rgb", &r, &opts, rect);
+  free(r.pixels);
+
+  /* nothing to verify without a trailer, or a pixel CRC alone unless
+   * asked to decode */
+  r = make_raw(9, 9, 3);
+  bfg_header_t header;
+  uint32_t len;
+  memset(&opts, 0, sizeof(opts));
+  uint8_t *plain = bfg_encode_opts(&r, &opts, &header, &len);
+  ok = plain && bfg_verify(&header, plain, len, BFG_VERIFY_PIXELS) != 0;
+  bfg_free_img(plain);
+  opts.checksum = BFG_CHECKSUM_PIXELS;
+  plain = bfg_encode_opts(&r, &opts, &header, &len);
+  ok = ok && plain && bfg_verify(&header, plain, len, 0) != 0 &&
+       bfg_verify(&header, plain, len, BFG_VERIFY_PIXELS) == 0;
+  bfg_free_img(plain);
+  free(r.pixels);
+  tests_run++;
+  if (ok) {
+    printf("  PASS checksum_absent\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL checksum_absent\n");
+  }
+}
+
+/* Probe headers from files and buffers, alone and in a batch, and reject
+ * missing, truncated and invalid files. */
+static void test_probe(void) {
+  const char *paths[5] = {"/tmp/bfg_test_probe0.bfg", "/tmp/bfg_test_probe1.bfg",
+                          "/tmp/bfg_test_probe_missing.bfg",
+                          "/tmp/bfg_test_probe_short.bfg",
+                          "/tmp/bfg_test_probe_flags.bfg"};
+  bfg_header_t written[2], headers[5], h;
+  int status[5];
+  int bad = 0;
+
+  tests_run++;
+  for (int i = 0; i < 2 && !bad; i++) {
+    struct bfg_raw raw = make_raw(17 + i * 40, 9, (uint8_t)(3 + i));
+    uint32_t len;
+    uint8_t *enc = bfg_encode(&raw, &written[i], &len);
+    uint8_t buf[BFG_HEADER_SIZE];
+    bad = !enc || bfg_write(paths[i], &written[i], enc, len);
+    bfg_header_pack(&written[i], buf);
+    if (!bad && (bfg_probe_buffer(buf, sizeof(buf), &h) ||
+                 h.width != written[i].width ||
+                 bfg_probe_buffer(buf, sizeof(buf) - 1, &h) == 0)) {
+      printf("  FAIL probe: buffer %d\n", i);
+      bad = 1;
+    }
+    bfg_free_img(enc);
+    free(raw.pixels);
+  }
+
+  /* a truncated header, and one with flags that can't go together */
+  FILE *fp = fopen(paths[3], "wb");
+  if (fp) {
+    fwrite("BFG2", 1, 4, fp);
+    fclose(fp);
+  }
+  uint8_t flags = written[1].flags;
+  written[1].flags |= BFG_FLAG_LAYERED | BFG_FLAG_INTER;
+  uint8_t one = 0;
+  if (bad || !fp || bfg_write(paths[4], &written[1], &one, 1)) {
+    printf("  FAIL probe: could not write test files\n");
+    bad = 1;
+  }
+  written[1].flags = flags;
+
+  if (!bad && (bfg_probe(paths[0], &h) || h.width != 17 || h.height != 9 ||
+               h.channels != 3 || bfg_probe(paths[2], &h) == 0)) {
+    printf("  FAIL probe: single file\n");
+    bad = 1;
+  }
+  if (!bad && (bfg_probe_batch(paths, 5, headers, status, 4) != 3 ||
+               status[0] || status[1] || !status[2] || !status[3] ||
+               !status[4] || headers[1].width != 57 ||
+               headers[1].channels != 4 ||
+               memcmp(&headers[0], &written[0], sizeof(h)) != 0)) {
+    printf("  FAIL probe: batch\n");
+    bad = 1;
+  }
+  if (!bad) {
+    printf("  PASS probe\n");
+    tests_passed++;
+  }
+  for (int i = 0; i < 5; i++) remove(paths[i]);
+}
+
+/* Serialize to memory, a file and a pipe, and read each back. */
+/* Write header and data with bfg_write_fd, to a regular file and to a
+ * pipe, and read them back with bfg_read_fd. Returns nonzero if both come
+ * back unchanged. */
+static int fd_roundtrip(const bfg_header_t *header, const uint8_t *enc,
+                        uint32_t len) {
+  bfg_header_t h2;
+  uint32_t len2 = 0;
+
+  /* a regular file, read back from its start */
+  const char *tmp_path = "/tmp/bfg_test_fd.bfg";
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  uint8_t *back = NULL;
+  int ok = fd >= 0 && bfg_write_fd(fd, header, enc, len) == 0 &&
+           lseek(fd, 0, SEEK_SET) == 0 &&
+           (back = bfg_read_fd(fd, &h2, &len2)) && len2 == len &&
+           memcmp(back, enc, len) == 0 &&
+           memcmp(&h2, header, sizeof(h2)) == 0;
+  bfg_free_img(back);
+  back = NULL;
+  if (fd >= 0) close(fd);
+  remove(tmp_path);
+
+  /* a pipe, written by a child and streamed in as it arrives */
+  int fds[2];
+  if (ok && pipe(fds) == 0) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      _exit(bfg_write_fd(fds[1], header, enc, len));
+    }
+    close(fds[1]);
+    back = pid > 0 ? bfg_read_fd(fds[0], &h2, &len2) : NULL;
+    close(fds[0]);
+    int status = 1;
+    if (pid > 0) waitpid(pid, &status, 0);
+    ok = back && status == 0 && len2 == len && memcmp(back, enc, len) == 0;
+    bfg_free_img(back);
+  } else {
+    ok = 0;
+  }
+  return ok;
+}
+
+static void test_serialize(void) {
+  struct bfg_raw r = make_raw(300, 300, 3);
+  srand(7);
+  for (uint32_t i = 0; i < 300 * 300 * 3; i++) r.pixels[i] = (uint8_t)rand();
+  bfg_header_t header, h2;
+  uint32_t len = 0, len2 = 0;
+  uint8_t *enc = bfg_encode(&r, &header, &len);
+  int ok = enc && len > 4 * 65536; /* several pipe buffers */
+
+  /* memory: exact fit only, and a view into the buffer */
+  size_t cap = BFG_HEADER_SIZE + (size_t)len;
+  uint8_t *buf = malloc(cap);
+  const uint8_t *view = NULL;
+  ok = ok && buf && bfg_serialize(&header, enc, len, buf, cap - 1) == 0 &&
+       bfg_serialize(&header, enc, len, buf, cap) == cap &&
+       bfg_deserialize(buf, cap, &h2, &view, &len2) == 0 &&
+       view == buf + BFG_HEADER_SIZE && len2 == len &&
+       memcmp(&h2, &header, sizeof(h2)) == 0;
+  if (buf) buf[0] ^= 1;
+  ok = ok && bfg_deserialize(buf, cap, &h2, &view, &len2) != 0;
+  free(buf);
+
+  ok = ok && fd_roundtrip(&header, enc, len);
+
+  /* 16 bits per channel, near its worst case of 9 bytes a pixel */
+  struct bfg_raw16 r16 = {64, 64, 4, malloc(64 * 64 * 4 * sizeof(uint16_t))};
+  for (uint32_t i = 0; r16.pixels && i < 64 * 64 * 4; i++) {
+    r16.pixels[i] = (uint16_t)rand();
+  }
+  uint8_t *enc16 = r16.pixels ? bfg_encode16(&r16, &h2, &len2) : NULL;
+  ok = ok && enc16 && len2 > 64 * 64 * 8 && fd_roundtrip(&h2, enc16, len2);
+  bfg_free_img(enc16);
+  free(r16.pixels);
+
+  tests_run++;
+  if (ok) {
+    printf("  PASS serialize (memory, file, pipe, 16-bit)\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL serialize\n");
+  }
+  bfg_free_img(enc);
+  free(r.pixels);
+}
+
+/* PAM/PPM files: written, mapped back in place, and encoded from the map */
+static void test_pnm(void) {
+  const char *ppm_path = "/tmp/bfg_test_pnm.ppm";
+  const char *pam_path = "/tmp/bfg_test_pnm.pam";
+  int ok = pnm_path(ppm_path) && pnm_path("A.PAM") && !pnm_path("a.png");
+
+  for (uint8_t ch = 3; ch <= 4; ch++) {
+    const char *path = ch == 3 ? ppm_path : pam_path;
+    struct bfg_raw r = make_raw(37, 23, ch);
+    for (uint32_t i = 0; i < 37 * 23 * ch; i++) r.pixels[i] = (uint8_t)(i * 7);
+    pnm_image_t img;
+    ok = ok && pnm_write(path, &r) == 0 && pnm_read(path, &img) == 0;
+    if (!ok) {
+      free(r.pixels);
+      break;
+    }
+    ok = img.raw.width == 37 && img.raw.height == 23 &&
+         img.raw.n_channels == ch &&
+         img.raw.pixels > (uint8_t *)img.map &&
+         img.raw.pixels + 37 * 23 * ch == (uint8_t *)img.map + img.map_len &&
+         memcmp(img.raw.pixels, r.pixels, 37 * 23 * ch) == 0;
+    bfg_header_t header;
+    uint32_t len = 0;
+    uint8_t *enc = bfg_encode(&img.raw, &header, &len);
+    struct bfg_raw dec = {0, 0, 0, NULL};
+    ok = ok && enc && bfg_decode(&header, enc, len, &dec) == 0 &&
+         memcmp(dec.pixels, r.pixels, 37 * 23 * ch) == 0;
+    bfg_free_raw(&dec);
+    bfg_free_img(enc);
+    pnm_free(&img);
+    free(r.pixels);
+  }
+
+  /* comments in the header, and the formats and sizes not taken */
+  static const char *const files[] = {
+      "P6 # size\n2 1\n# depth\n255\nabcdef",
+      "P6\n2 1\n65535\nabcdefghijkl",
+      "P6\n2 1\n255\nabcde",
+      "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\nTUPLTYPE GRAYSCALE\n"
+      "ENDHDR\na",
+      "P5\n1 1\n255\na",
+  };
+  for (int f = 0; f < 5; f++) {
+    FILE *fp = fopen(ppm_path, "wb");
+    if (fp) {
+      fputs(files[f], fp);
+      fclose(fp);
+    }
+    pnm_image_t img;
+    int err = pnm_read(ppm_path, &img);
+    ok = ok && fp && (f == 0 ? err == 0 && img.raw.pixels[0] == 'a' : err);
+    if (!err) pnm_free(&img);
+  }
+  remove(ppm_path);
+  remove(pam_path);
+
+  tests_run++;
+  if (ok) {
+    printf("  PASS pnm (ppm, pam, mapped in place)\n");
+    tests_passed++;
+  } else {
+    printf("  FAIL pnm\n");
+  }
+}
+
 int main(void) {
   printf("BFG2 synthetic roundtrip tests\n");
   printf("==============================\n\n");
@@ -310,13 +1945,34 @@ int main(void) {
   test_vertical_gradient();
   test_checkerboard();
   test_random_noise();
+  test_stored_blocks();
   test_1x1();
   test_1_wide();
   test_1_tall();
   test_alpha_variation();
   test_stripes();
   test_large();
+  test_ycocg();
+  test_cache_configs();
+  test_alpha_modes();
+  test_near_lossless();
+  test_row_pass();
+  test_decode_into();
+  test_decode_batch();
+  test_layered();
+  test_depth16();
+  test_sequences();
+  test_analyze();
+  test_striped();
+  test_checksums();
+#ifdef BFG_STATS
+  test_stats();
+#endif
   test_file_io();
+  test_archive();
+  test_probe();
+  test_serialize();
+  test_pnm();
 
   printf("\n%d / %d tests passed\n", tests_passed, tests_run);
   return tests_passed == tests_run ? 0 : 1;
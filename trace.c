@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 199309L
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DETAIL_LEN (31)
+
+struct span {
+  const char *name;
+  const char *cat;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+  uint64_t cpu_start_ns;
+  uint64_t cpu_dur_ns;
+  char detail[DETAIL_LEN + 1];
+};
+
+static struct {
+  char *fpath;
+  struct span *spans;
+  size_t n, cap;
+  uint64_t origin_ns;
+} trace;
+
+static uint64_t clock_ns(clockid_t id) {
+  struct timespec ts;
+  if (clock_gettime(id, &ts)) return 0;
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int trace_open(const char *fpath) {
+  if (!fpath || trace.fpath) return 1;
+  trace.fpath = malloc(strlen(fpath) + 1);
+  if (!trace.fpath) return 1;
+  strcpy(trace.fpath, fpath);
+  trace.origin_ns = clock_ns(CLOCK_MONOTONIC);
+  return 0;
+}
+
+trace_mark_t trace_begin(void) {
+  trace_mark_t m;
+  m.wall_ns = clock_ns(CLOCK_MONOTONIC);
+  m.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  return m;
+}
+
+double trace_end(trace_mark_t mark, const char *name, const char *cat,
+                 const char *detail) {
+  uint64_t wall = clock_ns(CLOCK_MONOTONIC) - mark.wall_ns;
+  uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - mark.cpu_ns;
+
+  if (trace.fpath) {
+    if (trace.n == trace.cap) {
+      size_t cap = trace.cap ? trace.cap * 2 : 256;
+      struct span *s = realloc(trace.spans, cap * sizeof(struct span));
+      if (!s) return wall / 1e6; /* drop the span, keep the timing */
+      trace.spans = s;
+      trace.cap = cap;
+    }
+    struct span *s = &trace.spans[trace.n++];
+    s->name = name;
+    s->cat = cat;
+    s->start_ns = mark.wall_ns - trace.origin_ns;
+    s->dur_ns = wall;
+    s->cpu_start_ns = mark.cpu_ns;
+    s->cpu_dur_ns = cpu;
+    memset(s->detail, 0, sizeof(s->detail));
+    if (detail) strncpy(s->detail, detail, DETAIL_LEN);
+  }
+  return wall / 1e6;
+}
+
+/* Writes str as a JSON string literal. */
+static void json_string(FILE *fp, const char *str) {
+  fputc('"', fp);
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    if (*c == '"' || *c == '\\') fprintf(fp, "\\%c", *c);
+    else if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+    else fputc(*c, fp);
+  }
+  fputc('"', fp);
+}
+
+int trace_close(void) {
+  if (!trace.fpath) return 0;
+
+  int err = 1;
+  FILE *fp = fopen(trace.fpath, "w");
+  if (fp) {
+    /* times in microseconds, as the format expects */
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (size_t i = 0; i < trace.n; i++) {
+      const struct span *s = &trace.spans[i];
+      fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+      json_string(fp, s->name);
+      fprintf(fp, ",\"cat\":");
+      json_string(fp, s->cat);
+      fprintf(fp,
+              ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+              "\"tts\":%.3f,\"tdur\":%.3f",
+              s->start_ns / 1e3, s->dur_ns / 1e3, s->cpu_start_ns / 1e3,
+              s->cpu_dur_ns / 1e3);
+      if (s->detail[0]) {
+        fprintf(fp, ",\"args\":{\"image\":");
+        json_string(fp, s->detail);
+        fputc('}', fp);
+      }
+      fputc('}', fp);
+    }
+    fprintf(fp, "\n]}\n");
+    err = ferror(fp) != 0;
+    err |= fclose(fp) != 0;
+  }
+
+  free(trace.spans);
+  free(trace.fpath);
+  memset(&trace, 0, sizeof(trace));
+  return err;
+}
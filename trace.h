@@ -0,0 +1,35 @@
+#ifndef BFG_TRACE_H
+#define BFG_TRACE_H
+
+#include <stdint.h>
+
+/* ------------- */
+/* Stage tracing */
+/* ------------- */
+
+/* Start of a span: monotonic wall clock and thread CPU clock, in ns. */
+typedef struct trace_mark {
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+} trace_mark_t;
+
+/* Starts recording spans, to be written to fpath by trace_close. Without
+ * trace_open, spans are only measured. Returns 0 on success. */
+int trace_open(const char *fpath);
+
+/* Marks the start of a span. */
+trace_mark_t trace_begin(void);
+
+/* Ends the span started at mark and records it under name and cat (which
+ * must outlive the trace, e.g. string literals), with an optional detail
+ * string such as the image name. Returns the span's wall time in ms. */
+double trace_end(trace_mark_t mark, const char *name, const char *cat,
+                 const char *detail);
+
+/* Writes recorded spans as Chrome trace-event JSON (chrome://tracing,
+ * Perfetto) and frees them. The thread CPU time of each span is exported
+ * as its thread duration, so time spent waiting (on I/O) shows as the gap
+ * between the two. Returns 0 on success, or if tracing was never opened. */
+int trace_close(void);
+
+#endif /* BFG_TRACE_H */